@@ -241,6 +241,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
+    qemu_mutex_init(&bs->reqs_lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -620,6 +621,28 @@ static void bdrv_join_options(BlockDriverState *bs, QDict *options,
     }
 }
 
+/**
+ * Set open flags for a given aio mode
+ *
+ * Return 0 on success, -1 if the aio mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Set open flags for a given discard mode
  *
@@ -1756,6 +1779,7 @@ int bdrv_open(BlockDriverState **pbs, const char *filename,
 
 typedef struct BlockReopenQueueEntry {
      bool prepared;
+     bool made_rw;
      BDRVReopenState state;
      QSIMPLEQ_ENTRY(BlockReopenQueueEntry) entry;
 } BlockReopenQueueEntry;
@@ -1919,11 +1943,28 @@ int bdrv_reopen_multiple(BlockReopenQueue *bs_queue, Error **errp)
      * changes
      */
     QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        bs_entry->made_rw = bdrv_is_read_only(bs_entry->state.bs) &&
+                            (bs_entry->state.flags & BDRV_O_RDWR);
         bdrv_reopen_commit(&bs_entry->state);
     }
 
     ret = 0;
 
+    /* Now that the whole queue (including the protocol layers) is writable,
+     * drivers may update their persistent dirty bitmaps.  Failing to do so
+     * does not undo the reopen. */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        BlockDriverState *bs = bs_entry->state.bs;
+
+        if (bs_entry->made_rw && bs->drv && bs->drv->bdrv_reopen_bitmaps_rw) {
+            bs->drv->bdrv_reopen_bitmaps_rw(bs, &local_err);
+            if (local_err) {
+                error_report_err(local_err);
+                local_err = NULL;
+            }
+        }
+    }
+
 cleanup:
     QSIMPLEQ_FOREACH_SAFE(bs_entry, bs_queue, entry, next) {
         if (ret && bs_entry->prepared) {
@@ -2134,9 +2175,6 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->blk) {
         blk_dev_change_media_cb(bs->blk, false);
     }
@@ -2180,6 +2218,11 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    /* Released only after the driver is closed so that it can still store
+     * persistent bitmaps */
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -2346,6 +2389,9 @@ static void bdrv_delete(BlockDriverState *bs)
     }
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
+    assert(!bs->num_queue_contexts);
+    g_free(bs->queue_contexts);
+    qemu_mutex_destroy(&bs->reqs_lock);
     g_free(bs);
 }
 
@@ -3042,6 +3088,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -3679,6 +3734,9 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
 
 void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
 {
+    /* Queue contexts must be removed first */
+    assert(!bs->num_queue_contexts);
+
     bdrv_drain(bs); /* ensure there are no in-flight requests */
 
     bdrv_detach_aio_context(bs);
@@ -3691,6 +3749,88 @@ void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
     aio_context_release(new_context);
 }
 
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    if (!bs->drv || !bs->drv->supports_multiqueue || bs->throttle_state) {
+        return false;
+    }
+    if (bs->file && !bdrv_supports_multiqueue(bs->file->bs)) {
+        return false;
+    }
+    if (bs->backing && !bdrv_supports_multiqueue(bs->backing->bs)) {
+        return false;
+    }
+    return true;
+}
+
+static void bdrv_do_add_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    bs->queue_contexts = g_renew(AioContext *, bs->queue_contexts,
+                                 bs->num_queue_contexts + 1);
+    bs->queue_contexts[bs->num_queue_contexts] = ctx;
+    atomic_set(&bs->num_queue_contexts, bs->num_queue_contexts + 1);
+
+    if (bs->file) {
+        bdrv_do_add_queue_context(bs->file->bs, ctx);
+    }
+    if (bs->backing) {
+        bdrv_do_add_queue_context(bs->backing->bs, ctx);
+    }
+}
+
+void bdrv_add_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    assert(bdrv_supports_multiqueue(bs));
+    assert(ctx != bdrv_get_aio_context(bs));
+    assert(!bs->quiesce_counter);
+
+    bdrv_do_add_queue_context(bs, ctx);
+}
+
+static void bdrv_do_remove_queue_context(BlockDriverState *bs,
+                                         AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < bs->num_queue_contexts; i++) {
+        if (bs->queue_contexts[i] == ctx) {
+            break;
+        }
+    }
+    assert(i < bs->num_queue_contexts);
+
+    bs->queue_contexts[i] = bs->queue_contexts[bs->num_queue_contexts - 1];
+    atomic_set(&bs->num_queue_contexts, bs->num_queue_contexts - 1);
+
+    if (bs->file) {
+        bdrv_do_remove_queue_context(bs->file->bs, ctx);
+    }
+    if (bs->backing) {
+        bdrv_do_remove_queue_context(bs->backing->bs, ctx);
+    }
+}
+
+void bdrv_remove_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    assert(!bs->quiesce_counter);
+
+    bdrv_drain(bs);
+    bdrv_do_remove_queue_context(bs, ctx);
+}
+
+AioContext *bdrv_get_request_context(BlockDriverState *bs)
+{
+    AioContext *ctx;
+
+    if (!atomic_read(&bs->num_queue_contexts)) {
+        return bs->aio_context;
+    }
+
+    /* The main loop never serves as a queue context */
+    ctx = qemu_get_current_aio_context();
+    return ctx == qemu_get_aio_context() ? bs->aio_context : ctx;
+}
+
 void bdrv_add_aio_context_notifier(BlockDriverState *bs,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
@@ -25,6 +25,20 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+/* Return the AioContext in which requests issued by the current thread
+ * complete; see bdrv_get_request_context().
+ */
+AioContext *blk_get_request_context(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (bs) {
+        return bdrv_get_request_context(bs);
+    } else {
+        return qemu_get_aio_context();
+    }
+}
+
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
 
 struct BlockBackend {
@@ -683,9 +697,9 @@ static int blk_check_request(BlockBackend *blk, int64_t sector_num,
                                   nb_sectors * BDRV_SECTOR_SIZE);
 }
 
-static int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
-                                      unsigned int bytes, QEMUIOVector *qiov,
-                                      BdrvRequestFlags flags)
+int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
+                               unsigned int bytes, QEMUIOVector *qiov,
+                               BdrvRequestFlags flags)
 {
     int ret = blk_check_byte_request(blk, offset, bytes);
     if (ret < 0) {
@@ -695,9 +709,9 @@ static int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
     return bdrv_co_do_preadv(blk_bs(blk), offset, bytes, qiov, flags);
 }
 
-static int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
-                                      unsigned int bytes, QEMUIOVector *qiov,
-                                      BdrvRequestFlags flags)
+int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
+                                unsigned int bytes, QEMUIOVector *qiov,
+                                BdrvRequestFlags flags)
 {
     int ret;
 
@@ -842,7 +856,7 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    bh = aio_bh_new(blk_get_aio_context(blk), error_callback_bh, acb);
+    bh = aio_bh_new(blk_get_request_context(blk), error_callback_bh, acb);
     acb->bh = bh;
     qemu_bh_schedule(bh);
 
@@ -901,7 +915,8 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset,
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        acb->bh = aio_bh_new(blk_get_aio_context(blk), blk_aio_complete_bh, acb);
+        acb->bh = aio_bh_new(blk_get_request_context(blk),
+                             blk_aio_complete_bh, acb);
         qemu_bh_schedule(acb->bh);
     }
 
@@ -1372,6 +1387,27 @@ void blk_set_aio_context(BlockBackend *blk, AioContext *new_context)
     }
 }
 
+bool blk_supports_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    return bs && bdrv_supports_multiqueue(bs);
+}
+
+void blk_add_queue_context(BlockBackend *blk, AioContext *ctx)
+{
+    bdrv_add_queue_context(blk_bs(blk), ctx);
+}
+
+void blk_remove_queue_context(BlockBackend *blk, AioContext *ctx)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (bs) {
+        bdrv_remove_queue_context(bs, ctx);
+    }
+}
+
 void blk_add_aio_context_notifier(BlockBackend *blk,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
@@ -1426,6 +1462,37 @@ void blk_io_unplug(BlockBackend *blk)
     }
 }
 
+/* Drivers renumber their registered buffers, so no request may use them
+ * meanwhile.
+ */
+void blk_register_buf(BlockBackend *blk, void *host, size_t size)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    AioContext *ctx = blk_get_aio_context(blk);
+
+    if (bs) {
+        aio_context_acquire(ctx);
+        bdrv_drained_begin(bs);
+        bdrv_register_buf(bs, host, size);
+        bdrv_drained_end(bs);
+        aio_context_release(ctx);
+    }
+}
+
+void blk_unregister_buf(BlockBackend *blk, void *host, size_t size)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    AioContext *ctx = blk_get_aio_context(blk);
+
+    if (bs) {
+        aio_context_acquire(ctx);
+        bdrv_drained_begin(bs);
+        bdrv_unregister_buf(bs, host, size);
+        bdrv_drained_end(bs);
+        aio_context_release(ctx);
+    }
+}
+
 BlockAcctStats *blk_get_stats(BlockBackend *blk)
 {
     return &blk->stats;
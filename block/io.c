@@ -221,8 +221,12 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs)
 bool bdrv_requests_pending(BlockDriverState *bs)
 {
     BdrvChild *child;
+    bool busy;
 
-    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+    qemu_mutex_lock(&bs->reqs_lock);
+    busy = !QLIST_EMPTY(&bs->tracked_requests);
+    qemu_mutex_unlock(&bs->reqs_lock);
+    if (busy) {
         return true;
     }
     if (!qemu_co_queue_empty(&bs->throttled_reqs[0])) {
@@ -253,6 +257,35 @@ static void bdrv_drain_recurse(BlockDriverState *bs)
     }
 }
 
+static void bdrv_set_wakeup(BlockDriverState *bs, bool wakeup)
+{
+    BdrvChild *child;
+
+    atomic_set(&bs->wakeup, wakeup);
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_set_wakeup(child->bs, wakeup);
+    }
+}
+
+/* Wait until the queue contexts of @bs are outside their handlers, and run
+ * the completions that are pending there.  Returns true if progress was
+ * made.
+ */
+static bool bdrv_poll_queue_contexts(BlockDriverState *bs)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < bs->num_queue_contexts; i++) {
+        AioContext *ctx = bs->queue_contexts[i];
+
+        aio_context_acquire(ctx);
+        progress |= aio_poll(ctx, false);
+        aio_context_release(ctx);
+    }
+    return progress;
+}
+
 /*
  * Wait for pending requests to complete on a single BlockDriverState subtree,
  * and suspend block driver's internal I/O until next request arrives.
@@ -260,20 +293,43 @@ static void bdrv_drain_recurse(BlockDriverState *bs)
  * Note that unlike bdrv_drain_all(), the caller must hold the BlockDriverState
  * AioContext.
  *
- * Only this BlockDriverState's AioContext is run, so in-flight requests must
- * not depend on events in other AioContexts.  In that case, use
- * bdrv_drain_all() instead.
+ * Only this BlockDriverState's AioContext and its queue contexts are run, so
+ * in-flight requests must not depend on events in other AioContexts.  In that
+ * case, use bdrv_drain_all() instead.
  */
 void bdrv_drain(BlockDriverState *bs)
 {
     bool busy = true;
+    int i;
 
     bdrv_drain_recurse(bs);
+
+    /* Stop queue contexts from submitting new requests, and have those
+     * that complete there kick our AioContext.
+     */
+    for (i = 0; i < bs->num_queue_contexts; i++) {
+        aio_disable_external(bs->queue_contexts[i]);
+    }
+    if (bs->num_queue_contexts) {
+        bdrv_set_wakeup(bs, true);
+    }
+
     while (busy) {
         /* Keep iterating */
          bdrv_flush_io_queue(bs);
          busy = bdrv_requests_pending(bs);
          busy |= aio_poll(bdrv_get_aio_context(bs), busy);
+         if (!busy && bs->num_queue_contexts) {
+             busy = bdrv_poll_queue_contexts(bs) ||
+                    bdrv_requests_pending(bs);
+         }
+    }
+
+    if (bs->num_queue_contexts) {
+        bdrv_set_wakeup(bs, false);
+    }
+    for (i = 0; i < bs->num_queue_contexts; i++) {
+        aio_enable_external(bs->queue_contexts[i]);
     }
 }
 
@@ -298,6 +354,10 @@ void bdrv_drain_all(void)
             block_job_pause(bs->job);
         }
         bdrv_drain_recurse(bs);
+        if (bs->num_queue_contexts) {
+            /* The loop below only runs the BDS's own AioContext */
+            bdrv_drained_begin(bs);
+        }
         aio_context_release(aio_context);
 
         if (!g_slist_find(aio_ctxs, aio_context)) {
@@ -338,6 +398,9 @@ void bdrv_drain_all(void)
         AioContext *aio_context = bdrv_get_aio_context(bs);
 
         aio_context_acquire(aio_context);
+        if (bs->num_queue_contexts) {
+            bdrv_drained_end(bs);
+        }
         if (bs->job) {
             block_job_resume(bs->job);
         }
@@ -353,12 +416,21 @@ void bdrv_drain_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    BlockDriverState *bs = req->bs;
+
+    qemu_mutex_lock(&bs->reqs_lock);
     if (req->serialising) {
-        req->bs->serialising_in_flight--;
+        bs->serialising_in_flight--;
     }
 
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
+    qemu_mutex_unlock(&bs->reqs_lock);
+
+    /* bdrv_drain() may be waiting for us in another AioContext */
+    if (atomic_read(&bs->wakeup)) {
+        aio_notify(bdrv_get_aio_context(bs));
+    }
 }
 
 /**
@@ -383,7 +455,9 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_queue_init(&req->wait_queue);
 
+    qemu_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    qemu_mutex_unlock(&bs->reqs_lock);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -392,6 +466,7 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
     unsigned int overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
                                - overlap_offset;
 
+    qemu_mutex_lock(&req->bs->reqs_lock);
     if (!req->serialising) {
         req->bs->serialising_in_flight++;
         req->serialising = true;
@@ -399,6 +474,7 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    qemu_mutex_unlock(&req->bs->reqs_lock);
 }
 
 /**
@@ -456,10 +532,11 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
     bool retry;
     bool waited = false;
 
-    if (!bs->serialising_in_flight) {
+    if (!atomic_read(&bs->serialising_in_flight)) {
         return false;
     }
 
+    qemu_mutex_lock(&bs->reqs_lock);
     do {
         retry = false;
         QLIST_FOREACH(req, &bs->tracked_requests, list) {
@@ -480,7 +557,7 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
                  * (instead of producing a deadlock in the former case). */
                 if (!req->waiting_for) {
                     self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
+                    qemu_co_queue_wait_lock(&req->wait_queue, &bs->reqs_lock);
                     self->waiting_for = NULL;
                     retry = true;
                     waited = true;
@@ -489,6 +566,7 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
             }
         }
     } while (retry);
+    qemu_mutex_unlock(&bs->reqs_lock);
 
     return waited;
 }
@@ -1171,6 +1249,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
         ret = bdrv_co_flush(bs);
     }
 
+    qemu_mutex_lock(&bs->reqs_lock);
     bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_offset < offset + bytes) {
@@ -1180,6 +1259,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     if (ret >= 0) {
         bs->total_sectors = MAX(bs->total_sectors, sector_num + nb_sectors);
     }
+    qemu_mutex_unlock(&bs->reqs_lock);
 
     return ret;
 }
@@ -1699,10 +1779,35 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+    BlockDriverState *bs = wco->bs;
+
+    wco->ret = bs->drv->bdrv_write_compressed(bs, wco->sector_num, wco->buf,
+                                              wco->nb_sectors);
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
     int ret;
 
     if (!drv) {
@@ -1718,7 +1823,20 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    /* Drivers may offload compression to worker threads, which requires
+     * coroutine context */
+    if (qemu_in_coroutine()) {
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return wco.ret;
 }
 
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
@@ -2129,7 +2247,7 @@ static void bdrv_co_maybe_schedule_bh(BlockAIOCBCoroutine *acb)
     if (acb->req.error != -EINPROGRESS) {
         BlockDriverState *bs = acb->common.bs;
 
-        acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
+        acb->bh = aio_bh_new(bdrv_get_request_context(bs), bdrv_co_em_bh, acb);
         qemu_bh_schedule(acb->bh);
     }
 }
@@ -2471,7 +2589,9 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors,
                           BDRV_TRACKED_DISCARD);
+    qemu_mutex_lock(&bs->reqs_lock);
     bdrv_set_dirty(bs, sector_num, nb_sectors);
+    qemu_mutex_unlock(&bs->reqs_lock);
 
     max_discard = MIN_NON_ZERO(bs->bl.max_discard, BDRV_REQUEST_MAX_SECTORS);
     while (nb_sectors > 0) {
@@ -2581,7 +2701,7 @@ static int bdrv_co_do_ioctl(BlockDriverState *bs, int req, void *buf)
     acb = drv->bdrv_aio_ioctl(bs, req, buf, bdrv_co_io_em_complete, &co);
     if (!acb) {
         BdrvIoctlCompletionData *data = g_new(BdrvIoctlCompletionData, 1);
-        data->bh = aio_bh_new(bdrv_get_aio_context(bs),
+        data->bh = aio_bh_new(bdrv_get_request_context(bs),
                                 bdrv_ioctl_bh_cb, data);
         data->co = &co;
         qemu_bh_schedule(data->bh);
@@ -2747,19 +2867,59 @@ void bdrv_flush_io_queue(BlockDriverState *bs)
     bdrv_start_throttled_reqs(bs);
 }
 
+/*
+ * Memory that will be used for I/O buffers, e.g. guest RAM.  Drivers can
+ * map it ahead of time, which saves mapping it again for every request.
+ * The registration is passed down to all the children of bs.  Must be
+ * called in a drained section.
+ */
+void bdrv_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BdrvChild *child;
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_register_buf(child->bs, host, size);
+    }
+    if (bs->drv && bs->drv->bdrv_register_buf) {
+        bs->drv->bdrv_register_buf(bs, host, size);
+    }
+}
+
+void bdrv_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BdrvChild *child;
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_unregister_buf(child->bs, host, size);
+    }
+    if (bs->drv && bs->drv->bdrv_unregister_buf) {
+        bs->drv->bdrv_unregister_buf(bs, host, size);
+    }
+}
+
 void bdrv_drained_begin(BlockDriverState *bs)
 {
+    int i;
+
     if (!bs->quiesce_counter++) {
         aio_disable_external(bdrv_get_aio_context(bs));
+        for (i = 0; i < bs->num_queue_contexts; i++) {
+            aio_disable_external(bs->queue_contexts[i]);
+        }
     }
     bdrv_drain(bs);
 }
 
 void bdrv_drained_end(BlockDriverState *bs)
 {
+    int i;
+
     assert(bs->quiesce_counter > 0);
     if (--bs->quiesce_counter > 0) {
         return;
     }
     aio_enable_external(bdrv_get_aio_context(bs));
+    for (i = 0; i < bs->num_queue_contexts; i++) {
+        aio_enable_external(bs->queue_contexts[i]);
+    }
 }
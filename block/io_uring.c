@@ -0,0 +1,704 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qapi/error.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Submission queue size (per-device).  The completion queue is twice as
+ * big, and at most that many requests are in flight at a time; the others
+ * wait in the pending queue.
+ */
+#define MAX_ENTRIES 128
+
+/* Maximum size of a registered buffer, a limit of the kernel.  */
+#define MAX_BUF_SIZE (1ULL << 30)
+#define MAX_BUFS     64
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    struct io_uring_sqe sqe;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /* Bytes already read by previous submissions of a short read, and the
+     * part of qiov that is left to be read.
+     */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+struct LuringState {
+    int ring_fd;
+    EventNotifier e;
+    bool sqpoll;
+
+    /* completes the requests in failed and retries the submission */
+    QEMUBH *submit_bh;
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed;
+
+    /* submission ring, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* completion ring, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* registered file, or -1 */
+    int fixed_fd;
+
+    /* registered buffers; only used if bufs_registered is true */
+    struct iovec bufs[MAX_BUFS];
+    int n_bufs;
+    bool bufs_registered;
+};
+
+static void ioq_submit(LuringState *s);
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    ssize_t ret = luringcb->ret;
+    size_t nbytes;
+
+    if (!luringcb->qiov) {
+        /* flush */
+        luringcb->common.cb(luringcb->common.opaque, ret < 0 ? ret : 0);
+        qemu_aio_unref(luringcb);
+        return;
+    }
+
+    nbytes = luringcb->qiov->size - luringcb->total_read;
+    if (ret == nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        if (luringcb->is_read) {
+            /* Short reads mean EOF, pad with zeros. */
+            luringcb->total_read += ret;
+            qemu_iovec_memset(luringcb->qiov, luringcb->total_read, 0,
+                              luringcb->qiov->size - luringcb->total_read);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/*
+ * Unlike Linux AIO, io_uring may stop a buffered read before the end of
+ * the file (for example if part of it is not in the page cache) or ask
+ * us to retry it.  The rest of the request goes back to the front of the
+ * pending queue; a short read that returns 0 really is EOF.
+ */
+static bool luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    ssize_t ret = luringcb->ret;
+
+    if (ret == -EINTR || ret == -EAGAIN) {
+        QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+        s->io_q.in_queue++;
+        return true;
+    }
+    if (luringcb->is_read && ret > 0 &&
+        ret < luringcb->qiov->size - luringcb->total_read) {
+        luringcb->total_read += ret;
+        if (!luringcb->resubmit_qiov.iov) {
+            qemu_iovec_init(&luringcb->resubmit_qiov, luringcb->qiov->niov);
+        } else {
+            qemu_iovec_reset(&luringcb->resubmit_qiov);
+        }
+        qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                          luringcb->total_read,
+                          luringcb->qiov->size - luringcb->total_read);
+
+        luringcb->sqe.opcode = IORING_OP_READV;
+        luringcb->sqe.flags &= IOSQE_FIXED_FILE;
+        luringcb->sqe.off += ret;
+        luringcb->sqe.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
+        luringcb->sqe.len = luringcb->resubmit_qiov.niov;
+        luringcb->sqe.buf_index = 0;
+
+        QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+        s->io_q.in_queue++;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Returns whether there are requests that the kernel has not seen yet:
+ * either pending, or in the submission ring after io_uring_enter() had
+ * no room for them.
+ */
+static bool ioq_has_work(LuringState *s)
+{
+    return !QSIMPLEQ_EMPTY(&s->io_q.pending) ||
+           (!s->sqpoll && *s->sq_tail != atomic_read(s->sq_head));
+}
+
+/*
+ * Reap the completion ring.  The head is advanced before each callback
+ * runs, so nested event loops started by a callback pick up where we
+ * left off instead of completing the same request twice.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    bool resubmitted = false;
+
+    for (;;) {
+        unsigned head = *s->cq_head;
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *luringcb;
+
+        if (head == atomic_read(s->cq_tail)) {
+            break;
+        }
+        /* read the entry only after seeing the tail that covers it */
+        smp_rmb();
+        cqe = &s->cqes[head & *s->cq_mask];
+        luringcb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        luringcb->ret = cqe->res;
+
+        /* let the kernel reuse the entry once it has been read */
+        smp_wmb();
+        atomic_set(s->cq_head, head + 1);
+        s->io_q.in_flight--;
+
+        if (luring_resubmit(s, luringcb)) {
+            resubmitted = true;
+            continue;
+        }
+        luring_process_completion(s, luringcb);
+    }
+
+    if ((resubmitted || !s->io_q.plugged) && ioq_has_work(s)) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions(s);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (*s->cq_head == atomic_read(s->cq_tail)) {
+        return false;
+    }
+
+    luring_process_completions(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+/*
+ * Takes back the entries of the submission ring that the kernel has not
+ * consumed, and fails their requests with err.  Without a kernel
+ * submission thread, the kernel only reads the ring in io_uring_enter(),
+ * so the entries can be taken back safely.  The callbacks run from a
+ * bottom half, as the caller may be in the middle of submitting them.
+ */
+static void ioq_fail_ring(LuringState *s, int err)
+{
+    unsigned head = atomic_read(s->sq_head);
+    unsigned i;
+
+    for (i = head; i != *s->sq_tail; i++) {
+        unsigned idx = s->sq_array[i & *s->sq_mask];
+        LuringAIOCB *luringcb;
+
+        luringcb = (LuringAIOCB *)(uintptr_t)s->sqes[idx].user_data;
+        luringcb->ret = err;
+        QSIMPLEQ_INSERT_TAIL(&s->failed, luringcb, next);
+        s->io_q.in_flight--;
+    }
+    atomic_set(s->sq_tail, head);
+    qemu_bh_schedule(s->submit_bh);
+}
+
+static void luring_submit_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    LuringAIOCB *luringcb;
+
+    while ((luringcb = QSIMPLEQ_FIRST(&s->failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        luring_process_completion(s, luringcb);
+    }
+    if (!s->io_q.plugged && ioq_has_work(s)) {
+        ioq_submit(s);
+    }
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Move pending requests to the submission ring and tell the kernel about
+ * them.  With a kernel submission thread, the kernel notices new entries
+ * by itself and the syscall is only needed if the thread went to sleep.
+ */
+static void ioq_submit(LuringState *s)
+{
+    unsigned tail = *s->sq_tail;
+    unsigned to_submit;
+    LuringAIOCB *luringcb;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        unsigned head = atomic_read(s->sq_head);
+        unsigned idx;
+
+        /* the kernel is done with the entries before the head */
+        smp_rmb();
+        if (tail - head == s->sq_entries ||
+            s->io_q.in_flight == s->cq_entries) {
+            break;
+        }
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+
+        idx = tail & *s->sq_mask;
+        s->sqes[idx] = luringcb->sqe;
+        s->sq_array[idx] = idx;
+        tail++;
+    }
+
+    /* publish the entries before the new tail */
+    smp_wmb();
+    atomic_set(s->sq_tail, tail);
+
+    if (s->sqpoll) {
+        /* order the tail update against reading the wakeup flag */
+        smp_mb();
+        if (atomic_read(s->sq_flags) & IORING_SQ_NEED_WAKEUP) {
+            io_uring_enter(s->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+    } else {
+        to_submit = tail - atomic_read(s->sq_head);
+        while (to_submit) {
+            ret = io_uring_enter(s->ring_fd, to_submit, 0, 0);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EBUSY)) {
+                /* The entries stay in the ring until some requests
+                 * complete.  If none is in the kernel, nothing would
+                 * complete, so retry from the event loop instead.
+                 */
+                if (s->io_q.in_flight == to_submit) {
+                    qemu_bh_schedule(s->submit_bh);
+                }
+                break;
+            }
+            if (ret < 0) {
+                ioq_fail_ring(s, -errno);
+                break;
+            }
+            to_submit -= ret;
+            if (ret == 0) {
+                break;
+            }
+        }
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s, bool unplug)
+{
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && ioq_has_work(s)) {
+        ioq_submit(s);
+    }
+}
+
+/* Return the index of the registered buffer that holds [buf, buf + len),
+ * or -1.
+ */
+static int luring_find_buf(LuringState *s, void *buf, size_t len)
+{
+    int i;
+
+    if (!s->bufs_registered) {
+        return -1;
+    }
+    for (i = 0; i < s->n_bufs; i++) {
+        uintptr_t start = (uintptr_t)s->bufs[i].iov_base;
+
+        if ((uintptr_t)buf >= start &&
+            (uintptr_t)buf - start + len <= s->bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Requests whose only buffer lies in registered memory use the fixed
+ * opcodes, the others plain READV/WRITEV.
+ */
+static void luring_prep_rw(LuringState *s, struct io_uring_sqe *sqe,
+                           QEMUIOVector *qiov, bool is_write)
+{
+    int buf_index = -1;
+
+    if (qiov->niov == 1) {
+        buf_index = luring_find_buf(s, qiov->iov[0].iov_base,
+                                    qiov->iov[0].iov_len);
+    }
+    if (buf_index >= 0) {
+        sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)qiov->iov[0].iov_base;
+        sqe->len = qiov->iov[0].iov_len;
+        sqe->buf_index = buf_index;
+    } else {
+        sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *luringcb;
+    struct io_uring_sqe *sqe;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->s = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    luringcb->qiov = qiov;
+    luringcb->total_read = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+
+    sqe = &luringcb->sqe;
+    memset(sqe, 0, sizeof(*sqe));
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+        assert(qiov->size == nb_sectors * BDRV_SECTOR_SIZE);
+        luring_prep_rw(s, sqe, qiov, type == QEMU_AIO_WRITE);
+        sqe->off = sector_num * BDRV_SECTOR_SIZE;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        qemu_aio_unref(luringcb);
+        return NULL;
+    }
+    if (fd == s->fixed_fd) {
+        sqe->fd = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    sqe->user_data = (uintptr_t)luringcb;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+/* Use the fixed file slot of the ring for fd, which saves the kernel a
+ * lookup of the file for every request.
+ */
+void luring_register_fd(LuringState *s, int fd)
+{
+    if (s->fixed_fd != -1) {
+        io_uring_register(s->ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+        s->fixed_fd = -1;
+    }
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0) {
+        s->fixed_fd = fd;
+    }
+}
+
+static void luring_update_bufs(LuringState *s)
+{
+    if (s->bufs_registered) {
+        io_uring_register(s->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        s->bufs_registered = false;
+    }
+    if (s->n_bufs == 0) {
+        return;
+    }
+    /* This fails if the memory cannot be locked, in which case requests
+     * simply keep using the non-fixed opcodes.
+     */
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_BUFFERS,
+                          s->bufs, s->n_bufs) == 0) {
+        s->bufs_registered = true;
+    }
+}
+
+/*
+ * The caller makes sure that no request is pending or in flight, as the
+ * indices of the buffers change.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    while (size > 0 && s->n_bufs < MAX_BUFS) {
+        size_t len = MIN(size, MAX_BUF_SIZE);
+
+        s->bufs[s->n_bufs].iov_base = host;
+        s->bufs[s->n_bufs].iov_len = len;
+        s->n_bufs++;
+        host += len;
+        size -= len;
+    }
+    luring_update_bufs(s);
+}
+
+void luring_unregister_buf(LuringState *s, void *host, size_t size)
+{
+    int i, j;
+
+    for (i = j = 0; i < s->n_bufs; i++) {
+        uintptr_t start = (uintptr_t)s->bufs[i].iov_base;
+
+        if (start - (uintptr_t)host >= size) {
+            s->bufs[j++] = s->bufs[i];
+        }
+    }
+    if (j != s->n_bufs) {
+        s->n_bufs = j;
+        luring_update_bufs(s);
+    }
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
+    qemu_bh_delete(s->submit_bh);
+    s->submit_bh = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->submit_bh = aio_bh_new(new_context, luring_submit_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb, luring_poll_cb);
+}
+
+static void luring_unmap_rings(LuringState *s)
+{
+    if (s->sqes) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ring) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+    if (s->sq_ring) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+}
+
+static int luring_map_rings(LuringState *s, struct io_uring_params *p)
+{
+    s->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    s->sq_ring = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (s->sq_ring == MAP_FAILED) {
+        s->sq_ring = NULL;
+        return -errno;
+    }
+    s->sq_head = s->sq_ring + p->sq_off.head;
+    s->sq_tail = s->sq_ring + p->sq_off.tail;
+    s->sq_mask = s->sq_ring + p->sq_off.ring_mask;
+    s->sq_flags = s->sq_ring + p->sq_off.flags;
+    s->sq_array = s->sq_ring + p->sq_off.array;
+    s->sq_entries = p->sq_entries;
+
+    s->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        s->sqes = NULL;
+        return -errno;
+    }
+
+    s->cq_ring_size = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+    s->cq_ring = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                      IORING_OFF_CQ_RING);
+    if (s->cq_ring == MAP_FAILED) {
+        s->cq_ring = NULL;
+        return -errno;
+    }
+    s->cq_head = s->cq_ring + p->cq_off.head;
+    s->cq_tail = s->cq_ring + p->cq_off.tail;
+    s->cq_mask = s->cq_ring + p->cq_off.ring_mask;
+    s->cq_entries = p->cq_entries;
+    s->cqes = s->cq_ring + p->cq_off.cqes;
+    return 0;
+}
+
+LuringState *luring_init(bool sqpoll, Error **errp)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int efd, ret;
+
+    s = g_malloc0(sizeof(*s));
+    s->fixed_fd = -1;
+    s->sqpoll = sqpoll;
+    ret = event_notifier_init(&s->e, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to initialize event notifier");
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+    }
+    s->ring_fd = io_uring_setup(MAX_ENTRIES, &p);
+    if (s->ring_fd < 0) {
+        error_setg_errno(errp, errno, "Failed to create io_uring%s",
+                         sqpoll ? " with submission polling" : "");
+        goto out_close_efd;
+    }
+
+    ret = luring_map_rings(s, &p);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to map io_uring");
+        goto out_close_ring;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_EVENTFD, &efd, 1)) {
+        error_setg_errno(errp, errno, "Failed to register io_uring eventfd");
+        goto out_close_ring;
+    }
+
+    ioq_init(&s->io_q);
+    QSIMPLEQ_INIT(&s->failed);
+
+    return s;
+
+out_close_ring:
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    event_notifier_cleanup(&s->e);
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+    g_free(s);
+}
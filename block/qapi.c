@@ -358,7 +358,7 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
 }
 
 static BlockStats *bdrv_query_stats(BlockBackend *blk,
-                                    const BlockDriverState *bs,
+                                    BlockDriverState *bs,
                                     bool query_backing);
 
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
@@ -428,7 +428,7 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     }
 }
 
-static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
+static void bdrv_query_bds_stats(BlockStats *s, BlockDriverState *bs,
                                  bool query_backing)
 {
     if (bdrv_get_node_name(bs)[0]) {
@@ -438,6 +438,9 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(NULL, bs->file->bs, query_backing);
@@ -451,7 +454,7 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 }
 
 static BlockStats *bdrv_query_stats(BlockBackend *blk,
-                                    const BlockDriverState *bs,
+                                    BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
@@ -0,0 +1,1161 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/qcow2.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+
+/* Limits for the bitmaps that QEMU loads, see docs/specs/qcow2.txt */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_PHYS_SIZE 0x20000000 /* bytes of bitmap data in RAM */
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_FLAG_IN_USE                 (1U << 0)
+#define BME_FLAG_AUTO                   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE  (1U << 2)
+#define BME_RESERVED_FLAGS              0xfffffff8U
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK     0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES   (1ULL << 0)
+
+/* Bitmap types */
+#define BT_DIRTY_TRACKING_BITMAP 1
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows  */
+    /* name follows  */
+} Qcow2BitmapDirEntry;
+
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    char *name;
+
+    /* Extra data is only kept so that unknown bitmaps can be written back */
+    uint32_t extra_data_size;
+    uint8_t *extra_data;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static inline uint64_t calc_dir_entry_size(size_t name_size,
+                                           size_t extra_data_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) + name_size + extra_data_size,
+                    8);
+}
+
+/* Number of guest sectors covered by one cluster of bitmap data */
+static uint64_t sectors_covered_by_cluster(BDRVQcow2State *s,
+                                           int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(BlockDriverState *bs, int granularity_bits)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return DIV_ROUND_UP(bs->total_sectors,
+                        sectors_covered_by_cluster(s, granularity_bits));
+}
+
+/*
+ * Only dirty tracking bitmaps without extra data are loaded; all other
+ * bitmaps are left untouched in the image.
+ */
+static bool bitmap_usable(Qcow2Bitmap *bm)
+{
+    return bm->type == BT_DIRTY_TRACKING_BITMAP && bm->extra_data_size == 0;
+}
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm->extra_data);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
+                                        const char *name)
+{
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (!strcmp(bm->name, name)) {
+            return bm;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Reads the bitmap table of @bm and converts it to host byte order.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+static int bitmap_table_load(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **bitmap_table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    assert(bm->table_size != 0);
+    table = g_try_new(uint64_t, bm->table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&table[i]);
+        if ((table[i] & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            (table[i] & BME_TABLE_ENTRY_OFFSET_MASK &
+             (s->cluster_size - 1)) ||
+            ((table[i] & BME_TABLE_ENTRY_OFFSET_MASK) &&
+             (table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES)))
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+    return ret;
+}
+
+/* Frees the data clusters and the bitmap table of @bm */
+static int free_bitmap_clusters(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    ret = bitmap_table_load(bs, bm, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(table);
+
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    return 0;
+}
+
+static int check_dir_entry(BlockDriverState *bs, Qcow2BitmapDirEntry *entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (entry->bitmap_table_offset & (s->cluster_size - 1) ||
+        entry->bitmap_table_offset == 0 ||
+        entry->bitmap_table_size == 0 ||
+        entry->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+        entry->flags & BME_RESERVED_FLAGS ||
+        entry->granularity_bits > 63 ||
+        entry->name_size == 0 ||
+        entry->name_size > BME_MAX_NAME_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the bitmap directory.
+ *
+ * Returns the list of all bitmaps in the image or NULL on error.
+ */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t size,
+                                         Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir, *dir_end, *pos;
+    Qcow2BitmapList *bm_list;
+    uint32_t nb_dir_entries = 0;
+    int ret;
+
+    if (size == 0 || size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Invalid bitmap directory size");
+        return NULL;
+    }
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+
+    ret = bdrv_pread(bs->file->bs, offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        goto fail;
+    }
+
+    bm_list = g_new(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    for (pos = dir; pos < dir_end;) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)pos;
+        Qcow2Bitmap *bm;
+        uint64_t entry_size;
+
+        if (dir_end - pos < sizeof(*e)) {
+            goto broken_dir;
+        }
+
+        be64_to_cpus(&e->bitmap_table_offset);
+        be32_to_cpus(&e->bitmap_table_size);
+        be32_to_cpus(&e->flags);
+        be16_to_cpus(&e->name_size);
+        be32_to_cpus(&e->extra_data_size);
+
+        entry_size = calc_dir_entry_size(e->name_size, e->extra_data_size);
+        if (entry_size > dir_end - pos) {
+            goto broken_dir;
+        }
+
+        if (++nb_dir_entries > s->nb_bitmaps) {
+            error_setg(errp, "More bitmaps found than specified in header"
+                       " extension");
+            goto fail_list;
+        }
+
+        if (check_dir_entry(bs, e) < 0) {
+            error_setg(errp, "Bitmap directory entry %" PRIu32 " is invalid",
+                       nb_dir_entries);
+            goto fail_list;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table_offset = e->bitmap_table_offset;
+        bm->table_size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->type = e->type;
+        bm->granularity_bits = e->granularity_bits;
+        bm->extra_data_size = e->extra_data_size;
+        if (bm->extra_data_size) {
+            bm->extra_data = g_memdup(e + 1, bm->extra_data_size);
+        }
+        bm->name = g_strndup((char *)(e + 1) + e->extra_data_size,
+                             e->name_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+
+        pos += entry_size;
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Less bitmaps found than specified in header"
+                         " extension");
+        goto fail_list;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken_dir:
+    error_setg(errp, "Broken bitmap directory");
+fail_list:
+    bitmap_list_free(bm_list);
+fail:
+    g_free(dir);
+    return NULL;
+}
+
+/*
+ * Writes the bitmap directory for @bm_list.  If @in_place is true, the
+ * directory overwrites the existing one at *@offset (only possible if its
+ * size did not change, e.g. because only flags were updated); otherwise new
+ * clusters are allocated and *@offset and *@size are set accordingly.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size, bool in_place,
+                             Error **errp)
+{
+    Qcow2Bitmap *bm;
+    uint64_t dir_size = 0;
+    int64_t dir_offset;
+    uint8_t *dir, *pos;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += calc_dir_entry_size(strlen(bm->name), bm->extra_data_size);
+    }
+
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Bitmap directory size is invalid");
+        return -EINVAL;
+    }
+
+    if (in_place) {
+        assert(*size == dir_size);
+        dir_offset = *offset;
+    } else {
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            error_setg_errno(errp, -dir_offset,
+                             "Could not allocate bitmap directory");
+            return dir_offset;
+        }
+    }
+
+    dir = g_try_malloc0(dir_size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate bitmap directory");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    pos = dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)pos;
+        size_t name_size = strlen(bm->name);
+
+        e->bitmap_table_offset = cpu_to_be64(bm->table_offset);
+        e->bitmap_table_size = cpu_to_be32(bm->table_size);
+        e->flags = cpu_to_be32(bm->flags);
+        e->type = bm->type;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = cpu_to_be16(name_size);
+        e->extra_data_size = cpu_to_be32(bm->extra_data_size);
+        if (bm->extra_data_size) {
+            memcpy(e + 1, bm->extra_data, bm->extra_data_size);
+        }
+        memcpy((uint8_t *)(e + 1) + bm->extra_data_size, bm->name, name_size);
+
+        pos += calc_dir_entry_size(name_size, bm->extra_data_size);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Bitmap directory would overlap with "
+                         "other metadata");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write bitmap directory");
+        goto fail;
+    }
+
+    g_free(dir);
+    *offset = dir_offset;
+    *size = dir_size;
+    return 0;
+
+fail:
+    g_free(dir);
+    if (!in_place) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+    return ret;
+}
+
+/*
+ * Replaces the bitmap directory by a newly written one for @bm_list (which
+ * may be empty) and points the header extension at it.  The clusters of the
+ * old directory are freed afterwards.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+static int update_ext_header_and_dir(BlockDriverState *bs,
+                                     Qcow2BitmapList *bm_list, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t new_offset = 0, new_size = 0;
+    uint32_t new_nb_bitmaps = 0;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autoclear_features = s->autoclear_features;
+    Qcow2Bitmap *bm;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        new_nb_bitmaps++;
+    }
+
+    if (new_nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many bitmaps");
+        return -EINVAL;
+    }
+
+    if (new_nb_bitmaps > 0) {
+        ret = bitmap_list_store(bs, bm_list, &new_offset, &new_size, false,
+                                errp);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* The refcounts of the new bitmap clusters must be on disk before
+         * the header refers to them */
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not flush refcounts");
+            goto fail;
+        }
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not flush bitmap data");
+            goto fail;
+        }
+
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    s->nb_bitmaps = new_nb_bitmaps;
+    s->bitmap_directory_offset = new_offset;
+    s->bitmap_directory_size = new_size;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        goto fail;
+    }
+
+    if (old_size) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return 0;
+
+fail:
+    if (new_size) {
+        qcow2_free_clusters(bs, new_offset, new_size, QCOW2_DISCARD_OTHER);
+    }
+
+    s->nb_bitmaps = old_nb_bitmaps;
+    s->bitmap_directory_offset = old_offset;
+    s->bitmap_directory_size = old_size;
+    s->autoclear_features = old_autoclear_features;
+
+    return ret;
+}
+
+/*
+ * Sets the in_use flag for all bitmaps that are loaded as persistent
+ * BdrvDirtyBitmaps and writes the updated directory in place.  From now on,
+ * the image does not contain their current state any more until they are
+ * stored again.
+ */
+static int bitmap_list_mark_in_use(BlockDriverState *bs,
+                                   Qcow2BitmapList *bm_list, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *bm;
+    bool need_update = false;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (!bitmap_usable(bm) || (bm->flags & BME_FLAG_IN_USE)) {
+            continue;
+        }
+
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if (bitmap && bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            bm->flags |= BME_FLAG_IN_USE;
+            need_update = true;
+        }
+    }
+
+    if (!need_update) {
+        return 0;
+    }
+
+    ret = bitmap_list_store(bs, bm_list, &s->bitmap_directory_offset,
+                            &s->bitmap_directory_size, true, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush bitmap directory");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int load_bitmap_data(BlockDriverState *bs, const uint64_t *table,
+                            uint32_t table_size, int granularity_bits,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sectors_per_cluster =
+        sectors_covered_by_cluster(s, granularity_bits);
+    uint8_t *buf;
+    uint32_t i;
+    int ret = 0;
+
+    assert(table_size == DIV_ROUND_UP(bm_size, sectors_per_cluster));
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(bm_size - start, sectors_per_cluster);
+
+        if (offset == 0) {
+            bdrv_dirty_bitmap_deserialize_fill(bitmap, start, count,
+                table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES, false);
+        } else {
+            ret = bdrv_pread(bs->file->bs, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start, count,
+                                               false);
+        }
+    }
+    ret = 0;
+
+out:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    g_free(buf);
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                    Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t *table;
+    int ret;
+
+    if (bm->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        bm->granularity_bits > BME_MAX_GRANULARITY_BITS)
+    {
+        error_setg(errp, "Bitmap '%s' has an unsupported granularity",
+                   bm->name);
+        return NULL;
+    }
+
+    if (bm->table_size != bitmap_table_size(bs, bm->granularity_bits) ||
+        (uint64_t)bm->table_size * s->cluster_size > BME_MAX_PHYS_SIZE)
+    {
+        error_setg(errp, "Bitmap '%s' has an invalid size", bm->name);
+        return NULL;
+    }
+
+    ret = bitmap_table_load(bs, bm, &table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap table of '%s'",
+                         bm->name);
+        return NULL;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                      bm->name, errp);
+    if (bitmap == NULL) {
+        goto fail;
+    }
+
+    ret = load_bitmap_data(bs, table, bm->table_size, bm->granularity_bits,
+                           bitmap);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s'", bm->name);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        bitmap = NULL;
+        goto fail;
+    }
+
+fail:
+    g_free(table);
+    return bitmap;
+}
+
+/*
+ * Creates a persistent BdrvDirtyBitmap for every usable bitmap in the image.
+ * Bitmaps with the in_use flag set were not stored after their last use and
+ * are ignored; they are removed from the image the next time the bitmaps are
+ * stored.  If the image is writable, the loaded bitmaps are marked as in use.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    GSList *created = NULL, *item;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (!bitmap_usable(bm)) {
+            continue;
+        }
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("Dirty bitmap '%s' was not stored cleanly and is "
+                         "ignored", bm->name);
+            continue;
+        }
+
+        /* After invalidating the cache, the bitmap may still be in memory */
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            continue;
+        }
+
+        bitmap = load_bitmap(bs, bm, errp);
+        if (bitmap == NULL) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistence(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+        created = g_slist_append(created, bitmap);
+    }
+
+    if (!bdrv_is_read_only(bs)) {
+        ret = bitmap_list_mark_in_use(bs, bm_list, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    return 0;
+
+fail:
+    for (item = created; item; item = item->next) {
+        bdrv_release_dirty_bitmap(bs, item->data);
+    }
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    return ret;
+}
+
+void qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+
+    if (s->nb_bitmaps == 0) {
+        return;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return;
+    }
+
+    bitmap_list_mark_in_use(bs, bm_list, errp);
+    bitmap_list_free(bm_list);
+}
+
+/*
+ * Writes the bitmap data of @bitmap to newly allocated clusters.  Clusters
+ * that would contain only zeroes are not allocated.
+ *
+ * Returns the bitmap table in host byte order or NULL on error.
+ */
+static uint64_t *store_bitmap_data(BlockDriverState *bs,
+                                   BdrvDirtyBitmap *bitmap,
+                                   uint32_t table_size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    const char *name = bdrv_dirty_bitmap_name(bitmap);
+    int granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sectors_per_cluster =
+        sectors_covered_by_cluster(s, granularity_bits);
+    uint64_t *table;
+    uint8_t *buf;
+    uint32_t i;
+    int ret;
+
+    table = g_try_new0(uint64_t, table_size);
+    if (table == NULL) {
+        error_setg(errp, "Could not allocate bitmap table for '%s'", name);
+        return NULL;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < table_size; i++) {
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(bm_size - start, sectors_per_cluster);
+        uint64_t write_size =
+            bdrv_dirty_bitmap_serialization_size(bitmap, start, count);
+        int64_t offset;
+
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, start, count);
+        memset(buf + write_size, 0, s->cluster_size - write_size);
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            error_setg_errno(errp, -offset, "Could not allocate cluster for "
+                             "bitmap '%s'", name);
+            goto fail;
+        }
+        table[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Data of bitmap '%s' would overlap "
+                             "with other metadata", name);
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file->bs, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write bitmap '%s'", name);
+            goto fail;
+        }
+    }
+
+    g_free(buf);
+    return table;
+
+fail:
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(buf);
+    g_free(table);
+    return NULL;
+}
+
+static Qcow2Bitmap *store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                                 Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    const char *name = bdrv_dirty_bitmap_name(bitmap);
+    int granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t table_size =
+        DIV_ROUND_UP(bdrv_dirty_bitmap_size(bitmap),
+                     sectors_covered_by_cluster(s, granularity_bits));
+    uint64_t *table;
+    int64_t table_offset;
+    Qcow2Bitmap *bm;
+    uint32_t i;
+    int ret;
+
+    if (table_size > BME_MAX_TABLE_SIZE ||
+        table_size * s->cluster_size > BME_MAX_PHYS_SIZE)
+    {
+        error_setg(errp, "Bitmap '%s' is too big to be stored", name);
+        return NULL;
+    }
+
+    table = store_bitmap_data(bs, bitmap, table_size, errp);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table_offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+    if (table_offset < 0) {
+        error_setg_errno(errp, -table_offset, "Could not allocate bitmap "
+                         "table for '%s'", name);
+        ret = table_offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, table_offset,
+                                        table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Bitmap table of '%s' would overlap "
+                         "with other metadata", name);
+        goto fail_table;
+    }
+
+    for (i = 0; i < table_size; i++) {
+        cpu_to_be64s(&table[i]);
+    }
+    ret = bdrv_pwrite(bs->file->bs, table_offset, table,
+                      table_size * sizeof(uint64_t));
+    for (i = 0; i < table_size; i++) {
+        be64_to_cpus(&table[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write bitmap table of '%s'",
+                         name);
+        goto fail_table;
+    }
+    g_free(table);
+
+    bm = g_new0(Qcow2Bitmap, 1);
+    bm->table_offset = table_offset;
+    bm->table_size = table_size;
+    bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+    bm->type = BT_DIRTY_TRACKING_BITMAP;
+    bm->granularity_bits = granularity_bits;
+    bm->name = g_strdup(name);
+
+    return bm;
+
+fail_table:
+    qcow2_free_clusters(bs, table_offset, table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+fail:
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(table);
+    return NULL;
+}
+
+/*
+ * Writes all persistent BdrvDirtyBitmaps of @bs to the image.  Bitmaps that
+ * QEMU does not know how to load are kept as they are; all other bitmaps in
+ * the image are replaced, so that bitmaps which were removed at runtime or
+ * which were not stored cleanly are dropped.  The BdrvDirtyBitmaps are not
+ * released.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapList *bm_list, drop_list;
+    Qcow2Bitmap *bm, *next;
+    int ret;
+
+    if (s->nb_bitmaps == 0 && !bdrv_has_persistent_dirty_bitmaps(bs)) {
+        return 0;
+    }
+
+    if (s->nb_bitmaps == 0) {
+        bm_list = g_new(Qcow2BitmapList, 1);
+        QSIMPLEQ_INIT(bm_list);
+    } else {
+        bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                   s->bitmap_directory_size, errp);
+        if (bm_list == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    /* Everything that QEMU can load is either rewritten from memory or
+     * dropped; the old clusters are freed once the new directory is in
+     * place */
+    QSIMPLEQ_INIT(&drop_list);
+    QSIMPLEQ_FOREACH_SAFE(bm, bm_list, entry, next) {
+        if (bitmap_usable(bm)) {
+            QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+            QSIMPLEQ_INSERT_TAIL(&drop_list, bm, entry);
+        }
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap) || name == NULL) {
+            continue;
+        }
+
+        if (find_bitmap_by_name(bm_list, name)) {
+            error_setg(errp, "Image already contains an unsupported bitmap "
+                       "named '%s'", name);
+            ret = -EEXIST;
+            goto fail;
+        }
+
+        bm = store_bitmap(bs, bitmap, errp);
+        if (bm == NULL) {
+            ret = -EIO;
+            goto fail;
+        }
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+    }
+
+    ret = update_ext_header_and_dir(bs, bm_list, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    QSIMPLEQ_FOREACH(bm, &drop_list, entry) {
+        /* If this fails, the clusters are only leaked */
+        free_bitmap_clusters(bs, bm);
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    /* All usable bitmaps left in the list have just been written */
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bitmap_usable(bm)) {
+            free_bitmap_clusters(bs, bm);
+        }
+    }
+
+out:
+    while ((bm = QSIMPLEQ_FIRST(&drop_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&drop_list, entry);
+        bitmap_free(bm);
+    }
+    bitmap_list_free(bm_list);
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits = ctz32(granularity);
+    uint64_t table_size;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Cannot store dirty bitmaps in qcow2 v2 files");
+        return false;
+    }
+
+    if (bdrv_is_read_only(bs)) {
+        error_setg(errp, "Cannot store dirty bitmaps in read-only images");
+        return false;
+    }
+
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        granularity_bits > BME_MAX_GRANULARITY_BITS)
+    {
+        error_setg(errp, "Granularity exceeds the maximum of %llu bytes",
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    table_size = bitmap_table_size(bs, granularity_bits);
+    if (table_size > BME_MAX_TABLE_SIZE ||
+        table_size * s->cluster_size > BME_MAX_PHYS_SIZE)
+    {
+        error_setg(errp, "Granularity is too small for an image of this "
+                   "size");
+        return false;
+    }
+
+    if (s->nb_bitmaps == 0) {
+        return true;
+    }
+
+    if (s->nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Maximum number of bitmaps reached");
+        return false;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return false;
+    }
+
+    bm = find_bitmap_by_name(bm_list, name);
+    if (bm && !bitmap_usable(bm)) {
+        error_setg(errp, "Image already contains an unsupported bitmap named "
+                   "'%s'", name);
+        bitmap_list_free(bm_list);
+        return false;
+    }
+
+    bitmap_list_free(bm_list);
+    return true;
+}
+
+/*
+ * Increases the refcounts in the given refcount table for the bitmap
+ * directory and the tables and data clusters of all bitmaps.
+ *
+ * Returns 0 on success (corruptions are counted in @res), -errno if an
+ * internal error occurred.
+ */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Error *local_err = NULL;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, &local_err);
+    if (bm_list == NULL) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *table;
+        uint32_t i;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap '%s': invalid bitmap table: %s\n",
+                    bm->name, strerror(-ret));
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table_size; i++) {
+            uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           offset ? s->cluster_size : 0);
+            if (ret < 0) {
+                g_free(table);
+                goto out;
+            }
+        }
+        g_free(table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+    return ret;
+}
@@ -31,40 +31,85 @@
 
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/* Unreferenced entries live in one of three lists.  A table that has been
+ * loaded but not used again since is kept in QCOW2_CACHE_A1; once it is hit
+ * again after its first use it moves to QCOW2_CACHE_AM.  This is the
+ * simplified 2Q algorithm, an approximation of LRU-2: a single pass over
+ * many tables (e.g. qemu-img check or a sequential read of a big image) can
+ * only push out entries of A1, while the working set in AM survives.
+ *
+ * Referenced entries are taken off the lists and put back by
+ * qcow2_cache_put() when their reference count drops to zero.
+ */
+enum {
+    QCOW2_CACHE_FREE,
+    QCOW2_CACHE_A1,
+    QCOW2_CACHE_AM,
+    QCOW2_CACHE_LIST_MAX,
+    QCOW2_CACHE_NO_LIST = QCOW2_CACHE_LIST_MAX,
+};
+
+/* Percentage of the cache that A1 may use before it is preferred for
+ * eviction */
+#define QCOW2_CACHE_A1_PERCENT 25
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     hot;
+    uint8_t  list;
+    int      hash_next;
+    int      prev;
+    int      next;
 } Qcow2CachedTable;
 
+typedef struct Qcow2CacheList {
+    int head;
+    int tail;
+    int count;
+} Qcow2CacheList;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
+    int                     num_dirty;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Hash table of cached offsets, chained through hash_next */
+    int                    *buckets;
+    int                     hash_bits;
+
+    Qcow2CacheList          lists[QCOW2_CACHE_LIST_MAX];
+    int                     a1_target;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
@@ -72,18 +117,135 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
-    if (length > 0) {
+    if (mem_size > offset && length > 0) {
         qemu_madvise((uint8_t *) t + offset, length, QEMU_MADV_DONTNEED);
     }
 #endif
 }
 
+static void qcow2_cache_list_remove(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    Qcow2CacheList *l;
+
+    if (t->list == QCOW2_CACHE_NO_LIST) {
+        return;
+    }
+
+    l = &c->lists[t->list];
+    if (t->prev >= 0) {
+        c->entries[t->prev].next = t->next;
+    } else {
+        l->head = t->next;
+    }
+    if (t->next >= 0) {
+        c->entries[t->next].prev = t->prev;
+    } else {
+        l->tail = t->prev;
+    }
+    l->count--;
+
+    t->list = QCOW2_CACHE_NO_LIST;
+    t->prev = t->next = -1;
+}
+
+static void qcow2_cache_list_insert(Qcow2Cache *c, int i, int list)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    Qcow2CacheList *l = &c->lists[list];
+
+    assert(t->list == QCOW2_CACHE_NO_LIST);
+
+    t->list = list;
+    t->prev = -1;
+    t->next = l->head;
+    if (l->head >= 0) {
+        c->entries[l->head].prev = i;
+    } else {
+        l->tail = i;
+    }
+    l->head = i;
+    l->count++;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9e3779b97f4a7c15ULL)
+           >> (64 - c->hash_bits);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/* Forget the table cached in entry i and move it to the free list */
+static void qcow2_cache_entry_invalidate(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0 && !t->dirty);
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    qcow2_cache_list_remove(c, i);
+
+    t->offset = 0;
+    t->lru_counter = 0;
+    t->hot = false;
+    qcow2_cache_list_insert(c, i, QCOW2_CACHE_FREE);
+}
+
+/* Pick an unreferenced entry to hold a new table, preferring free entries,
+ * then tables that were used only once, then the least recently used of the
+ * tables that were used more than once. */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    Qcow2CacheList *a1 = &c->lists[QCOW2_CACHE_A1];
+    Qcow2CacheList *am = &c->lists[QCOW2_CACHE_AM];
+
+    if (c->lists[QCOW2_CACHE_FREE].count) {
+        return c->lists[QCOW2_CACHE_FREE].tail;
+    }
+    if (a1->count && (a1->count > c->a1_target || !am->count)) {
+        return a1->tail;
+    }
+    return am->tail;
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -104,8 +266,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_invalidate(c, i);
             i++;
             to_clean++;
         }
@@ -118,22 +279,43 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
+
+    assert(num_tables > 0);
+    assert(table_size >= BDRV_SECTOR_SIZE && is_power_of_2(table_size));
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
+    c->hash_bits = MAX(1, 64 - clz64(num_tables - 1));
+    c->a1_target = MAX(1, num_tables * QCOW2_CACHE_A1_PERCENT / 100);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < QCOW2_CACHE_LIST_MAX; i++) {
+        c->lists[i] = (Qcow2CacheList) { .head = -1, .tail = -1 };
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        c->entries[i].list = QCOW2_CACHE_NO_LIST;
+        qcow2_cache_list_insert(c, i, QCOW2_CACHE_FREE);
     }
 
     return c;
@@ -148,6 +330,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -196,13 +379,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -216,12 +399,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file->bs, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
 
     c->entries[i].dirty = false;
+    c->num_dirty--;
 
     return 0;
 }
@@ -235,7 +419,7 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
-    for (i = 0; i < c->size; i++) {
+    for (i = 0; i < c->size && c->num_dirty > 0; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
             result = ret;
@@ -290,9 +474,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_invalidate(c, i);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
@@ -306,39 +488,38 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        t = &c->entries[i];
+        if (t->ref == 0) {
+            /* A table that is used again after its first use has proven
+             * that it belongs to the working set */
+            t->hot = true;
+            qcow2_cache_list_remove(c, i);
         }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+        c->hits++;
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    c->misses++;
+    i = qcow2_cache_find_victim(c);
+    if (i < 0) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -347,9 +528,15 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
+    t = &c->entries[i];
+    if (t->offset) {
+        c->evictions++;
+    }
+    qcow2_cache_entry_invalidate(c, i);
+    qcow2_cache_list_remove(c, i);
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -357,17 +544,19 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
         ret = bdrv_pread(bs->file->bs, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
+            qcow2_cache_list_insert(c, i, QCOW2_CACHE_FREE);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    t->ref++;
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -391,15 +580,18 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(bs, c, *table);
+    Qcow2CachedTable *t = &c->entries[i];
 
-    c->entries[i].ref--;
+    t->ref--;
     *table = NULL;
 
-    if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
+    if (t->ref == 0) {
+        t->lru_counter = ++c->lru_counter;
+        qcow2_cache_list_insert(c, i, t->hot ? QCOW2_CACHE_AM
+                                             : QCOW2_CACHE_A1);
     }
 
-    assert(c->entries[i].ref >= 0);
+    assert(t->ref >= 0);
 }
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -407,5 +599,25 @@ void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
 {
     int i = qcow2_cache_get_table_idx(bs, c, table);
     assert(c->entries[i].offset != 0);
-    c->entries[i].dirty = true;
+    if (!c->entries[i].dirty) {
+        c->entries[i].dirty = true;
+        c->num_dirty++;
+    }
+}
+
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new0(Qcow2CacheStats, 1);
+
+    *stats = (Qcow2CacheStats) {
+        .size       = c->size,
+        .entry_size = c->table_size,
+        .used       = c->size - c->lists[QCOW2_CACHE_FREE].count,
+        .dirty      = c->num_dirty,
+        .hits       = c->hits,
+        .misses     = c->misses,
+        .evictions  = c->evictions,
+    };
+
+    return stats;
 }
@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -142,22 +141,23 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at @l2_offset that contains the entry for
+ * the guest offset @offset into memory. If the slice is in the cache, the
+ * cache is used; otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 and a pointer to the slice in @l2_slice on success, or -errno if
+ * the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+                   uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret;
-
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    int start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return ret;
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                           (void **) l2_slice);
 }
 
 /*
@@ -204,13 +204,16 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table is written through the L2 cache one slice at a time; callers
+ * load the slice they need with l2_load() afterwards.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned slice, slice_size2, n_slices;
     int64_t l2_offset;
     int ret;
 
@@ -220,7 +223,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -231,41 +234,48 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
+    for (slice = 0; slice < n_slices; slice++) {
+        /* allocate a new entry in the l2 cache */
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    l2_table = *table;
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new slice */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t *old_slice;
+            uint64_t old_l2_slice_offset =
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2;
+
+            /* if there was an old l2 table, read the slice from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache, old_l2_slice_offset,
+                                  (void **) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+            memcpy(l2_slice, old_slice, slice_size2);
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_slice);
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        /* write the l2 slice to the file */
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-        qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+        trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
 
-    /* write the l2 table to the file */
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-
-    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -279,36 +289,35 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
 }
 
 /*
- * Checks how many clusters in a given L2 table are contiguous in the image
- * file. As soon as one of the flags in the bitmask stop_flags changes compared
- * to the first cluster, the search is stopped and the cluster is not counted
- * as contiguous. (This allows it, for example, to stop at the first compressed
- * cluster which may require a different handling)
+ * Checks how many clusters in a given L2 slice, starting at l2_index, are
+ * contiguous in the image file. As soon as one of the flags in the bitmask
+ * stop_flags changes compared to the first cluster, the search is stopped and
+ * the cluster is not counted as contiguous. (This allows it, for example, to
+ * stop at the first compressed cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_slice, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -317,8 +326,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) == QCOW2_CLUSTER_NORMAL);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -326,14 +335,16 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_clusters_by_type(int nb_clusters,
-                                             uint64_t *l2_table,
+static int count_contiguous_clusters_by_type(BDRVQcow2State *s,
+                                             int nb_clusters,
+                                             uint64_t *l2_slice, int l2_index,
                                              int wanted_type)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        int type = qcow2_get_cluster_type(l2_entry);
 
         if (type != wanted_type) {
             break;
@@ -343,6 +354,51 @@ static int count_contiguous_clusters_by_type(int nb_clusters,
     return i;
 }
 
+/*
+ * For images with extended L2 entries: counts how many subclusters, starting
+ * with subcluster sc_index of the cluster at l2_index, have the same type as
+ * that first subcluster, up to nb_subclusters.  Allocated subclusters must
+ * also be contiguous in the image file to be counted.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, int nb_subclusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        int l2_index)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    uint64_t expected_offset = l2_entry & L2E_OFFSET_MASK;
+    int expected_type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap,
+                                                  sc_index);
+    int count = 0;
+    int i;
+
+    assert(has_subclusters(s) && expected_type >= 0);
+
+    for (i = l2_index; i < s->l2_slice_size; i++, sc_index = 0) {
+        l2_entry = get_l2_entry(s, l2_slice, i);
+        l2_bitmap = get_l2_bitmap(s, l2_slice, i);
+
+        if (expected_type == QCOW2_CLUSTER_NORMAL &&
+            (l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+            break;
+        }
+
+        for (; sc_index < s->subclusters_per_cluster; sc_index++) {
+            if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index)
+                != expected_type) {
+                return count;
+            }
+            if (++count == nb_subclusters) {
+                return count;
+            }
+        }
+
+        expected_offset += s->cluster_size;
+    }
+
+    return count;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -482,19 +538,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t l1_index, l2_offset, *l2_table;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, bytes_per_slice;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    bytes_per_slice = (uint64_t) s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the L2 slice that maps it
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = bytes_per_slice - (offset & (bytes_per_slice - 1));
 
     /* compute the number of available sectors */
 
@@ -528,21 +585,63 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* nb_needed <= INT_MAX, thus nb_clusters <= INT_MAX, too */
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
+    if (has_subclusters(s) &&
+        qcow2_get_cluster_type(*cluster_offset) != QCOW2_CLUSTER_COMPRESSED) {
+        /* Subclusters are looked at one by one, but compressed clusters are
+         * handled below like without extended L2 entries */
+        unsigned sc_index = index_in_cluster / s->subcluster_sectors;
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+        ret = qcow2_get_subcluster_type(s, *cluster_offset, l2_bitmap,
+                                        sc_index);
+        if (ret < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid subcluster "
+                                    "allocation bitmap %#" PRIx64 " (L2 "
+                                    "offset: %#" PRIx64 ", L2 index: %#x)",
+                                    l2_bitmap, l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+
+        c = count_contiguous_subclusters(s,
+                DIV_ROUND_UP(nb_needed, s->subcluster_sectors) - sc_index,
+                sc_index, l2_table, l2_index);
+        nb_available = (uint64_t)(sc_index + c) * s->subcluster_sectors;
+
+        if (ret == QCOW2_CLUSTER_NORMAL) {
+            *cluster_offset &= L2E_OFFSET_MASK;
+            if (offset_into_cluster(s, *cluster_offset)) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster "
+                                        "offset %#" PRIx64 " unaligned (L2 "
+                                        "offset: %#" PRIx64 ", L2 index: "
+                                        "%#x)", *cluster_offset, l2_offset,
+                                        l2_index);
+                ret = -EIO;
+                goto fail;
+            }
+        } else {
+            *cluster_offset = 0;
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        goto out;
+    }
+
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
@@ -558,20 +657,21 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
-                                              QCOW2_CLUSTER_ZERO);
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index, QCOW2_CLUSTER_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index,
                                               QCOW2_CLUSTER_UNALLOCATED);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
@@ -607,10 +707,10 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the slice of the l2 table that maps it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the l2 slice are given to
+ * the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -645,29 +745,33 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        assert(offset_into_cluster(s, l2_offset) == 0);
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -705,7 +809,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -729,7 +833,11 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        /* The bitmap is unused for compressed clusters */
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
@@ -795,7 +903,8 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     if (s->use_lazy_refcounts) {
         qcow2_mark_dirty(bs);
     }
-    if (qcow2_need_accurate_refcounts(s)) {
+    if (qcow2_need_accurate_refcounts(s) && !s->alloc_batch_size) {
+        /* With an allocation batch, this happened when it was refilled */
         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                    s->refcount_block_cache);
     }
@@ -806,20 +915,46 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (!m->keep_old_clusters) {
+            if (old_entry != 0) {
+                old_cluster[j++] = old_entry;
+            }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
-     }
+            set_l2_entry(s, l2_table, l2_index + i,
+                         (cluster_offset + (i << s->cluster_bits))
+                         | QCOW_OFLAG_COPIED);
+        }
+
+        /* Mark the subclusters that were written, including COW, as
+         * allocated; the others keep their state */
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t written_from = l2meta_cow_start(m) - m->offset;
+            uint64_t written_to = l2meta_cow_end(m) - m->offset;
+            int first_sc, last_sc;
+
+            /* Narrow the written area down to the current cluster */
+            written_from = MAX(written_from, (uint64_t)i << s->cluster_bits);
+            written_to = MIN(written_to, (uint64_t)(i + 1) << s->cluster_bits);
+            assert(written_from < written_to);
+
+            first_sc = offset_to_sc_index(s, written_from);
+            last_sc = offset_to_sc_index(s, written_to - 1);
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc + 1);
+            l2_bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc + 1);
+            set_l2_bitmap(s, l2_table, l2_index + i, l2_bitmap);
+        }
+    }
 
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
@@ -832,7 +967,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -854,7 +989,7 @@ static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -905,6 +1040,14 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With subclusters, the COW area of a new allocation need not cover
+         * whole clusters, but nothing else may use the clusters until their
+         * L2 entries point to the new allocation */
+        if (!old_alloc->keep_old_clusters) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -927,9 +1070,8 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
             if (bytes == 0) {
                 /* Wait for the dependency to complete. We need to recheck
                  * the free/allocated clusters when we continue. */
-                qemu_co_mutex_unlock(&s->lock);
-                qemu_co_queue_wait(&old_alloc->dependent_requests);
-                qemu_co_mutex_lock(&s->lock);
+                qemu_co_queue_wait_mutex(&old_alloc->dependent_requests,
+                                         &s->lock);
                 return -EAGAIN;
             }
         }
@@ -942,6 +1084,90 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * With extended L2 entries, a write to clusters that are already allocated
+ * and don't need COW may still touch subclusters that are unallocated or read
+ * as zeroes.  These must be marked as allocated in the L2 bitmap once the data
+ * has been written, and if the write covers such a subcluster only partially,
+ * the rest of it must be copied first (from the backing file, or zeroes).
+ *
+ * Adds a QCowL2Meta with keep_old_clusters set to *m for the write of @bytes
+ * at @guest_offset to the clusters starting at @l2_index, whose host offset
+ * is @host_cluster_offset.  Nothing is added if all touched subclusters are
+ * allocated already.
+ */
+static void calculate_keep_old_l2meta(BlockDriverState *bs,
+                                      uint64_t guest_offset, uint64_t bytes,
+                                      uint64_t host_cluster_offset,
+                                      uint64_t *l2_slice, int l2_index,
+                                      QCowL2Meta **m)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    uint64_t cow_start_from = start;
+    uint64_t cow_end_to = end;
+    int nb_clusters = size_to_clusters(s, end);
+    int first_sc = offset_to_sc_index(s, start);
+    int last_sc = offset_to_sc_index(s, end - 1);
+    uint64_t first_bitmap, last_bitmap;
+    bool all_allocated = true;
+    QCowL2Meta *old_m = *m;
+    int i;
+
+    assert(has_subclusters(s));
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        int from = (i == 0) ? first_sc : 0;
+        int to = (i == nb_clusters - 1) ? last_sc + 1
+                                        : s->subclusters_per_cluster;
+        uint64_t wanted = QCOW_OFLAG_SUB_ALLOC_RANGE(from, to);
+
+        if ((l2_bitmap & wanted) != wanted) {
+            all_allocated = false;
+            break;
+        }
+    }
+
+    if (all_allocated) {
+        return;
+    }
+
+    /* Partially written subclusters that are not allocated yet need COW */
+    first_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    if (!(first_bitmap & QCOW_OFLAG_SUB_ALLOC(first_sc))) {
+        cow_start_from = (uint64_t)first_sc << s->subcluster_bits;
+    }
+
+    last_bitmap = get_l2_bitmap(s, l2_slice, l2_index + nb_clusters - 1);
+    if (!(last_bitmap & QCOW_OFLAG_SUB_ALLOC(last_sc))) {
+        cow_end_to = align_offset(end, s->subcluster_size);
+    }
+
+    *m = g_malloc0(sizeof(**m));
+    **m = (QCowL2Meta) {
+        .next               = old_m,
+
+        .alloc_offset       = host_cluster_offset,
+        .offset             = start_of_cluster(s, guest_offset),
+        .nb_clusters        = nb_clusters,
+        .nb_available       = end >> BDRV_SECTOR_BITS,
+        .keep_old_clusters  = true,
+
+        .cow_start = {
+            .offset     = cow_start_from,
+            .nb_sectors = (start - cow_start_from) >> BDRV_SECTOR_BITS,
+        },
+        .cow_end = {
+            .offset     = end,
+            .nb_sectors = (cow_end_to - end) >> BDRV_SECTOR_BITS,
+        },
+    };
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -988,8 +1214,8 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -998,7 +1224,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1025,8 +1251,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -1034,6 +1259,12 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
 
+        if (has_subclusters(s)) {
+            calculate_keep_old_l2meta(bs, guest_offset, *bytes,
+                                      cluster_offset & L2E_OFFSET_MASK,
+                                      l2_table, l2_index, m);
+        }
+
         ret = 1;
     } else {
         ret = 0;
@@ -1082,7 +1313,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
+    if (s->alloc_batch_size) {
+        return qcow2_alloc_clusters_batched(bs, host_offset, nb_clusters);
+    } else if (*host_offset == 0) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
@@ -1100,6 +1333,86 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * For images with extended L2 entries: computes the area of a new allocation
+ * for the @nb_clusters clusters starting at @l2_index that must be written,
+ * either by the guest write of @bytes at @guest_offset or by COW.  Besides the
+ * subclusters touched by the guest write, this includes everything that was
+ * allocated in the old clusters, so that no data is lost when the L2 entries
+ * are switched to the new allocation.
+ *
+ * On success, [*cow_start_from, *cow_end_to) is set to that area, relative to
+ * the start of the first cluster.  Returns 0 on success and -EIO if an L2
+ * bitmap is corrupted.
+ */
+static int calculate_alloc_cow_range(BlockDriverState *bs,
+                                     uint64_t guest_offset, uint64_t bytes,
+                                     uint64_t *l2_slice, int l2_index,
+                                     int nb_clusters, uint64_t *cow_start_from,
+                                     uint64_t *cow_end_to)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = MIN(start + bytes, (uint64_t)nb_clusters << s->cluster_bits);
+    uint64_t last_cluster = (uint64_t)(nb_clusters - 1) << s->cluster_bits;
+    int first_sc = offset_to_sc_index(s, start);
+    int last_sc = offset_to_sc_index(s, end - 1);
+    uint64_t l2_entry, l2_bitmap;
+    uint32_t alloc_bitmap;
+
+    assert(has_subclusters(s));
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, 0) < 0) {
+        goto corrupt;
+    }
+    alloc_bitmap = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+
+    switch (qcow2_get_cluster_type(l2_entry & ~QCOW_OFLAG_ZERO)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        *cow_start_from = 0;
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        *cow_start_from = (uint64_t)MIN(first_sc, ctz32(alloc_bitmap))
+                          << s->subcluster_bits;
+        break;
+    default:
+        *cow_start_from = (uint64_t)first_sc << s->subcluster_bits;
+        break;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index + nb_clusters - 1);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + nb_clusters - 1);
+    if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, 0) < 0) {
+        goto corrupt;
+    }
+    alloc_bitmap = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+
+    switch (qcow2_get_cluster_type(l2_entry & ~QCOW_OFLAG_ZERO)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        *cow_end_to = last_cluster + s->cluster_size;
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        *cow_end_to = last_cluster +
+                      ((uint64_t)MAX(last_sc + 1, 32 - clz32(alloc_bitmap))
+                       << s->subcluster_bits);
+        break;
+    default:
+        *cow_end_to = last_cluster +
+                      ((uint64_t)(last_sc + 1) << s->subcluster_bits);
+        break;
+    }
+
+    return 0;
+
+corrupt:
+    qcow2_signal_corruption(bs, true, -1, -1, "Invalid subcluster allocation "
+                            "bitmap %#" PRIx64 " (guest offset: %#" PRIx64
+                            ")", l2_bitmap, guest_offset);
+    return -EIO;
+}
+
 /*
  * Allocates new clusters for an area that either is yet unallocated or needs a
  * copy on write. If *host_offset is non-zero, clusters are only allocated if
@@ -1128,6 +1441,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     uint64_t nb_clusters;
+    uint64_t cow_start_from = 0, cow_end_to = 0;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1143,8 +1457,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1153,7 +1467,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
@@ -1167,6 +1481,16 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
+    if (has_subclusters(s)) {
+        ret = calculate_alloc_cow_range(bs, guest_offset, *bytes, l2_table,
+                                        l2_index, nb_clusters,
+                                        &cow_start_from, &cow_end_to);
+        if (ret < 0) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            return ret;
+        }
+    }
+
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     /* Allocate, if necessary at a given offset in the image file */
@@ -1216,8 +1540,17 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    int cow_start_sector = 0;
+    int cow_end_sector = avail_sectors;
     QCowL2Meta *old_m = *m;
 
+    /* With subclusters, COW is only needed for the subclusters touched by
+     * the write and for whatever the old clusters had allocated */
+    if (has_subclusters(s)) {
+        cow_start_sector = cow_start_from >> BDRV_SECTOR_BITS;
+        cow_end_sector = MIN(cow_end_to >> BDRV_SECTOR_BITS, avail_sectors);
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1229,12 +1562,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .nb_available   = nb_sectors,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = cow_start_sector * BDRV_SECTOR_SIZE,
+            .nb_sectors = alloc_n_start - cow_start_sector,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sector - nb_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1381,57 +1714,65 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Makes s->cluster_cache hold the decompressed data of the compressed cluster
+ * described by the L2 entry @cluster_offset.
+ *
+ * Must be called with s->lock held.  On a cache miss the lock is dropped while
+ * the compressed data is read and inflated in the thread pool, so that
+ * several compressed clusters can be decompressed in parallel.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *in_buf, *out_buf;
+    unsigned gen;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file->bs, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+    if (s->cluster_cache_offset == coffset) {
+        return 0;
     }
-    return 0;
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    in_buf = qemu_try_blockalign(bs->file->bs, nb_csectors * 512);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (in_buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    gen = s->cluster_cache_gen;
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file->bs, coffset >> 9, in_buf, nb_csectors);
+    if (ret >= 0 &&
+        qcow2_co_decompress(bs, out_buf, s->cluster_size,
+                            in_buf + sector_offset, csize) < 0) {
+        ret = -EIO;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Only keep the data cached if no write invalidated the cache while the
+     * lock was dropped; the host range may have been freed and reused. */
+    memcpy(s->cluster_cache, out_buf, s->cluster_size);
+    s->cluster_cache_offset = (gen == s->cluster_cache_gen) ? coffset : -1;
+    ret = 0;
+
+out:
+    qemu_vfree(in_buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
@@ -1454,14 +1795,15 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_l2_entry;
+        uint64_t old_l2_entry, old_l2_bitmap;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        old_l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1475,10 +1817,21 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
          *
          * If full_discard is true, the sector should not read back as zeroes,
          * but rather fall through to the backing file.
+         *
+         * With extended L2 entries, unallocated clusters may have subclusters
+         * that read as zeroes, so the bitmap must be checked, too.
          */
         switch (qcow2_get_cluster_type(old_l2_entry)) {
             case QCOW2_CLUSTER_UNALLOCATED:
-                if (full_discard || !bs->backing) {
+                if (!bs->backing) {
+                    continue;
+                }
+                /* Without subclusters, the bitmap is always 0 */
+                if (full_discard && old_l2_bitmap == 0) {
+                    continue;
+                }
+                if (!full_discard &&
+                    old_l2_bitmap == QCOW_L2_BITMAP_ALL_ZEROES) {
                     continue;
                 }
                 break;
@@ -1499,10 +1852,14 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (!full_discard && s->qcow_version >= 3) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1534,6 +1891,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, end_offset - offset);
 
+    qcow2_invalidate_cluster_cache(s);
     s->cache_discards = true;
 
     /* Each L2 table is handled by its own loop iteration */
@@ -1574,22 +1932,33 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            if (has_subclusters(s)) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                set_l2_bitmap(s, l2_table, l2_index + i,
+                              QCOW_L2_BITMAP_ALL_ZEROES);
+            } else {
+                set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
+            }
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
+        } else if (has_subclusters(s)) {
+            /* Keep the cluster allocated, like preallocated zero clusters */
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1598,9 +1967,69 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
+/*
+ * For images with extended L2 entries: makes the subclusters of a single
+ * cluster that are covered by @bytes at @offset read as zeroes.  Both @offset
+ * and @bytes must be aligned to the subcluster size.
+ *
+ * Returns -ENOTSUP for compressed clusters, which cannot be zeroed partially.
+ */
+static int zero_l2_subclusters(BlockDriverState *bs, uint64_t offset,
+                               uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t l2_entry, l2_bitmap;
+    int l2_index, first_sc, nb_subclusters;
+    int ret;
+
+    assert(has_subclusters(s));
+    assert(((offset | bytes) & (s->subcluster_size - 1)) == 0);
+    assert(offset_into_cluster(s, offset) + bytes <= s->cluster_size);
+
+    first_sc = offset_to_sc_index(s, offset);
+    nb_subclusters = bytes >> s->subcluster_bits;
+
+    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_table, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+    if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, first_sc) < 0) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Invalid subcluster "
+                                "allocation bitmap %#" PRIx64 " (guest "
+                                "offset: %#" PRIx64 ")", l2_bitmap, offset);
+        ret = -EIO;
+        goto out;
+    }
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    l2_bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(first_sc,
+                                           first_sc + nb_subclusters);
+    l2_bitmap &= ~QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc,
+                                             first_sc + nb_subclusters);
+
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    set_l2_bitmap(s, l2_table, l2_index, l2_bitmap);
+    ret = 0;
+
+out:
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    return ret;
+}
+
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
+    uint64_t end_offset = offset + ((uint64_t)nb_sectors << BDRV_SECTOR_BITS);
+    uint64_t head, tail;
     uint64_t nb_clusters;
     int ret;
 
@@ -1609,11 +2038,27 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
+    /* Without subclusters, the request must be cluster aligned; with them,
+     * partial clusters at the head and tail are handled in the bitmaps */
+    head = MIN(end_offset, align_offset(offset, s->cluster_size)) - offset;
+    tail = end_offset > offset + head ? offset_into_cluster(s, end_offset) : 0;
+    assert(has_subclusters(s) || (head == 0 && tail == 0));
+
+    qcow2_invalidate_cluster_cache(s);
 
     s->cache_discards = true;
 
+    if (head) {
+        ret = zero_l2_subclusters(bs, offset, head);
+        if (ret < 0) {
+            goto fail;
+        }
+        offset += head;
+    }
+
+    /* Each L2 table is handled by its own loop iteration */
+    nb_clusters = size_to_clusters(s, end_offset - tail - offset);
+
     while (nb_clusters > 0) {
         ret = zero_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
@@ -1624,6 +2069,13 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         offset += (ret * s->cluster_size);
     }
 
+    if (tail) {
+        ret = zero_l2_subclusters(bs, offset, tail);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     s->cache_discards = false;
@@ -1649,13 +2101,18 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     BDRVQcow2State *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
     uint64_t *l2_table = NULL;
+    unsigned slice, slice_size2, n_slices;
     int ret;
     int i, j;
 
+    /* L2 tables are processed one slice at a time, like the L2 cache does */
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        l2_table = qemu_try_blockalign(bs->file->bs, slice_size2);
         if (l2_table == NULL) {
             return -ENOMEM;
         }
@@ -1663,7 +2120,6 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1683,124 +2139,137 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file->bs, l2_offset / BDRV_SECTOR_SIZE,
-                            (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t l2_slice_offset = l2_offset + slice * slice_size2;
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, l2_slice_offset,
+                                      (void **)&l2_table);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_read(bs->file->bs,
+                                l2_slice_offset / BDRV_SECTOR_SIZE,
+                                (void *)l2_table,
+                                slice_size2 / BDRV_SECTOR_SIZE);
+            }
+            if (ret < 0) {
+                goto fail;
             }
 
-            if (!preallocated) {
-                if (!bs->backing) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
+
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        l2_table[j] = 0;
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    qcow2_signal_corruption(bs, true, -1, -1, "Data cluster "
+                                            "offset %#" PRIx64 " unaligned "
+                                            "(L2 offset: %#" PRIx64 ", L2 "
+                                            "index: %#x)", offset, l2_offset,
+                                            slice * s->l2_slice_size + j);
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_write_zeroes(bs->file->bs, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_write_zeroes(bs->file->bs,
+                                        offset / BDRV_SECTOR_SIZE,
+                                        s->cluster_sectors, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                } else {
+                    l2_table[j] = cpu_to_be64(offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                 l2_table);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            l2_slice_offset, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file->bs, l2_offset / BDRV_SECTOR_SIZE,
-                                 (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_write(bs->file->bs,
+                                     l2_slice_offset / BDRV_SECTOR_SIZE,
+                                     (void *)l2_table,
+                                     slice_size2 / BDRV_SECTOR_SIZE);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1840,6 +2309,10 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
     int ret;
     int i, j;
 
+    /* Only needed to downgrade to version 2, which has no extended L2
+     * entries; zero clusters don't exist in that format anyway */
+    assert(!has_subclusters(s));
+
     if (status_cb) {
         l1_entries = s->l1_size;
         for (i = 0; i < s->nb_snapshots; i++) {
@@ -1897,3 +2370,96 @@ fail:
     g_free(l1_table);
     return ret;
 }
+
+static int compressed_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
+                                     int l1_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int n_slices = s->l2_size / s->l2_slice_size;
+    uint64_t *l2_slice;
+    int ret;
+    int i, j, slice;
+
+    for (i = 0; i < l1_size; i++) {
+        uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+
+        if (!l2_offset) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, l2_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
+                                    PRIx64 " unaligned (L1 index: %#x)",
+                                    l2_offset, i);
+            return -EIO;
+        }
+
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset +
+                slice * s->l2_slice_size * l2_entry_size(s);
+
+            ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                                  (void **) &l2_slice);
+            if (ret < 0) {
+                return ret;
+            }
+
+            for (j = 0; j < s->l2_slice_size; j++) {
+                if (get_l2_entry(s, l2_slice, j) & QCOW_OFLAG_COMPRESSED) {
+                    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+                    return 1;
+                }
+            }
+
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Checks whether the active or any snapshot L1 table references a compressed
+ * cluster.  Returns 1 if so, 0 if not and -errno on error.
+ */
+int qcow2_has_compressed_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l1_table = NULL;
+    int ret;
+    int i, j;
+
+    ret = compressed_clusters_in_l1(bs, s->l1_table, s->l1_size);
+    if (ret) {
+        return ret;
+    }
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        int l1_sectors = (s->snapshots[i].l1_size * sizeof(uint64_t) +
+                BDRV_SECTOR_SIZE - 1) / BDRV_SECTOR_SIZE;
+
+        l1_table = g_realloc(l1_table, l1_sectors * BDRV_SECTOR_SIZE);
+
+        ret = bdrv_read(bs->file->bs,
+                        s->snapshots[i].l1_table_offset / BDRV_SECTOR_SIZE,
+                        (void *)l1_table, l1_sectors);
+        if (ret < 0) {
+            goto out;
+        }
+
+        for (j = 0; j < s->snapshots[i].l1_size; j++) {
+            be64_to_cpus(&l1_table[j]);
+        }
+
+        ret = compressed_clusters_in_l1(bs, l1_table, s->snapshots[i].l1_size);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    g_free(l1_table);
+    return ret;
+}
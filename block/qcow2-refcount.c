@@ -918,6 +918,113 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * The L2 entries that will point to newly allocated clusters must not be
+ * written before the refcount blocks.  With an allocation batch this is only
+ * needed once per refcount update, so qcow2_alloc_cluster_link_l2() doesn't
+ * repeat it.
+ */
+static int alloc_batch_set_dependency(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!qcow2_need_accurate_refcounts(s)) {
+        return 0;
+    }
+    return qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                      s->refcount_block_cache);
+}
+
+/*
+ * Allocates data clusters from the allocation batch: a contiguous range of
+ * clusters whose refcounts have been incremented with a single refcount update
+ * when the batch was refilled, but that aren't referenced by any L2 entry yet.
+ * Allocations served from the batch touch neither the refcount blocks nor the
+ * flush dependencies of the L2 table cache.
+ *
+ * If *host_offset is 0, the clusters may be allocated anywhere and *host_offset
+ * is set to the first of them.  Otherwise only clusters starting at
+ * *host_offset are acceptable.  In both cases *nb_clusters is updated to the
+ * number of clusters that were actually allocated, which may be less than
+ * requested (or even 0 if *host_offset was given).
+ *
+ * Returns 0 on success and -errno on error.
+ */
+int qcow2_alloc_clusters_batched(BlockDriverState *bs, uint64_t *host_offset,
+                                 uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t ret;
+
+    assert(s->alloc_batch_size > 0);
+
+    if (s->alloc_batch_clusters == 0) {
+        /* Refill the batch, if possible right where the previous one ended */
+        uint64_t batch_size = MAX(s->alloc_batch_size, *nb_clusters);
+
+        if (*host_offset) {
+            ret = qcow2_alloc_clusters_at(bs, *host_offset, batch_size);
+            if (ret < 0) {
+                return ret;
+            }
+            s->alloc_batch_offset = *host_offset;
+            s->alloc_batch_clusters = ret;
+        } else {
+            ret = qcow2_alloc_clusters(bs, batch_size << s->cluster_bits);
+            if (ret < 0) {
+                return ret;
+            }
+            s->alloc_batch_offset = ret;
+            s->alloc_batch_clusters = batch_size;
+        }
+
+        ret = alloc_batch_set_dependency(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (*host_offset && *host_offset != s->alloc_batch_offset) {
+        /* The contiguous allocation doesn't continue into the batch */
+        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return ret ? alloc_batch_set_dependency(bs) : 0;
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->alloc_batch_clusters);
+    *host_offset = s->alloc_batch_offset;
+    s->alloc_batch_offset += *nb_clusters << s->cluster_bits;
+    s->alloc_batch_clusters -= *nb_clusters;
+
+    return 0;
+}
+
+/*
+ * Drops the references to the clusters that are left in the allocation batch,
+ * so that they don't show up as leaked clusters in the image.
+ */
+int qcow2_release_alloc_batch(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (s->alloc_batch_clusters == 0) {
+        return 0;
+    }
+
+    ret = update_refcount(bs, s->alloc_batch_offset,
+                          s->alloc_batch_clusters << s->cluster_bits,
+                          1, true, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->alloc_batch_offset = 0;
+    s->alloc_batch_clusters = 0;
+    return 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1052,11 +1159,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
+    unsigned slice, slice_size2, n_slices;
     int i, j, l1_modified = 0, nb_csectors;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -1101,20 +1212,22 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
+                    offset = get_l2_entry(s, l2_table, j);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
 
-                switch (qcow2_get_cluster_type(offset)) {
+                    switch (qcow2_get_cluster_type(offset)) {
                     case QCOW2_CLUSTER_COMPRESSED:
                         nb_csectors = ((offset >> s->csize_shift) &
                                        s->csize_mask) + 1;
@@ -1133,18 +1246,22 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
                     case QCOW2_CLUSTER_NORMAL:
                     case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
+                        if (offset_into_cluster(s, offset &
+                                                   L2E_OFFSET_MASK)) {
                             qcow2_signal_corruption(bs, true, -1, -1, "Data "
                                                     "cluster offset %#llx "
                                                     "unaligned (L2 offset: %#"
                                                     PRIx64 ", L2 index: %#x)",
                                                     offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
+                                                    l2_offset,
+                                                    slice * s->l2_slice_size
+                                                    + j);
                             ret = -EIO;
                             goto fail;
                         }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                        cluster_index = (offset & L2E_OFFSET_MASK)
+                                        >> s->cluster_bits;
                         if (!cluster_index) {
                             /* unallocated */
                             refcount = 0;
@@ -1171,23 +1288,24 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
                     default:
                         abort();
-                }
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        set_l2_entry(s, l2_table, j, offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1359,6 +1477,16 @@ static int inc_refcounts(BlockDriverState *bs,
     return 0;
 }
 
+/* For qcow2-bitmap.c, which checks the clusters used by bitmaps */
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
+{
+    return inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                         offset, size);
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1383,7 +1511,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, l2_size);
@@ -1395,7 +1523,26 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+            if (l2_entry & QCOW_OFLAG_ZERO) {
+                fprintf(stderr, "ERROR: L2 entry %#" PRIx64 " has the "
+                        "reserved zero flag set\n", l2_entry);
+                l2_entry &= ~QCOW_OFLAG_ZERO;
+                res->corruptions++;
+            }
+
+            if ((l2_entry & QCOW_OFLAG_COMPRESSED) ? l2_bitmap != 0 :
+                qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, 0) < 0) {
+                fprintf(stderr, "ERROR: invalid subcluster allocation bitmap "
+                        "%#" PRIx64 " for L2 entry %#" PRIx64 "\n",
+                        l2_bitmap, l2_entry);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1617,7 +1764,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file->bs, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1626,7 +1773,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1646,9 +1793,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1841,6 +1988,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
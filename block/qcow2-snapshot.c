@@ -469,6 +469,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     int cur_l1_bytes, sn_l1_bytes;
     int ret;
     uint64_t *sn_l1_table = NULL;
+    int64_t sector;
 
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
@@ -484,6 +485,9 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
     }
 
+    /* Switching to the snapshot frees the clusters of the active layer */
+    qcow2_invalidate_cluster_cache(s);
+
     /*
      * Make sure that the current L1 table is big enough to contain the whole
      * L1 table of the snapshot. If the snapshot L1 table is smaller, the
@@ -572,6 +576,14 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
     }
 
+    /* Any part of the disk may have changed, which enabled dirty bitmaps
+     * (in particular persistent ones with the 'auto' flag) must reflect */
+    for (sector = 0; sector < bs->total_sectors;
+         sector += BDRV_REQUEST_MAX_SECTORS) {
+        bdrv_set_dirty(bs, sector, MIN(BDRV_REQUEST_MAX_SECTORS,
+                                       bs->total_sectors - sector));
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
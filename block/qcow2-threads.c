@@ -0,0 +1,385 @@
+/*
+ * Threaded data processing for the QCOW2 format: (de)compression
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "block/qcow2.h"
+
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+
+    Qcow2CompressFunc *func;
+} Qcow2CompressData;
+
+/*
+ * Compress @src_size bytes from @src into @dest as a raw deflate stream with
+ * a 4k window and no zlib header.
+ *
+ * Returns the compressed size on success, -1 if the result does not fit into
+ * @dest_size bytes and -2 on any other error.
+ */
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -2;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -1 : -2);
+    }
+
+    deflateEnd(&strm);
+
+    return ret;
+}
+
+/*
+ * Inflate the raw deflate stream in @src into @dest.  The uncompressed data
+ * must fill @dest_size bytes exactly; trailing garbage in @src is ignored
+ * because compressed clusters are stored rounded up to whole sectors.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static ssize_t qcow2_decompress(void *dest, size_t dest_size,
+                                const void *src, size_t src_size)
+{
+    int ret;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -1;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret == Z_STREAM_END || ret == Z_BUF_ERROR) && strm.avail_out == 0) {
+        ret = 0;
+    } else {
+        ret = -1;
+    }
+
+    inflateEnd(&strm);
+
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * Compress @src into a single zstd frame in @dest.
+ *
+ * Returns the compressed size on success, -1 if the result does not fit into
+ * @dest_size bytes and -2 on any other error.
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall ? -1 : -2;
+    }
+
+    return ret;
+}
+
+/*
+ * Decompress the zstd frame at the start of @src into @dest.  The streaming
+ * interface is used because @src may extend past the end of the frame.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input = { .src = src, .size = src_size, .pos = 0 };
+    ZSTD_outBuffer output = { .dst = dest, .size = dest_size, .pos = 0 };
+    ssize_t ret = -1;
+    size_t zret;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -1;
+    }
+
+    /* A return value of 0 means that the whole frame has been decoded */
+    do {
+        size_t in_pos = input.pos;
+
+        zret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zret)) {
+            goto out;
+        }
+        if (input.pos == in_pos && output.pos == output.size) {
+            /* more data than fits into a cluster */
+            goto out;
+        }
+    } while (zret && input.pos < input.size);
+
+    if (zret == 0 && output.pos == dest_size) {
+        ret = 0;
+    }
+
+out:
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+#endif
+
+#ifdef CONFIG_LZ4
+/*
+ * LZ4 blocks do not record their own length, and compressed clusters are
+ * padded to whole sectors.  Store the block length as a 32-bit little-endian
+ * prefix so that decompression can pass the exact size to LZ4.
+ */
+#define QCOW2_LZ4_HDR_SIZE 4
+
+/*
+ * Compress @src into a length-prefixed LZ4 block in @dest.
+ *
+ * Returns the compressed size on success, -1 if the result does not fit into
+ * @dest_size bytes and -2 on any other error.
+ */
+static ssize_t qcow2_lz4_compress(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size)
+{
+    int ret;
+
+    if (dest_size <= QCOW2_LZ4_HDR_SIZE || src_size > LZ4_MAX_INPUT_SIZE) {
+        return -2;
+    }
+
+    ret = LZ4_compress_default(src, (char *) dest + QCOW2_LZ4_HDR_SIZE,
+                               src_size, dest_size - QCOW2_LZ4_HDR_SIZE);
+    if (ret <= 0) {
+        /* LZ4 reports a destination buffer that is too small as 0 */
+        return -1;
+    }
+
+    stl_le_p(dest, ret);
+    return ret + QCOW2_LZ4_HDR_SIZE;
+}
+
+/*
+ * Decompress the length-prefixed LZ4 block at the start of @src into @dest.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static ssize_t qcow2_lz4_decompress(void *dest, size_t dest_size,
+                                    const void *src, size_t src_size)
+{
+    uint32_t len;
+    int ret;
+
+    if (src_size < QCOW2_LZ4_HDR_SIZE) {
+        return -1;
+    }
+
+    len = ldl_le_p(src);
+    if (len > src_size - QCOW2_LZ4_HDR_SIZE) {
+        return -1;
+    }
+
+    ret = LZ4_decompress_safe((const char *) src + QCOW2_LZ4_HDR_SIZE, dest,
+                              len, dest_size);
+
+    return ret == dest_size ? 0 : -1;
+}
+#endif
+
+bool qcow2_compression_type_supported(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+
+    return 0;
+}
+
+/*
+ * Run @func in the thread pool of the AioContext that serves requests for
+ * @bs.  At most QCOW2_MAX_THREADS jobs per image are in flight; further
+ * callers wait in s->compress_wait_queue so that a large conversion cannot
+ * monopolize the pool that regular I/O also depends on.
+ */
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc *func)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_request_context(bs));
+    Qcow2CompressData arg = {
+        .dest = dest,
+        .dest_size = dest_size,
+        .src = src,
+        .src_size = src_size,
+        .func = func,
+    };
+
+    qemu_mutex_lock(&s->compress_lock);
+    while (s->nb_compress_threads >= QCOW2_MAX_THREADS) {
+        qemu_co_queue_wait_lock(&s->compress_wait_queue, &s->compress_lock);
+    }
+    s->nb_compress_threads++;
+    qemu_mutex_unlock(&s->compress_lock);
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+
+    qemu_mutex_lock(&s->compress_lock);
+    s->nb_compress_threads--;
+    qemu_co_queue_next(&s->compress_wait_queue);
+    qemu_mutex_unlock(&s->compress_lock);
+
+    return arg.ret;
+}
+
+/*
+ * Compress @src_size bytes from @src into @dest with the compression type of
+ * the image.
+ *
+ * Returns the compressed size on success, -1 if the result does not fit into
+ * @dest_size bytes and -2 on any other error.
+ */
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc *fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_compress;
+        break;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        fn = qcow2_lz4_compress;
+        break;
+#endif
+    default:
+        /* Rejected when the image is opened */
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+/*
+ * Decompress @src into @dest with the compression type of the image.  The
+ * uncompressed data must fill @dest_size bytes exactly.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc *fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_decompress;
+        break;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        fn = qcow2_lz4_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
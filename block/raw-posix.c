@@ -141,6 +141,11 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+    bool io_uring_sqpoll;
+    LuringState *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
@@ -157,6 +162,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -376,25 +384,39 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_attach_aio_context(s->io_uring_ctx, new_context);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -429,6 +451,27 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_io_uring(BDRVRawState *s, bool *use_linux_io_uring,
+                            int bdrv_flags, Error **errp)
+{
+    if (!(bdrv_flags & BDRV_O_IO_URING)) {
+        *use_linux_io_uring = false;
+        return 0;
+    }
+
+    /* if non-NULL, luring_init() has already been run */
+    if (s->io_uring_ctx == NULL) {
+        s->io_uring_ctx = luring_init(s->io_uring_sqpoll, errp);
+        if (!s->io_uring_ctx) {
+            return -1;
+        }
+    }
+    *use_linux_io_uring = true;
+    return 0;
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -449,6 +492,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "Submit io_uring requests through a kernel polling "
+                    "thread (default: off)",
+        },
         { /* end of list */ }
     },
 };
@@ -515,6 +564,24 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    s->io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    if (raw_set_io_uring(s, &s->use_linux_io_uring, bdrv_flags, errp) < 0) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->use_linux_io_uring) {
+        luring_register_fd(s->io_uring_ctx, s->fd);
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -619,6 +686,13 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_linux_io_uring = s->use_linux_io_uring;
+    if (raw_set_io_uring(s, &raw_s->use_linux_io_uring, state->flags,
+                         errp) < 0) {
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -705,6 +779,22 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* The completion notifier and the bottom half only exist while
+     * io_uring is in use, see raw_attach_aio_context().
+     */
+    if (s->use_linux_io_uring && !raw_s->use_linux_io_uring) {
+        luring_detach_aio_context(s->io_uring_ctx,
+                                  bdrv_get_aio_context(state->bs));
+    } else if (!s->use_linux_io_uring && raw_s->use_linux_io_uring) {
+        luring_attach_aio_context(s->io_uring_ctx,
+                                  bdrv_get_aio_context(state->bs));
+    }
+    s->use_linux_io_uring = raw_s->use_linux_io_uring;
+    if (s->use_linux_io_uring) {
+        luring_register_fd(s->io_uring_ctx, s->fd);
+    }
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1271,7 +1361,7 @@ static int paio_submit_co(BlockDriverState *bs, int fd,
     }
 
     trace_paio_submit_co(sector_num, nb_sectors, type);
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(bdrv_get_request_context(bs));
     return thread_pool_submit_co(pool, aio_worker, acb);
 }
 
@@ -1296,10 +1386,18 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     }
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(bdrv_get_request_context(bs));
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+/* Linux AIO and io_uring state belongs to the BDS's own AioContext; requests
+ * issued from a queue context go through that context's thread pool.
+ */
+static bool raw_use_native_aio(BlockDriverState *bs)
+{
+    return bdrv_get_request_context(bs) == bdrv_get_aio_context(bs);
+}
+
 static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockCompletionFunc *cb, void *opaque, int type)
@@ -1313,17 +1411,24 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
      * Check if the underlying device requires requests to be aligned,
      * and if the request we are trying to submit is aligned or not.
      * If this is the case tell the low-level driver that it needs
-     * to copy the buffer.
+     * to copy the buffer.  Linux AIO is only used with O_DIRECT, which
+     * always requires alignment; io_uring also works without.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+    } else if (raw_use_native_aio(bs)) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_linux_io_uring) {
+            return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                                 nb_sectors, cb, opaque, type);
+        }
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_aio) {
+        if (s->use_aio) {
             return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
                                nb_sectors, cb, opaque, type);
-#endif
         }
+#endif
     }
 
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
@@ -1332,34 +1437,87 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+
+    if (!raw_use_native_aio(bs)) {
+        return;
+    }
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_io_plug(bs, s->io_uring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+
+    if (!raw_use_native_aio(bs)) {
+        return;
+    }
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+
+    if (!raw_use_native_aio(bs)) {
+        return;
+    }
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, false);
+    }
+#endif
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring_ctx) {
+        luring_register_buf(s->io_uring_ctx, host, size);
+    }
 }
 
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring_ctx) {
+        luring_unregister_buf(s->io_uring_ctx, host, size);
+    }
+}
+#endif
+
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockCompletionFunc *cb, void *opaque)
@@ -1384,6 +1542,12 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring && raw_use_native_aio(bs)) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1397,6 +1561,12 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_cleanup(s->io_uring_ctx);
+        s->io_uring_ctx = NULL;
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -1930,6 +2100,7 @@ BlockDriver bdrv_file = {
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
     .bdrv_file_open = raw_open,
@@ -1950,6 +2121,10 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -2275,7 +2450,7 @@ static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(bdrv_get_request_context(bs));
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 #endif /* linux */
@@ -2380,6 +2555,7 @@ static BlockDriver bdrv_host_device = {
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
@@ -2399,6 +2575,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -2529,6 +2709,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -2665,6 +2849,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
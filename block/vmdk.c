@@ -1613,14 +1613,19 @@ static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-static int vmdk_write_compressed(BlockDriverState *bs,
-                                 int64_t sector_num,
-                                 const uint8_t *buf,
-                                 int nb_sectors)
+static coroutine_fn int vmdk_write_compressed(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              const uint8_t *buf,
+                                              int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
+    int ret;
+
     if (s->num_extents == 1 && s->extents[0].compressed) {
-        return vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_co_mutex_lock(&s->lock);
+        ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
     } else {
         return -ENOTSUP;
     }
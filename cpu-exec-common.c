@@ -21,9 +21,13 @@
 #include "cpu.h"
 #include "sysemu/cpus.h"
 #include "exec/memory-internal.h"
+#include "exec/helper-proto.h"
 
 bool exit_request;
 CPUState *tcg_current_cpu;
+bool mttcg_enabled;
+bool tcg_superblocks_enabled;
+bool parallel_cpus;
 
 /* exit the current TB from a signal handler. The host registers are
    restored in a state compatible with the CPU emulator
@@ -80,3 +84,16 @@ void cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc)
     cpu->current_tb = NULL;
     siglongjmp(cpu->jmp_env, 1);
 }
+
+/* Leave the execution loop so that the current instruction is executed
+   again with all other vCPUs stopped.  */
+void cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc)
+{
+    cpu->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit_restore(cpu, pc);
+}
+
+void HELPER(exit_atomic)(CPUArchState *env)
+{
+    cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
+}
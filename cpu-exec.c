@@ -32,6 +32,8 @@
 #include "hw/i386/apic.h"
 #endif
 #include "sysemu/replay.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 
 /* -icount align implementation. */
 
@@ -204,68 +206,153 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     tb = tb_gen_code(cpu, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles | CF_NOCACHE
                          | (ignore_icount ? CF_IGNORE_ICOUNT : 0));
     tb->orig_tb = tcg_ctx.tb_ctx.tb_invalidated_flag ? NULL : orig_tb;
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
-static TranslationBlock *tb_find_physical(CPUState *cpu,
-                                          target_ulong pc,
-                                          target_ulong cs_base,
-                                          uint64_t flags)
+#ifndef CONFIG_USER_ONLY
+/* Execute the instruction at the current PC with every other vCPU
+ * outside of guest code, so that it is atomic with respect to them.
+ * Called by vCPU threads after cpu_exec() returned EXCP_ATOMIC, without
+ * the BQL held.
+ */
+void cpu_exec_step_atomic(CPUState *cpu)
 {
+    CPUClass *cc = CPU_GET_CLASS(cpu);
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb) {
-            return NULL;
+    /* volatile, so that it survives the siglongjmp of a fault */
+    TranslationBlock *volatile tb = NULL;
+    target_ulong cs_base, pc;
+    int flags;
+
+    start_exclusive();
+
+    /* Since we got here, we know that parallel_cpus must be true.  */
+    parallel_cpus = false;
+    current_cpu = cpu;
+    rcu_read_lock();
+    cc->cpu_exec_enter(cpu);
+
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+        tb_lock();
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 1 | CF_NOCACHE);
+        tb->orig_tb = NULL;
+        tb_unlock();
+
+        cpu->current_tb = tb;
+        trace_exec_tb_nocache(tb, pc);
+        cpu_tb_exec(cpu, tb);
+        cpu->current_tb = NULL;
+
+        tb_lock();
+        tb_phys_invalidate(tb, -1);
+        tb_free(tb);
+        tb_unlock();
+    } else {
+        /* The instruction raised an exception, which is delivered by
+         * the next cpu_exec.  cpu_restore_state() already dropped the
+         * one-shot TB if the fault came from its code; otherwise it is
+         * still live here.
+         */
+        cpu->can_do_io = 1;
+        tb_lock_reset();
+        if (qemu_mutex_iothread_locked()) {
+            qemu_mutex_unlock_iothread();
         }
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2) {
-                    break;
-                }
-            } else {
-                break;
+        if (tb && !atomic_read(&tb->invalid)) {
+            tb_lock();
+            tb_phys_invalidate(tb, -1);
+            tb_free(tb);
+            tb_unlock();
+        }
+    }
+
+    cc->cpu_exec_exit(cpu);
+    rcu_read_unlock();
+    current_cpu = NULL;
+    parallel_cpus = true;
+
+    end_exclusive();
+}
+#endif
+
+typedef struct tb_desc {
+    target_ulong pc;
+    target_ulong cs_base;
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    uint64_t flags;
+} tb_desc;
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags &&
+        !atomic_read(&tb->invalid)) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
+    return false;
+}
 
-    /* Move the TB to the head of the list */
-    *ptb1 = tb->phys_hash_next;
-    tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
-    return tb;
+/* Does not need tb_lock: the hash table is read under RCU.  */
+static TranslationBlock *tb_htable_lookup(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags,
+                                          tb_page_addr_t phys_pc)
+{
+    struct tb_desc desc;
+    uint32_t h;
+
+    desc.env = (CPUArchState *)cpu->env_ptr;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.pc = pc;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags, cs_base);
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+}
+
+static TranslationBlock *tb_find_physical(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags)
+{
+    CPUArchState *env = (CPUArchState *)cpu->env_ptr;
+
+    return tb_htable_lookup(cpu, pc, cs_base, flags,
+                            get_page_addr_code(env, pc));
 }
 
 static TranslationBlock *tb_find_slow(CPUState *cpu,
@@ -280,32 +367,28 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
         goto found;
     }
 
-#ifdef CONFIG_USER_ONLY
     /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
+     * taken outside tb_lock.  Since the lookup above did not hold
      * tb_lock, there's a chance that our desired tb has been
-     * translated.
+     * translated in the meantime.
      */
-    tb_unlock();
+#ifdef CONFIG_USER_ONLY
     mmap_lock();
+#endif
     tb_lock();
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
+    tb_unlock();
 #ifdef CONFIG_USER_ONLY
     mmap_unlock();
 #endif
 
 found:
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
@@ -320,7 +403,7 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(cpu, pc, cs_base, flags);
@@ -328,6 +411,119 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
     return tb;
 }
 
+/* Hot trace detection for superblocks.
+ *
+ * A TB is not chained to its successors until it has been executed
+ * TB_HOT_THRESHOLD times: until then each of its exits comes back to
+ * the main loop, which counts how often every exit is taken.  When a TB
+ * becomes hot, the path that most often follows it is retranslated as a
+ * single superblock.
+ */
+#define TB_HOT_THRESHOLD 1000
+
+static inline bool tb_is_profiled(TranslationBlock *tb)
+{
+    return !(tb->cflags & CF_SUPERBLOCK) &&
+           atomic_read(&tb->exec_count) < TB_HOT_THRESHOLD;
+}
+
+/* Return the exit of 'tb' taken in at least 3/4 of its executions, or
+   -1 if there is none.  */
+static int tb_hot_exit(TranslationBlock *tb)
+{
+    uint64_t count = MAX(tb->exec_count, 1);
+    int n = tb->edge_count[1] > tb->edge_count[0];
+
+    return (uint64_t)tb->edge_count[n] * 4 >= count * 3 ? n : -1;
+}
+
+/* Called with mmap_lock held for user-mode emulation, and tb_lock held.  */
+static TranslationBlock *tb_form_superblock(CPUState *cpu,
+                                            TranslationBlock *head)
+{
+    TranslationBlock *trace[TB_SB_MAX_TBS];
+    int slots[TB_SB_MAX_TBS];
+    target_ulong page = head->pc & TARGET_PAGE_MASK;
+    TranslationBlock *tb = head;
+    int i, n, nb_tbs, icount;
+
+    /* Keep it simple: the whole superblock lives in one guest page.  */
+    if (head->invalid || head->cflags || head->page_addr[1] != -1 ||
+        cpu->singlestep_enabled || singlestep) {
+        return NULL;
+    }
+
+    trace[0] = head;
+    icount = head->icount;
+    for (nb_tbs = 1; nb_tbs < TB_SB_MAX_TBS; nb_tbs++) {
+        n = tb_hot_exit(tb);
+        if (n < 0 || (tb->edge_pc[n] & TARGET_PAGE_MASK) != page ||
+            tb->edge_pc[n] < head->pc) {
+            break;
+        }
+        tb = tb_htable_lookup(cpu, tb->edge_pc[n], head->cs_base,
+                              head->flags, head->page_addr[0] |
+                              (tb->edge_pc[n] & ~TARGET_PAGE_MASK));
+        if (!tb || tb->cflags || tb->page_addr[1] != -1 ||
+            icount + tb->icount + nb_tbs > TCG_MAX_INSNS) {
+            break;
+        }
+        /* stop when the trace loops back */
+        for (i = 0; i < nb_tbs; i++) {
+            if (trace[i] == tb) {
+                break;
+            }
+        }
+        if (i < nb_tbs) {
+            break;
+        }
+        slots[nb_tbs - 1] = n;
+        trace[nb_tbs] = tb;
+        icount += tb->icount;
+    }
+    if (nb_tbs < 2) {
+        return NULL;
+    }
+    return tb_gen_superblock(cpu, trace, slots, nb_tbs);
+}
+
+/* Account for the execution of 'tb', reached from the TB and exit
+ * encoded in *next_tb, and return the TB to execute instead.
+ * *next_tb is cleared if the two must not be chained.
+ */
+static TranslationBlock *tb_profile(CPUState *cpu, TranslationBlock *tb,
+                                    uintptr_t *next_tb)
+{
+    TranslationBlock *last_tb = (TranslationBlock *)(*next_tb & ~TB_EXIT_MASK);
+    TranslationBlock *sb;
+    int n = *next_tb & TB_EXIT_MASK;
+
+    if (*next_tb != 0 && n <= TB_EXIT_IDX1 && tb_is_profiled(last_tb)) {
+        last_tb->edge_pc[n] = tb->pc;
+        last_tb->edge_count[n]++;
+        *next_tb = 0;
+    }
+    if ((tb->cflags & CF_SUPERBLOCK) ||
+        atomic_fetch_inc(&tb->exec_count) != TB_HOT_THRESHOLD - 1) {
+        return tb;
+    }
+
+#ifdef CONFIG_USER_ONLY
+    mmap_lock();
+#endif
+    tb_lock();
+    sb = tb_form_superblock(cpu, tb);
+    tb_unlock();
+#ifdef CONFIG_USER_ONLY
+    mmap_unlock();
+#endif
+    if (!sb) {
+        return tb;
+    }
+    *next_tb = 0;
+    return sb;
+}
+
 static void cpu_handle_debug_exception(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
@@ -352,7 +548,7 @@ int cpu_exec(CPUState *cpu)
     CPUArchState *env = &x86_cpu->env;
 #endif
     int ret, interrupt_request;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *last_tb;
     uintptr_t next_tb;
     SyncClocks sc;
 
@@ -417,7 +613,13 @@ int cpu_exec(CPUState *cpu)
                     break;
 #else
                     if (replay_exception()) {
+                        if (qemu_tcg_mttcg_enabled()) {
+                            qemu_mutex_lock_iothread();
+                        }
                         cc->do_interrupt(cpu);
+                        if (qemu_tcg_mttcg_enabled()) {
+                            qemu_mutex_unlock_iothread();
+                        }
                         cpu->exception_index = -1;
                     } else if (!replay_has_interrupt()) {
                         /* give a chance to iothread in replay mode */
@@ -438,6 +640,11 @@ int cpu_exec(CPUState *cpu)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* Interrupt delivery touches device state, which
+                       vCPU threads may only access under the BQL.  */
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_lock_iothread();
+                    }
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -490,6 +697,9 @@ int cpu_exec(CPUState *cpu)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_unlock_iothread();
+                    }
                 }
                 if (unlikely(cpu->exit_request
                              || replay_has_interrupt())) {
@@ -497,26 +707,32 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                tb_lock();
                 tb = tb_find_fast(cpu);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                if (unlikely(tcg_superblocks_enabled)) {
+                    tb = tb_profile(cpu, tb, &next_tb);
                 }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
+                   jump.  The lookup did not hold tb_lock, so check
+                   again for invalidation once we have it.  */
                 if (next_tb != 0 && tb->page_addr[1] == -1
                     && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    tb_lock();
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X
+                       when doing it in tb_find_slow */
+                    if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code,
+                           we must recompute the hash index here */
+                        next_tb = 0;
+                        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                    }
+                    last_tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                    if (next_tb != 0 && !last_tb->invalid && !tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                tb_unlock();
                 if (likely(!cpu->exit_request)) {
                     trace_exec_tb(tb, tb->pc);
                     /* execute the generated code */
@@ -594,6 +810,11 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            /* vCPU threads run guest code without the BQL; drop it if
+               the longjmp came from a section that had taken it.  */
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
+            }
         }
     } /* for(;;) */
 
@@ -25,10 +25,16 @@
 #include "exec/cpu_ldst.h"
 
 #include "exec/cputlb.h"
+#include "exec/tlb-resize.h"
+#include "exec/tb-hash.h"
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -58,46 +64,253 @@
 /* statistics */
 int tlb_flush_count;
 
-/* NOTE:
- * If flush_global is true (the usual case), flush all tlb entries.
- * If flush_global is false, flush (at least) all tlb entries not
- * marked global.
- *
- * Since QEMU doesn't currently implement a global/not-global flag
- * for tlb entries, at the moment tlb_flush() will also flush all
- * tlb entries in the flush_global == false case. This is OK because
- * CPU architectures generally permit an implementation to drop
- * entries from the TLB at any time, so flushing more entries than
- * required is only an efficiency issue, not a correctness issue.
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* A TLB table and its size.  Other threads may walk the table of a vCPU
+ * (see tlb_reset_dirty), so the size is kept together with the entries,
+ * and old tables are only freed after an RCU grace period.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+typedef struct CPUTLBTable {
+    struct rcu_head rcu;
+    size_t n_entries;
+    CPUTLBEntry entries[];
+} CPUTLBTable;
+#endif
+
+/* The state of the TLB of one MMU mode that generated code does not need.
+ * It is kept out of env, because targets clear the CPU_COMMON fields of
+ * env on reset.
+ */
+typedef struct CPUTLBDesc {
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUTLBTable *table;
+    CPUIOTLBEntry *iotlb;
+    /* start of the current resize window, see tlb_mmu_resize */
+    int64_t window_begin_ns;
+    /* maximum of n_used_entries in the current resize window */
+    size_t window_max_entries;
+#endif
+    /* valid entries in the main table */
+    size_t n_used_entries;
+    /* statistics, see qmp_query_tlb_stats */
+    uint64_t fills;
+    uint64_t victim_hits;
+    uint64_t flushes;
+    uint64_t resizes;
+} CPUTLBDesc;
+
+#define ALL_MMUIDX_BITS ((1UL << NB_MMU_MODES) - 1)
+
+/* A flush of the pages from addr to last (both page aligned).  */
+typedef struct TLBFlushRange {
+    target_ulong addr;
+    target_ulong last;
+    unsigned long idxmap;
+} TLBFlushRange;
+
+#define TLB_FLUSH_BATCH_SIZE 32
+
+/* Flushes requested by other threads, see tlb_flush_batch_add.  */
+typedef struct CPUTLBFlushBatch {
+    QemuSpin lock;
+    /* a tlb_flush_batch_work item is pending on the vCPU */
+    bool queued;
+    /* MMU modes to flush entirely */
+    unsigned long full_idxmap;
+    int n_ranges;
+    TLBFlushRange ranges[TLB_FLUSH_BATCH_SIZE];
+} CPUTLBFlushBatch;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+static void tlb_table_free(CPUTLBTable *table)
+{
+    g_free(table);
+}
+
+/* Allocate tables of n_entries for desc, or smaller ones if the host
+ * is short on memory.
+ */
+static void tlb_table_alloc(CPUTLBDesc *desc, size_t n_entries)
+{
+    CPUTLBTable *table;
+    CPUIOTLBEntry *iotlb;
+
+    for (;;) {
+        if (n_entries <= (1 << CPU_TLB_DYN_MIN_BITS)) {
+            table = g_malloc(sizeof(*table) +
+                             n_entries * sizeof(CPUTLBEntry));
+            iotlb = g_new(CPUIOTLBEntry, n_entries);
+            break;
+        }
+        table = g_try_malloc(sizeof(*table) +
+                             n_entries * sizeof(CPUTLBEntry));
+        iotlb = g_try_new(CPUIOTLBEntry, n_entries);
+        if (table && iotlb) {
+            break;
+        }
+        g_free(table);
+        g_free(iotlb);
+        n_entries >>= 1;
+    }
+
+    table->n_entries = n_entries;
+    memset(table->entries, -1, n_entries * sizeof(CPUTLBEntry));
+    if (desc->table) {
+        call_rcu(desc->table, tlb_table_free, rcu);
+    }
+    g_free(desc->iotlb);
+    atomic_rcu_set(&desc->table, table);
+    desc->iotlb = iotlb;
+}
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t now, size_t max_entries)
+{
+    desc->window_begin_ns = now;
+    desc->window_max_entries = max_entries;
+}
+
+static void tlb_mmu_resize(CPUTLBDesc *desc, int64_t now)
+{
+    size_t old_size = desc->table->n_entries;
+    size_t new_size;
+    bool window_expired = now > desc->window_begin_ns + TLB_RESIZE_WINDOW_NS;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    new_size = tlb_resize_policy(old_size, desc->window_max_entries,
+                                 window_expired, 1 << CPU_TLB_DYN_MIN_BITS,
+                                 1 << CPU_TLB_DYN_MAX_BITS);
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    tlb_debug("resize %zu -> %zu\n", old_size, new_size);
+    tlb_table_alloc(desc, new_size);
+    tlb_window_reset(desc, now, 0);
+    desc->resizes++;
+}
+
+/* Make the current tables of desc visible to the generated code.  */
+static void tlb_publish(CPUArchState *env, CPUTLBDesc *desc, int mmu_idx)
+{
+    env->tlb_mask[mmu_idx] =
+        (desc->table->n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    atomic_rcu_set(&env->tlb_table[mmu_idx], desc->table->entries);
+    env->iotlb[mmu_idx] = desc->iotlb;
+}
+
+static size_t tlb_desc_n_entries(CPUTLBDesc *desc)
+{
+    CPUTLBTable *table = atomic_rcu_read(&desc->table);
+
+    return table->n_entries;
+}
+#else
+static size_t tlb_desc_n_entries(CPUTLBDesc *desc)
+{
+    return CPU_TLB_SIZE;
+}
+#endif
+
+void tlb_init(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
-    tlb_debug("(%d)\n", flush_global);
+    cpu->tlb_desc = g_new0(CPUTLBDesc, NB_MMU_MODES);
+    cpu->tlb_flush_batch = g_new0(CPUTLBFlushBatch, 1);
+    qemu_spin_init(&cpu->tlb_flush_batch->lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+
+        tlb_table_alloc(desc, 1 << CPU_TLB_DYN_DEFAULT_BITS);
+        tlb_window_reset(desc, get_clock_realtime(), 0);
+        tlb_publish(env, desc, mmu_idx);
+#else
+        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+#endif
+        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    }
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int mmu_idx;
+
+    if (!cpu->tlb_desc) {
+        return;
+    }
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+
+        call_rcu(desc->table, tlb_table_free, rcu);
+        g_free(desc->iotlb);
+    }
+#endif
+    g_free(cpu->tlb_desc);
+    cpu->tlb_desc = NULL;
+    g_free(cpu->tlb_flush_batch);
+    cpu->tlb_flush_batch = NULL;
+}
+
+/* Flush all the entries of one MMU mode, resizing its table if needed.  */
+static void tlb_flush_one_mmuidx(CPUState *cpu, int mmu_idx, int64_t now)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    tlb_mmu_resize(desc, now);
+    memset(desc->table->entries, -1,
+           desc->table->n_entries * sizeof(CPUTLBEntry));
+    tlb_publish(env, desc, mmu_idx);
+#else
+    memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+#endif
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    desc->n_used_entries = 0;
+    desc->flushes++;
+}
+
+/* With one host thread per vCPU, only the thread running a vCPU may touch
+ * its TLB.  Flushes requested from any other thread are queued on the
+ * target vCPU and performed before it next executes guest code.
+ */
+static inline bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_nocheck(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = get_clock_realtime();
+    int mmu_idx;
 
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(cpu, mmu_idx, now);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
-    tlb_flush_count++;
+    atomic_inc(&tlb_flush_count);
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+static unsigned long tlb_mmuidx_map(va_list argp)
 {
-    CPUArchState *env = cpu->env_ptr;
-
-    tlb_debug("start\n");
-    /* must reset current TB so that interrupts cannot modify the
-       links while we are modifying them */
-    cpu->current_tb = NULL;
+    unsigned long idxmap = 0;
 
     for (;;) {
         int mmu_idx = va_arg(argp, int);
@@ -105,25 +318,73 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
         if (mmu_idx < 0) {
             break;
         }
+        idxmap |= 1UL << mmu_idx;
+    }
+    return idxmap;
+}
+
+static void tlb_flush_by_mmuidx_nocheck(CPUState *cpu, unsigned long idxmap)
+{
+    int64_t now;
+    int mmu_idx;
+
+    if (idxmap == ALL_MMUIDX_BITS) {
+        tlb_flush_nocheck(cpu);
+        return;
+    }
+    now = get_clock_realtime();
+
+    tlb_debug("start\n");
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!test_bit(mmu_idx, &idxmap)) {
+            continue;
+        }
 
         tlb_debug("%d\n", mmu_idx);
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_one_mmuidx(cpu, mmu_idx, now);
     }
 
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 }
 
-void tlb_flush_by_mmuidx(CPUState *cpu, ...)
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *tlb_entry)
 {
-    va_list argp;
-    va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
-    va_end(argp);
+    return tlb_entry->addr_read == -1 && tlb_entry->addr_write == -1 &&
+           tlb_entry->addr_code == -1;
+}
+
+static inline void tlb_n_used_entries_dec(CPUTLBDesc *desc)
+{
+    /* Only entries that were counted can be flushed, but do not let an
+     * accounting mistake turn into a huge count that would grow the TLB.
+     */
+    if (likely(desc->n_used_entries)) {
+        desc->n_used_entries--;
+    }
+}
+
+/* Account for a victim TLB hit, which swapped a victim entry with the
+ * main entry 'old'.  The main slot was maybe empty, and now is in use.
+ * Called from softmmu_template.h.
+ */
+static inline void tlb_victim_hit(CPUArchState *env, int mmu_idx,
+                                  const CPUTLBEntry *old)
+{
+    CPUTLBDesc *desc = &ENV_GET_CPU(env)->tlb_desc[mmu_idx];
+
+    if (tlb_entry_is_empty(old)) {
+        desc->n_used_entries++;
+    }
+    desc->victim_hits++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Return true if the entry was flushed.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -132,93 +393,290 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+/* Return true if tlb_addr is valid and its page is in [addr, last].  */
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong addr,
+                                 target_ulong last)
+{
+    return !(tlb_addr & TLB_INVALID_MASK) &&
+           (tlb_addr & TARGET_PAGE_MASK) - addr <= last - addr;
+}
+
+static inline void tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong addr, target_ulong last)
+{
+    if (tlb_hit_range(tlb_entry->addr_read, addr, last) ||
+        tlb_hit_range(tlb_entry->addr_write, addr, last) ||
+        tlb_hit_range(tlb_entry->addr_code, addr, last)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+    }
+}
+
+/* Flush the pages from addr to last (both page aligned) from the main and
+ * victim TLBs of one MMU mode.  Each page can only be in one slot of the
+ * main table, but once the range has as many pages as the table has
+ * slots, every slot would be looked at anyway and flushing the whole mode
+ * is cheaper.  The victim TLB is scanned once for the whole range.
+ */
+static void tlb_flush_range_one_mmuidx(CPUState *cpu, int mmu_idx,
+                                       target_ulong addr, target_ulong last,
+                                       int64_t now)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+    target_ulong n_pages = ((last - addr) >> TARGET_PAGE_BITS) + 1;
+    target_ulong page;
+    int k;
+
+    if (n_pages >= tlb_desc_n_entries(desc)) {
+        tlb_debug("flushing all of idx %d\n", mmu_idx);
+        tlb_flush_one_mmuidx(cpu, mmu_idx, now);
+        return;
+    }
+    for (page = addr; n_pages--; page += TARGET_PAGE_SIZE) {
+        if (tlb_flush_entry(tlb_entry(env, mmu_idx, page), page)) {
+            tlb_n_used_entries_dec(desc);
+        }
+    }
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][k], addr, last);
+    }
+}
+
+/* Discard the jump cache entries of any TB which might overlap the pages
+ * from addr to last.  Like tb_flush_jmp_cache, but each bucket is cleared
+ * once, and the whole cache at once if the range covers all buckets.
+ */
+static void tlb_flush_jmp_cache_range(CPUState *cpu, target_ulong addr,
+                                      target_ulong last)
+{
+    target_ulong n_pages = ((last - addr) >> TARGET_PAGE_BITS) + 2;
+    target_ulong page;
+
+    if (n_pages >= TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE) {
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        return;
+    }
+    for (page = addr - TARGET_PAGE_SIZE; n_pages--;
+         page += TARGET_PAGE_SIZE) {
+        memset(&cpu->tb_jmp_cache[tb_jmp_cache_hash_page(page)], 0,
+               TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    }
+}
+
+static void tlb_flush_range_nocheck(CPUState *cpu, target_ulong addr,
+                                    target_ulong last, unsigned long idxmap)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
+    int64_t now = get_clock_realtime();
     int mmu_idx;
 
-    tlb_debug("page :" TARGET_FMT_lx "\n", addr);
+    tlb_debug("range " TARGET_FMT_lx "-" TARGET_FMT_lx " idxmap %lx\n",
+              addr, last, idxmap);
 
     /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
+    if ((addr & env->tlb_flush_mask) <= env->tlb_flush_addr &&
+        env->tlb_flush_addr <= (last & env->tlb_flush_mask)) {
         tlb_debug("forcing full flush ("
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu, 1);
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        if (test_bit(mmu_idx, &idxmap)) {
+            tlb_flush_range_one_mmuidx(cpu, mmu_idx, addr, last, now);
+        }
     }
 
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+    tlb_flush_jmp_cache_range(cpu, addr, last);
+}
+
+/* Remote flushes are not queued one by one: they are collected in the
+ * batch of the target vCPU, and a single work item performs everything
+ * that was added to the batch until it runs.  Guest TLB shootdowns send
+ * many single-page flushes to each vCPU in a row; adjacent pages are
+ * merged into one range, and once the batch is full the remaining
+ * requests become full flushes of their MMU modes.
+ */
+static void tlb_flush_batch_work(void *data)
+{
+    CPUState *cpu = data;
+    CPUTLBFlushBatch *batch = cpu->tlb_flush_batch;
+    TLBFlushRange ranges[TLB_FLUSH_BATCH_SIZE];
+    unsigned long full_idxmap;
+    int i, n_ranges;
+
+    qemu_spin_lock(&batch->lock);
+    full_idxmap = batch->full_idxmap;
+    n_ranges = batch->n_ranges;
+    memcpy(ranges, batch->ranges, n_ranges * sizeof(ranges[0]));
+    batch->full_idxmap = 0;
+    batch->n_ranges = 0;
+    batch->queued = false;
+    qemu_spin_unlock(&batch->lock);
+
+    tlb_debug("%d ranges, full idxmap %lx\n", n_ranges, full_idxmap);
+
+    if (full_idxmap) {
+        tlb_flush_by_mmuidx_nocheck(cpu, full_idxmap);
+    }
+    for (i = 0; i < n_ranges; i++) {
+        unsigned long idxmap = ranges[i].idxmap & ~full_idxmap;
+
+        if (idxmap) {
+            tlb_flush_range_nocheck(cpu, ranges[i].addr, ranges[i].last,
+                                    idxmap);
         }
     }
+}
 
-    tb_flush_jmp_cache(cpu, addr);
+/* Queue a flush of the pages from addr to last on a remote vCPU.  A range
+ * that covers the whole address space is a full flush.
+ */
+static void tlb_flush_batch_add(CPUState *cpu, target_ulong addr,
+                                target_ulong last, unsigned long idxmap)
+{
+    CPUTLBFlushBatch *batch = cpu->tlb_flush_batch;
+    TLBFlushRange *prev;
+    bool kick;
+
+    qemu_spin_lock(&batch->lock);
+    prev = batch->n_ranges ? &batch->ranges[batch->n_ranges - 1] : NULL;
+    if (addr == 0 && last == TARGET_PAGE_MASK) {
+        batch->full_idxmap |= idxmap;
+    } else if (prev && prev->idxmap == idxmap &&
+               prev->last + TARGET_PAGE_SIZE == addr) {
+        prev->last = last;
+    } else if (batch->n_ranges < TLB_FLUSH_BATCH_SIZE) {
+        TLBFlushRange *range = &batch->ranges[batch->n_ranges++];
+
+        range->addr = addr;
+        range->last = last;
+        range->idxmap = idxmap;
+    } else {
+        batch->full_idxmap |= idxmap;
+    }
+    kick = !batch->queued;
+    batch->queued = true;
+    qemu_spin_unlock(&batch->lock);
+
+    if (kick) {
+        async_run_on_cpu(cpu, tlb_flush_batch_work, cpu);
+    }
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+/* NOTE:
+ * If flush_global is true (the usual case), flush all tlb entries.
+ * If flush_global is false, flush (at least) all tlb entries not
+ * marked global.
+ *
+ * Since QEMU doesn't currently implement a global/not-global flag
+ * for tlb entries, at the moment tlb_flush() will also flush all
+ * tlb entries in the flush_global == false case. This is OK because
+ * CPU architectures generally permit an implementation to drop
+ * entries from the TLB at any time, so flushing more entries than
+ * required is only an efficiency issue, not a correctness issue.
+ */
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    tlb_debug("(%d)\n", flush_global);
+
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_batch_add(cpu, 0, TARGET_PAGE_MASK, ALL_MMUIDX_BITS);
+    } else {
+        tlb_flush_nocheck(cpu);
+    }
+}
+
+static void tlb_flush_by_mmuidx_map(CPUState *cpu, unsigned long idxmap)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_batch_add(cpu, 0, TARGET_PAGE_MASK, idxmap);
+    } else {
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
+    }
+}
+
+void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
     va_list argp;
+    unsigned long idxmap;
 
-    va_start(argp, addr);
+    va_start(argp, cpu);
+    idxmap = tlb_mmuidx_map(argp);
+    va_end(argp);
 
-    tlb_debug("addr "TARGET_FMT_lx"\n", addr);
+    tlb_flush_by_mmuidx_map(cpu, idxmap);
+}
 
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-        tlb_debug("forced full flush ("
-                  TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-                  env->tlb_flush_addr, env->tlb_flush_mask);
+static void tlb_flush_range_by_mmuidx_map(CPUState *cpu, target_ulong addr,
+                                          target_ulong len,
+                                          unsigned long idxmap)
+{
+    target_ulong last = addr + len - 1;
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+    if (len == 0) {
         return;
     }
-    /* must reset current TB so that interrupts cannot modify the
-       links while we are modifying them */
-    cpu->current_tb = NULL;
-
+    if (last < addr) {
+        /* wraps around the end of the address space */
+        last = -1;
+    }
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    last &= TARGET_PAGE_MASK;
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_batch_add(cpu, addr, last, idxmap);
+    } else {
+        tlb_flush_range_nocheck(cpu, addr, last, idxmap);
+    }
+}
 
-        if (mmu_idx < 0) {
-            break;
-        }
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    tlb_flush_range_by_mmuidx_map(cpu, addr & TARGET_PAGE_MASK,
+                                  TARGET_PAGE_SIZE, ALL_MMUIDX_BITS);
+}
 
-        tlb_debug("idx %d\n", mmu_idx);
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    va_list argp;
+    unsigned long idxmap;
 
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+    va_start(argp, addr);
+    idxmap = tlb_mmuidx_map(argp);
+    va_end(argp);
 
-        /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
-    }
+    tlb_flush_range_by_mmuidx_map(cpu, addr & TARGET_PAGE_MASK,
+                                  TARGET_PAGE_SIZE, idxmap);
+}
+
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    tlb_flush_range_by_mmuidx_map(cpu, addr, len, ALL_MMUIDX_BITS);
+}
+
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, ...)
+{
+    va_list argp;
+    unsigned long idxmap;
+
+    va_start(argp, len);
+    idxmap = tlb_mmuidx_map(argp);
     va_end(argp);
 
-    tb_flush_jmp_cache(cpu, addr);
+    tlb_flush_range_by_mmuidx_map(cpu, addr, len, idxmap);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -236,22 +694,39 @@ void tlb_unprotect_code(ram_addr_t ram_addr)
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
-static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
+static bool tlb_is_dirty_ram(target_ulong addr_write)
 {
-    return (tlbe->addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
+    return (addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
 }
 
+/* This may be called on the TLB of a vCPU that is running concurrently
+ * in another thread, so addr_write is only updated if the entry was not
+ * refilled in the meantime.
+ */
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length)
 {
+#if TARGET_LONG_BITS > HOST_LONG_BITS
     uintptr_t addr;
 
-    if (tlb_is_dirty_ram(tlb_entry)) {
+    if (tlb_is_dirty_ram(tlb_entry->addr_write)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
             tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
+#else
+    target_ulong orig_addr = atomic_read(&tlb_entry->addr_write);
+    uintptr_t addr;
+
+    if (tlb_is_dirty_ram(orig_addr)) {
+        addr = (orig_addr & TARGET_PAGE_MASK) + atomic_read(&tlb_entry->addend);
+        if ((addr - start) < length) {
+            atomic_cmpxchg(&tlb_entry->addr_write, orig_addr,
+                           orig_addr | TLB_NOTDIRTY);
+        }
+    }
+#endif
 }
 
 static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
@@ -273,11 +748,25 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 
     env = cpu->env_ptr;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        unsigned int i;
-
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
-            tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                  start1, length);
+        CPUTLBEntry *table;
+        size_t i, n_entries;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        /* The vCPU may be resizing its TLB; the caller is in an RCU
+         * read-side critical section.  The table is NULL between a reset
+         * of the CPU and the following flush.
+         */
+        table = atomic_rcu_read(&env->tlb_table[mmu_idx]);
+        if (!table) {
+            continue;
+        }
+        n_entries = container_of(table, CPUTLBTable, entries[0])->n_entries;
+#else
+        table = env->tlb_table[mmu_idx];
+        n_entries = CPU_TLB_SIZE;
+#endif
+        for (i = 0; i < n_entries; i++) {
+            tlb_reset_dirty_range(&table[i], start1, length);
         }
 
         for (i = 0; i < CPU_VTLB_SIZE; i++) {
@@ -299,13 +788,11 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -351,6 +838,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
                              int mmu_idx, target_ulong size)
 {
     CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
     MemoryRegionSection *section;
     unsigned int index;
     target_ulong address;
@@ -388,12 +876,16 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    if (tlb_entry_is_empty(te)) {
+        desc->n_used_entries++;
+    }
+    desc->fills++;
 
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
@@ -451,11 +943,13 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     CPUState *cpu = ENV_GET_CPU(env1);
     CPUIOTLBEntry *iotlbentry;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        /* the fill may have flushed and resized the TLB */
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     iotlbentry = &env1->iotlb[mmu_idx][page_index];
     pd = iotlbentry->addr & ~TARGET_PAGE_MASK;
@@ -474,6 +968,48 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+TLBStatsList *qmp_query_tlb_stats(Error **errp)
+{
+    TLBStatsList *head = NULL, **tail = &head;
+    CPUState *cpu;
+    int mmu_idx;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "TLB statistics are only available with TCG");
+        return NULL;
+    }
+
+    /* The counters are updated by the vCPU threads without locks, so the
+     * values may be slightly stale.
+     */
+    rcu_read_lock();
+    CPU_FOREACH(cpu) {
+        if (!cpu->tlb_desc) {
+            continue;
+        }
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+            TLBStatsList *entry = g_new0(TLBStatsList, 1);
+            TLBStats *stats = g_new0(TLBStats, 1);
+
+            stats->cpu_index = cpu->cpu_index;
+            stats->mmu_index = mmu_idx;
+            stats->size = tlb_desc_n_entries(desc);
+            stats->used = atomic_read(&desc->n_used_entries);
+            stats->fills = desc->fills;
+            stats->victim_hits = desc->victim_hits;
+            stats->flushes = desc->flushes;
+            stats->resizes = desc->resizes;
+
+            entry->value = stats;
+            *tail = entry;
+            tail = &entry->next;
+        }
+    }
+    rcu_read_unlock();
+    return head;
+}
+
 #define MMUSUFFIX _mmu
 
 #define SHIFT 0
@@ -84,6 +84,9 @@ this code that are retained.
  */
 #include "qemu/osdep.h"
 
+#include <math.h>
+#include <float.h>
+
 #include "fpu/softfloat.h"
 
 /* We only need stdlib for abort() */
@@ -2158,13 +2161,216 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  Most operations have normal inputs and use the
+| default rounding mode, and then the host FPU gives the same result as the
+| code below, much faster.  The result of the host is only used when its
+| exception flags are known without reading back the host flags, which costs
+| more than the operation itself: the sticky inexact flag must already be
+| set, an infinite result is an overflow, and the result must not be tiny,
+| because those results depend on the tininess detection and flush-to-zero
+| settings of the target.  Anything else is done in software.
+| This needs IEEE single and double precision host types without excess
+| precision, and is not possible with -ffast-math.
+*----------------------------------------------------------------------------*/
+#if defined(__FAST_MATH__) || !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD != 0
+# define QEMU_NO_HARDFLOAT 1
+#else
+# define QEMU_NO_HARDFLOAT 0
+#endif
+
+bool float_host_fpu_enabled = true;
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+typedef bool (*f32_check_fn)(float32 a, float32 b);
+typedef bool (*f64_check_fn)(float64 a, float64 b);
+
+typedef float (*hard_f32_op2_fn)(float a, float b);
+typedef double (*hard_f64_op2_fn)(double a, double b);
+typedef float32 (*soft_f32_op2_fn)(float32 a, float32 b, float_status *s);
+typedef float64 (*soft_f64_op2_fn)(float64 a, float64 b, float_status *s);
+
+static inline bool can_use_fpu(const float_status *s)
+{
+    return !QEMU_NO_HARDFLOAT && likely(float_host_fpu_enabled &&
+        (s->float_exception_flags & float_flag_inexact) &&
+        s->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool f32_is_zon2(float32 a, float32 b)
+{
+    return float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b);
+}
+
+static inline bool f64_is_zon2(float64 a, float64 b)
+{
+    return float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b);
+}
+
+static inline bool f32_div_pre(float32 a, float32 b)
+{
+    return float32_is_zero_or_normal(a) && float32_is_normal(b);
+}
+
+static inline bool f64_div_pre(float64 a, float64 b)
+{
+    return float64_is_zero_or_normal(a) && float64_is_normal(b);
+}
+
+static inline bool f32_sqrt_pre(float32 a, float32 unused)
+{
+    return float32_is_zero_or_normal(a) && !float32_is_neg(a);
+}
+
+static inline bool f64_sqrt_pre(float64 a, float64 unused)
+{
+    return float64_is_zero_or_normal(a) && !float64_is_neg(a);
+}
+
+static inline float hard_f32_add(float a, float b)
+{
+    return a + b;
+}
+
+static inline float hard_f32_sub(float a, float b)
+{
+    return a - b;
+}
+
+static inline float hard_f32_mul(float a, float b)
+{
+    return a * b;
+}
+
+static inline float hard_f32_div(float a, float b)
+{
+    return a / b;
+}
+
+static inline float hard_f32_sqrt(float a, float unused)
+{
+    return __builtin_sqrtf(a);
+}
+
+static inline double hard_f64_add(double a, double b)
+{
+    return a + b;
+}
+
+static inline double hard_f64_sub(double a, double b)
+{
+    return a - b;
+}
+
+static inline double hard_f64_mul(double a, double b)
+{
+    return a * b;
+}
+
+static inline double hard_f64_div(double a, double b)
+{
+    return a / b;
+}
+
+static inline double hard_f64_sqrt(double a, double unused)
+{
+    return __builtin_sqrt(a);
+}
+
+static inline float32 float32_gen2(float32 xa, float32 xb, float_status *s,
+                                   hard_f32_op2_fn hard, soft_f32_op2_fn soft,
+                                   f32_check_fn pre)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(s) || !pre(xa, xb)) {
+        goto soft;
+    }
+    ua.s = xa;
+    ub.s = xb;
+    ur.h = hard(ua.h, ub.h);
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow | float_flag_inexact, s);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft(xa, xb, s);
+}
+
+static inline float64 float64_gen2(float64 xa, float64 xb, float_status *s,
+                                   hard_f64_op2_fn hard, soft_f64_op2_fn soft,
+                                   f64_check_fn pre)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(s) || !pre(xa, xb)) {
+        goto soft;
+    }
+    ua.s = xa;
+    ub.s = xb;
+    ur.h = hard(ua.h, ub.h);
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow | float_flag_inexact, s);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft(xa, xb, s);
+}
+
+static inline float32 float32_gen1(float32 xa, float_status *s,
+                                   hard_f32_op2_fn hard,
+                                   float32 (*soft)(float32, float_status *),
+                                   f32_check_fn pre)
+{
+    union_float32 ua, ur;
+
+    if (!can_use_fpu(s) || !pre(xa, xa)) {
+        return soft(xa, s);
+    }
+    ua.s = xa;
+    ur.h = hard(ua.h, ua.h);
+    /* the square root of a zero or normal number cannot be tiny */
+    return ur.s;
+}
+
+static inline float64 float64_gen1(float64 xa, float_status *s,
+                                   hard_f64_op2_fn hard,
+                                   float64 (*soft)(float64, float_status *),
+                                   f64_check_fn pre)
+{
+    union_float64 ua, ur;
+
+    if (!can_use_fpu(s) || !pre(xa, xa)) {
+        return soft(xa, s);
+    }
+    ua.s = xa;
+    ur.h = hard(ua.h, ua.h);
+    return ur.s;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2181,13 +2387,20 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_add(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_add, soft_float32_add,
+                        f32_is_zon2);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of subtracting the single-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2204,13 +2417,20 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_sub(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_sub, soft_float32_sub,
+                        f32_is_zon2);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of multiplying the single-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2269,13 +2489,20 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_mul(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_mul, soft_float32_mul,
+                        f32_is_zon2);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of dividing the single-precision floating-point value `a'
 | by the corresponding value `b'.  The operation is performed according to the
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2339,6 +2566,12 @@ float32 float32_div(float32 a, float32 b, float_status *status)
 
 }
 
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, hard_f32_div, soft_float32_div,
+                        f32_div_pre);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the single-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
@@ -2673,7 +2906,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt(float32 a, float_status *status)
+static float32 soft_float32_sqrt(float32 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -2724,6 +2957,12 @@ float32 float32_sqrt(float32 a, float_status *status)
 
 }
 
+float32 float32_sqrt(float32 a, float_status *status)
+{
+    return float32_gen1(a, status, hard_f32_sqrt, soft_float32_sqrt,
+                        f32_sqrt_pre);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary exponential of the single-precision floating-point value
 | `a'. The operation is performed according to the IEC/IEEE Standard for
@@ -3955,7 +4194,8 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3972,13 +4212,20 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_add(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_add, soft_float64_add,
+                        f64_is_zon2);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of subtracting the double-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3995,13 +4242,20 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_sub(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_sub, soft_float64_sub,
+                        f64_is_zon2);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of multiplying the double-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4058,13 +4312,20 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_mul(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_mul, soft_float64_mul,
+                        f64_is_zon2);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of dividing the double-precision floating-point value `a'
 | by the corresponding value `b'.  The operation is performed according to
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4136,6 +4397,12 @@ float64 float64_div(float64 a, float64 b, float_status *status)
 
 }
 
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, hard_f64_div, soft_float64_div,
+                        f64_div_pre);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the double-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
@@ -4477,7 +4744,7 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt(float64 a, float_status *status)
+static float64 soft_float64_sqrt(float64 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -4525,6 +4792,12 @@ float64 float64_sqrt(float64 a, float_status *status)
 
 }
 
+float64 float64_sqrt(float64 a, float_status *status)
+{
+    return float64_gen1(a, status, hard_f64_sqrt, soft_float64_sqrt,
+                        f64_sqrt_pre);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary log of the double-precision floating-point value `a'.
 | The operation is performed according to the IEC/IEEE Standard for Binary
@@ -572,6 +572,21 @@ STEXI
 @item info migrate_cache_size
 @findex migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of calc_dirty_rate",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the guest dirty rate measured by calc_dirty_rate, for each vCPU (with
+TCG) and for each RAM block.
 ETEXI
 
     {
@@ -712,6 +727,21 @@ STEXI
 @item info iothreads
 @findex iothreads
 Show iothread's identifiers.
+ETEXI
+
+    {
+        .name       = "tlb-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show software TLB statistics",
+        .mhandler.cmd = hmp_info_tlb_stats,
+    },
+
+STEXI
+@item info tlb-stats
+@findex tlb-stats
+Show the size, the number of fills and flushes, and the victim TLB hits
+of the software TLB of each MMU mode of each virtual CPU.
 ETEXI
 
     {
@@ -960,6 +960,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l",
+        .params     = "second",
+        .help       = "start measuring the guest dirty rate for 'second' "
+                      "seconds, see 'info dirty_rate'",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second}
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties its memory, for
+@var{second} seconds.
 ETEXI
 
     {
@@ -233,6 +233,21 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle encoding rate: %0.2f\n",
+                       info->xbzrle_cache->encoding_rate);
+    }
+
+    if (info->has_compression) {
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+        monitor_printf(mon, "compression throughput: %0.2f mbps\n",
+                       info->compression->throughput * 8 / 1000000);
+        monitor_printf(mon, "compression level: %" PRId64 "\n",
+                       info->compression->level);
     }
 
     if (info->has_x_cpu_throttle_percentage) {
@@ -286,6 +301,9 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
         monitor_printf(mon, "\n");
     }
 
@@ -298,6 +316,34 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateVcpuList *vcpu;
+    DirtyRateBlockList *block;
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->has_calc_time) {
+        monitor_printf(mon, "Calculation time: %" PRId64 " seconds\n",
+                       info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+    for (vcpu = info->vcpu_dirty_rate; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  CPU #%" PRId64 ": %" PRId64 " MB/s\n",
+                       vcpu->value->id, vcpu->value->dirty_rate);
+    }
+    for (block = info->block_dirty_rate; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " MB/s\n",
+                       block->value->id, block->value->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1196,6 +1242,20 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, &err);
+    if (err) {
+        error_report_err(err);
+        return;
+    }
+    monitor_printf(mon, "Measuring the dirty rate for %" PRId64 " seconds, "
+                   "see 'info dirty_rate'\n", sec);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1242,6 +1302,7 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_multifd_channels = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER__MAX; i++) {
@@ -1262,12 +1323,16 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_multifd_channels, value,
                                        &err);
             break;
         }
@@ -2008,13 +2073,47 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        monitor_printf(mon, "%s:\n", info->value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n",
+                       info->value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n",
+                       info->value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n",
+                       info->value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n",
+                       info->value->poll_shrink);
     }
 
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_tlb_stats(Monitor *mon, const QDict *qdict)
+{
+    TLBStatsList *stats_list, *stats;
+    Error *err = NULL;
+
+    stats_list = qmp_query_tlb_stats(&err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "%4s %4s %8s %8s %12s %12s %8s %8s\n",
+                   "cpu", "mmu", "size", "used", "fills", "victim-hits",
+                   "flushes", "resizes");
+    for (stats = stats_list; stats; stats = stats->next) {
+        TLBStats *s = stats->value;
+
+        monitor_printf(mon, "%4" PRId64 " %4" PRId64 " %8" PRId64
+                       " %8" PRId64 " %12" PRId64 " %12" PRId64
+                       " %8" PRId64 " %8" PRId64 "\n",
+                       s->cpu_index, s->mmu_index, s->size, s->used,
+                       s->fills, s->victim_hits, s->flushes, s->resizes);
+    }
+
+    qapi_free_TLBStatsList(stats_list);
+}
+
 void hmp_qom_list(Monitor *mon, const QDict *qdict)
 {
     const char *path = qdict_get_try_str(qdict, "path");
@@ -26,6 +26,15 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+typedef struct VirtIOBlockDataPlaneVQ {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;                  /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    QEMUBH *bh;                     /* bh for guest notification */
+    IOThread *iothread;             /* iothread from the mapping */
+    AioContext *ctx;                /* context serving the virtqueue */
+} VirtIOBlockDataPlaneVQ;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
@@ -33,9 +42,8 @@ struct VirtIOBlockDataPlane {
     VirtIOBlkConf *conf;
 
     VirtIODevice *vdev;
-    VirtQueue *vq;                  /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
-    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned num_queues;
+    VirtIOBlockDataPlaneVQ *vqs;
 
     Notifier insert_notifier, remove_notifier;
 
@@ -44,28 +52,38 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext *ctx;                /* home context of the BlockBackend */
+
+    /* Whether the other iothreads were added as queue contexts */
+    bool multiqueue;
 
     /* Operation blocker on BDS */
     Error *blocker;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s)
+void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    qemu_bh_schedule(s->vqs[virtio_get_queue_index(vq)].bh);
+}
+
+AioContext *virtio_blk_data_plane_get_aio_context(VirtIOBlockDataPlane *s,
+                                                  VirtQueue *vq)
 {
-    qemu_bh_schedule(s->bh);
+    return s->vqs[virtio_get_queue_index(vq)].ctx;
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneVQ *dvq = opaque;
 
-    if (!virtio_should_notify(s->vdev, s->vq)) {
+    if (!virtio_should_notify(dvq->s->vdev, dvq->vq)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(dvq->guest_notifier);
 }
 
 static void data_plane_set_up_op_blockers(VirtIOBlockDataPlane *s)
@@ -74,6 +92,13 @@ static void data_plane_set_up_op_blockers(VirtIOBlockDataPlane *s)
     error_setg(&s->blocker, "block device is in use by data plane");
     blk_op_block_all(s->conf->conf.blk, s->blocker);
     blk_op_unblock(s->conf->conf.blk, BLOCK_OP_TYPE_RESIZE, s->blocker);
+
+    /* Several iothreads submit requests to the same BlockDriverState, which
+     * the block layer only supports as long as the graph does not change.
+     */
+    if (s->num_iothreads > 1) {
+        return;
+    }
     blk_op_unblock(s->conf->conf.blk, BLOCK_OP_TYPE_DRIVE_DEL, s->blocker);
     blk_op_unblock(s->conf->conf.blk, BLOCK_OP_TYPE_BACKUP_SOURCE, s->blocker);
     blk_op_unblock(s->conf->conf.blk, BLOCK_OP_TYPE_CHANGE, s->blocker);
@@ -116,6 +141,84 @@ static void data_plane_blk_remove_notifier(Notifier *n, void *data)
     data_plane_remove_op_blockers(s);
 }
 
+/* Resolve the iothreads that serve the virtqueues.  Virtqueue i is served by
+ * the (i % n)th iothread of the "iothread-vq-mapping" list; the first one is
+ * the home context of the BlockBackend.
+ */
+static bool data_plane_resolve_iothreads(VirtIOBlockDataPlane *s,
+                                         Error **errp)
+{
+    VirtIOBlkConf *conf = s->conf;
+    char **ids;
+    unsigned i, j, n;
+
+    if (!conf->iothread_vq_mapping) {
+        s->iothreads = g_new(IOThread *, 1);
+        s->iothreads[0] = conf->iothread;
+        object_ref(OBJECT(conf->iothread));
+        s->num_iothreads = 1;
+        for (i = 0; i < s->num_queues; i++) {
+            s->vqs[i].iothread = conf->iothread;
+        }
+        return true;
+    }
+
+    ids = g_strsplit(conf->iothread_vq_mapping, ":", -1);
+    n = g_strv_length(ids);
+    if (n == 0) {
+        error_setg(errp, "iothread-vq-mapping must list at least one "
+                   "iothread");
+        g_strfreev(ids);
+        return false;
+    }
+
+    s->iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+        IOThread *iothread;
+
+        obj = obj ? object_dynamic_cast(obj, TYPE_IOTHREAD) : NULL;
+        if (!obj) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            g_strfreev(ids);
+            return false;
+        }
+        iothread = IOTHREAD(obj);
+
+        for (j = 0; j < s->num_iothreads; j++) {
+            if (s->iothreads[j] == iothread) {
+                break;
+            }
+        }
+        if (j == s->num_iothreads) {
+            object_ref(obj);
+            s->iothreads[s->num_iothreads++] = iothread;
+        }
+        if (i < s->num_queues) {
+            s->vqs[i].iothread = iothread;
+        }
+    }
+    for (i = n; i < s->num_queues; i++) {
+        s->vqs[i].iothread = s->vqs[i % n].iothread;
+    }
+
+    g_strfreev(ids);
+    return true;
+}
+
+static void data_plane_free(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->vqs);
+    g_free(s);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -124,10 +227,17 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (!conf->iothread) {
+    if (!conf->iothread && !conf->iothread_vq_mapping) {
+        return;
+    }
+
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties "
+                   "cannot be set at the same time");
         return;
     }
 
@@ -150,13 +260,19 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->num_queues = conf->num_queues;
+    s->vqs = g_new0(VirtIOBlockDataPlaneVQ, s->num_queues);
+
+    if (!data_plane_resolve_iothreads(s, errp)) {
+        data_plane_free(s);
+        return;
+    }
+    s->ctx = iothread_get_aio_context(s->iothreads[0]);
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_queues; i++) {
+        s->vqs[i].s = s;
+        s->vqs[i].vq = virtio_get_queue(vdev, i);
     }
-    s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
 
     s->insert_notifier.notify = data_plane_blk_insert_notifier;
     s->remove_notifier.notify = data_plane_blk_remove_notifier;
@@ -179,9 +295,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     data_plane_remove_op_blockers(s);
     notifier_remove(&s->insert_notifier);
     notifier_remove(&s->remove_notifier);
-    qemu_bh_delete(s->bh);
-    object_unref(OBJECT(s->iothread));
-    g_free(s);
+    data_plane_free(s);
 }
 
 static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
@@ -195,12 +309,69 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     virtio_blk_handle_vq(s, vq);
 }
 
+/* Let the iothreads other than the home one submit requests directly, or
+ * serve all virtqueues from the home context if the BlockDriverState cannot
+ * be accessed from several threads.
+ *
+ * Context: QEMU global mutex held
+ */
+static void data_plane_add_queue_contexts(VirtIOBlockDataPlane *s)
+{
+    BlockBackend *blk = s->conf->conf.blk;
+    unsigned i;
+
+    s->multiqueue = false;
+    if (s->num_iothreads > 1) {
+        if (blk_supports_multiqueue(blk)) {
+            s->multiqueue = true;
+        } else {
+            char *id = object_get_canonical_path_component(
+                           OBJECT(s->iothreads[0]));
+
+            error_report("virtio-blk: block device does not support "
+                         "multiple iothreads, using iothread '%s' for all "
+                         "virtqueues", id);
+            g_free(id);
+        }
+    }
+
+    aio_context_acquire(s->ctx);
+    for (i = 1; s->multiqueue && i < s->num_iothreads; i++) {
+        blk_add_queue_context(blk, iothread_get_aio_context(s->iothreads[i]));
+    }
+    aio_context_release(s->ctx);
+
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneVQ *dvq = &s->vqs[i];
+
+        dvq->ctx = s->multiqueue ? iothread_get_aio_context(dvq->iothread)
+                                 : s->ctx;
+        dvq->bh = aio_bh_new(dvq->ctx, notify_guest_bh, dvq);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void data_plane_remove_queue_contexts(VirtIOBlockDataPlane *s)
+{
+    BlockBackend *blk = s->conf->conf.blk;
+    unsigned i;
+
+    aio_context_acquire(s->ctx);
+    for (i = 1; s->multiqueue && i < s->num_iothreads; i++) {
+        blk_remove_queue_context(blk,
+                                 iothread_get_aio_context(s->iothreads[i]));
+    }
+    aio_context_release(s->ctx);
+    s->multiqueue = false;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned i, nvqs = s->num_queues;
     int r;
 
     if (vblk->dataplane_started || s->starting) {
@@ -208,22 +379,30 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     }
 
     s->starting = true;
-    s->vq = virtio_get_queue(s->vdev, 0);
 
     /* Set up guest notifier (irq) */
-    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
     if (r != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier (%d), "
                 "ensure -enable-kvm is set\n", r);
         goto fail_guest_notifiers;
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(s->vq);
+    for (i = 0; i < nvqs; i++) {
+        s->vqs[i].guest_notifier =
+            virtio_queue_get_guest_notifier(s->vqs[i].vq);
+    }
 
     /* Set up virtqueue notify */
-    r = k->set_host_notifier(qbus->parent, 0, true);
-    if (r != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n", r);
-        goto fail_host_notifier;
+    for (i = 0; i < nvqs; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n",
+                    r);
+            while (i--) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            goto fail_host_notifier;
+        }
     }
 
     s->starting = false;
@@ -231,19 +410,26 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     trace_virtio_blk_data_plane_start(s);
 
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
+    data_plane_add_queue_contexts(s);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(s->vq));
+    for (i = 0; i < nvqs; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(s->vqs[i].vq));
+    }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
-    virtio_queue_aio_set_host_notifier_handler(s->vq, s->ctx,
-                                               virtio_blk_data_plane_handle_output);
-    aio_context_release(s->ctx);
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockDataPlaneVQ *dvq = &s->vqs[i];
+
+        aio_context_acquire(dvq->ctx);
+        virtio_queue_aio_set_host_notifier_handler(dvq->vq, dvq->ctx,
+                                    virtio_blk_data_plane_handle_output);
+        aio_context_release(dvq->ctx);
+    }
     return;
 
   fail_host_notifier:
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
   fail_guest_notifiers:
     vblk->dataplane_disabled = true;
     s->starting = false;
@@ -256,6 +442,7 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned i, nvqs = s->num_queues;
 
     if (!vblk->dataplane_started || s->stopping) {
         return;
@@ -270,20 +457,39 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
-    virtio_queue_aio_set_host_notifier_handler(s->vq, s->ctx, NULL);
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockDataPlaneVQ *dvq = &s->vqs[i];
+
+        aio_context_acquire(dvq->ctx);
+        virtio_queue_aio_set_host_notifier_handler(dvq->vq, dvq->ctx, NULL);
+        aio_context_release(dvq->ctx);
+    }
+
+    /* Wait for the requests submitted by the other iothreads */
+    data_plane_remove_queue_contexts(s);
+
+    aio_context_acquire(s->ctx);
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    k->set_host_notifier(qbus->parent, 0, false);
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockDataPlaneVQ *dvq = &s->vqs[i];
+
+        /* Deliver a notification that may still be pending */
+        qemu_bh_delete(dvq->bh);
+        dvq->bh = NULL;
+        notify_guest_bh(dvq);
+        dvq->ctx = NULL;
+
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
     /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
 
     vblk->dataplane_started = false;
     s->stopping = false;
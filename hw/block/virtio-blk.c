@@ -28,10 +28,13 @@
 #endif
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
+#include "exec/address-spaces.h"
 
-void virtio_blk_init_request(VirtIOBlock *s, VirtIOBlockReq *req)
+void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
+                             VirtIOBlockReq *req)
 {
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->in_len = 0;
     req->next = NULL;
@@ -53,14 +56,28 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->in_len);
+    virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane);
+        virtio_blk_data_plane_notify(s->dataplane, req->vq);
     } else {
-        virtio_notify(vdev, s->vq);
+        virtio_notify(vdev, req->vq);
     }
 }
 
+/* Requests from different virtqueues may fail concurrently when the device
+ * is served by several iothreads, so the list is updated atomically.
+ */
+static void virtio_blk_push_failed_request(VirtIOBlock *s,
+                                           VirtIOBlockReq *req)
+{
+    VirtIOBlockReq *old;
+
+    do {
+        old = atomic_read(&s->rq);
+        req->next = old;
+    } while (atomic_cmpxchg(&s->rq, old, req) != old);
+}
+
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     bool is_read)
 {
@@ -72,8 +89,7 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         /* Break the link as the next request is going to be parsed from the
          * ring again. Otherwise we may end up doing a double completion! */
         req->mr_next = NULL;
-        req->next = s->rq;
-        s->rq = req;
+        virtio_blk_push_failed_request(s, req);
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         block_acct_failed(blk_get_stats(s->blk), &req->acct);
@@ -187,12 +203,12 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtqueue_pop(s->vq, sizeof(VirtIOBlockReq));
+    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
 
     if (req) {
-        virtio_blk_init_request(s, req);
+        virtio_blk_init_request(s, vq, req);
     }
     return req;
 }
@@ -585,7 +601,7 @@ void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s))) {
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
@@ -612,16 +628,21 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     virtio_blk_handle_vq(s, vq);
 }
 
+typedef struct VirtIOBlockRestart {
+    VirtIOBlock *s;
+    VirtIOBlockReq *rq, *last;
+    QEMUBH *bh;
+} VirtIOBlockRestart;
+
 static void virtio_blk_dma_restart_bh(void *opaque)
 {
-    VirtIOBlock *s = opaque;
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockRestart *restart = opaque;
+    VirtIOBlock *s = restart->s;
+    VirtIOBlockReq *req = restart->rq;
     MultiReqBuffer mrb = {};
 
-    qemu_bh_delete(s->bh);
-    s->bh = NULL;
-
-    s->rq = NULL;
+    qemu_bh_delete(restart->bh);
+    g_free(restart);
 
     while (req) {
         VirtIOBlockReq *next = req->next;
@@ -634,20 +655,67 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     }
 }
 
+/* Failed requests are resubmitted from the AioContext that serves their
+ * virtqueue, since completing them pushes to that virtqueue.
+ */
+static AioContext *virtio_blk_get_vq_aio_context(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane && s->dataplane_started && !s->dataplane_disabled) {
+        return virtio_blk_data_plane_get_aio_context(s->dataplane, vq);
+    }
+    return blk_get_aio_context(s->conf.conf.blk);
+}
+
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
                                       RunState state)
 {
     VirtIOBlock *s = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOBlockRestart **restarts;
+    VirtIOBlockReq *req;
+    unsigned i, nvqs = s->conf.num_queues;
 
     if (!running) {
         return;
     }
 
-    if (!s->bh) {
-        s->bh = aio_bh_new(blk_get_aio_context(s->conf.conf.blk),
-                           virtio_blk_dma_restart_bh, s);
-        qemu_bh_schedule(s->bh);
+    req = atomic_xchg(&s->rq, NULL);
+    if (!req) {
+        return;
+    }
+
+    /* Split the list by virtqueue, keeping the order within each queue */
+    restarts = g_new0(VirtIOBlockRestart *, nvqs);
+    while (req) {
+        VirtIOBlockReq *next = req->next;
+        VirtIOBlockRestart *restart;
+
+        i = virtio_get_queue_index(req->vq);
+        restart = restarts[i];
+        if (!restart) {
+            restart = restarts[i] = g_new0(VirtIOBlockRestart, 1);
+            restart->s = s;
+            restart->rq = req;
+        } else {
+            restart->last->next = req;
+        }
+        restart->last = req;
+        req->next = NULL;
+        req = next;
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockRestart *restart = restarts[i];
+        AioContext *ctx;
+
+        if (!restart) {
+            continue;
+        }
+        ctx = virtio_blk_get_vq_aio_context(s, virtio_get_queue(vdev, i));
+        restart->bh = aio_bh_new(ctx, virtio_blk_dma_restart_bh, restart);
+        qemu_bh_schedule(restart->bh);
     }
+    g_free(restarts);
 }
 
 static void virtio_blk_reset(VirtIODevice *vdev)
@@ -710,6 +778,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = blk_enable_write_cache(s->blk);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
     memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
 }
 
@@ -734,6 +803,9 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     virtio_add_feature(&features, VIRTIO_BLK_F_GEOMETRY);
     virtio_add_feature(&features, VIRTIO_BLK_F_TOPOLOGY);
     virtio_add_feature(&features, VIRTIO_BLK_F_BLK_SIZE);
+    if (s->conf.num_queues > 1) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
+    }
     if (virtio_has_feature(features, VIRTIO_F_VERSION_1)) {
         if (s->conf.scsi) {
             error_setg(errp, "Please set scsi=off for virtio-blk devices in order to use virtio 1.0");
@@ -813,6 +885,11 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
+
+        if (s->conf.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
+
         qemu_put_virtqueue_element(f, &req->elem);
         req = req->next;
     }
@@ -836,9 +913,22 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
+        unsigned nvqs = s->conf.num_queues;
+        unsigned vq_idx = 0;
         VirtIOBlockReq *req;
+
+        if (nvqs > 1) {
+            vq_idx = qemu_get_be32(f);
+
+            if (vq_idx >= nvqs) {
+                error_report("Invalid virtqueue index in request list: %#x",
+                             vq_idx);
+                return -EINVAL;
+            }
+        }
+
         req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
-        virtio_blk_init_request(s, req);
+        virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
         req->next = s->rq;
         s->rq = req;
     }
@@ -857,6 +947,68 @@ static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
 };
 
+/* Smaller sections, such as the ones switched by the PAM registers, are
+ * not worth pinning and would renumber the registered buffers often.
+ */
+#define VIRTIO_BLK_MIN_RAM_BUF (1 << 20)
+
+/* Requests point into guest RAM, so let the block layer map it once.
+ * ROMs and video memory (which has dirty logging for the display) are
+ * left out.
+ */
+static bool virtio_blk_ram_section(MemoryRegionSection *section)
+{
+    return memory_region_is_ram(section->mr) &&
+           !memory_region_is_rom(section->mr) &&
+           !(memory_region_get_dirty_log_mask(section->mr) &
+             (1 << DIRTY_MEMORY_VGA)) &&
+           int128_ge(section->size, int128_make64(VIRTIO_BLK_MIN_RAM_BUF));
+}
+
+static struct iovec virtio_blk_ram_buf(MemoryRegionSection *section)
+{
+    return (struct iovec) {
+        .iov_base = memory_region_get_ram_ptr(section->mr) +
+                    section->offset_within_region,
+        .iov_len = int128_get64(section->size),
+    };
+}
+
+static void virtio_blk_ram_region_add(MemoryListener *listener,
+                                      MemoryRegionSection *section)
+{
+    VirtIOBlock *s = container_of(listener, VirtIOBlock, ram_listener);
+    struct iovec buf;
+
+    if (!virtio_blk_ram_section(section)) {
+        return;
+    }
+    buf = virtio_blk_ram_buf(section);
+    g_array_append_val(s->ram_bufs, buf);
+    blk_register_buf(s->blk, buf.iov_base, buf.iov_len);
+}
+
+static void virtio_blk_ram_region_del(MemoryListener *listener,
+                                      MemoryRegionSection *section)
+{
+    VirtIOBlock *s = container_of(listener, VirtIOBlock, ram_listener);
+    struct iovec buf;
+    int i;
+
+    if (!virtio_blk_ram_section(section)) {
+        return;
+    }
+    buf = virtio_blk_ram_buf(section);
+    for (i = 0; i < s->ram_bufs->len; i++) {
+        if (g_array_index(s->ram_bufs, struct iovec, i).iov_base ==
+            buf.iov_base) {
+            g_array_remove_index_fast(s->ram_bufs, i);
+            blk_unregister_buf(s->blk, buf.iov_base, buf.iov_len);
+            break;
+        }
+    }
+}
+
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -864,6 +1016,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     VirtIOBlkConf *conf = &s->conf;
     Error *err = NULL;
     static int virtio_blk_id;
+    unsigned i;
 
     if (!conf->conf.blk) {
         error_setg(errp, "drive property not set");
@@ -883,6 +1036,12 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     }
     blkconf_blocksizes(&conf->conf);
 
+    if (!conf->num_queues || conf->num_queues > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "num-queues property must be larger than 0 "
+                   "and at most %d", VIRTIO_QUEUE_MAX);
+        return;
+    }
+
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
                 sizeof(struct virtio_blk_config));
 
@@ -890,7 +1049,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
@@ -905,12 +1066,28 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
 
     blk_iostatus_enable(s->blk);
+
+    s->ram_bufs = g_array_new(false, false, sizeof(struct iovec));
+    s->ram_listener = (MemoryListener) {
+        .region_add = virtio_blk_ram_region_add,
+        .region_del = virtio_blk_ram_region_del,
+    };
+    memory_listener_register(&s->ram_listener, &address_space_memory);
 }
 
 static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
+    int i;
+
+    memory_listener_unregister(&s->ram_listener);
+    for (i = 0; i < s->ram_bufs->len; i++) {
+        struct iovec *buf = &g_array_index(s->ram_bufs, struct iovec, i);
+
+        blk_unregister_buf(s->blk, buf->iov_base, buf->iov_len);
+    }
+    g_array_free(s->ram_bufs, true);
 
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
@@ -943,6 +1120,9 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_STRING("iothread-vq-mapping", VirtIOBlock,
+                       conf.iothread_vq_mapping),
     DEFINE_PROP_END_OF_LIST(),
 };
 
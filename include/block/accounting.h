@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qemu/thread.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -43,6 +44,10 @@ struct BlockAcctTimedStats {
 };
 
 typedef struct BlockAcctStats {
+    /* Requests can complete in several AioContexts at once, see
+     * bdrv_add_queue_context(); this protects the counters below.
+     */
+    QemuSpin lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
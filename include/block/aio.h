@@ -46,6 +46,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -116,6 +117,12 @@ struct AioContext {
     /* Scheduling this BH forces the event loop it iterate */
     QEMUBH *notify_dummy_bh;
 
+    /* Coroutines that other threads asked to run in this AioContext, see
+     * aio_co_schedule(), and the BH that enters them.
+     */
+    QSLIST_HEAD(, Coroutine) scheduled_coroutines;
+    QEMUBH *co_schedule_bh;
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
@@ -128,6 +135,15 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Number of AioHandlers without .io_poll() */
+    int poll_disable_cnt;
+
+    /* Polling mode parameters */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
 };
 
 /**
@@ -307,12 +323,19 @@ bool aio_poll(AioContext *ctx, bool blocking);
  *
  * Code that invokes AIO completion functions should rely on this function
  * instead of qemu_set_fd_handler[2].
+ *
+ * @io_poll is an optional function that checks for new work without
+ * sleeping, and processes it if there is any.  It returns true if it made
+ * progress.  aio_poll() calls it in a loop for a short while before going
+ * to sleep in ppoll/epoll_wait, but only if every handler of the context
+ * provides one.
  */
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         bool is_external,
                         IOHandler *io_read,
                         IOHandler *io_write,
+                        AioPollFn *io_poll,
                         void *opaque);
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -325,7 +348,8 @@ void aio_set_fd_handler(AioContext *ctx,
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             bool is_external,
-                            EventNotifierHandler *io_read);
+                            EventNotifierHandler *io_read,
+                            AioPollFn *io_poll);
 
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
@@ -441,4 +465,65 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds
+ * @grow: polling time growth factor
+ * @shrink: polling time shrink factor
+ *
+ * Poll mode can be disabled by setting poll_max_ns to 0.  The polling time
+ * starts at zero and adapts to the workload: it grows by @grow (2 if zero)
+ * every time an event arrives shortly after polling stopped, up to @max_ns,
+ * and is divided by @shrink (reset to 0 if zero) every time the event loop
+ * would have had to poll for more than @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
+/**
+ * aio_co_schedule:
+ * @ctx: the aio context
+ * @co: the coroutine
+ *
+ * Start a coroutine on a remote AioContext.
+ *
+ * The coroutine must not be entered by anyone else while aio_co_schedule()
+ * is active.  In addition the coroutine must have yielded unless ctx
+ * is the context in which the coroutine is running (i.e. the value of
+ * qemu_get_current_aio_context() from the coroutine itself).
+ */
+void aio_co_schedule(AioContext *ctx, struct Coroutine *co);
+
+/**
+ * aio_co_wake:
+ * @co: the coroutine
+ *
+ * Restart a coroutine that has yielded, in the AioContext that last entered
+ * it.  If that is not the current one, including when it is the main loop's,
+ * the coroutine is handed over to it with aio_co_schedule(); otherwise it is
+ * entered directly, or after the current coroutine yields if called from
+ * coroutine context.
+ */
+void aio_co_wake(struct Coroutine *co);
+
+/**
+ * qemu_get_current_aio_context:
+ *
+ * Return the AioContext whose event loop runs in the current thread: the
+ * one registered with qemu_set_current_aio_context(), or the main loop's
+ * AioContext.
+ */
+AioContext *qemu_get_current_aio_context(void);
+
+/**
+ * qemu_set_current_aio_context:
+ * @ctx: the aio context, or NULL
+ *
+ * Record that the current thread runs the event loop of @ctx.  Used by
+ * IOThreads when they start and stop.
+ */
+void qemu_set_current_aio_context(AioContext *ctx);
+
 #endif
@@ -94,6 +94,7 @@ typedef struct HDGeometry {
                                       select an appropriate protocol driver,
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
+#define BDRV_O_IO_URING    0x20000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -209,6 +210,7 @@ void bdrv_replace_in_backing_chain(BlockDriverState *old,
 
 int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
+int bdrv_parse_aio(const char *mode, int *flags);
 BdrvChild *bdrv_open_child(const char *filename,
                            QDict *options, const char *bdref_key,
                            BlockDriverState* parent,
@@ -424,6 +426,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t sector_num, int nb_sectors,
                             int64_t *cluster_sector_num,
@@ -514,6 +517,45 @@ AioContext *bdrv_get_aio_context(BlockDriverState *bs);
  * This function must be called with iothread lock held.
  */
 void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
+/**
+ * bdrv_supports_multiqueue:
+ *
+ * Returns: true if every driver in the subtree of @bs can serve requests
+ * from several AioContexts at once and no I/O limits are configured.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs);
+
+/**
+ * bdrv_add_queue_context:
+ *
+ * Let @ctx submit requests to @bs and its children concurrently with the
+ * #AioContext of @bs.  Requests issued from the thread that runs @ctx use
+ * @ctx for their completions; bdrv_drain() and bdrv_drained_begin() also
+ * quiesce @ctx.  bdrv_supports_multiqueue() must be true.
+ *
+ * This function must be called with iothread lock held and the
+ * #AioContext of @bs acquired.
+ */
+void bdrv_add_queue_context(BlockDriverState *bs, AioContext *ctx);
+
+/**
+ * bdrv_remove_queue_context:
+ *
+ * Undo bdrv_add_queue_context(), after waiting for the requests that are
+ * in flight.  The caller must make sure that @ctx does not submit new
+ * requests to @bs anymore.
+ */
+void bdrv_remove_queue_context(BlockDriverState *bs, AioContext *ctx);
+
+/**
+ * bdrv_get_request_context:
+ *
+ * Returns: the #AioContext in which a request issued by the current thread
+ * completes, i.e. the current thread's #AioContext if it is a queue context
+ * of @bs, or the #AioContext of @bs otherwise.
+ */
+AioContext *bdrv_get_request_context(BlockDriverState *bs);
 int bdrv_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz);
 int bdrv_probe_geometry(BlockDriverState *bs, HDGeometry *geo);
 
@@ -521,6 +563,9 @@ void bdrv_io_plug(BlockDriverState *bs);
 void bdrv_io_unplug(BlockDriverState *bs);
 void bdrv_flush_io_queue(BlockDriverState *bs);
 
+void bdrv_register_buf(BlockDriverState *bs, void *host, size_t size);
+void bdrv_unregister_buf(BlockDriverState *bs, void *host, size_t size);
+
 /**
  * bdrv_drained_begin:
  *
@@ -59,8 +59,12 @@ typedef struct TranslationBlock TranslationBlock;
  * and up to 4 + N parameters on 64-bit archs
  * (N = number of input arguments + output arguments).  */
 #define MAX_OPC_PARAM (4 + (MAX_OPC_PARAM_PER_ARG * MAX_OPC_PARAM_ARGS))
-#define OPC_BUF_SIZE 640
-#define OPC_MAX_SIZE (OPC_BUF_SIZE - MAX_OP_PER_INSTR)
+/* A TB is translated into at most OPC_TB_SIZE ops.  A superblock is
+   translated from several TBs in a row, so the buffer has room for a
+   few of them.  */
+#define OPC_TB_SIZE 640
+#define OPC_BUF_SIZE (OPC_TB_SIZE * 3)
+#define OPC_MAX_SIZE (OPC_TB_SIZE - MAX_OP_PER_INSTR)
 
 #define OPPARAM_BUF_SIZE (OPC_BUF_SIZE * MAX_OPC_PARAM)
 
@@ -78,9 +82,14 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+/* Maximum number of TBs retranslated together as a superblock */
+#define TB_SB_MAX_TBS 8
+TranslationBlock *tb_gen_superblock(CPUState *cpu, TranslationBlock **trace,
+                                    const int *slots, int nb_tbs);
 void cpu_exec_init(CPUState *cpu, Error **errp);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc);
+void QEMU_NORETURN cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc);
 
 #if !defined(CONFIG_USER_ONLY)
 void cpu_reloading_memory_map(void);
@@ -113,6 +122,18 @@ void cpu_address_space_init(CPUState *cpu, AddressSpace *as, int asidx);
  */
 AddressSpace *cpu_get_address_space(CPUState *cpu, int asidx);
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB of the specified CPU.
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB should be freed
+ */
+void tlb_destroy(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -153,6 +174,29 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...);
  * MMU indexes.
  */
 void tlb_flush_by_mmuidx(CPUState *cpu, ...);
+/**
+ * tlb_flush_range:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ *
+ * Flush all the pages that overlap the range from the TLB of the
+ * specified CPU, for all MMU indexes.  This is cheaper than calling
+ * tlb_flush_page for each page, and turns into a full flush of the
+ * MMU indexes whose TLB is smaller than the range.
+ */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
+/**
+ * tlb_flush_range_by_mmuidx:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ * @...: list of MMU indexes to flush, terminated by a negative value
+ *
+ * Like tlb_flush_range, for the specified MMU indexes.
+ */
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, ...);
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -207,12 +251,23 @@ static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
 static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
 }
+
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
+
+static inline void tlb_flush_range_by_mmuidx(CPUState *cpu,
+                                             target_ulong addr,
+                                             target_ulong len, ...)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* Estimated block size for TB allocation.  */
 /* ??? The following is based on a 2015 survey of x86_64 host output.
@@ -245,11 +300,23 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_SUPERBLOCK  0x80000 /* Formed from a trace of hot TBs */
+#define CF_SB_MEMBER   0x100000 /* Not the first TB of a superblock */
+
+    /* Set under tb_lock when the TB is removed from the hash table.  Lookups
+       do not take tb_lock, so a concurrent lookup may still return the TB;
+       it must then not be chained to.  */
+    bool invalid;
+
+    /* Execution profile used to find hot traces, only kept up to date
+       with -tcg superblocks=on.  The counters are not atomic and only
+       approximate.  edge_pc[n] is where exit n of the TB jumps to.  */
+    uint32_t exec_count;
+    uint32_t edge_count[2];
+    target_ulong edge_pc[2];
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -273,21 +340,43 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_first;
 };
 
-#include "qemu/thread.h"
+#include "qemu/qht.h"
+
+/* The translation buffer is split into up to TB_NB_REGIONS regions that
+   are filled in turn.  Once the last one is full, the oldest region is
+   evicted: only the TBs generated into it are invalidated, and the code
+   in the other regions stays valid.  */
+#define TB_NB_REGIONS 8
+
+typedef struct TBRegion {
+    void *start;
+    void *end;
+    void *code_end;         /* end of generated code, once filled */
+    TranslationBlock *tbs;  /* slice of TBContext.tbs, sorted by tc_ptr */
+    int nb_tbs;
+} TBRegion;
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* physical PC based hash table, read locklessly under RCU */
+    struct qht htable;
     int nb_tbs;
+    TBRegion regions[TB_NB_REGIONS];
+    int nb_regions;
+    int cur_region;
+    int region_max_tbs;
+    size_t region_size;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_region_evict_count;
     int tb_phys_invalidate_count;
+    int tb_superblock_count;
 
     int tb_invalidated_flag;
 };
@@ -465,4 +554,25 @@ extern int singlestep;
 extern CPUState *tcg_current_cpu;
 extern bool exit_request;
 
+/* cpu-exec-common.c */
+/* True when every vCPU is run by its own host thread (-tcg thread=multi).  */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
+/* True when hot traces of TBs are retranslated as superblocks
+ * (-tcg superblocks=on, or -superblocks for user mode emulation).
+ */
+extern bool tcg_superblocks_enabled;
+
+/* True when guest code may run concurrently on several host threads.
+ * Translators must then make atomic sequences atomic with respect to
+ * other vCPUs, or exit with cpu_loop_exit_atomic() so that the
+ * instruction is replayed by cpu_exec_step_atomic().
+ */
+extern bool parallel_cpus;
+
+#if !defined(CONFIG_USER_ONLY)
+void cpu_exec_step_atomic(CPUState *cpu);
+#endif
+
 #endif
@@ -14,12 +14,16 @@ static inline void gen_tb_start(TranslationBlock *tb)
     TCGv_i32 count, flag, imm;
     int i;
 
-    exitreq_label = gen_new_label();
-    flag = tcg_temp_new_i32();
-    tcg_gen_ld_i32(flag, cpu_env,
-                   offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
-    tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
-    tcg_temp_free_i32(flag);
+    /* The members of a superblock after the first one are entered from
+       the previous member, and must not exit with TB_EXIT_REQUESTED.  */
+    if (!(tb->cflags & CF_SB_MEMBER)) {
+        exitreq_label = gen_new_label();
+        flag = tcg_temp_new_i32();
+        tcg_gen_ld_i32(flag, cpu_env,
+                       offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
+        tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
+        tcg_temp_free_i32(flag);
+    }
 
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
@@ -49,8 +53,10 @@ static inline void gen_tb_start(TranslationBlock *tb)
 
 static void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
-    gen_set_label(exitreq_label);
-    tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    if (!(tb->cflags & CF_SB_MEMBER)) {
+        gen_set_label(exitreq_label);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    }
 
     if (tb->cflags & CF_USE_ICOUNT) {
         *icount_arg = num_insns;
@@ -347,6 +347,15 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 if (tcg_enabled()) {
                     atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
                 }
+            } else {
+                /* Skip clean memory, landing on the last zero word */
+                unsigned long skip =
+                    find_first_nonzero_word(&bitmap[k], nr - k) - 1;
+
+                k += skip;
+                offset += skip;
+                idx += offset / BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE);
+                offset %= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE);
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -382,6 +391,11 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
 }
 #endif /* not _WIN32 */
 
+/* Write-protect the range in the TLBs of all vcpus, so that the next write
+ * to it sets the dirty bits again.  The range must be within a RAM block.
+ */
+void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length);
+
 bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
@@ -406,6 +420,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
+        bool cleared = false;
         int k;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long * const *src;
@@ -422,10 +437,21 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
             if (src[idx][offset]) {
                 unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
+                cleared |= bits != 0;
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+            } else {
+                /* Skip clean memory up to the end of the block */
+                unsigned long n = MIN(page + nr - k,
+                                      BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)
+                                      - offset);
+                unsigned long skip =
+                    find_first_nonzero_word(&src[idx][offset], n) - 1;
+
+                k += skip;
+                offset += skip;
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -435,6 +461,14 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
         }
 
         rcu_read_unlock();
+
+        /* As in cpu_physical_memory_test_and_clear_dirty: with TCG, the
+         * next write to the pages must fault to set their dirty bit again,
+         * and to count them for the vcpu that writes
+         */
+        if (cleared && tcg_enabled()) {
+            tlb_reset_dirty_range_all(start, length);
+        }
     } else {
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
             if (cpu_physical_memory_test_and_clear_dirty(
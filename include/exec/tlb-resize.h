@@ -0,0 +1,51 @@
+/*
+ * Sizing policy of the softmmu TLB
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef EXEC_TLB_RESIZE_H
+#define EXEC_TLB_RESIZE_H
+
+#include "qemu/host-utils.h"
+
+/* The TLB of each MMU mode is resized when it is fully flushed, based on
+ * the number of entries that were in use in a window of at least 100ms:
+ * - if more than 70% of the table was in use, the working set of the
+ *   guest does not fit and its accesses conflict with each other, so the
+ *   table doubles;
+ * - if less than 30% of the table was in use during a whole window, the
+ *   table shrinks so that the peak use of the window fills a quarter to
+ *   a half of it.  Smaller tables are cheaper to flush, which matters for
+ *   guests that flush often.
+ * Shrinking only after a full window keeps the size from bouncing back
+ * and forth for guests whose working set changes quickly.
+ */
+#define TLB_RESIZE_WINDOW_NS    (100 * SCALE_MS)
+#define TLB_RESIZE_GROW_RATE    70
+#define TLB_RESIZE_SHRINK_RATE  30
+
+/**
+ * tlb_resize_policy: return the new number of entries of a TLB table
+ * @old_size: the current number of entries, a power of 2
+ * @max_used: the peak number of entries in use during the window
+ * @window_expired: whether the window lasted at least TLB_RESIZE_WINDOW_NS
+ * @min_size: the smallest allowed number of entries, a power of 2
+ * @max_size: the largest allowed number of entries, a power of 2
+ */
+static inline size_t tlb_resize_policy(size_t old_size, size_t max_used,
+                                       bool window_expired,
+                                       size_t min_size, size_t max_size)
+{
+    size_t rate = max_used * 100 / old_size;
+
+    if (rate > TLB_RESIZE_GROW_RATE) {
+        return MIN(old_size << 1, max_size);
+    }
+    if (rate < TLB_RESIZE_SHRINK_RATE && window_expired) {
+        return MAX(pow2ceil(max_used * 2), min_size);
+    }
+    return old_size;
+}
+
+#endif
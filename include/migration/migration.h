@@ -211,6 +211,7 @@ void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 MigrationState *migrate_init(const MigrationParams *params);
 bool migration_in_setup(MigrationState *);
+bool migration_is_setup_or_active(int state);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 /* True if outgoing migration has entered postcopy phase */
@@ -223,6 +224,13 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void multifd_save_setup(void);
+void multifd_send_new_channel(int id, int fd);
+void multifd_send_shutdown(void);
+void multifd_save_cleanup(void);
+void multifd_load_setup(void);
+int multifd_recv_new_channel(int fd, Error **errp);
+void multifd_load_cleanup(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -241,6 +249,12 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+double xbzrle_mig_encoding_rate(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+double compress_mig_rate(void);
+double compress_mig_throughput(void);
+int compress_mig_level(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -273,16 +287,25 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* For tests: the encoder in use, and a switch to the next slower one */
+const char *xbzrle_encode_buffer_accel(void);
+bool xbzrle_encode_buffer_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+/* True while calc-dirty-rate is running */
+bool dirty_rate_measuring(void);
+
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_compress_zstd(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -0,0 +1,56 @@
+/*
+ * Page streams compressed with zstd for RAM migration
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_ZSTD_PAGE_H
+#define QEMU_MIGRATION_ZSTD_PAGE_H
+
+#include <zstd.h>
+
+/**
+ * zstd_compress_page: compress a page as the continuation of a stream
+ *
+ * Returns the length of the compressed data, or -1 on error.  The output
+ * is flushed, so the other side can decompress the page as soon as it
+ * gets it.
+ *
+ * zstd only changes the level at the start of a frame, so when @level
+ * differs from *@frame_level the page ends the current frame, and the
+ * next one starts at @level.
+ *
+ * @zcs: the compression context of the stream
+ * @frame_level: the level of the current frame, updated
+ * @level: the level wanted
+ * @page: the page to compress
+ * @size: the size of the page
+ * @buf: where to put the compressed data
+ * @buf_size: the size of @buf, at least ZSTD_compressBound(@size)
+ * @errp: pointer to an error
+ */
+ssize_t zstd_compress_page(ZSTD_CCtx *zcs, int *frame_level, int level,
+                           const uint8_t *page, size_t size,
+                           uint8_t *buf, size_t buf_size, Error **errp);
+
+/**
+ * zstd_decompress_page: decompress a page that zstd_compress_page compressed
+ *
+ * Returns 0 on success, -1 on error.  The pages of a stream must be
+ * decompressed in order with the same context; after an error the
+ * following pages of the stream cannot be decompressed either.
+ *
+ * @zds: the decompression context of the stream
+ * @buf: the compressed data
+ * @len: the length of the compressed data
+ * @page: where to put the page
+ * @size: the size of the page
+ * @errp: pointer to an error
+ */
+int zstd_decompress_page(ZSTD_DCtx *zds, const uint8_t *buf, size_t len,
+                         uint8_t *page, size_t size, Error **errp);
+
+#endif
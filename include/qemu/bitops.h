@@ -141,6 +141,17 @@ static inline int test_bit(long nr, const unsigned long *addr)
 unsigned long find_last_bit(const unsigned long *addr,
                             unsigned long size);
 
+/**
+ * find_first_nonzero_word - find the first nonzero word in an array
+ * @addr: The address to start the search at
+ * @nr: The number of words to search
+ *
+ * Returns the index of the first nonzero word, or @nr if all of them
+ * are zero.
+ */
+unsigned long find_first_nonzero_word(const unsigned long *addr,
+                                      unsigned long nr);
+
 /**
  * find_next_bit - find the next set bit in a memory region
  * @addr: The address to base the search on
@@ -17,6 +17,7 @@
 
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
 
 /**
  * Coroutines are a mechanism for stack switching and can be used for
@@ -117,6 +118,17 @@ void qemu_co_queue_init(CoQueue *queue);
  */
 void coroutine_fn qemu_co_queue_wait(CoQueue *queue);
 
+/**
+ * Adds the current coroutine to the CoQueue, releases @lock and transfers
+ * control to the caller of the coroutine.  @lock is taken again before
+ * returning.
+ *
+ * Use this when the queue is shared by coroutines that run in different
+ * threads; @lock must protect both the queue and the condition that is
+ * waited for, and must be held when restarting the queue.
+ */
+void coroutine_fn qemu_co_queue_wait_lock(CoQueue *queue, QemuMutex *lock);
+
 /**
  * Restarts the next coroutine in the CoQueue and removes it from the queue.
  *
@@ -141,10 +153,13 @@ bool qemu_co_queue_empty(CoQueue *queue);
 
 
 /**
- * Provides a mutex that can be used to synchronise coroutines
+ * Provides a mutex that can be used to synchronise coroutines.  The mutex
+ * can be shared by coroutines running in different AioContexts; when it is
+ * released, ownership passes directly to the first waiter.
  */
 typedef struct CoMutex {
     bool locked;
+    QemuSpin spin;      /* protects locked and queue */
     CoQueue queue;
 } CoMutex;
 
@@ -166,6 +181,11 @@ void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
  */
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex);
 
+/**
+ * Like qemu_co_queue_wait_lock(), but @mutex is a CoMutex.
+ */
+void coroutine_fn qemu_co_queue_wait_mutex(CoQueue *queue, CoMutex *mutex);
+
 typedef struct CoRwlock {
     bool writer;
     int reader;
@@ -40,6 +40,14 @@ struct Coroutine {
     Coroutine *caller;
     QSLIST_ENTRY(Coroutine) pool_next;
 
+    /* The AioContext that last entered the coroutine.  Wakeups coming from
+     * other threads are routed through it, see aio_co_wake().
+     */
+    AioContext *ctx;
+
+    /* Used by aio_co_schedule() */
+    QSLIST_ENTRY(Coroutine) co_scheduled_next;
+
     /* Coroutines that should be woken up when we yield or terminate */
     QTAILQ_HEAD(, Coroutine) co_queue_wakeup;
     QTAILQ_ENTRY(Coroutine) co_queue_next;
@@ -172,6 +172,23 @@ bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len);
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 bool buffer_is_zero(const void *buf, size_t len);
 
+/*
+ * For tests and benchmarks: the name of the vector code picked for the
+ * host, and a way to switch to the next slower one it supports.  The
+ * latter returns false once the portable version is in use.
+ */
+const char *buffer_find_nonzero_offset_accel(void);
+bool buffer_find_nonzero_offset_next_accel(void);
+
+/*
+ * Whether the SSE4.1 and AVX2 code of buffer_find_nonzero_offset() can run
+ * on the host: the CPU must have the instructions, and for AVX2 the OS must
+ * also save the YMM registers.  Always false when that code is not built;
+ * the AVX2 code needs CONFIG_AVX2_OPT, the SSE4.1 code only an x86 host.
+ */
+bool host_cpu_has_sse4_1(void);
+bool host_cpu_has_avx2(void);
+
 /*
  * Implementation of ULEB128 (http://en.wikipedia.org/wiki/LEB128)
  * Input is limited to 14-bit numbers
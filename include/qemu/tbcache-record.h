@@ -0,0 +1,52 @@
+/*
+ * tbcache-record.h - record format of the persistent translation cache
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_TBCACHE_RECORD_H
+#define QEMU_TBCACHE_RECORD_H
+
+#define TBCACHE_REC_MAGIC  0x54424332 /* "TBC2" */
+
+/*
+ * A record is followed by the guest code bytes it was translated from,
+ * the opcode stream and padding up to a multiple of 8 bytes.
+ */
+typedef struct TBCacheRecord {
+    uint32_t magic;
+    uint32_t len;       /* whole record, padded to 8 bytes */
+    uint64_t key;
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint16_t size;      /* guest code bytes following the record */
+    uint16_t icount;
+    uint32_t ops_len;   /* opcode stream following the guest code */
+    uint32_t crc;       /* crc32c of the guest code and opcode stream */
+    uint32_t reserved;
+} TBCacheRecord;
+
+/**
+ * tbcache_record_append: append a record to @buf
+ * @buf: the buffer
+ * @rec: the header of the record; magic, len and crc are filled in
+ * @code: the @rec->size bytes of guest code
+ * @ops: the @rec->ops_len bytes of the opcode stream
+ */
+void tbcache_record_append(GByteArray *buf, TBCacheRecord *rec,
+                           const void *code, const void *ops);
+
+/**
+ * tbcache_record_next: return the record at offset *@off of @map
+ * @map: the records
+ * @size: the size of @map
+ * @off: the offset of the record, advanced past it on success
+ *
+ * Returns NULL at the end of @map or if the record is damaged, for
+ * example because it was only partly written.
+ */
+const TBCacheRecord *tbcache_record_next(const void *map, size_t size,
+                                         size_t *off);
+
+#endif
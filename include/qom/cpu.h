@@ -252,6 +252,10 @@ struct kvm_run;
  * @as: Pointer to the first AddressSpace, for the convenience of targets which
  *      only have a single AddressSpace
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
+ * @tlb_desc: Per-MMU-mode state of the softmmu TLB that is not accessed
+ *            by generated code (size, resize heuristics and statistics).
+ * @tlb_flush_batch: TLB flushes requested by other threads and not yet
+ *                   performed by this CPU.
  * @current_tb: Currently executing TB.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
@@ -303,6 +307,8 @@ struct CPUState {
     MemoryRegion *memory;
 
     void *env_ptr; /* CPUArchState */
+    struct CPUTLBDesc *tlb_desc;
+    struct CPUTLBFlushBatch *tlb_flush_batch;
     struct TranslationBlock *current_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
     struct GDBRegisterState *gdb_regs;
@@ -343,6 +349,13 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu alone, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
+    /* Clean pages written by this vcpu, counted on TCG write faults and
+     * reset by whoever samples it.  With MTTCG the vcpu counts outside the
+     * iothread lock, so this is only accessed with atomic operations.
+     */
+    unsigned long dirty_pages;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -611,6 +624,19 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * while all other vCPUs are outside of guest code.  Unlike async_run_on_cpu()
+ * the work is always queued, even when called from @cpu itself.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -645,10 +671,21 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  A vcpu sleeps for the highest
+ * of its own percentage and the one set by cpu_throttle_set.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -664,7 +701,7 @@ bool cpu_throttle_active(void);
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
  *
- * Returns: The throttle percentage in range 1 to 99.
+ * Returns: The highest throttle percentage of any vcpu, in range 1 to 99.
  */
 int cpu_throttle_get_percentage(void);
 
@@ -7,6 +7,17 @@ void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
+
+/* Exclusive sections: start_exclusive() waits until no other vCPU is
+ * executing guest code and keeps them out until end_exclusive().  The
+ * vCPU threads bracket guest execution with cpu_exec_start() and
+ * cpu_exec_end().  None of these may be called with the BQL held.
+ */
+void start_exclusive(void);
+void end_exclusive(void);
+void cpu_exec_start(CPUState *cpu);
+void cpu_exec_end(CPUState *cpu);
 
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
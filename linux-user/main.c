@@ -38,6 +38,7 @@ int singlestep;
 static const char *filename;
 static const char *argv0;
 static int gdbstub_port;
+static const char *tb_cache_dir;
 static envlist_t *envlist;
 static const char *cpu_model;
 unsigned long mmap_min_addr;
@@ -3912,6 +3913,21 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = strdup(arg);
+}
+
+static void handle_arg_superblocks(const char *arg)
+{
+#ifndef TARGET_SUPPORTS_SUPERBLOCKS
+    fprintf(stderr, "-superblocks is not supported for this guest "
+            "architecture\n");
+    exit(EXIT_FAILURE);
+#endif
+    tcg_superblocks_enabled = true;
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_NAME " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3964,6 +3980,10 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "dir",        "reuse translated code across runs, cached in 'dir'"},
+    {"superblocks", "QEMU_SUPERBLOCKS", false, handle_arg_superblocks,
+     "",           "retranslate hot code paths as superblocks"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_randseed,
      "",           "Seed for pseudo-random number generator"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
@@ -4355,6 +4375,11 @@ int main(int argc, char **argv, char **envp)
        the real value of GUEST_BASE into account.  */
     tcg_prologue_init(&tcg_ctx);
 
+    /* The debugger may insert breakpoints, which the cache ignores.  */
+    if (tb_cache_dir && !gdbstub_port && !singlestep) {
+        tbcache_init(tb_cache_dir, cpu_model);
+    }
+
 #if defined(TARGET_I386)
     env->cr[0] = CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK;
     env->hflags |= HF_PE_MASK | HF_CPL_MASK;
@@ -60,6 +60,65 @@ void mmap_fork_end(int child)
         pthread_mutex_unlock(&mmap_mutex);
 }
 
+/* Executable mappings of files, which the persistent translation cache
+   uses to identify guest code.  Protected by mmap_lock.  */
+typedef struct MmapFile {
+    abi_ulong start;
+    abi_ulong end;
+    abi_ulong offset;   /* file offset of 'start' */
+    uint64_t id;
+    QLIST_ENTRY(MmapFile) entry;
+} MmapFile;
+
+static QLIST_HEAD(, MmapFile) mmap_files = QLIST_HEAD_INITIALIZER(mmap_files);
+
+/* Forget about the file mappings overlapping [start, end).  */
+static void mmap_files_forget(abi_ulong start, abi_ulong end)
+{
+    MmapFile *f, *next;
+
+    QLIST_FOREACH_SAFE(f, &mmap_files, entry, next) {
+        if (f->start < end && start < f->end) {
+            QLIST_REMOVE(f, entry);
+            g_free(f);
+        }
+    }
+}
+
+static void mmap_files_add(abi_ulong start, abi_ulong end, int fd,
+                           abi_ulong offset)
+{
+    struct stat sb;
+    MmapFile *f;
+
+    if (start >= end || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        return;
+    }
+    f = g_new(MmapFile, 1);
+    f->start = start;
+    f->end = end;
+    f->offset = offset;
+    /* any change to the file is assumed to update its size or mtime */
+    f->id = ((uint64_t)sb.st_dev << 32) ^ sb.st_ino;
+    f->id = f->id * 0x9e3779b97f4a7c15ull ^ sb.st_size;
+    f->id = f->id * 0x9e3779b97f4a7c15ull ^ sb.st_mtime;
+    QLIST_INSERT_HEAD(&mmap_files, f, entry);
+}
+
+bool mmap_find_file(abi_ulong addr, uint64_t *id, abi_ulong *offset)
+{
+    MmapFile *f;
+
+    QLIST_FOREACH(f, &mmap_files, entry) {
+        if (addr >= f->start && addr < f->end) {
+            *id = f->id;
+            *offset = f->offset + (addr - f->start);
+            return true;
+        }
+    }
+    return false;
+}
+
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
 int target_mprotect(abi_ulong start, abi_ulong len, int prot)
 {
@@ -561,6 +620,10 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
     page_dump(stdout);
     printf("\n");
 #endif
+    mmap_files_forget(start, start + len);
+    if (!(flags & MAP_ANONYMOUS) && (prot & PROT_EXEC)) {
+        mmap_files_add(start, start + len, fd, offset);
+    }
     tb_invalidate_phys_range(start, start + len);
     mmap_unlock();
     return start;
@@ -666,6 +729,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
 
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
+        mmap_files_forget(start, start + len);
         tb_invalidate_phys_range(start, start + len);
     }
     mmap_unlock();
@@ -744,6 +808,8 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        mmap_files_forget(old_addr, old_addr + old_size);
+        mmap_files_forget(new_addr, new_addr + new_size);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size);
     mmap_unlock();
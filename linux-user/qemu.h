@@ -254,6 +254,13 @@ void cpu_list_lock(void);
 void cpu_list_unlock(void);
 void mmap_fork_start(void);
 void mmap_fork_end(int child);
+bool mmap_find_file(abi_ulong addr, uint64_t *id, abi_ulong *offset);
+
+/* tbcache.c */
+void tbcache_init(const char *dir, const char *cpu_model);
+bool tbcache_lookup(CPUState *cpu, TranslationBlock *tb);
+void tbcache_insert(TranslationBlock *tb);
+void tbcache_flush(void);
 
 /* main.c */
 extern unsigned long guest_stack_size;
@@ -5898,6 +5898,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tbcache_flush();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -6106,6 +6107,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 
             if (!(p = lock_user_string(arg1)))
                 goto execve_efault;
+            tbcache_flush();
             ret = get_errno(execve(p, argp, envp));
             unlock_user(p, arg1, 0);
 
@@ -7832,6 +7834,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tbcache_flush();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
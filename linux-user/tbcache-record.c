@@ -0,0 +1,52 @@
+/*
+ * tbcache-record.c - record format of the persistent translation cache
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/crc32c.h"
+#include "qemu/tbcache-record.h"
+
+static uint32_t tbcache_record_crc(const void *code, uint32_t size,
+                                   const void *ops, uint32_t ops_len)
+{
+    uint32_t crc = crc32c(0xffffffff, code, size);
+
+    return crc32c(crc ^ 0xffffffff, ops, ops_len);
+}
+
+void tbcache_record_append(GByteArray *buf, TBCacheRecord *rec,
+                           const void *code, const void *ops)
+{
+    static const uint8_t zero[8];
+    size_t data_len = sizeof(*rec) + rec->size + rec->ops_len;
+
+    rec->magic = TBCACHE_REC_MAGIC;
+    rec->len = ROUND_UP(data_len, 8);
+    rec->crc = tbcache_record_crc(code, rec->size, ops, rec->ops_len);
+
+    g_byte_array_append(buf, (const uint8_t *)rec, sizeof(*rec));
+    g_byte_array_append(buf, code, rec->size);
+    g_byte_array_append(buf, ops, rec->ops_len);
+    g_byte_array_append(buf, zero, rec->len - data_len);
+}
+
+const TBCacheRecord *tbcache_record_next(const void *map, size_t size,
+                                         size_t *off)
+{
+    const TBCacheRecord *rec = map + *off;
+    const uint8_t *code = (const uint8_t *)(rec + 1);
+
+    if (*off + sizeof(TBCacheRecord) > size ||
+        rec->magic != TBCACHE_REC_MAGIC ||
+        rec->len > size - *off ||
+        rec->len < sizeof(*rec) + rec->size + rec->ops_len ||
+        tbcache_record_crc(code, rec->size, code + rec->size,
+                           rec->ops_len) != rec->crc) {
+        return NULL;
+    }
+    *off += rec->len;
+    return rec;
+}
@@ -0,0 +1,331 @@
+/*
+ *  Persistent translation cache for user mode emulation
+ *
+ *  Short-lived processes spend most of their time translating the same
+ *  code (ld.so, libc) over and over.  This keeps the optimized opcode
+ *  stream of every TB translated from an executable file mapping in a
+ *  cache file, so that later processes can skip the target front end and
+ *  the optimizer for it.  An entry is only reused if the guest code it
+ *  was generated from is still byte for byte the same.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "qemu.h"
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "qemu/tbcache-record.h"
+#include "tcg.h"
+
+/* The cache file starts with TBCACHE_FILE_MAGIC, the length of the
+   configuration string and the string itself, padded to 8 bytes; a
+   file is only used by processes with the very same configuration.
+   It is followed by records, which are only ever appended.  */
+#define TBCACHE_FILE_MAGIC "QEMU-TBC"
+
+/* Stop appending to the cache file once it reaches this size.  */
+#define TBCACHE_MAX_SIZE   (256u * 1024 * 1024)
+
+/* Amount of new records kept in memory before being appended.  */
+#define TBCACHE_FLUSH_SIZE (64u * 1024)
+
+static struct {
+    bool enabled;
+    char *path;
+    /* records of the cache file as it was when the process started */
+    void *map;
+    size_t map_size;
+    GHashTable *index;
+    /* records translated by this process, not yet in the file */
+    GByteArray *pending;
+    pid_t pending_pid;
+    /* opcode stream of the TB being translated, see tbcache_lookup() */
+    GByteArray *ops;
+    uint64_t key;
+} tbcache;
+
+static uint64_t tbcache_mix(uint64_t h, uint64_t v)
+{
+    return (h ^ v) * 0x9e3779b97f4a7c15ull;
+}
+
+static char *tbcache_config(const char *cpu_model)
+{
+    struct stat sb;
+
+    /* The opcode streams depend on the QEMU binary and on the CPU
+       model; they are valid regardless of where things are mapped.  */
+    if (stat("/proc/self/exe", &sb) == -1) {
+        return NULL;
+    }
+    return g_strdup_printf("%s %s %s exe=%llx:%llx:%llx:%llx",
+                           QEMU_VERSION, TARGET_NAME, cpu_model,
+                           (unsigned long long)sb.st_dev,
+                           (unsigned long long)sb.st_ino,
+                           (unsigned long long)sb.st_size,
+                           (unsigned long long)sb.st_mtime);
+}
+
+/* Write the header of a new cache file, or check that the header of an
+   existing one matches 'config'.  Called with the file locked.  */
+static bool tbcache_check_header(int fd, const char *config, size_t *hdr_len)
+{
+    uint32_t config_len = strlen(config);
+    size_t len = ROUND_UP(8 + 4 + config_len, 8);
+    char *hdr = g_malloc0(len);
+    struct stat sb;
+    bool ret = false;
+
+    memcpy(hdr, TBCACHE_FILE_MAGIC, 8);
+    memcpy(hdr + 8, &config_len, 4);
+    memcpy(hdr + 12, config, config_len);
+
+    if (fstat(fd, &sb) == -1) {
+        goto out;
+    }
+    if (sb.st_size == 0) {
+        ret = write(fd, hdr, len) == (ssize_t)len;
+    } else if (sb.st_size >= (off_t)len) {
+        char *buf = g_malloc(len);
+
+        ret = pread(fd, buf, len, 0) == (ssize_t)len &&
+              !memcmp(buf, hdr, len);
+        g_free(buf);
+    }
+    *hdr_len = len;
+ out:
+    g_free(hdr);
+    return ret;
+}
+
+/* The opcode streams of the cache are compiled into host code, so only
+   files that nobody else could have written are used.  */
+static bool tbcache_check_owner(const struct stat *sb, const char *path)
+{
+    if (sb->st_uid != geteuid() || (sb->st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "qemu: ignoring translation cache %s: it must be "
+                "owned by the user and not writable by others\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* Index the records of the file, stopping at the first damaged one.  */
+static void tbcache_load(size_t start)
+{
+    size_t off = start;
+    const TBCacheRecord *rec;
+
+    while ((rec = tbcache_record_next(tbcache.map, tbcache.map_size, &off))) {
+        gpointer key = (gpointer)&rec->key;
+
+        if (!g_hash_table_lookup(tbcache.index, key)) {
+            g_hash_table_insert(tbcache.index, key, (gpointer)rec);
+        }
+    }
+}
+
+void tbcache_init(const char *dir, const char *cpu_model)
+{
+    char *config;
+    size_t hdr_len = 0;
+    struct stat sb;
+    bool ok;
+    int fd;
+
+    config = tbcache_config(cpu_model);
+    if (!config) {
+        return;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "qemu: cannot create translation cache %s: %s\n",
+                dir, strerror(errno));
+        goto out;
+    }
+    if (stat(dir, &sb) == -1 || !S_ISDIR(sb.st_mode) ||
+        !tbcache_check_owner(&sb, dir)) {
+        goto out;
+    }
+    /* Each configuration gets its own file; the header tells apart the
+       (unlikely) configurations whose names hash the same.  */
+    tbcache.path = g_strdup_printf("%s/qemu-%s-%08x.tbc", dir, TARGET_NAME,
+                                   crc32c(0xffffffff, (uint8_t *)config,
+                                          strlen(config)));
+    fd = open(tbcache.path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "qemu: cannot open translation cache %s: %s\n",
+                tbcache.path, strerror(errno));
+        goto out;
+    }
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+        !tbcache_check_owner(&sb, tbcache.path)) {
+        close(fd);
+        goto out;
+    }
+
+    flock(fd, LOCK_EX);
+    ok = tbcache_check_header(fd, config, &hdr_len) && fstat(fd, &sb) == 0;
+    flock(fd, LOCK_UN);
+    if (!ok) {
+        close(fd);
+        goto out;
+    }
+
+    /* The file only ever grows, so the mapping stays valid while other
+       processes append to it.  */
+    tbcache.map_size = sb.st_size;
+    tbcache.map = mmap(NULL, tbcache.map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (tbcache.map == MAP_FAILED) {
+        goto out;
+    }
+
+    tbcache.index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    tbcache.pending = g_byte_array_new();
+    tbcache.pending_pid = getpid();
+    tbcache.ops = g_byte_array_new();
+    tbcache_load(hdr_len);
+    tbcache.enabled = true;
+ out:
+    g_free(config);
+}
+
+static bool tbcache_match(const TBCacheRecord *rec, TranslationBlock *tb)
+{
+    return rec->pc == tb->pc && rec->cs_base == tb->cs_base &&
+           rec->flags == tb->flags &&
+           page_check_range(tb->pc, rec->size, PAGE_READ) == 0 &&
+           !memcmp(g2h(tb->pc), rec + 1, rec->size);
+}
+
+/* Called with mmap_lock and tb_lock held, after tcg_func_start().
+   Returns true if the opcode stream of 'tb' was imported from the
+   cache, in which case the front end must not be run.  Otherwise,
+   prepares tcg_ctx for tbcache_insert().  */
+bool tbcache_lookup(CPUState *cpu, TranslationBlock *tb)
+{
+    TBCacheRecord *rec;
+    abi_ulong offset;
+    uint64_t id, key;
+
+    tcg_ctx.gen_ops_export = NULL;
+    if (!tbcache.enabled || tb->cflags || cpu->singlestep_enabled ||
+        !QTAILQ_EMPTY(&cpu->breakpoints)) {
+        return false;
+    }
+    /* Only code mapped from files is worth keeping */
+    if (!mmap_find_file(tb->pc, &id, &offset)) {
+        return false;
+    }
+    key = tbcache_mix(id, offset);
+    key = tbcache_mix(key, tb->pc);
+    key = tbcache_mix(key, tb->cs_base);
+    key = tbcache_mix(key, tb->flags);
+
+    rec = g_hash_table_lookup(tbcache.index, &key);
+    if (rec && tbcache_match(rec, tb)) {
+        if (tcg_import_ops(&tcg_ctx, tb, (uint8_t *)(rec + 1) + rec->size,
+                           rec->ops_len)) {
+            tb->size = rec->size;
+            tb->icount = rec->icount;
+            return true;
+        }
+        /* start over from a clean context */
+        tcg_func_start(&tcg_ctx);
+    }
+
+    tbcache.key = key;
+    g_byte_array_set_size(tbcache.ops, 0);
+    tcg_ctx.gen_ops_export = tbcache.ops;
+    return false;
+}
+
+static void tbcache_write_pending(void)
+{
+    struct stat sb;
+    int fd;
+
+    if (!tbcache.pending->len) {
+        return;
+    }
+    fd = open(tbcache.path, O_WRONLY | O_APPEND | O_CLOEXEC | O_NOFOLLOW);
+    if (fd != -1) {
+        /* Whole records must be appended in one go, as other processes
+           may be appending to the file at the same time.  */
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &sb) == 0 &&
+            sb.st_size + tbcache.pending->len <= TBCACHE_MAX_SIZE) {
+            if (write(fd, tbcache.pending->data, tbcache.pending->len) !=
+                (ssize_t)tbcache.pending->len) {
+                /* the damaged tail will be ignored by tbcache_load() */
+                tbcache.enabled = false;
+            }
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    g_byte_array_set_size(tbcache.pending, 0);
+}
+
+/* Called with mmap_lock and tb_lock held, once 'tb' has been generated
+   successfully.  */
+void tbcache_insert(TranslationBlock *tb)
+{
+    TBCacheRecord rec = { 0 };
+
+    if (!tcg_ctx.gen_ops_export) {
+        return;
+    }
+    tcg_ctx.gen_ops_export = NULL;
+    /* the opcode stream could not be exported */
+    if (!tbcache.ops->len) {
+        return;
+    }
+    /* records translated before a fork belong to the parent */
+    if (tbcache.pending_pid != getpid()) {
+        g_byte_array_set_size(tbcache.pending, 0);
+        tbcache.pending_pid = getpid();
+    }
+
+    rec.key = tbcache.key;
+    rec.pc = tb->pc;
+    rec.cs_base = tb->cs_base;
+    rec.flags = tb->flags;
+    rec.size = tb->size;
+    rec.icount = tb->icount;
+    rec.ops_len = tbcache.ops->len;
+    tbcache_record_append(tbcache.pending, &rec, g2h(tb->pc),
+                          tbcache.ops->data);
+
+    if (tbcache.pending->len >= TBCACHE_FLUSH_SIZE) {
+        tbcache_write_pending();
+    }
+}
+
+/* Append the records translated so far to the cache file.  Must be
+   called before the process exits or execs.  */
+void tbcache_flush(void)
+{
+    if (!tbcache.enabled) {
+        return;
+    }
+    tb_lock();
+    if (tbcache.pending_pid == getpid()) {
+        tbcache_write_pending();
+    }
+    tb_unlock();
+}
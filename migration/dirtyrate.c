@@ -0,0 +1,238 @@
+/*
+ * Guest dirty rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/rcu_queue.h"
+#include "qom/cpu.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTY_RATE_MAX_CALC_TIME 60
+
+typedef struct DirtyRateBlockStat {
+    char *idstr;
+    uint64_t pages;
+} DirtyRateBlockStat;
+
+typedef struct DirtyRateVcpuStat {
+    int cpu_index;
+    uint64_t pages;
+} DirtyRateVcpuStat;
+
+/* Result of the last measurement, protected by the iothread lock */
+static DirtyRateStatus dirty_rate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static int64_t dirty_rate_calc_time;
+static int64_t dirty_rate_elapsed_ms;
+static uint64_t dirty_rate_pages;
+static DirtyRateBlockStat *dirty_rate_blocks;
+static int dirty_rate_nr_blocks;
+static DirtyRateVcpuStat *dirty_rate_vcpus;
+static int dirty_rate_nr_vcpus;
+
+static QemuThread dirty_rate_thread;
+
+bool dirty_rate_measuring(void)
+{
+    return dirty_rate_status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+static void dirty_rate_clear(void)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate_nr_blocks; i++) {
+        g_free(dirty_rate_blocks[i].idstr);
+    }
+    g_free(dirty_rate_blocks);
+    g_free(dirty_rate_vcpus);
+    dirty_rate_blocks = NULL;
+    dirty_rate_nr_blocks = 0;
+    dirty_rate_vcpus = NULL;
+    dirty_rate_nr_vcpus = 0;
+    dirty_rate_pages = 0;
+}
+
+/* Called with the iothread lock held, forget what was dirtied so far */
+static void dirty_rate_start(void)
+{
+    RAMBlock *block;
+    CPUState *cpu;
+
+    memory_global_dirty_log_start();
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /* Also write-protects the pages in the TLBs for vcpu accounting */
+        cpu_physical_memory_test_and_clear_dirty(block->offset,
+                                                 block->used_length,
+                                                 DIRTY_MEMORY_MIGRATION);
+    }
+    rcu_read_unlock();
+
+    CPU_FOREACH(cpu) {
+        atomic_xchg(&cpu->dirty_pages, 0);
+    }
+}
+
+/* Called with the iothread lock held, collect the pages dirtied since
+ * dirty_rate_start
+ */
+static void dirty_rate_stop(void)
+{
+    unsigned long *bmap;
+    RAMBlock *block;
+    CPUState *cpu;
+    int i;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    bmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        dirty_rate_nr_blocks++;
+    }
+    dirty_rate_blocks = g_new0(DirtyRateBlockStat, dirty_rate_nr_blocks);
+    i = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        dirty_rate_blocks[i].idstr = g_strdup(block->idstr);
+        dirty_rate_blocks[i].pages =
+            cpu_physical_memory_sync_dirty_bitmap(bmap, block->offset,
+                                                  block->used_length);
+        dirty_rate_pages += dirty_rate_blocks[i].pages;
+        i++;
+    }
+    rcu_read_unlock();
+    g_free(bmap);
+
+    memory_global_dirty_log_stop();
+
+    /* Only TCG can tell which vcpu dirtied a page */
+    if (tcg_enabled()) {
+        CPU_FOREACH(cpu) {
+            dirty_rate_nr_vcpus++;
+        }
+        dirty_rate_vcpus = g_new0(DirtyRateVcpuStat, dirty_rate_nr_vcpus);
+        i = 0;
+        CPU_FOREACH(cpu) {
+            dirty_rate_vcpus[i].cpu_index = cpu->cpu_index;
+            dirty_rate_vcpus[i].pages = atomic_read(&cpu->dirty_pages);
+            i++;
+        }
+    }
+}
+
+static void *dirty_rate_thread_fn(void *opaque)
+{
+    int64_t start_time;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    dirty_rate_start();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(dirty_rate_calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    dirty_rate_stop();
+    dirty_rate_elapsed_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                            start_time;
+    trace_dirty_rate_measured(dirty_rate_pages, dirty_rate_elapsed_ms);
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "a value between 1 and 60");
+        return;
+    }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "The dirty rate is already being measured");
+        return;
+    }
+    if (migration_is_setup_or_active(s->state)) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    dirty_rate_clear();
+    dirty_rate_calc_time = calc_time;
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURING;
+    qemu_thread_create(&dirty_rate_thread, "dirtyrate", dirty_rate_thread_fn,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+
+/* Converts a number of pages dirtied during the measurement to MB/s */
+static int64_t dirty_rate_mbps(uint64_t pages)
+{
+    if (!dirty_rate_elapsed_ms) {
+        return 0;
+    }
+    return pages * TARGET_PAGE_SIZE * 1000 / dirty_rate_elapsed_ms >> 20;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    int i;
+
+    info->status = dirty_rate_status;
+    if (dirty_rate_status == DIRTY_RATE_STATUS_UNSTARTED) {
+        return info;
+    }
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate_calc_time;
+    if (dirty_rate_status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_mbps(dirty_rate_pages);
+
+    info->has_block_dirty_rate = true;
+    for (i = dirty_rate_nr_blocks - 1; i >= 0; i--) {
+        DirtyRateBlockList *entry = g_new0(DirtyRateBlockList, 1);
+
+        entry->value = g_new0(DirtyRateBlock, 1);
+        entry->value->id = g_strdup(dirty_rate_blocks[i].idstr);
+        entry->value->dirty_rate = dirty_rate_mbps(dirty_rate_blocks[i].pages);
+        entry->next = info->block_dirty_rate;
+        info->block_dirty_rate = entry;
+    }
+
+    info->has_vcpu_dirty_rate = dirty_rate_vcpus != NULL;
+    for (i = dirty_rate_nr_vcpus - 1; i >= 0; i--) {
+        DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+        entry->value = g_new0(DirtyRateVcpu, 1);
+        entry->value->id = dirty_rate_vcpus[i].cpu_index;
+        entry->value->dirty_rate = dirty_rate_mbps(dirty_rate_vcpus[i].pages);
+        entry->next = info->vcpu_dirty_rate;
+        info->vcpu_dirty_rate = entry;
+    }
+
+    return info;
+}
@@ -30,6 +30,9 @@
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
+#ifdef CONFIG_ZSTD
+#include "migration/zstd-page.h"
+#endif
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
@@ -41,6 +44,8 @@
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -66,6 +71,10 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* Synchronization point with the multifd channels.  Flags must stay below
+ * the smallest TARGET_PAGE_SIZE (1k), so this is the last one available.
+ */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -152,6 +161,11 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    double xbzrle_encoding_rate;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    double compress_rate;
+    double compress_throughput;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -216,6 +230,31 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+double xbzrle_mig_encoding_rate(void)
+{
+    return acct_info.xbzrle_encoding_rate;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+double compress_mig_rate(void)
+{
+    return acct_info.compress_rate;
+}
+
+double compress_mig_throughput(void)
+{
+    return acct_info.compress_throughput;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -258,6 +297,18 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    /* stream the thread writes to, when using zstd */
+    uint8_t id;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zcs;
+    uint8_t *zbuf;
+    /* level of the current zstd frame */
+    int level;
+#endif
+    /* protected by mutex, read by compress_update_stats */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    int64_t busy_ns;
 };
 typedef struct CompressParam CompressParam;
 
@@ -268,6 +319,9 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+#ifdef CONFIG_ZSTD
+    ZSTD_DCtx *zds;
+#endif
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -288,6 +342,40 @@ static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 
+/* The zstd level is adjusted to the bandwidth by compress_update_stats */
+#define COMPRESS_ZSTD_LEVEL_MIN 1
+#define COMPRESS_ZSTD_LEVEL_MAX 19
+
+static int compress_level;
+
+/* Statistics of the last period computed by compress_update_stats */
+static int64_t compress_stats_time;
+static uint64_t compress_bytes_in_prev;
+static uint64_t compress_bytes_out_prev;
+static int64_t compress_busy_ns_prev;
+
+#ifdef CONFIG_ZSTD
+/* One decompression context for each stream of the source */
+static ZSTD_DCtx *decomp_streams[UINT8_MAX + 1];
+#endif
+static bool decomp_stream_error;
+
+int compress_mig_level(void)
+{
+    return compress_level;
+}
+
+/* Largest compressed page that can be found in the migration stream */
+static size_t compress_bound(void)
+{
+    size_t bound = compressBound(TARGET_PAGE_SIZE);
+
+#ifdef CONFIG_ZSTD
+    bound = MAX(bound, ZSTD_compressBound(TARGET_PAGE_SIZE));
+#endif
+    return bound;
+}
+
 static int do_compress_ram_page(CompressParam *param);
 
 static void *do_data_compress(void *opaque)
@@ -347,6 +435,10 @@ void migrate_compress_threads_join(void)
         qemu_fclose(comp_param[i].file);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
+#ifdef CONFIG_ZSTD
+        ZSTD_freeCCtx(comp_param[i].zcs);
+        g_free(comp_param[i].zbuf);
+#endif
     }
     qemu_mutex_destroy(comp_done_lock);
     qemu_cond_destroy(comp_done_cond);
@@ -369,6 +461,14 @@ void migrate_compress_threads_create(void)
     }
     quit_comp_thread = false;
     compression_switch = true;
+    compress_level = migrate_compress_level();
+    if (migrate_use_compress_zstd()) {
+        compress_level = MAX(compress_level, COMPRESS_ZSTD_LEVEL_MIN);
+    }
+    compress_stats_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    compress_bytes_in_prev = 0;
+    compress_bytes_out_prev = 0;
+    compress_busy_ns_prev = 0;
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
@@ -382,6 +482,16 @@ void migrate_compress_threads_create(void)
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
         comp_param[i].done = true;
+        comp_param[i].id = i;
+#ifdef CONFIG_ZSTD
+        if (migrate_use_compress_zstd()) {
+            comp_param[i].zcs = ZSTD_createCCtx();
+            comp_param[i].zbuf = g_malloc(ZSTD_compressBound(TARGET_PAGE_SIZE));
+            comp_param[i].level = compress_level;
+            ZSTD_CCtx_setParameter(comp_param[i].zcs, ZSTD_c_compressionLevel,
+                                   compress_level);
+        }
+#endif
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
         qemu_thread_create(compress_threads + i, "compress",
@@ -390,6 +500,390 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multiple fd's */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* Last packet a channel sends before a synchronization point */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Number of target pages carried by one packet at most */
+#define MULTIFD_PAGES_PER_PACKET 128
+
+/* First thing sent on each channel, so that the destination can tell them
+ * apart no matter in which order the connections were accepted.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t id;
+    uint8_t unused[7];
+} QEMU_PACKED MultiFDInit;
+
+/* Header of a packet; it is followed by pages_used target pages */
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t pages_used;
+    uint32_t unused;
+    char ramblock[256];
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+} QEMU_PACKED MultiFDPacket;
+
+typedef struct {
+    RAMBlock *block;
+    uint32_t used;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+struct MultiFDSendParams {
+    uint8_t id;
+    int fd;
+    QemuThread thread;
+    bool running;
+    /* kicks the thread when there is a job for it or it has to quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    bool quit;
+    /* pages handed over and not sent yet, the channel is idle when it is 0 */
+    int pending_job;
+    /* flags for the next packet; a SYNC request does not make it busy */
+    uint32_t flags;
+    MultiFDPages *pages;
+    /* only used by the channel thread */
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 1];
+};
+typedef struct MultiFDSendParams MultiFDSendParams;
+
+typedef struct {
+    MultiFDSendParams *params;
+    int count;
+    /* pages being gathered by the migration thread */
+    MultiFDPages *pages;
+    /* posted each time a channel is done with a job */
+    QemuSemaphore channels_ready;
+    /* posted each time a channel has sent a SYNC packet */
+    QemuSemaphore sem_sync;
+    int next_channel;
+    bool error;
+} MultiFDSendState;
+
+static MultiFDSendState *multifd_send_state;
+
+static size_t multifd_send_fill_packet(MultiFDSendParams *p, uint32_t used,
+                                       uint32_t flags)
+{
+    MultiFDPacket *packet = &p->packet;
+    size_t len = sizeof(*packet);
+    uint32_t i;
+
+    memset(packet, 0, sizeof(*packet));
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->flags = cpu_to_be32(flags);
+    packet->pages_used = cpu_to_be32(used);
+    if (used) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                p->pages->block->idstr);
+    }
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = sizeof(*packet);
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = p->pages->offset[i];
+
+        packet->offset[i] = cpu_to_be64(offset);
+        p->iov[i + 1].iov_base = p->pages->block->host + offset;
+        p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+        len += TARGET_PAGE_SIZE;
+    }
+
+    return len;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDInit msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    bool error = false;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+    if (iov_send(p->fd, &iov, 1, 0, sizeof(msg)) != sizeof(msg)) {
+        error = true;
+        goto out;
+    }
+    trace_multifd_send_thread_start(p->id);
+
+    /* The channel starts out idle */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job || p->flags) {
+            uint32_t used = p->pages->used;
+            uint32_t flags = p->flags;
+            bool job = p->pending_job;
+            ssize_t len = 0;
+
+            if (used || flags) {
+                len = multifd_send_fill_packet(p, used, flags);
+            }
+            p->pages->used = 0;
+            p->flags = 0;
+            qemu_mutex_unlock(&p->mutex);
+
+            /* The pages stay valid while the job is pending: the migration
+             * thread is in an RCU critical section until it has synchronized
+             * with every channel.
+             */
+            if (len && iov_send(p->fd, p->iov, used + 1, 0, len) != len) {
+                error = true;
+                break;
+            }
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_send_state->sem_sync);
+            }
+            /* Only the end of a page job makes the channel idle again, so
+             * that channels_ready counts exactly the idle channels.
+             */
+            if (job) {
+                qemu_mutex_lock(&p->mutex);
+                p->pending_job = 0;
+                qemu_mutex_unlock(&p->mutex);
+                qemu_sem_post(&multifd_send_state->channels_ready);
+            }
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+out:
+    if (error) {
+        error_report("multifd: channel %d failed to send", p->id);
+        atomic_set(&multifd_send_state->error, true);
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->quit = true;
+    qemu_mutex_unlock(&p->mutex);
+
+    /* Whoever waits for this channel has to notice that it is gone */
+    qemu_sem_post(&multifd_send_state->sem_sync);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+    trace_multifd_send_thread_end(p->id);
+
+    return NULL;
+}
+
+void multifd_save_setup(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_new0(MultiFDSendState, 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->id = i;
+        p->fd = -1;
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->pages = g_new0(MultiFDPages, 1);
+    }
+}
+
+/* Takes ownership of @fd, which must be a connected blocking socket */
+void multifd_send_new_channel(int id, int fd)
+{
+    MultiFDSendParams *p = &multifd_send_state->params[id];
+
+    p->fd = fd;
+    p->running = true;
+    qemu_thread_create(&p->thread, "multifd-send", multifd_send_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* Makes the channel threads give up, even if they are blocked sending */
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        if (p->fd != -1) {
+            shutdown(p->fd, SHUT_RDWR);
+        }
+        qemu_sem_post(&p->sem);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    multifd_send_shutdown();
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->fd != -1) {
+            closesocket(p->fd);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Hands the gathered pages over to an idle channel */
+static int multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages *pages;
+    int i, n;
+
+    /* Each post stands for a channel that became idle (or quit), and only
+     * this function makes channels busy, so one pass finds an idle one.
+     */
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (n = 0; n < multifd_send_state->count; n++) {
+        i = (multifd_send_state->next_channel + n) % multifd_send_state->count;
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            return -EIO;
+        }
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    assert(n < multifd_send_state->count);
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    pages = p->pages;
+    p->pages = multifd_send_state->pages;
+    p->pending_job = 1;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    multifd_send_state->pages = pages;
+    pages->used = 0;
+    pages->block = NULL;
+
+    return 0;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    int ret;
+
+    /* A packet only carries pages of a single RAMBlock */
+    if (pages->used && pages->block != block) {
+        ret = multifd_send_pages();
+        if (ret < 0) {
+            return ret;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+/**
+ * multifd_send_sync_main: flush the channels at the end of a round
+ *
+ * Every channel sends a SYNC packet after the pages queued so far, and
+ * RAM_SAVE_FLAG_MULTIFD_SYNC is written to the main stream.  The
+ * destination does not read past that flag before all channels have
+ * received their SYNC packet, so a page sent in a later round can never be
+ * overtaken by an older copy.
+ *
+ * Returns: 0 on success, negative on error
+ *
+ * @f: QEMUFile where to send the data
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i, ret;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used) {
+        ret = multifd_send_pages();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            return -EIO;
+        }
+        p->flags |= MULTIFD_FLAG_SYNC;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        return -EIO;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    trace_multifd_send_sync_main();
+    return 0;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -418,6 +912,49 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return size;
 }
 
+/* Throttle the vcpus that dirtied more pages than the average vcpu during the
+ * last period, instead of the whole guest.  Returns false if the dirty pages
+ * could not be accounted to vcpus (KVM has no per-vcpu dirty log).
+ */
+static bool mig_throttle_dirty_vcpus(int pct_initial, int pct_increment)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int nr_vcpus = 0;
+
+    CPU_FOREACH(cpu) {
+        total += atomic_read(&cpu->dirty_pages);
+        nr_vcpus++;
+    }
+    if (!total) {
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        uint64_t dirty_pages = atomic_read(&cpu->dirty_pages);
+        int pct;
+
+        if (dirty_pages * nr_vcpus < total) {
+            continue;
+        }
+        pct = cpu->throttle_percentage ?
+              cpu->throttle_percentage + pct_increment : pct_initial;
+        trace_migration_throttle_vcpu(cpu->cpu_index, dirty_pages, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+    return true;
+}
+
+/* Start counting the pages dirtied by each vcpu in a new period */
+static void mig_reset_vcpu_dirty_pages(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        atomic_xchg(&cpu->dirty_pages, 0);
+    }
+}
+
 /* Reduce amount of guest cpu execution to hopefully slow down memory writes.
  * If guest dirty memory rate is reduced below the rate at which we can
  * transfer pages to the destination then we should be able to complete
@@ -432,6 +969,10 @@ static void mig_throttle_guest_down(void)
     uint64_t pct_icrement =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
 
+    if (mig_throttle_dirty_vcpus(pct_initial, pct_icrement)) {
+        return;
+    }
+
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
         cpu_throttle_set(pct_initial);
@@ -599,6 +1140,9 @@ static int64_t start_time;
 static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
+static uint64_t xbzrle_pages_prev;
+static uint64_t xbzrle_bytes_prev;
+static uint64_t xbzrle_overflows_prev;
 static uint64_t iterations_prev;
 
 static void migration_bitmap_sync_init(void)
@@ -607,6 +1151,9 @@ static void migration_bitmap_sync_init(void)
     bytes_xfer_prev = 0;
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
+    xbzrle_pages_prev = 0;
+    xbzrle_bytes_prev = 0;
+    xbzrle_overflows_prev = 0;
     iterations_prev = 0;
 }
 
@@ -663,17 +1210,32 @@ static void migration_bitmap_sync(void)
                     mig_throttle_guest_down();
              }
              bytes_xfer_prev = bytes_xfer_now;
+             mig_reset_vcpu_dirty_pages();
         }
 
         if (migrate_use_xbzrle()) {
+            uint64_t pages = acct_info.xbzrle_pages - xbzrle_pages_prev;
+            uint64_t bytes = acct_info.xbzrle_bytes - xbzrle_bytes_prev;
+
             if (iterations_prev != acct_info.iterations) {
                 acct_info.xbzrle_cache_miss_rate =
                    (double)(acct_info.xbzrle_cache_miss -
                             xbzrle_cache_miss_prev) /
                    (acct_info.iterations - iterations_prev);
             }
+            /* how many bytes of guest RAM each byte on the wire stood for */
+            acct_info.xbzrle_encoding_rate =
+                bytes ? (double)pages * TARGET_PAGE_SIZE / bytes : 0;
+            trace_migration_xbzrle_period(pages, bytes,
+                                          acct_info.xbzrle_cache_miss -
+                                          xbzrle_cache_miss_prev,
+                                          acct_info.xbzrle_overflows -
+                                          xbzrle_overflows_prev);
             iterations_prev = acct_info.iterations;
             xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+            xbzrle_pages_prev = acct_info.xbzrle_pages;
+            xbzrle_bytes_prev = acct_info.xbzrle_bytes;
+            xbzrle_overflows_prev = acct_info.xbzrle_overflows;
         }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
@@ -786,6 +1348,24 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
+    /* Normal pages go through the multifd channels, but not those that
+     * xbzrle has just copied into its cache: they must reach the destination
+     * with the same contents as the cached copy.
+     */
+    if (pages == -1 && send_async && migrate_use_multifd()) {
+        ret = multifd_queue_page(block, pss->offset);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            XBZRLE_cache_unlock();
+            return ret;
+        }
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        XBZRLE_cache_unlock();
+        return 1;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -802,27 +1382,159 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
 
     XBZRLE_cache_unlock();
 
+    if (pages > 0 && migrate_use_multifd()) {
+        /* See ram_save_target_page */
+        last_sent_block = block;
+    }
+
     return pages;
 }
 
+#ifdef CONFIG_ZSTD
+/*
+ * Compress a page as the continuation of the zstd stream of the thread, so
+ * that previous pages work as the dictionary for this one.  The page is
+ * written as the stream id, the length and the compressed data.
+ */
+static int compress_page_zstd(CompressParam *param, uint8_t *p)
+{
+    Error *local_err = NULL;
+    ssize_t len;
+
+    len = zstd_compress_page(param->zcs, &param->level,
+                             atomic_read(&compress_level),
+                             p, TARGET_PAGE_SIZE, param->zbuf,
+                             ZSTD_compressBound(TARGET_PAGE_SIZE), &local_err);
+    if (len < 0) {
+        error_report_err(local_err);
+        qemu_file_set_error(param->file, -EIO);
+        return 0;
+    }
+
+    qemu_put_byte(param->file, param->id);
+    qemu_put_be32(param->file, len);
+    qemu_put_buffer(param->file, param->zbuf, len);
+    return len + 5;
+}
+#else
+static int compress_page_zstd(CompressParam *param, uint8_t *p)
+{
+    g_assert_not_reached();
+}
+#endif
+
 static int do_compress_ram_page(CompressParam *param)
 {
     int bytes_sent, blen;
     uint8_t *p;
     RAMBlock *block = param->block;
     ram_addr_t offset = param->offset;
+    int64_t t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     p = block->host + (offset & TARGET_PAGE_MASK);
 
     bytes_sent = save_page_header(param->file, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    if (migrate_use_compress_zstd()) {
+        blen = compress_page_zstd(param, p);
+    } else {
+        blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
+                                         migrate_compress_level());
+    }
     bytes_sent += blen;
 
+    param->bytes_in += TARGET_PAGE_SIZE;
+    param->bytes_out += blen;
+    param->busy_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
+
     return bytes_sent;
 }
 
+/* Append the pages compressed by a thread to the migration stream */
+static int put_compressed_data(QEMUFile *f, CompressParam *param)
+{
+    int ret = qemu_file_get_error(param->file);
+
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+    return qemu_put_qemu_file(f, param->file);
+}
+
+/*
+ * Raise the zstd level while the compression threads could compress twice
+ * as much guest memory as the link can carry, and lower it when they cannot
+ * keep up with the link.
+ */
+static void compress_adjust_level(uint64_t in, uint64_t out, int64_t busy_ns)
+{
+    MigrationState *s = migrate_get_current();
+    int level = compress_level;
+    /* bytes of guest memory per second that the threads can compress */
+    double capacity = (double)in * migrate_compress_threads() *
+                      NANOSECONDS_PER_SECOND / busy_ns;
+    /* bytes of guest memory per second that fit in the link once compressed */
+    double needed = (double)s->bandwidth_limit * in / out;
+
+    /* Without a bandwidth limit there is nothing to adjust to */
+    if (!s->bandwidth_limit) {
+        return;
+    }
+    if (capacity < needed) {
+        level = MAX(level - 1, COMPRESS_ZSTD_LEVEL_MIN);
+    } else if (capacity > 2 * needed) {
+        level = MIN(level + 1, COMPRESS_ZSTD_LEVEL_MAX);
+    }
+    if (level != compress_level) {
+        trace_migration_compress_level(level, capacity, needed);
+        atomic_set(&compress_level, level);
+    }
+}
+
+/* Called from the migration thread after sending a batch of pages */
+static void compress_update_stats(void)
+{
+    uint64_t bytes_in = 0, bytes_out = 0;
+    int64_t busy_ns = 0, now;
+    int idx, thread_count;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    thread_count = migrate_compress_threads();
+    for (idx = 0; idx < thread_count; idx++) {
+        qemu_mutex_lock(&comp_param[idx].mutex);
+        bytes_in += comp_param[idx].bytes_in;
+        bytes_out += comp_param[idx].bytes_out;
+        busy_ns += comp_param[idx].busy_ns;
+        qemu_mutex_unlock(&comp_param[idx].mutex);
+    }
+    acct_info.compress_pages = bytes_in / TARGET_PAGE_SIZE;
+    acct_info.compress_bytes = bytes_out;
+
+    /* Rates are computed over periods of about one second */
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (now < compress_stats_time + 1000 ||
+        bytes_out == compress_bytes_out_prev ||
+        busy_ns == compress_busy_ns_prev) {
+        return;
+    }
+    acct_info.compress_rate = (double)(bytes_in - compress_bytes_in_prev) /
+                              (bytes_out - compress_bytes_out_prev);
+    acct_info.compress_throughput = (double)(bytes_in - compress_bytes_in_prev)
+                                    * 1000 / (now - compress_stats_time);
+    if (migrate_use_compress_zstd()) {
+        compress_adjust_level(bytes_in - compress_bytes_in_prev,
+                              bytes_out - compress_bytes_out_prev,
+                              busy_ns - compress_busy_ns_prev);
+    }
+
+    compress_stats_time = now;
+    compress_bytes_in_prev = bytes_in;
+    compress_bytes_out_prev = bytes_out;
+    compress_busy_ns_prev = busy_ns;
+}
+
 static inline void start_compression(CompressParam *param)
 {
     param->done = false;
@@ -859,7 +1571,7 @@ static void flush_compressed_data(QEMUFile *f)
             qemu_mutex_unlock(comp_done_lock);
         }
         if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
+            len = put_compressed_data(f, &comp_param[idx]);
             bytes_transferred += len;
         }
     }
@@ -883,7 +1595,7 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
     while (true) {
         for (idx = 0; idx < thread_count; idx++) {
             if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
+                bytes_xmit = put_compressed_data(f, &comp_param[idx]);
                 set_compress_params(&comp_param[idx], block, offset);
                 start_compression(&comp_param[idx]);
                 pages = 1;
@@ -962,7 +1674,7 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                  */
                 bytes_xmit = do_compress_ram_page(&comp_param[0]);
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
+                put_compressed_data(f, &comp_param[0]);
                 *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
@@ -1261,9 +1973,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  With multifd most pages bypass the stream, so
+         * ram_save_page does it itself for those that did not.
          */
-        if (res > 0) {
+        if (res > 0 && !migrate_use_multifd()) {
             last_sent_block = pss->block;
         }
     }
@@ -1946,6 +2659,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
     memory_global_dirty_log_start();
+    mig_reset_vcpu_dirty_pages();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -2014,7 +2728,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    compress_update_stats();
+    ret = multifd_send_sync_main(f);
     rcu_read_unlock();
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
 
     /*
      * Must occur before EOS (or any QEMUFile operation)
@@ -2036,6 +2755,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
@@ -2052,12 +2773,17 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         pages = ram_find_and_save_block(f, true, &bytes_transferred);
         /* no more blocks to sent */
-        if (pages == 0) {
+        if (pages <= 0) {
             break;
         }
     }
 
     flush_compressed_data(f);
+    compress_update_stats();
+    ret = multifd_send_sync_main(f);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2184,6 +2910,28 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+#ifdef CONFIG_ZSTD
+/*
+ * Pages of a stream depend on the pages before them, so unlike with zlib a
+ * failure cannot be ignored: the following pages would be corrupted too.
+ */
+static void decompress_page_zstd(DecompressParam *param)
+{
+    Error *local_err = NULL;
+
+    if (zstd_decompress_page(param->zds, param->compbuf, param->len,
+                             param->des, TARGET_PAGE_SIZE, &local_err) < 0) {
+        error_report_err(local_err);
+        atomic_set(&decomp_stream_error, true);
+    }
+}
+#else
+static void decompress_page_zstd(DecompressParam *param)
+{
+    g_assert_not_reached();
+}
+#endif
+
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
@@ -2194,7 +2942,9 @@ static void *do_data_decompress(void *opaque)
         while (!param->start && !quit_decomp_thread) {
             qemu_cond_wait(&param->cond, &param->mutex);
             pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
+            if (!quit_decomp_thread && migrate_use_compress_zstd()) {
+                decompress_page_zstd(param);
+            } else if (!quit_decomp_thread) {
                 /* uncompress() will return failed in some case, especially
                  * when the page is dirted when doing the compression, it's
                  * not a problem because the dirty page will be retransferred
@@ -2203,7 +2953,8 @@ static void *do_data_decompress(void *opaque)
                 uncompress((Bytef *)param->des, &pagesize,
                            (const Bytef *)param->compbuf, param->len);
             }
-            param->start = false;
+            /* publishes decomp_stream_error to wait_for_decompress_done */
+            atomic_mb_set(&param->start, false);
         }
         qemu_mutex_unlock(&param->mutex);
     }
@@ -2219,10 +2970,11 @@ void migrate_decompress_threads_create(void)
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
     quit_decomp_thread = false;
+    decomp_stream_error = false;
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf = g_malloc0(compress_bound());
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2246,12 +2998,64 @@ void migrate_decompress_threads_join(void)
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
     }
+#ifdef CONFIG_ZSTD
+    for (i = 0; i < ARRAY_SIZE(decomp_streams); i++) {
+        ZSTD_freeDCtx(decomp_streams[i]);
+        decomp_streams[i] = NULL;
+    }
+#endif
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
     decomp_param = NULL;
 }
 
+#ifdef CONFIG_ZSTD
+/*
+ * The pages of a stream must be decompressed in order, so each stream is
+ * always handled by the same thread.
+ */
+static void decompress_stream_with_multi_threads(QEMUFile *f, void *host,
+                                                 int len, uint8_t stream)
+{
+    int idx = stream % migrate_decompress_threads();
+
+    if (!decomp_streams[stream]) {
+        decomp_streams[stream] = ZSTD_createDCtx();
+    }
+    while (atomic_read(&decomp_param[idx].start)) {
+        /* wait for the previous page of the thread */
+    }
+    qemu_get_buffer(f, decomp_param[idx].compbuf, len);
+    decomp_param[idx].des = host;
+    decomp_param[idx].len = len;
+    decomp_param[idx].zds = decomp_streams[stream];
+    start_decompression(&decomp_param[idx]);
+}
+#else
+static void decompress_stream_with_multi_threads(QEMUFile *f, void *host,
+                                                 int len, uint8_t stream)
+{
+    g_assert_not_reached();
+}
+#endif
+
+/* Wait until the threads have decompressed every page they were given */
+static void wait_for_decompress_done(void)
+{
+    int idx, thread_count;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    thread_count = migrate_decompress_threads();
+    for (idx = 0; idx < thread_count; idx++) {
+        while (atomic_mb_read(&decomp_param[idx].start)) {
+            /* wait for the thread to finish its page */
+        }
+    }
+}
+
 static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
@@ -2274,6 +3078,240 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     }
 }
 
+struct MultiFDRecvParams {
+    uint8_t id;
+    int fd;
+    QemuThread thread;
+    bool running;
+    bool quit;
+    /* posted by the main thread once every channel reached a SYNC packet */
+    QemuSemaphore sem_sync;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+};
+typedef struct MultiFDRecvParams MultiFDRecvParams;
+
+typedef struct {
+    MultiFDRecvParams *params;
+    int count;
+    /* posted each time a channel has received a SYNC packet */
+    QemuSemaphore sem_sync;
+    bool error;
+} MultiFDRecvState;
+
+static MultiFDRecvState *multifd_recv_state;
+
+/* Called within an RCU critical section */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, uint32_t *used,
+                                      uint32_t *flags)
+{
+    MultiFDPacket *packet = &p->packet;
+    RAMBlock *block;
+    uint32_t i;
+
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_report("multifd: bad packet magic %#x on channel %d",
+                     be32_to_cpu(packet->magic), p->id);
+        return -EINVAL;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    *used = be32_to_cpu(packet->pages_used);
+    if (*used > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: packet with %u pages on channel %d",
+                     *used, p->id);
+        return -EINVAL;
+    }
+    if (!*used) {
+        return 0;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_report("multifd: can't find block %s", packet->ramblock);
+        return -EINVAL;
+    }
+    for (i = 0; i < *used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+        void *host = host_from_ram_block_offset(block, offset);
+
+        if (!host || (offset & ~TARGET_PAGE_MASK)) {
+            error_report("multifd: illegal RAM offset " RAM_ADDR_FMT
+                         " in block %s", offset, block->idstr);
+            return -EINVAL;
+        }
+        p->iov[i].iov_base = host;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    struct iovec iov = { .iov_base = &p->packet,
+                         .iov_len = sizeof(p->packet) };
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    while (true) {
+        uint32_t used, flags;
+        ssize_t len;
+        int ret;
+
+        len = iov_recv(p->fd, &iov, 1, 0, sizeof(p->packet));
+        if (len != sizeof(p->packet)) {
+            break;
+        }
+
+        rcu_read_lock();
+        ret = multifd_recv_unfill_packet(p, &used, &flags);
+        if (!ret && used) {
+            len = used * TARGET_PAGE_SIZE;
+            if (iov_recv(p->fd, p->iov, used, 0, len) != len) {
+                ret = -EIO;
+            }
+        }
+        rcu_read_unlock();
+        if (ret < 0) {
+            break;
+        }
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    /* The source closes the channels once it is done, which is only fine
+     * after the last synchronization point; the main thread finds out
+     * whether that was the case.
+     */
+    if (!atomic_read(&p->quit)) {
+        atomic_set(&multifd_recv_state->error, true);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+    trace_multifd_recv_thread_end(p->id);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+void multifd_load_setup(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(MultiFDRecvState, 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = thread_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        p->id = i;
+        p->fd = -1;
+        qemu_sem_init(&p->sem_sync, 0);
+    }
+}
+
+/* Reads the handshake from @fd, a connected blocking socket, and starts
+ * receiving on it.  Takes ownership of @fd on success.
+ */
+int multifd_recv_new_channel(int fd, Error **errp)
+{
+    MultiFDRecvParams *p;
+    MultiFDInit msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+    if (iov_recv(fd, &iov, 1, 0, sizeof(msg)) != sizeof(msg)) {
+        error_setg_errno(errp, errno, "multifd: failed to read handshake");
+        return -1;
+    }
+    if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: bad handshake magic %#x",
+                   be32_to_cpu(msg.magic));
+        return -1;
+    }
+    if (be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: unsupported version %u",
+                   be32_to_cpu(msg.version));
+        return -1;
+    }
+    if (msg.id >= multifd_recv_state->count) {
+        error_setg(errp, "multifd: channel %d out of range, expected at "
+                   "most %d channels", msg.id, multifd_recv_state->count);
+        return -1;
+    }
+    p = &multifd_recv_state->params[msg.id];
+    if (p->running) {
+        error_setg(errp, "multifd: channel %d received twice", msg.id);
+        return -1;
+    }
+
+    p->fd = fd;
+    p->running = true;
+    qemu_thread_create(&p->thread, "multifd-recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            atomic_set(&p->quit, true);
+            shutdown(p->fd, SHUT_RDWR);
+            qemu_sem_post(&p->sem_sync);
+            qemu_thread_join(&p->thread);
+        }
+        if (p->fd != -1) {
+            closesocket(p->fd);
+        }
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/* Waits until every channel has received all pages sent before the
+ * RAM_SAVE_FLAG_MULTIFD_SYNC that was just read, then lets them go on.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: synchronization point without channels");
+        return -EINVAL;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+    return 0;
+}
+
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
@@ -2413,6 +3451,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    int stream;
     /*
      * If system is running in postcopy mode, page inserts to host memory must
      * be atomic
@@ -2504,13 +3543,18 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            stream = migrate_use_compress_zstd() ? qemu_get_byte(f) : -1;
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > compress_bound()) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            if (stream >= 0) {
+                decompress_stream_with_multi_threads(f, host, len, stream);
+            } else {
+                decompress_data_with_multi_threads(f, host, len);
+            }
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2521,6 +3565,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2538,6 +3585,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    /* Whether at the end of the section or on an error, let the threads
+     * finish the pages they have, and fail if one of them broke a stream.
+     */
+    wait_for_decompress_done();
+    if (!ret && atomic_read(&decomp_stream_error)) {
+        ret = -EINVAL;
+    }
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -16,12 +16,14 @@
 #include "qemu/osdep.h"
 
 #include "qemu-common.h"
+#include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -33,6 +35,99 @@
     do { } while (0)
 #endif
 
+/* How long the destination waits for the multifd channels to show up */
+#define MULTIFD_ACCEPT_TIMEOUT (10 * NANOSECONDS_PER_SECOND)
+
+static char *outgoing_host_port;
+
+/* The multifd channels of an outgoing migration being connected */
+typedef struct TcpMultiFDConnect {
+    MigrationState *s;
+    /* the main channel, already connected */
+    int fd;
+    /* connections that have not completed yet */
+    int pending;
+    Error *err;
+} TcpMultiFDConnect;
+
+typedef struct TcpMultiFDChannel {
+    TcpMultiFDConnect *conn;
+    int id;
+} TcpMultiFDChannel;
+
+static void tcp_migration_connected(MigrationState *s, int fd)
+{
+    DPRINTF("migrate connect success\n");
+    s->to_dst_file = qemu_fopen_socket(fd, "wb");
+    migrate_fd_connect(s);
+}
+
+/* Starts the migration once every channel has connected or failed */
+static void tcp_multifd_channel_done(TcpMultiFDConnect *conn)
+{
+    if (--conn->pending) {
+        return;
+    }
+    if (conn->err) {
+        error_report_err(conn->err);
+        multifd_save_cleanup();
+        closesocket(conn->fd);
+        conn->s->to_dst_file = NULL;
+        migrate_fd_error(conn->s);
+    } else {
+        tcp_migration_connected(conn->s, conn->fd);
+    }
+    g_free(conn);
+}
+
+static void tcp_wait_for_multifd_connect(int fd, Error *err, void *opaque)
+{
+    TcpMultiFDChannel *ch = opaque;
+    TcpMultiFDConnect *conn = ch->conn;
+
+    if (fd < 0) {
+        error_propagate(&conn->err, err);
+    } else {
+        /* the channel threads use blocking I/O */
+        qemu_set_block(fd);
+        multifd_send_new_channel(ch->id, fd);
+    }
+    g_free(ch);
+    tcp_multifd_channel_done(conn);
+}
+
+/* The multifd channels are only opened once the main one is established, so
+ * that the destination accepts the main channel first.  Like the main one,
+ * they connect without blocking the main loop.
+ */
+static void tcp_connect_multifd_channels(MigrationState *s, int fd)
+{
+    TcpMultiFDConnect *conn = g_new0(TcpMultiFDConnect, 1);
+    int i;
+
+    conn->s = s;
+    conn->fd = fd;
+    /* one more, so that channels that connect at once do not finish early */
+    conn->pending = migrate_multifd_channels() + 1;
+
+    multifd_save_setup();
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        TcpMultiFDChannel *ch = g_new0(TcpMultiFDChannel, 1);
+        Error *local_err = NULL;
+
+        ch->conn = conn;
+        ch->id = i;
+        if (inet_nonblocking_connect(outgoing_host_port,
+                                     tcp_wait_for_multifd_connect, ch,
+                                     &local_err) < 0) {
+            error_propagate(&conn->err, local_err);
+            g_free(ch);
+            tcp_multifd_channel_done(conn);
+        }
+    }
+    tcp_multifd_channel_done(conn);
+}
+
 static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 {
     MigrationState *s = opaque;
@@ -41,18 +136,49 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
         DPRINTF("migrate connect error: %s\n", error_get_pretty(err));
         s->to_dst_file = NULL;
         migrate_fd_error(s);
+    } else if (migrate_use_multifd()) {
+        tcp_connect_multifd_channels(s, fd);
     } else {
-        DPRINTF("migrate connect success\n");
-        s->to_dst_file = qemu_fopen_socket(fd, "wb");
-        migrate_fd_connect(s);
+        tcp_migration_connected(s, fd);
     }
 }
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(outgoing_host_port);
+    outgoing_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+static int tcp_accept_multifd_channels(int s, Error **errp)
+{
+    int i, c;
+
+    multifd_load_setup();
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        GPollFD pfd = { .fd = s, .events = G_IO_IN };
+
+        if (qemu_poll_ns(&pfd, 1, MULTIFD_ACCEPT_TIMEOUT) <= 0) {
+            error_setg(errp, "multifd: timed out waiting for channel %d "
+                       "(is x-multifd enabled on the source?)", i);
+            return -1;
+        }
+        do {
+            c = qemu_accept(s, NULL, NULL);
+        } while (c < 0 && errno == EINTR);
+        if (c < 0) {
+            error_setg_errno(errp, errno, "could not accept multifd channel");
+            return -1;
+        }
+        qemu_set_block(c);
+        if (multifd_recv_new_channel(c, errp) < 0) {
+            closesocket(c);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -60,21 +186,30 @@ static void tcp_accept_incoming_migration(void *opaque)
     int s = (intptr_t)opaque;
     QEMUFile *f;
     int c;
+    Error *local_err = NULL;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c < 0 && errno == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(errno));
+        closesocket(s);
         return;
     }
 
+    if (migrate_use_multifd() &&
+        tcp_accept_multifd_channels(s, &local_err) < 0) {
+        error_report_err(local_err);
+        closesocket(s);
+        goto out;
+    }
+    closesocket(s);
+
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
@@ -85,6 +220,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     return;
 
 out:
+    multifd_load_cleanup();
     closesocket(c);
 }
 
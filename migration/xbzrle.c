@@ -14,6 +14,72 @@
 #include "qemu/cutils.h"
 #include "include/migration/migration.h"
 
+/*
+ * The encoder spends its time finding where runs of equal and of different
+ * bytes end.  The scanners below return the end of the run starting at @i;
+ * they all give the same result, so the encoded stream does not depend on
+ * the host.
+ */
+
+static int zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static int nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -24,12 +90,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static inline __attribute__((always_inline)) int
+xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+              uint8_t *dst, int dlen,
+              int (*zrun_end)(const uint8_t *, const uint8_t *, int, int),
+              int (*nzrun_end)(const uint8_t *, const uint8_t *, int, int))
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -41,28 +109,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,42 +125,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,12 +143,178 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static int xbzrle_encode_long(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         zrun_end_long, nzrun_end_long);
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* A bit set in the mask for every pair of equal bytes */
+static inline unsigned sse2_eq_mask(const uint8_t *old_buf,
+                                    const uint8_t *new_buf)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)old_buf);
+    __m128i b = _mm_loadu_si128((const __m128i *)new_buf);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+}
+
+static inline int zrun_end_sse2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        unsigned mask = sse2_eq_mask(old_buf + i, new_buf + i);
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int nzrun_end_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        unsigned mask = sse2_eq_mask(old_buf + i, new_buf + i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         zrun_end_sse2, nzrun_end_sse2);
+}
+#endif
+
+/* See the comment in util/cutils.c about GCC versions before 4.9 */
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint32_t avx2_eq_mask(const uint8_t *old_buf,
+                                    const uint8_t *new_buf)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)old_buf);
+    __m256i b = _mm256_loadu_si256((const __m256i *)new_buf);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+
+static inline int zrun_end_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t mask = avx2_eq_mask(old_buf + i, new_buf + i);
+        if (mask != 0xffffffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    return zrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static inline int nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t mask = avx2_eq_mask(old_buf + i, new_buf + i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return nzrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         zrun_end_avx2, nzrun_end_avx2);
+}
+#pragma GCC pop_options
+#endif
+
+typedef struct XbzrleEncodeAccel {
+    const char *name;
+    bool (*supported)(void);
+    int (*encode)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen);
+} XbzrleEncodeAccel;
+
+/* Fastest first; the entries without a check work on every host that
+ * built them
+ */
+static const XbzrleEncodeAccel xbzrle_encode_accels[] = {
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+    { "avx2", host_cpu_has_avx2, xbzrle_encode_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", NULL, xbzrle_encode_sse2 },
+#endif
+    { "long", NULL, xbzrle_encode_long },
+};
+
+static const XbzrleEncodeAccel *xbzrle_encode_accel =
+    &xbzrle_encode_accels[ARRAY_SIZE(xbzrle_encode_accels) - 1];
+
+static void __attribute__((constructor)) xbzrle_encode_init(void)
+{
+    const XbzrleEncodeAccel *accel;
+
+    for (accel = xbzrle_encode_accels; accel->supported; accel++) {
+        if (accel->supported()) {
+            break;
+        }
+    }
+    xbzrle_encode_accel = accel;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_accel->encode(old_buf, new_buf, slen, dst, dlen);
+}
+
+const char *xbzrle_encode_buffer_accel(void)
+{
+    return xbzrle_encode_accel->name;
+}
+
+bool xbzrle_encode_buffer_next_accel(void)
+{
+    const XbzrleEncodeAccel *last =
+        &xbzrle_encode_accels[ARRAY_SIZE(xbzrle_encode_accels) - 1];
+
+    while (xbzrle_encode_accel < last) {
+        xbzrle_encode_accel++;
+        if (!xbzrle_encode_accel->supported ||
+            xbzrle_encode_accel->supported()) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
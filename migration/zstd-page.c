@@ -0,0 +1,63 @@
+/*
+ * Page streams compressed with zstd for RAM migration
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "migration/zstd-page.h"
+
+ssize_t zstd_compress_page(ZSTD_CCtx *zcs, int *frame_level, int level,
+                           const uint8_t *page, size_t size,
+                           uint8_t *buf, size_t buf_size, Error **errp)
+{
+    ZSTD_EndDirective end = level == *frame_level ? ZSTD_e_flush : ZSTD_e_end;
+    ZSTD_inBuffer in = { page, size, 0 };
+    ZSTD_outBuffer out = { buf, buf_size, 0 };
+    size_t ret;
+
+    ret = ZSTD_compressStream2(zcs, &out, &in, end);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "zstd compression failed: %s",
+                   ZSTD_getErrorName(ret));
+        return -1;
+    }
+    if (ret != 0) {
+        error_setg(errp, "zstd compression failed: output buffer too small");
+        return -1;
+    }
+    if (end == ZSTD_e_end) {
+        ZSTD_CCtx_setParameter(zcs, ZSTD_c_compressionLevel, level);
+        *frame_level = level;
+    }
+    return out.pos;
+}
+
+int zstd_decompress_page(ZSTD_DCtx *zds, const uint8_t *buf, size_t len,
+                         uint8_t *page, size_t size, Error **errp)
+{
+    ZSTD_inBuffer in = { buf, len, 0 };
+    ZSTD_outBuffer out = { page, size, 0 };
+    size_t ret;
+
+    while (in.pos < in.size || out.pos < out.size) {
+        size_t in_pos = in.pos, out_pos = out.pos;
+
+        ret = ZSTD_decompressStream(zds, &out, &in);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "zstd decompression failed: %s",
+                       ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (in.pos == in_pos && out.pos == out_pos) {
+            error_setg(errp, "zstd decompression failed: page is %zu bytes",
+                       out.pos);
+            return -1;
+        }
+    }
+    return 0;
+}
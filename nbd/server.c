@@ -1202,7 +1202,7 @@ static void nbd_set_handlers(NBDClient *client)
                            true,
                            client->can_read ? nbd_read : NULL,
                            client->send_coroutine ? nbd_restart_write : NULL,
-                           client);
+                           NULL, client);
     }
 }
 
@@ -1210,7 +1210,7 @@ static void nbd_unset_handlers(NBDClient *client)
 {
     if (client->exp && client->exp->ctx) {
         aio_set_fd_handler(client->exp->ctx, client->sioc->fd,
-                           true, NULL, NULL, NULL);
+                           true, NULL, NULL, NULL, NULL);
     }
 }
 
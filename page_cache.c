@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a 2-way set associative hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,11 +29,15 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages that share a hash bucket */
+#define CACHE_WAYS 2
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_hits;
     uint8_t *it_data;
 };
 
@@ -41,6 +45,8 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -71,8 +77,10 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->num_sets);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -86,6 +94,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -108,31 +117,74 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first of the num_ways items that @address can be cached in */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Hits are halved for every bitmap sync in which the page was not used,
+ * so that pages which were hot a while ago do not stay in the cache
+ * forever.
+ */
+static uint64_t cache_item_hits(const CacheItem *it, uint64_t current_age)
+{
+    uint64_t idle = current_age > it->it_age ? current_age - it->it_age : 0;
 
-    pos = cache_get_cache_pos(cache, addr);
+    return idle >= 64 ? 0 : it->it_hits >> idle;
+}
+
+/* Pick the item to reuse for a new page: a free one, else the least hit */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
 
-    return &cache->page_cache[pos];
+        if (!it->it_data) {
+            return it;
+        }
+        if (cache_item_hits(it, current_age) <
+            cache_item_hits(victim, current_age) ||
+            (cache_item_hits(it, current_age) ==
+             cache_item_hits(victim, current_age) &&
+             it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -142,8 +194,9 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
+    if (it) {
+        /* update the it_age and the hit count when the cache hit */
+        it->it_hits = cache_item_hits(it, current_age) + 1;
         it->it_age = current_age;
         return true;
     }
@@ -159,10 +212,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (it->it_data && it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            return -1;
+        }
+        it->it_hits = 0;
     }
     /* allocate page */
     if (!it->it_data) {
@@ -186,8 +242,9 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
+    unsigned int j;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it, *new_it, *new_set;
 
     g_assert(cache);
 
@@ -212,7 +269,17 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_set = cache_get_set(new_cache, old_it->it_addr);
+            new_it = &new_set[0];
+            for (j = 0; j < new_cache->num_ways; j++) {
+                if (!new_set[j].it_data ||
+                    new_set[j].it_age < new_it->it_age) {
+                    new_it = &new_set[j];
+                    if (!new_it->it_data) {
+                        break;
+                    }
+                }
+            }
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -223,6 +290,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 g_free(new_it->it_data);
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
+                new_it->it_hits = old_it->it_hits;
                 new_it->it_addr = old_it->it_addr;
             }
         }
@@ -231,6 +299,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -521,7 +521,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -564,7 +565,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -3464,6 +3465,28 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tcg", HAS_ARG, QEMU_OPTION_tcg, \
+    "-tcg [thread=single|multi][,superblocks=on|off]\n"
+    "                run all vCPUs in a single TCG thread (default) or\n"
+    "                give each vCPU its own host thread\n"
+    "                superblocks=on retranslates hot paths as superblocks\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcg [thread=single|multi][,superblocks=on|off]
+@findex -tcg
+Select how the TCG accelerator runs guest vCPUs.  With @option{thread=single}
+(the default) all vCPUs are executed round-robin by one host thread.  With
+@option{thread=multi} every vCPU gets its own host thread and runs in parallel
+with the others; this is only available for guest/host combinations whose
+memory models are compatible and cannot be combined with @option{-icount}.
+
+With @option{superblocks=on}, TCG counts how often each translated block runs
+and which block follows it.  Paths through several blocks that are executed
+often are then translated again as a single superblock, which is optimized as
+a whole.  This is only available for x86 guests and cannot be combined with
+@option{-icount} either.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming tcp:[host]:port[,to=maxport][,ipv4][,ipv6]\n" \
     "-incoming rdma:host:port[,ipv4][,ipv6]\n" \
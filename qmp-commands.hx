@@ -754,6 +754,73 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:l",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its memory.  The result
+is returned by query-dirty-rate.  Fails while a migration or another
+measurement is in progress.
+
+Arguments:
+
+- "calc-time": duration of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last calc-dirty-rate command.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "calc-time": duration of the measurement in seconds (json-int, optional)
+- "dirty-rate": rate at which the guest dirtied memory in MB/s
+                (json-int, present once measured)
+- "vcpu-dirty-rate": json-array of json-objects with the following
+                     information, present once measured with TCG:
+         - "id": vCPU index (json-int)
+         - "dirty-rate": dirty rate of the vCPU in MB/s (json-int)
+- "block-dirty-rate": json-array of json-objects with the following
+                      information, present once measured:
+         - "id": name of the RAM block (json-string)
+         - "dirty-rate": dirty rate of the block in MB/s (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "calc-time": 1,
+        "dirty-rate": 108,
+        "block-dirty-rate": [
+           { "id": "pc.ram", "dirty-rate": 108 },
+           { "id": "vga.vram", "dirty-rate": 0 } ]
+      }
+   }
+
 EQMP
 
     {
@@ -1400,7 +1467,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1417,6 +1484,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image file when it is closed and
+                load it again when it is opened (json-bool, optional,
+                default false)
 
 Example:
 
@@ -2888,6 +2958,51 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_cpus,
     },
 
+SQMP
+query-tlb-stats
+---------------
+
+Statistics about the software TLB of each virtual CPU.  Only available
+with TCG.
+
+Return a json-array.  There is one json-object for each MMU mode of each
+virtual CPU, which contains:
+
+- "cpu-index": index of the virtual CPU (json-int)
+- "mmu-index": index of the MMU mode (json-int)
+- "size": current number of entries in the TLB (json-int)
+- "used": number of valid entries in the TLB (json-int)
+- "fills": number of entries filled after a TLB miss (json-int)
+- "victim-hits": number of TLB misses served by the victim TLB (json-int)
+- "flushes": number of times the whole TLB was flushed (json-int)
+- "resizes": number of times the TLB was resized (json-int)
+
+Example:
+
+-> { "execute": "query-tlb-stats" }
+<- {
+      "return":[
+         {
+            "cpu-index":0,
+            "mmu-index":0,
+            "size":1024,
+            "used":601,
+            "fills":183450,
+            "victim-hits":20321,
+            "flushes":311,
+            "resizes":3
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-tlb-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_tlb_stats,
+    },
+
 SQMP
 query-iothreads
 ---------------
@@ -2902,6 +3017,9 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 disables polling (json-int)
+- "poll-grow": polling time growth factor (json-int)
+- "poll-shrink": polling time shrink factor (json-int)
 
 Example:
 
@@ -2910,11 +3028,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3553,6 +3677,19 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "encoding-rate": size of the pages sent with XBZRLE since the
+           previous dirty bitmap sync divided by the size of their
+           encoding (json-number)
+- "compression": only present if compression is active.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages (json-int)
+         - "compressed-size": size of the compressed pages in bytes
+           (json-int)
+         - "compression-rate": size of the pages compressed during the
+           last second divided by their compressed size (json-number)
+         - "throughput": bytes of guest memory compressed per second
+           during the last second (json-number)
+         - "level": compression level in use (json-int)
 
 Examples:
 
@@ -3658,7 +3795,8 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "encoding-rate":6.25
          }
       }
    }
@@ -3684,6 +3822,9 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several connections
+- "x-compress-zstd": compress pages with one zstd stream per compression
+  thread, at a level adjusted to the bandwidth and CPU time available
 
 Arguments:
 
@@ -3714,6 +3855,8 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple RAM page channels state (json-bool)
+         - "x-compress-zstd": zstd stream compression state (json-bool)
 
 Arguments:
 
@@ -3727,7 +3870,9 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-compress-zstd"}
    ]}
 
 EQMP
@@ -3751,6 +3896,8 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-multifd-channels": set the number of extra connections used to send
+                        RAM pages with x-multifd (json-int)
 
 Arguments:
 
@@ -3764,7 +3911,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-multifd-channels:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +3928,8 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-multifd-channels" : number of extra connections used to send
+                                  RAM pages (json-int)
 
 Arguments:
 
@@ -3793,7 +3942,8 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-multifd-channels": 2
       }
    }
 
@@ -93,7 +93,6 @@ typedef enum {
 } ExitStatus;
 
 /* global register indexes */
-static TCGv_env cpu_env;
 static TCGv cpu_std_ir[31];
 static TCGv cpu_fir[31];
 static TCGv cpu_pc;
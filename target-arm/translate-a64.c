@@ -20,6 +20,7 @@
 
 #include "cpu.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -478,6 +479,15 @@ static inline int fp_reg_hi_offset(DisasContext *s, int regno)
     return offsetof(CPUARMState, vfp.regs[regno * 2 + 1]);
 }
 
+/* Offset of the whole 128 bit vector Qn, as used by the tcg_gen_gvec_*
+ * operations (which work on host-endian 64 bit units).
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
 /* Convenience accessors for reading and writing single and double
  * FP registers. Writing clears the upper parts of the associated
  * 128 bit vector register, as required by the architecture.
@@ -8875,11 +8885,36 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
     bool is_q = extract32(insn, 30, 1);
     TCGv_i64 tcg_op1, tcg_op2, tcg_res[2];
     int pass;
+    void (*gvec_fn)(unsigned, uint32_t, uint32_t, uint32_t,
+                    uint32_t, uint32_t) = NULL;
 
     if (!fp_access_check(s)) {
         return;
     }
 
+    switch (size + 4 * is_u) {
+    case 0: /* AND */
+        gvec_fn = tcg_gen_gvec_and;
+        break;
+    case 1: /* BIC */
+        gvec_fn = tcg_gen_gvec_andc;
+        break;
+    case 2: /* ORR */
+        gvec_fn = tcg_gen_gvec_or;
+        break;
+    case 3: /* ORN */
+        gvec_fn = tcg_gen_gvec_orc;
+        break;
+    case 4: /* EOR */
+        gvec_fn = tcg_gen_gvec_xor;
+        break;
+    }
+    if (gvec_fn) {
+        gvec_fn(0, vec_full_reg_offset(s, rd), vec_full_reg_offset(s, rn),
+                vec_full_reg_offset(s, rm), is_q ? 16 : 8, 16);
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -9242,6 +9277,19 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    if (opcode == 0x10) { /* ADD, SUB */
+        if (u) {
+            tcg_gen_gvec_sub(size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm), is_q ? 16 : 8, 16);
+        } else {
+            tcg_gen_gvec_add(size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm), is_q ? 16 : 8, 16);
+        }
+        return;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
@@ -9414,16 +9462,6 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
                 genfn = fns[size][u];
                 break;
             }
-            case 0x10: /* ADD, SUB */
-            {
-                static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_add_u8, gen_helper_neon_sub_u8 },
-                    { gen_helper_neon_add_u16, gen_helper_neon_sub_u16 },
-                    { tcg_gen_add_i32, tcg_gen_sub_i32 },
-                };
-                genfn = fns[size][u];
-                break;
-            }
             case 0x11: /* CMTST, CMEQ */
             {
                 static NeonGenTwoOpFn * const fns[3][2] = {
@@ -24,6 +24,7 @@
 #include "internals.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "qemu/bitops.h"
 #include "arm_ldst.h"
@@ -56,7 +57,6 @@
 #define IS_USER(s) (s->user)
 #endif
 
-TCGv_env cpu_env;
 /* We reuse the same 64-bit temporaries for efficiency.  */
 static TCGv_i64 cpu_V0, cpu_V1, cpu_M0;
 static TCGv_i32 cpu_R[16];
@@ -82,6 +82,7 @@ static const char *regnames[] =
 void arm_translate_init(void)
 {
     int i;
+    int nzcv[4];
 
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
 
@@ -106,6 +107,13 @@ void arm_translate_init(void)
         offsetof(CPUARMState, exclusive_info), "exclusive_info");
 #endif
 
+    /* MRS only needs the flags to be in memory */
+    nzcv[0] = GET_TCGV_I32(cpu_NF);
+    nzcv[1] = GET_TCGV_I32(cpu_ZF);
+    nzcv[2] = GET_TCGV_I32(cpu_CF);
+    nzcv[3] = GET_TCGV_I32(cpu_VF);
+    tcg_set_helper_globals(helper_cpsr_read, nzcv, ARRAY_SIZE(nzcv), NULL, 0);
+
     a64_translate_init();
 }
 
@@ -5391,6 +5399,8 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
     uint32_t imm, mask;
     TCGv_i32 tmp, tmp2, tmp3, tmp4, tmp5;
     TCGv_i64 tmp64;
+    int vec_size;
+    uint32_t rd_ofs, rn_ofs, rm_ofs;
 
     /* FIXME: this access check should not take precedence over UNDEF
      * for invalid encodings; we will generate incorrect syndrome information
@@ -5466,6 +5476,46 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        /* Operations on all elements at once */
+        vec_size = q ? 16 : 8;
+        rd_ofs = vfp_reg_offset(1, rd);
+        rn_ofs = vfp_reg_offset(1, rn);
+        rm_ofs = vfp_reg_offset(1, rm);
+        switch (op) {
+        case NEON_3R_VADD_VSUB:
+            if (u) {
+                tcg_gen_gvec_sub(size, rd_ofs, rn_ofs, rm_ofs,
+                                 vec_size, vec_size);
+            } else {
+                tcg_gen_gvec_add(size, rd_ofs, rn_ofs, rm_ofs,
+                                 vec_size, vec_size);
+            }
+            return 0;
+        case NEON_3R_LOGIC:
+            switch ((u << 2) | size) {
+            case 0: /* VAND */
+                tcg_gen_gvec_and(0, rd_ofs, rn_ofs, rm_ofs,
+                                 vec_size, vec_size);
+                return 0;
+            case 1: /* VBIC */
+                tcg_gen_gvec_andc(0, rd_ofs, rn_ofs, rm_ofs,
+                                  vec_size, vec_size);
+                return 0;
+            case 2: /* VORR */
+                tcg_gen_gvec_or(0, rd_ofs, rn_ofs, rm_ofs,
+                                vec_size, vec_size);
+                return 0;
+            case 3: /* VORN */
+                tcg_gen_gvec_orc(0, rd_ofs, rn_ofs, rm_ofs,
+                                 vec_size, vec_size);
+                return 0;
+            case 4: /* VEOR */
+                tcg_gen_gvec_xor(0, rd_ofs, rn_ofs, rm_ofs,
+                                 vec_size, vec_size);
+                return 0;
+            }
+            break;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -35,6 +35,16 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* The x86 memory model is only honoured for parallel vCPU threads when
+   the host is at least as strongly ordered, i.e. an x86 host too.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define TARGET_SUPPORTS_MTTCG
+#endif
+
+/* Superblocks, whose members fall through to the next one past their
+   conditional branches, have been validated for this target.  */
+#define TARGET_SUPPORTS_SUPERBLOCKS
+
 #ifdef TARGET_X86_64
 #define I386_ELF_MACHINE  EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
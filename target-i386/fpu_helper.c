@@ -23,6 +23,7 @@
 #include "exec/helper-proto.h"
 #include "qemu/host-utils.h"
 #include "exec/cpu_ldst.h"
+#include "qemu/main-loop.h"
 
 #define FPU_RC_MASK         0xc00
 #define FPU_RC_NEAR         0x000
@@ -135,7 +136,16 @@ static void fpu_raise_exception(CPUX86State *env, uintptr_t retaddr)
     }
 #if !defined(CONFIG_USER_ONLY)
     else {
+        /* FERR# is wired to the interrupt controller.  */
+        bool locked = !qemu_mutex_iothread_locked();
+
+        if (locked) {
+            qemu_mutex_lock_iothread();
+        }
         cpu_set_ferr(env);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 #endif
 }
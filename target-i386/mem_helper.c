@@ -55,12 +55,105 @@ void helper_lock_init(void)
 }
 #endif
 
+/* With parallel vCPUs, locked read-modify-write instructions load their
+ * operand normally and store the result with a host compare-and-swap
+ * against the loaded value.  Accesses that cannot be done on host memory
+ * (unaligned, MMIO, pages whose writes are tracked, 64-bit operands on
+ * 32-bit hosts) are replayed with all other vCPUs stopped instead.
+ */
+static void *atomic_mmu_lookup(CPUX86State *env, target_ulong addr,
+                               int size, uintptr_t retaddr)
+{
+#ifdef CONFIG_USER_ONLY
+    if (addr & (size - 1) || size > sizeof(void *)) {
+        cpu_loop_exit_atomic(ENV_GET_CPU(env), retaddr);
+    }
+    return g2h(addr);
+#else
+    int mmu_idx = cpu_mmu_index(env, false);
+    void *haddr;
+
+    if (addr & (size - 1) || size > sizeof(void *)) {
+        cpu_loop_exit_atomic(ENV_GET_CPU(env), retaddr);
+    }
+    haddr = tlb_vaddr_to_host(env, addr, MMU_DATA_STORE, mmu_idx);
+    if (!haddr) {
+        /* fill the TLB, or raise the page fault */
+        probe_write(env, addr, mmu_idx, retaddr);
+        haddr = tlb_vaddr_to_host(env, addr, MMU_DATA_STORE, mmu_idx);
+    }
+    if (!haddr) {
+        cpu_loop_exit_atomic(ENV_GET_CPU(env), retaddr);
+    }
+    return haddr;
+#endif
+}
+
+/* Store @newv at @a0 if it still holds @oldv, the value that the
+ * instruction loaded.  Otherwise another vCPU wrote in between, and the
+ * instruction starts again from its first byte.
+ */
+void helper_rmw_commit(CPUX86State *env, target_ulong a0, target_ulong oldv,
+                       target_ulong newv, uint32_t ot)
+{
+    uintptr_t ra = GETPC();
+    void *haddr = atomic_mmu_lookup(env, a0, 1 << ot, ra);
+    bool ok;
+
+    switch (ot) {
+    case MO_8:
+        ok = atomic_cmpxchg((uint8_t *)haddr, (uint8_t)oldv,
+                            (uint8_t)newv) == (uint8_t)oldv;
+        break;
+    case MO_16:
+        ok = atomic_cmpxchg((uint16_t *)haddr, cpu_to_le16(oldv),
+                            cpu_to_le16(newv)) == cpu_to_le16(oldv);
+        break;
+    case MO_32:
+        ok = atomic_cmpxchg((uint32_t *)haddr, cpu_to_le32(oldv),
+                            cpu_to_le32(newv)) == cpu_to_le32(oldv);
+        break;
+#if defined(TARGET_X86_64) && HOST_LONG_BITS == 64
+    case MO_64:
+        ok = atomic_cmpxchg((uint64_t *)haddr, cpu_to_le64(oldv),
+                            cpu_to_le64(newv)) == cpu_to_le64(oldv);
+        break;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+    if (!ok) {
+        cpu_loop_exit_restore(ENV_GET_CPU(env), ra);
+    }
+}
+
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d;
     int eflags;
 
     eflags = cpu_cc_compute_all(env, CC_OP);
+#if HOST_LONG_BITS == 64
+    if (parallel_cpus) {
+        uint64_t cmpv = ((uint64_t)env->regs[R_EDX] << 32)
+                        | (uint32_t)env->regs[R_EAX];
+        uint64_t newv = ((uint64_t)env->regs[R_ECX] << 32)
+                        | (uint32_t)env->regs[R_EBX];
+        uint64_t *haddr = atomic_mmu_lookup(env, a0, 8, GETPC());
+
+        d = le64_to_cpu(atomic_cmpxchg(haddr, cpu_to_le64(cmpv),
+                                       cpu_to_le64(newv)));
+        if (d == cmpv) {
+            eflags |= CC_Z;
+        } else {
+            env->regs[R_EDX] = (uint32_t)(d >> 32);
+            env->regs[R_EAX] = (uint32_t)d;
+            eflags &= ~CC_Z;
+        }
+        CC_SRC = eflags;
+        return;
+    }
+#endif
     d = cpu_ldq_data_ra(env, a0, GETPC());
     if (d == (((uint64_t)env->regs[R_EDX] << 32) | (uint32_t)env->regs[R_EAX])) {
         cpu_stq_data_ra(env, a0, ((uint64_t)env->regs[R_ECX] << 32)
@@ -85,6 +178,10 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
     if ((a0 & 0xf) != 0) {
         raise_exception_ra(env, EXCP0D_GPF, GETPC());
     }
+    /* there is no 128-bit compare-and-swap to use */
+    if (parallel_cpus) {
+        cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
+    }
     eflags = cpu_cc_compute_all(env, CC_OP);
     d0 = cpu_ldq_data_ra(env, a0, GETPC());
     d1 = cpu_ldq_data_ra(env, a0 + 8, GETPC());
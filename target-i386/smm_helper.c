@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "exec/log.h"
+#include "qemu/main-loop.h"
 
 /* SMM support */
 
@@ -46,9 +47,19 @@ void cpu_smm_update(X86CPU *cpu)
 {
     CPUX86State *env = &cpu->env;
     bool smm_enabled = (env->hflags & HF_SMM_MASK);
+    bool locked = false;
 
     if (cpu->smram) {
+        /* RSM runs without the BQL when vCPUs are in separate threads,
+           but the memory map may only be changed with the BQL held.  */
+        if (!qemu_mutex_iothread_locked()) {
+            qemu_mutex_lock_iothread();
+            locked = true;
+        }
         memory_region_set_enabled(cpu->smram, smm_enabled);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 }
 
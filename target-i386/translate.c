@@ -22,6 +22,7 @@
 #include "cpu.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -71,7 +72,6 @@
 //#define MACRO_TEST   1
 
 /* global register indexes */
-static TCGv_env cpu_env;
 static TCGv cpu_A0;
 static TCGv cpu_cc_dst, cpu_cc_src, cpu_cc_src2, cpu_cc_srcT;
 static TCGv_i32 cpu_cc_op;
@@ -83,6 +83,8 @@ static TCGv_i64 cpu_bndu[4];
 static TCGv cpu_T0, cpu_T1;
 /* local register indexes (only used inside old micro ops) */
 static TCGv cpu_tmp0, cpu_tmp4;
+/* value loaded by a locked read-modify-write, see gen_op_ld_rmw */
+static TCGv cpu_rmw_old;
 static TCGv_ptr cpu_ptr0, cpu_ptr1;
 static TCGv_i32 cpu_tmp2_i32, cpu_tmp3_i32;
 static TCGv_i64 cpu_tmp1_i64;
@@ -433,6 +435,81 @@ static inline void gen_op_st_rm_T0_A0(DisasContext *s, int idx, int d)
     }
 }
 
+static inline bool gen_locked(DisasContext *s)
+{
+    return (s->prefix & PREFIX_LOCK) && parallel_cpus;
+}
+
+/* Store @newv at @a0 with a compare-and-swap against @oldv; the helper
+   restarts the instruction if another vCPU wrote in between.  */
+static void gen_rmw_commit(TCGMemOp ot, TCGv a0, TCGv oldv, TCGv newv)
+{
+    TCGv_i32 t_ot = tcg_const_i32(ot);
+
+    gen_helper_rmw_commit(cpu_env, a0, oldv, newv, t_ot);
+    tcg_temp_free_i32(t_ot);
+}
+
+/* Load and store the memory operand of a read-modify-write instruction.
+   With a LOCK prefix and parallel vCPUs the store only succeeds if memory
+   still holds the loaded value, so nothing that the instruction depends
+   on may be changed before it.  */
+static void gen_op_ld_rmw(DisasContext *s, int idx, TCGv t0, TCGv a0)
+{
+    gen_op_ld_v(s, idx, t0, a0);
+    if (gen_locked(s)) {
+        tcg_gen_mov_tl(cpu_rmw_old, t0);
+    }
+}
+
+static void gen_op_st_rmw(DisasContext *s, int idx, TCGv t0, TCGv a0)
+{
+    if (gen_locked(s)) {
+        gen_rmw_commit(idx, a0, cpu_rmw_old, t0);
+    } else {
+        gen_op_st_v(s, idx, t0, a0);
+    }
+}
+
+static inline void gen_op_st_rmw_T0_A0(DisasContext *s, int idx, int d)
+{
+    if (d == OR_TMP0) {
+        gen_op_st_rmw(s, idx, cpu_T0, cpu_A0);
+    } else {
+        gen_op_mov_reg_v(idx, d, cpu_T0);
+    }
+}
+
+/* The LOCK-prefixed instructions that gen_op_ld_rmw and gen_op_st_rmw
+   make atomic; with parallel vCPUs the others are replayed with all
+   other vCPUs stopped.  */
+static bool lock_is_rmw(int b)
+{
+    switch (b) {
+    case 0x00 ... 0x01: /* add */
+    case 0x08 ... 0x09: /* or */
+    case 0x10 ... 0x11: /* adc */
+    case 0x18 ... 0x19: /* sbb */
+    case 0x20 ... 0x21: /* and */
+    case 0x28 ... 0x29: /* sub */
+    case 0x30 ... 0x31: /* xor */
+    case 0x80 ... 0x83: /* GRP1 */
+    case 0x86 ... 0x87: /* xchg */
+    case 0xf6 ... 0xf7: /* not, neg */
+    case 0xfe ... 0xff: /* inc, dec */
+    case 0x1ab: /* bts */
+    case 0x1b3: /* btr */
+    case 0x1ba: /* bts, btr, btc with immediate */
+    case 0x1bb: /* btc */
+    case 0x1b0 ... 0x1b1: /* cmpxchg */
+    case 0x1c0 ... 0x1c1: /* xadd */
+    case 0x1c7: /* cmpxchg8b, cmpxchg16b: see their helpers */
+        return true;
+    default:
+        return false;
+    }
+}
+
 static inline void gen_jmp_im(target_ulong pc)
 {
     tcg_gen_movi_tl(cpu_tmp0, pc);
@@ -1258,14 +1335,14 @@ static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d)
     if (d != OR_TMP0) {
         gen_op_mov_v_reg(ot, cpu_T0, d);
     } else {
-        gen_op_ld_v(s1, ot, cpu_T0, cpu_A0);
+        gen_op_ld_rmw(s1, ot, cpu_T0, cpu_A0);
     }
     switch(op) {
     case OP_ADCL:
         gen_compute_eflags_c(s1, cpu_tmp4);
         tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
         tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_tmp4);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update3_cc(cpu_tmp4);
         set_cc_op(s1, CC_OP_ADCB + ot);
         break;
@@ -1273,39 +1350,39 @@ static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d)
         gen_compute_eflags_c(s1, cpu_tmp4);
         tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_T1);
         tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_tmp4);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update3_cc(cpu_tmp4);
         set_cc_op(s1, CC_OP_SBBB + ot);
         break;
     case OP_ADDL:
         tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update2_cc();
         set_cc_op(s1, CC_OP_ADDB + ot);
         break;
     case OP_SUBL:
         tcg_gen_mov_tl(cpu_cc_srcT, cpu_T0);
         tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update2_cc();
         set_cc_op(s1, CC_OP_SUBB + ot);
         break;
     default:
     case OP_ANDL:
         tcg_gen_and_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update1_cc();
         set_cc_op(s1, CC_OP_LOGICB + ot);
         break;
     case OP_ORL:
         tcg_gen_or_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update1_cc();
         set_cc_op(s1, CC_OP_LOGICB + ot);
         break;
     case OP_XORL:
         tcg_gen_xor_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        gen_op_st_rmw_T0_A0(s1, ot, d);
         gen_op_update1_cc();
         set_cc_op(s1, CC_OP_LOGICB + ot);
         break;
@@ -1324,18 +1401,15 @@ static void gen_inc(DisasContext *s1, TCGMemOp ot, int d, int c)
     if (d != OR_TMP0) {
         gen_op_mov_v_reg(ot, cpu_T0, d);
     } else {
-        gen_op_ld_v(s1, ot, cpu_T0, cpu_A0);
-    }
-    gen_compute_eflags_c(s1, cpu_cc_src);
-    if (c > 0) {
-        tcg_gen_addi_tl(cpu_T0, cpu_T0, 1);
-        set_cc_op(s1, CC_OP_INCB + ot);
-    } else {
-        tcg_gen_addi_tl(cpu_T0, cpu_T0, -1);
-        set_cc_op(s1, CC_OP_DECB + ot);
+        gen_op_ld_rmw(s1, ot, cpu_T0, cpu_A0);
     }
-    gen_op_st_rm_T0_A0(s1, ot, d);
+    /* the flags only change once the result is stored */
+    gen_compute_eflags_c(s1, cpu_tmp4);
+    tcg_gen_addi_tl(cpu_T0, cpu_T0, c > 0 ? 1 : -1);
+    gen_op_st_rmw_T0_A0(s1, ot, d);
+    tcg_gen_mov_tl(cpu_cc_src, cpu_tmp4);
     tcg_gen_mov_tl(cpu_cc_dst, cpu_T0);
+    set_cc_op(s1, (c > 0 ? CC_OP_INCB : CC_OP_DECB) + ot);
 }
 
 static void gen_shift_flags(DisasContext *s, TCGMemOp ot, TCGv result,
@@ -4315,6 +4389,34 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+            tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xd4: /* paddq */
+            tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+            tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xdb: /* pand */
+            tcg_gen_gvec_and(MO_64, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xdf: /* pandn */
+            tcg_gen_gvec_andc(MO_64, op1_offset, op2_offset, op1_offset,
+                              is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xeb: /* por */
+            tcg_gen_gvec_or(MO_64, op1_offset, op1_offset, op2_offset,
+                            is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xef: /* pxor */
+            tcg_gen_gvec_xor(MO_64, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -4490,11 +4592,20 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->dflag = dflag;
 
     /* lock generation */
-    if (prefixes & PREFIX_LOCK)
+    if (prefixes & PREFIX_LOCK) {
         gen_helper_lock();
+    }
 
     /* now check op code */
  reswitch:
+    /* The global lock only serializes against other TCG code running in
+       the same thread.  With parallel vCPUs, read-modify-write
+       instructions store with a compare-and-swap, and the rest are
+       replayed with all other vCPUs stopped.  */
+    if ((prefixes & PREFIX_LOCK) && parallel_cpus && b != 0x0f &&
+        !lock_is_rmw(b)) {
+        gen_helper_exit_atomic(cpu_env);
+    }
     switch(b) {
     case 0x0f:
         /**************************/
@@ -4630,7 +4741,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (op == 0)
                 s->rip_offset = insn_const_size(ot);
             gen_lea_modrm(env, s, modrm);
-            gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            gen_op_ld_rmw(s, ot, cpu_T0, cpu_A0);
         } else {
             gen_op_mov_v_reg(ot, cpu_T0, rm);
         }
@@ -4645,7 +4756,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         case 2: /* not */
             tcg_gen_not_tl(cpu_T0, cpu_T0);
             if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                gen_op_st_rmw(s, ot, cpu_T0, cpu_A0);
             } else {
                 gen_op_mov_reg_v(ot, rm, cpu_T0);
             }
@@ -4653,7 +4764,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         case 3: /* neg */
             tcg_gen_neg_tl(cpu_T0, cpu_T0);
             if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                gen_op_st_rmw(s, ot, cpu_T0, cpu_A0);
             } else {
                 gen_op_mov_reg_v(ot, rm, cpu_T0);
             }
@@ -5053,9 +5164,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T0, reg);
-            gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
+            gen_op_ld_rmw(s, ot, cpu_T1, cpu_A0);
             tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
-            gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+            gen_op_st_rmw(s, ot, cpu_T0, cpu_A0);
             gen_op_mov_reg_v(ot, reg, cpu_T1);
         }
         gen_op_update2_cc();
@@ -5099,12 +5210,22 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             } else {
                 /* perform no-op store cycle like physical cpu; must be
                    before changing accumulator to ensure idempotency if
-                   the store faults and the instruction is restarted */
-                gen_op_st_v(s, ot, t0, a0);
+                   the store faults and the instruction is restarted.
+                   When locked, it checks that the comparison used the
+                   current value.  */
+                if (gen_locked(s)) {
+                    gen_rmw_commit(ot, a0, t0, t0);
+                } else {
+                    gen_op_st_v(s, ot, t0, a0);
+                }
                 gen_op_mov_reg_v(ot, R_EAX, t0);
                 tcg_gen_br(label2);
                 gen_set_label(label1);
-                gen_op_st_v(s, ot, t1, a0);
+                if (gen_locked(s)) {
+                    gen_rmw_commit(ot, a0, t0, t1);
+                } else {
+                    gen_op_st_v(s, ot, t1, a0);
+                }
             }
             gen_set_label(label2);
             tcg_gen_mov_tl(cpu_cc_src, t0);
@@ -5458,12 +5579,19 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T0, reg);
             /* for xchg, lock is implicit */
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
-            gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
-            gen_op_st_v(s, ot, cpu_T0, cpu_A0);
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+            if (parallel_cpus) {
+                gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
+                gen_rmw_commit(ot, cpu_A0, cpu_T1, cpu_T0);
+            } else {
+                if (!(prefixes & PREFIX_LOCK)) {
+                    gen_helper_lock();
+                }
+                gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
+                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                if (!(prefixes & PREFIX_LOCK)) {
+                    gen_helper_unlock();
+                }
+            }
             gen_op_mov_reg_v(ot, reg, cpu_T1);
         }
         break;
@@ -6549,7 +6677,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (mod != 3) {
             s->rip_offset = 1;
             gen_lea_modrm(env, s, modrm);
-            gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            gen_op_ld_rmw(s, ot, cpu_T0, cpu_A0);
         } else {
             gen_op_mov_v_reg(ot, cpu_T0, rm);
         }
@@ -6585,7 +6713,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_sari_tl(cpu_tmp0, cpu_T1, 3 + ot);
             tcg_gen_shli_tl(cpu_tmp0, cpu_tmp0, ot);
             tcg_gen_add_tl(cpu_A0, cpu_A0, cpu_tmp0);
-            gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            gen_op_ld_rmw(s, ot, cpu_T0, cpu_A0);
         } else {
             gen_op_mov_v_reg(ot, cpu_T0, rm);
         }
@@ -6614,7 +6742,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         }
         if (op != 0) {
             if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                gen_op_st_rmw(s, ot, cpu_T0, cpu_A0);
             } else {
                 gen_op_mov_reg_v(ot, rm, cpu_T0);
             }
@@ -8087,6 +8215,61 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     return s->pc;
 }
 
+/* Tell TCG which globals are accessed by the helpers that are called
+   from hot code, so that the other ones can stay in host registers.  */
+static void x86_helper_globals_init(void)
+{
+    const int eax = GET_TCGV(cpu_regs[R_EAX]);
+    const int ecx = GET_TCGV(cpu_regs[R_ECX]);
+    const int edx = GET_TCGV(cpu_regs[R_EDX]);
+    const int ebx = GET_TCGV(cpu_regs[R_EBX]);
+    const int cc_op = GET_TCGV_I32(cpu_cc_op);
+    const int cc_dst = GET_TCGV(cpu_cc_dst);
+    const int cc_src = GET_TCGV(cpu_cc_src);
+    const int cc_src2 = GET_TCGV(cpu_cc_src2);
+
+    /* these can raise an exception */
+    const int w_a[] = { eax };
+    const int w_ad[] = { eax, edx };
+    const int w_adc[] = { eax, edx, ecx };
+    const int w_abcd[] = { eax, ebx, ecx, edx };
+
+    /* these cannot */
+    const int r_bcd[] = { eax, cc_op, cc_dst, cc_src, cc_src2 };
+    const int w_bcd[] = { eax, cc_src };
+    const int r_aam[] = { eax };
+    const int w_aam[] = { eax, cc_dst };
+
+    tcg_set_helper_globals(helper_divb_AL, NULL, 0, w_a, ARRAY_SIZE(w_a));
+    tcg_set_helper_globals(helper_idivb_AL, NULL, 0, w_a, ARRAY_SIZE(w_a));
+    tcg_set_helper_globals(helper_divw_AX, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+    tcg_set_helper_globals(helper_idivw_AX, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+    tcg_set_helper_globals(helper_divl_EAX, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+    tcg_set_helper_globals(helper_idivl_EAX, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+#ifdef TARGET_X86_64
+    tcg_set_helper_globals(helper_divq_EAX, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+    tcg_set_helper_globals(helper_idivq_EAX, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+#endif
+    tcg_set_helper_globals(helper_cpuid, NULL, 0,
+                           w_abcd, ARRAY_SIZE(w_abcd));
+    tcg_set_helper_globals(helper_rdtsc, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+    tcg_set_helper_globals(helper_rdtscp, NULL, 0, w_adc, ARRAY_SIZE(w_adc));
+    tcg_set_helper_globals(helper_rdmsr, NULL, 0, w_ad, ARRAY_SIZE(w_ad));
+
+    tcg_set_helper_globals(helper_aaa, r_bcd, ARRAY_SIZE(r_bcd),
+                           w_bcd, ARRAY_SIZE(w_bcd));
+    tcg_set_helper_globals(helper_aas, r_bcd, ARRAY_SIZE(r_bcd),
+                           w_bcd, ARRAY_SIZE(w_bcd));
+    tcg_set_helper_globals(helper_daa, r_bcd, ARRAY_SIZE(r_bcd),
+                           w_bcd, ARRAY_SIZE(w_bcd));
+    tcg_set_helper_globals(helper_das, r_bcd, ARRAY_SIZE(r_bcd),
+                           w_bcd, ARRAY_SIZE(w_bcd));
+    tcg_set_helper_globals(helper_aam, r_aam, ARRAY_SIZE(r_aam),
+                           w_aam, ARRAY_SIZE(w_aam));
+    tcg_set_helper_globals(helper_aad, r_aam, ARRAY_SIZE(r_aam),
+                           w_aam, ARRAY_SIZE(w_aam));
+}
+
 void tcg_x86_init(void)
 {
     static const char reg_names[CPU_NB_REGS][4] = {
@@ -8168,6 +8351,7 @@ void tcg_x86_init(void)
                                      bnd_regu_names[i]);
     }
 
+    x86_helper_globals_init();
     helper_lock_init();
 }
 
@@ -8252,6 +8436,7 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
     cpu_tmp2_i32 = tcg_temp_new_i32();
     cpu_tmp3_i32 = tcg_temp_new_i32();
     cpu_tmp4 = tcg_temp_new();
+    cpu_rmw_old = tcg_temp_new();
     cpu_ptr0 = tcg_temp_new_ptr();
     cpu_ptr1 = tcg_temp_new_ptr();
     cpu_cc_srcT = tcg_temp_local_new();
@@ -44,7 +44,6 @@
 
 #define MEM_INDEX 0
 
-static TCGv_env cpu_env;
 static TCGv cpu_R[32];
 static TCGv cpu_pc;
 static TCGv cpu_ie;
@@ -36,9 +36,6 @@
 #include "qemu/host-utils.h"
 #include "exec/cpu_ldst.h"
 
-/* global register indexes */
-static TCGv_env cpu_env;
-
 #include "exec/gen-icount.h"
 #include "exec/helper-proto.h"
 #include "exec/helper-gen.h"
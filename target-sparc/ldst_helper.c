@@ -118,7 +118,7 @@ static void replace_tlb_entry(SparcTLBEntry *tlb,
                               uint64_t tlb_tag, uint64_t tlb_tte,
                               CPUSPARCState *env1)
 {
-    target_ulong mask, size, va, offset;
+    target_ulong mask, size, va;
 
     /* flush page range if translation is valid */
     if (TTE_IS_VALID(tlb->tte)) {
@@ -130,9 +130,7 @@ static void replace_tlb_entry(SparcTLBEntry *tlb,
 
         va = tlb->tag & mask;
 
-        for (offset = 0; offset < size; offset += TARGET_PAGE_SIZE) {
-            tlb_flush_page(cs, va + offset);
-        }
+        tlb_flush_range(cs, va, size);
     }
 
     tlb->tag = tlb_tag;
@@ -0,0 +1,119 @@
+/*
+ * Generic vectorized operation runtime
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "tcg-gvec-desc.h"
+
+/* This file is compiled once, and thus we can't include the standard
+   "exec/helper-proto.h", which has includes that are target specific.  */
+
+#include "exec/helper-head.h"
+
+#define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
+#define DEF_HELPER_FLAGS_3(name, flags, ret, t1, t2, t3) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3));
+#define DEF_HELPER_FLAGS_4(name, flags, ret, t1, t2, t3, t4) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3), \
+                              dh_ctype(t4));
+
+#include "tcg-runtime.h"
+
+/* The operands are only guaranteed to be 8-byte aligned, so the vector
+   types must not require more than that.  Without compiler support for
+   vector types, the same loops work one element at a time.  */
+#ifdef CONFIG_VECTOR16
+typedef uint8_t vec8 __attribute__((vector_size(16), aligned(8)));
+typedef uint16_t vec16 __attribute__((vector_size(16), aligned(8)));
+typedef uint32_t vec32 __attribute__((vector_size(16), aligned(8)));
+typedef uint64_t vec64 __attribute__((vector_size(16), aligned(8)));
+#else
+typedef uint8_t vec8;
+typedef uint16_t vec16;
+typedef uint32_t vec32;
+typedef uint64_t vec64;
+#endif
+
+static inline void clear_high(void *d, intptr_t oprsz, uint32_t desc)
+{
+    intptr_t maxsz = simd_maxsz(desc);
+
+    if (unlikely(maxsz > oprsz)) {
+        memset(d + oprsz, 0, maxsz - oprsz);
+    }
+}
+
+#define DO_ADD(A, B)   ((A) + (B))
+#define DO_SUB(A, B)   ((A) - (B))
+#define DO_AND(A, B)   ((A) & (B))
+#define DO_OR(A, B)    ((A) | (B))
+#define DO_XOR(A, B)   ((A) ^ (B))
+#define DO_ANDC(A, B)  ((A) & ~(B))
+#define DO_ORC(A, B)   ((A) | ~(B))
+
+/* The sizes are multiples of 8 but not necessarily of the vector size;
+   the remaining 8 bytes are done one element at a time.  */
+#define DO_GVEC_3(NAME, TYPE, ETYPE, OP)                                \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)             \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i + sizeof(TYPE) <= oprsz; i += sizeof(TYPE)) {         \
+        *(TYPE *)(d + i) = OP(*(TYPE *)(a + i), *(TYPE *)(b + i));      \
+    }                                                                   \
+    for (; i < oprsz; i += sizeof(ETYPE)) {                             \
+        *(ETYPE *)(d + i) = OP(*(ETYPE *)(a + i), *(ETYPE *)(b + i));   \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_GVEC_3(gvec_add8, vec8, uint8_t, DO_ADD)
+DO_GVEC_3(gvec_add16, vec16, uint16_t, DO_ADD)
+DO_GVEC_3(gvec_add32, vec32, uint32_t, DO_ADD)
+DO_GVEC_3(gvec_add64, vec64, uint64_t, DO_ADD)
+
+DO_GVEC_3(gvec_sub8, vec8, uint8_t, DO_SUB)
+DO_GVEC_3(gvec_sub16, vec16, uint16_t, DO_SUB)
+DO_GVEC_3(gvec_sub32, vec32, uint32_t, DO_SUB)
+DO_GVEC_3(gvec_sub64, vec64, uint64_t, DO_SUB)
+
+DO_GVEC_3(gvec_and, vec64, uint64_t, DO_AND)
+DO_GVEC_3(gvec_or, vec64, uint64_t, DO_OR)
+DO_GVEC_3(gvec_xor, vec64, uint64_t, DO_XOR)
+DO_GVEC_3(gvec_andc, vec64, uint64_t, DO_ANDC)
+DO_GVEC_3(gvec_orc, vec64, uint64_t, DO_ORC)
+
+void HELPER(gvec_mov)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+
+    memmove(d, a, oprsz);
+    clear_high(d, oprsz, desc);
+}
+
+void HELPER(gvec_not)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        *(uint64_t *)(d + i) = ~*(uint64_t *)(a + i);
+    }
+    clear_high(d, oprsz, desc);
+}
@@ -27,6 +27,7 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE 16
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 21
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
 
 typedef struct {
     uint64_t lo __attribute__((aligned(16)));
@@ -71,6 +71,20 @@ static void reset_all_temps(int nb_temps)
     bitmap_zero(temps_used.l, nb_temps);
 }
 
+/* Reset the normal temps at a conditional branch.  The fall-through path
+   is only reached from the branch, so what is known about globals and
+   local temps still holds there.  */
+static void reset_cbranch_temps(TCGContext *s, int nb_temps)
+{
+    int i;
+
+    for (i = s->nb_globals; i < nb_temps; i++) {
+        if (!s->temps[i].temp_local && test_bit(i, temps_used.l)) {
+            reset_temp(i);
+        }
+    }
+}
+
 /* Initialize and activate a temporary.  */
 static void init_temp_info(TCGArg temp)
 {
@@ -570,6 +584,240 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/* Dead store elimination for the CPU state.  The front ends often store
+   to the same env field several times in a row within a basic block
+   (e.g. the PC or the condition codes of each instruction), while only
+   the last value can be observed.  Walk the ops backward and remember
+   the env bytes that are overwritten before anything can read them.  */
+
+#define DSE_MAX_RANGES 16
+
+typedef struct DSERange {
+    intptr_t start;
+    intptr_t end;
+} DSERange;
+
+typedef struct DSEState {
+    DSERange r[DSE_MAX_RANGES];
+    int n;
+} DSEState;
+
+static void dse_forget(DSEState *d, intptr_t start, intptr_t end)
+{
+    int i;
+
+    for (i = 0; i < d->n; ) {
+        if (d->r[i].start < end && start < d->r[i].end) {
+            d->r[i] = d->r[--d->n];
+        } else {
+            i++;
+        }
+    }
+}
+
+static bool dse_is_dead(DSEState *d, intptr_t start, intptr_t end)
+{
+    int i;
+
+    for (i = 0; i < d->n; i++) {
+        if (d->r[i].start <= start && end <= d->r[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void dse_add(DSEState *d, intptr_t start, intptr_t end)
+{
+    int i;
+
+    /* merge with the adjacent or overlapping ranges */
+    for (i = 0; i < d->n; ) {
+        if (d->r[i].start <= end && start <= d->r[i].end) {
+            start = MIN(start, d->r[i].start);
+            end = MAX(end, d->r[i].end);
+            d->r[i] = d->r[--d->n];
+        } else {
+            i++;
+        }
+    }
+    if (d->n < DSE_MAX_RANGES) {
+        d->r[d->n].start = start;
+        d->r[d->n].end = end;
+        d->n++;
+    }
+}
+
+static int dse_access_size(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static inline bool dse_is_env(TCGContext *s, TCGArg arg)
+{
+    return arg < s->nb_globals && s->temps[arg].fixed_reg &&
+           s->temps[arg].reg == TCG_AREG0;
+}
+
+#ifdef CONFIG_DEBUG_TCG
+/* Check, going forward from op OI, that env bytes [start, end) are
+   overwritten before a helper call, an exit, a load or a global access
+   can read them.  This is the property the backward pass relies on.  */
+static bool dse_check_dead(TCGContext *s, int oi, intptr_t start,
+                           intptr_t end)
+{
+    unsigned all = (1u << (end - start)) - 1, covered = 0;
+    int i;
+
+    for (; oi >= 0; oi = s->gen_op_buf[oi].next) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        TCGArg * const args = &s->gen_opparam_buf[op->args];
+        const TCGOpDef *def = &tcg_op_defs[op->opc];
+        int size = dse_access_size(op->opc);
+
+        if (op->opc == INDEX_op_call ||
+            (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS |
+                           TCG_OPF_CALL_CLOBBER))) {
+            return false;
+        }
+        for (i = 0; i < def->nb_oargs + def->nb_iargs; i++) {
+            TCGTemp *ts;
+            intptr_t lo, hi;
+
+            if (args[i] >= s->nb_globals || s->temps[args[i]].fixed_reg) {
+                continue;
+            }
+            ts = &s->temps[args[i]];
+            if (ts->indirect_reg || !dse_is_env(s, ts->mem_base - s->temps)) {
+                return false;
+            }
+            lo = MAX(start, ts->mem_offset);
+            hi = MIN(end, ts->mem_offset +
+                     (ts->type == TCG_TYPE_I64 ? 8 : 4));
+            if (lo < hi &&
+                (((1u << (hi - start)) - (1u << (lo - start))) & ~covered)) {
+                return false;
+            }
+        }
+        if (size && dse_is_env(s, args[1])) {
+            intptr_t lo = MAX(start, (intptr_t)args[2]);
+            intptr_t hi = MIN(end, (intptr_t)args[2] + size);
+            unsigned mask;
+
+            if (lo >= hi) {
+                continue;
+            }
+            mask = (1u << (hi - start)) - (1u << (lo - start));
+            if (def->nb_oargs == 0) {
+                covered |= mask;
+                if (covered == all) {
+                    return true;
+                }
+            } else if (mask & ~covered) {
+                return false;
+            }
+        } else if (size && def->nb_oargs == 1) {
+            return false;
+        }
+    }
+    return false;
+}
+#endif
+
+static void tcg_dead_env_stores(TCGContext *s)
+{
+    DSEState d = { .n = 0 };
+    int oi, oi_prev, i;
+
+    for (oi = s->gen_last_op_idx; oi >= 0; oi = oi_prev) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        TCGArg * const args = &s->gen_opparam_buf[op->args];
+        TCGOpcode opc = op->opc;
+        const TCGOpDef *def = &tcg_op_defs[opc];
+        int size = dse_access_size(opc);
+        int nb_args;
+
+        oi_prev = op->prev;
+
+        /* Anything that can leave the block or look at env sees all
+           the stores done so far.  */
+        if (opc == INDEX_op_call ||
+            (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS |
+                           TCG_OPF_CALL_CLOBBER))) {
+            d.n = 0;
+            continue;
+        }
+
+        if (size && def->nb_oargs == 0 && dse_is_env(s, args[1])) {
+            /* store to env */
+            intptr_t start = args[2];
+
+            if (dse_is_dead(&d, start, start + size)) {
+#ifdef CONFIG_DEBUG_TCG
+                assert(dse_check_dead(s, op->next, start, start + size));
+#endif
+                tcg_op_remove(s, op);
+                continue;
+            }
+            dse_add(&d, start, start + size);
+        } else if (size && dse_is_env(s, args[1])) {
+            /* load from env */
+            dse_forget(&d, args[2], args[2] + size);
+        } else if (size && def->nb_oargs == 1) {
+            /* load through some other pointer, which may point into env */
+            d.n = 0;
+            continue;
+        }
+
+        /* The register allocator may load or store any global used by
+           the op from or to its canonical location.  */
+        nb_args = def->nb_oargs + def->nb_iargs;
+        for (i = 0; i < nb_args && d.n; i++) {
+            TCGTemp *ts;
+
+            if (args[i] >= s->nb_globals) {
+                continue;
+            }
+            ts = &s->temps[args[i]];
+            if (ts->fixed_reg) {
+                continue;
+            }
+            if (ts->indirect_reg || !dse_is_env(s, ts->mem_base - s->temps)) {
+                d.n = 0;
+            } else {
+                dse_forget(&d, ts->mem_offset, ts->mem_offset +
+                           (ts->type == TCG_TYPE_I64 ? 8 : 4));
+            }
+        }
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -1295,7 +1543,17 @@ void tcg_optimize(TCGContext *s)
             break;
 
         case INDEX_op_call:
-            if (!(args[nb_oargs + nb_iargs + 1]
+            if (args[nb_oargs + nb_iargs + 1] & TCG_CALL_GLOBALS_LISTED) {
+                const TCGCallGlobals *g;
+
+                g = tcg_call_globals(s, args[nb_oargs + nb_iargs]);
+                for (i = 0; i < nb_globals; i++) {
+                    if (test_bit(i, temps_used.l) &&
+                        test_bit(i, g->writes.l)) {
+                        reset_temp(i);
+                    }
+                }
+            } else if (!(args[nb_oargs + nb_iargs + 1]
                   & (TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_WRITE_GLOBALS))) {
                 for (i = 0; i < nb_globals; i++) {
                     if (test_bit(i, temps_used.l)) {
@@ -1312,7 +1570,9 @@ void tcg_optimize(TCGContext *s)
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
                the non-zero bits mask for the first output arg.  */
-            if (def->flags & TCG_OPF_BB_END) {
+            if (def->flags & TCG_OPF_COND_BRANCH) {
+                reset_cbranch_temps(s, nb_temps);
+            } else if (def->flags & TCG_OPF_BB_END) {
                 reset_all_temps(nb_temps);
             } else {
         do_reset_output:
@@ -1328,4 +1588,6 @@ void tcg_optimize(TCGContext *s)
             break;
         }
     }
+
+    tcg_dead_env_stores(s);
 }
@@ -0,0 +1,363 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+#include "tcg-gvec-desc.h"
+
+/* Vectors of up to this many 64-bit units are expanded inline.  */
+#define MAX_UNROLL  4
+
+typedef struct {
+    /* Expand inline as a 64-bit operation.  */
+    void (*fni8)(TCGv_i64, TCGv_i64);
+    /* Expand out-of-line helper w/descriptor.  */
+    void (*fno)(TCGv_ptr, TCGv_ptr, TCGv_i32);
+} GVecGen2;
+
+typedef struct {
+    void (*fni8)(TCGv_i64, TCGv_i64, TCGv_i64);
+    void (*fno)(TCGv_ptr, TCGv_ptr, TCGv_ptr, TCGv_i32);
+} GVecGen3;
+
+uint32_t simd_desc(uint32_t oprsz, uint32_t maxsz)
+{
+    uint32_t desc = 0;
+
+    tcg_debug_assert(oprsz % 8 == 0 && oprsz <= (8 << SIMD_OPRSZ_BITS));
+    tcg_debug_assert(maxsz % 8 == 0 && maxsz <= (8 << SIMD_MAXSZ_BITS));
+
+    desc = deposit32(desc, SIMD_OPRSZ_SHIFT, SIMD_OPRSZ_BITS, oprsz / 8 - 1);
+    desc = deposit32(desc, SIMD_MAXSZ_SHIFT, SIMD_MAXSZ_BITS, maxsz / 8 - 1);
+    return desc;
+}
+
+static void check_size_align(uint32_t oprsz, uint32_t maxsz, uint32_t ofs)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz <= maxsz);
+    tcg_debug_assert((oprsz | maxsz | ofs) % 8 == 0);
+}
+
+static void expand_clr(uint32_t dofs, uint32_t size)
+{
+    TCGv_i64 zero = tcg_const_i64(0);
+    uint32_t i;
+
+    for (i = 0; i < size; i += 8) {
+        tcg_gen_st_i64(zero, cpu_env, dofs + i);
+    }
+    tcg_temp_free_i64(zero);
+}
+
+static void expand_2_i64(uint32_t dofs, uint32_t aofs, uint32_t oprsz,
+                         void (*fni)(TCGv_i64, TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, cpu_env, aofs + i);
+        fni(t0, t0);
+        tcg_gen_st_i64(t0, cpu_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+static void expand_3_i64(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                         uint32_t oprsz,
+                         void (*fni)(TCGv_i64, TCGv_i64, TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, cpu_env, aofs + i);
+        tcg_gen_ld_i64(t1, cpu_env, bofs + i);
+        fni(t0, t0, t1);
+        tcg_gen_st_i64(t0, cpu_env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+static void tcg_gen_gvec_2(uint32_t dofs, uint32_t aofs,
+                           uint32_t oprsz, uint32_t maxsz, const GVecGen2 *g)
+{
+    TCGv_ptr a0, a1;
+    TCGv_i32 desc;
+
+    check_size_align(oprsz, maxsz, dofs | aofs);
+
+    if (maxsz <= MAX_UNROLL * 8) {
+        expand_2_i64(dofs, aofs, oprsz, g->fni8);
+        if (maxsz > oprsz) {
+            expand_clr(dofs + oprsz, maxsz - oprsz);
+        }
+        return;
+    }
+
+    a0 = tcg_temp_new_ptr();
+    a1 = tcg_temp_new_ptr();
+    desc = tcg_const_i32(simd_desc(oprsz, maxsz));
+
+    tcg_gen_addi_ptr(a0, cpu_env, dofs);
+    tcg_gen_addi_ptr(a1, cpu_env, aofs);
+    g->fno(a0, a1, desc);
+
+    tcg_temp_free_ptr(a0);
+    tcg_temp_free_ptr(a1);
+    tcg_temp_free_i32(desc);
+}
+
+static void tcg_gen_gvec_3(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                           uint32_t oprsz, uint32_t maxsz, const GVecGen3 *g)
+{
+    TCGv_ptr a0, a1, a2;
+    TCGv_i32 desc;
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+
+    if (maxsz <= MAX_UNROLL * 8) {
+        expand_3_i64(dofs, aofs, bofs, oprsz, g->fni8);
+        if (maxsz > oprsz) {
+            expand_clr(dofs + oprsz, maxsz - oprsz);
+        }
+        return;
+    }
+
+    a0 = tcg_temp_new_ptr();
+    a1 = tcg_temp_new_ptr();
+    a2 = tcg_temp_new_ptr();
+    desc = tcg_const_i32(simd_desc(oprsz, maxsz));
+
+    tcg_gen_addi_ptr(a0, cpu_env, dofs);
+    tcg_gen_addi_ptr(a1, cpu_env, aofs);
+    tcg_gen_addi_ptr(a2, cpu_env, bofs);
+    g->fno(a0, a1, a2, desc);
+
+    tcg_temp_free_ptr(a0);
+    tcg_temp_free_ptr(a1);
+    tcg_temp_free_ptr(a2);
+    tcg_temp_free_i32(desc);
+}
+
+static void gen_mov_i64(TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_mov_i64(d, a);
+}
+
+void tcg_gen_gvec_mov(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2 g = {
+        .fni8 = gen_mov_i64,
+        .fno = gen_helper_gvec_mov,
+    };
+
+    if (dofs == aofs && oprsz == maxsz) {
+        return;
+    }
+    tcg_gen_gvec_2(dofs, aofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_not(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen2 g = {
+        .fni8 = tcg_gen_not_i64,
+        .fno = gen_helper_gvec_not,
+    };
+
+    tcg_gen_gvec_2(dofs, aofs, oprsz, maxsz, &g);
+}
+
+/* Add or subtract the elements of a 64-bit unit in parallel.  M has the
+   sign bit of each element set; the carries or borrows are kept from
+   propagating into the next element by clearing (or setting) that bit
+   in the inputs, and the correct value of the bit is computed apart.  */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_addv_mask(d, a, b, 0x8080808080808080ull);
+}
+
+static void gen_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_addv_mask(d, a, b, 0x8000800080008000ull);
+}
+
+static void gen_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~0xffffffffull);
+    tcg_gen_add_i64(t2, a, b);
+    tcg_gen_add_i64(t1, t1, b);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static void gen_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_subv_mask(d, a, b, 0x8080808080808080ull);
+}
+
+static void gen_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_subv_mask(d, a, b, 0x8000800080008000ull);
+}
+
+static void gen_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+    tcg_gen_sub_i64(t2, a, b);
+    tcg_gen_sub_i64(t1, a, t1);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g[4] = {
+        { .fni8 = gen_add8_i64, .fno = gen_helper_gvec_add8 },
+        { .fni8 = gen_add16_i64, .fno = gen_helper_gvec_add16 },
+        { .fni8 = gen_add32_i64, .fno = gen_helper_gvec_add32 },
+        { .fni8 = tcg_gen_add_i64, .fno = gen_helper_gvec_add64 },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g[vece]);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g[4] = {
+        { .fni8 = gen_sub8_i64, .fno = gen_helper_gvec_sub8 },
+        { .fni8 = gen_sub16_i64, .fno = gen_helper_gvec_sub16 },
+        { .fni8 = gen_sub32_i64, .fno = gen_helper_gvec_sub32 },
+        { .fni8 = tcg_gen_sub_i64, .fno = gen_helper_gvec_sub64 },
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g[vece]);
+}
+
+/* The bitwise operations ignore VECE.  */
+
+void tcg_gen_gvec_and(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_and_i64,
+        .fno = gen_helper_gvec_and,
+    };
+
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_or(unsigned vece, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_or_i64,
+        .fno = gen_helper_gvec_or,
+    };
+
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_xor(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_xor_i64,
+        .fno = gen_helper_gvec_xor,
+    };
+
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_andc(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_andc_i64,
+        .fno = gen_helper_gvec_andc,
+    };
+
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g);
+}
+
+void tcg_gen_gvec_orc(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static const GVecGen3 g = {
+        .fni8 = tcg_gen_orc_i64,
+        .fno = gen_helper_gvec_orc,
+    };
+
+    tcg_gen_gvec_3(dofs, aofs, bofs, oprsz, maxsz, &g);
+}
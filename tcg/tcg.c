@@ -311,11 +311,12 @@ typedef struct TCGHelperInfo {
     const char *name;
     unsigned flags;
     unsigned sizemask;
+    TCGCallGlobals *globals;
 } TCGHelperInfo;
 
 #include "exec/helper-proto.h"
 
-static const TCGHelperInfo all_helpers[] = {
+static TCGHelperInfo all_helpers[] = {
 #include "exec/helper-tcg.h"
 };
 
@@ -407,7 +408,7 @@ void tcg_prologue_init(TCGContext *s)
     /* Compute a high-water mark, at which we voluntarily flush the buffer
        and start over.  The size here is arbitrary, significantly larger
        than we expect the code generation for any one opcode to require.  */
-    s->code_gen_highwater = s->code_gen_buffer + (total_size - 1024);
+    s->code_gen_highwater = s->code_gen_buffer + (total_size - TCG_HIGHWATER);
 
     tcg_register_jit(s->code_gen_buffer, total_size);
 
@@ -439,7 +440,10 @@ void tcg_func_start(TCGContext *s)
     s->gen_first_op_idx = 0;
     s->gen_last_op_idx = -1;
     s->gen_next_op_idx = 0;
+    s->gen_op_base = 0;
     s->gen_next_parm_idx = 0;
+    s->gen_host_ptr = false;
+    s->gen_ops_imported = false;
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
 }
@@ -717,6 +721,45 @@ int tcg_check_temp_count(void)
 }
 #endif
 
+static void tcg_global_set_add(TCGContext *s, TCGTempSet *set, int idx)
+{
+    tcg_debug_assert(idx >= 0 && idx < s->nb_globals);
+    set_bit(idx, set->l);
+    /* 64-bit globals are made of two temps on 32-bit hosts */
+    if (TCG_TARGET_REG_BITS == 32 &&
+        s->temps[idx].base_type == TCG_TYPE_I64) {
+        set_bit(idx + 1, set->l);
+    }
+}
+
+void tcg_set_helper_globals(void *func, const int *reads, int nb_reads,
+                            const int *writes, int nb_writes)
+{
+    TCGContext *s = &tcg_ctx;
+    TCGHelperInfo *info = g_hash_table_lookup(s->helpers, func);
+    TCGCallGlobals *g;
+    int i;
+
+    tcg_debug_assert(info != NULL);
+    g = g_new0(TCGCallGlobals, 1);
+    g->reads_all = reads == NULL;
+    for (i = 0; i < nb_reads; i++) {
+        tcg_global_set_add(s, &g->reads, reads[i]);
+    }
+    for (i = 0; i < nb_writes; i++) {
+        tcg_global_set_add(s, &g->writes, writes[i]);
+    }
+    g_free(info->globals);
+    info->globals = g;
+}
+
+const TCGCallGlobals *tcg_call_globals(TCGContext *s, TCGArg func)
+{
+    TCGHelperInfo *info = g_hash_table_lookup(s->helpers, (gpointer)func);
+
+    return info->globals;
+}
+
 /* Note: we convert the 64 bit args to 32 bit and do some alignment
    and endian swap. Maybe it would be better to do the alignment
    and endian swap in tcg_reg_alloc_call(). */
@@ -730,6 +773,9 @@ void tcg_gen_callN(TCGContext *s, void *func, TCGArg ret,
     info = g_hash_table_lookup(s->helpers, (gpointer)func);
     flags = info->flags;
     sizemask = info->sizemask;
+    if (info->globals) {
+        flags |= TCG_CALL_GLOBALS_LISTED;
+    }
 
 #if defined(__sparc__) && !defined(__arch64__) \
     && !defined(CONFIG_TCG_INTERPRETER)
@@ -1136,6 +1182,394 @@ void tcg_dump_ops(TCGContext *s)
     }
 }
 
+/* Serialized opcode stream, see tcg_export_ops().  It is only meant to
+   be read back by the same QEMU binary on the same host, so everything
+   is in host byte order.  The header is followed by nb_temps
+   TCGOpsTemp, nb_ops TCGOpsOp and nb_params 64-bit arguments.  */
+typedef struct TCGOpsHeader {
+    uint32_t nb_globals;
+    uint32_t nb_temps;
+    uint32_t nb_labels;
+    uint32_t nb_ops;
+    uint32_t nb_params;
+    uint32_t reserved;
+} TCGOpsHeader;
+
+typedef struct TCGOpsTemp {
+    uint8_t base_type;
+    uint8_t type;
+    uint8_t temp_local;
+    uint8_t reserved;
+} TCGOpsTemp;
+
+typedef struct TCGOpsOp {
+    uint8_t opc;
+    uint8_t callo;
+    uint8_t calli;
+    uint8_t nb_args;
+} TCGOpsOp;
+
+/* exit_tb argument of a TB that does not return to the main loop with
+   a TB pointer */
+#define TCG_OPS_EXIT_NO_TB UINT64_MAX
+
+static int tcg_op_nb_args(const TCGOp *op)
+{
+    const TCGOpDef *def = &tcg_op_defs[op->opc];
+
+    if (op->opc == INDEX_op_call) {
+        return op->callo + op->calli + def->nb_cargs;
+    }
+    return def->nb_args;
+}
+
+/* Index of the label argument of 'opc', or -1 if it has none.  */
+static int tcg_op_label_arg(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+        return 0;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return 3;
+    case INDEX_op_brcond2_i32:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+/* Size of the host memory access of 'opc', or 0 if it is not a host
+   load or store.  */
+static int tcg_op_host_access_size(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* Offsets relative to env must stay within the CPU object, which
+   starts ENV_OFFSET bytes before it.  */
+static bool tcg_env_offset_ok(int64_t ofs, int size)
+{
+    return ofs >= -(int64_t)ENV_OFFSET &&
+           ofs <= (int64_t)sizeof(CPUArchState) - size;
+}
+
+/* Imported opcode streams must not reach host memory outside of the CPU
+   object, whatever the file they come from says.  env may only be the
+   base of host loads and stores with a valid offset, an argument of
+   helper calls, or added to a constant that is a valid offset to form
+   a pointer for a helper.  Fixed registers are never written.  'known'
+   and 'val' track the temps that hold a constant, from movi up to the
+   next label.  */
+static bool tcg_import_check_op(TCGContext *s, const TCGOpsOp *o,
+                                const TCGArg *args, TCGArg env,
+                                bool *known, int64_t *val)
+{
+    TCGOpcode opc = o->opc;
+    const TCGOpDef *def = &tcg_op_defs[opc];
+    int nb_oargs, nb_iargs, size, i;
+
+    if (opc == INDEX_op_call) {
+        nb_oargs = o->callo;
+        nb_iargs = o->calli;
+    } else {
+        nb_oargs = def->nb_oargs;
+        nb_iargs = def->nb_iargs;
+    }
+    size = tcg_op_host_access_size(opc);
+
+    for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+        TCGArg other = args[i == 1 ? 2 : 1];
+
+        if (args[i] != env || opc == INDEX_op_call) {
+            continue;
+        }
+        if (size && i == nb_oargs + nb_iargs - 1) {
+            /* base of a host load or store */
+            continue;
+        }
+        if ((opc == INDEX_op_add_i32 || opc == INDEX_op_add_i64) &&
+            other != env && known[other] && tcg_env_offset_ok(val[other], 1)) {
+            continue;
+        }
+        return false;
+    }
+    if (size) {
+        /* the base is the last input, the offset the only constant */
+        if (args[nb_oargs + nb_iargs - 1] != env ||
+            !tcg_env_offset_ok((tcg_target_long)args[nb_oargs + nb_iargs],
+                               size)) {
+            return false;
+        }
+    }
+
+    if (opc == INDEX_op_set_label) {
+        memset(known, 0, s->nb_temps * sizeof(bool));
+    }
+    for (i = 0; i < nb_oargs; i++) {
+        if (args[i] == TCG_CALL_DUMMY_ARG) {
+            continue;
+        }
+        if (s->temps[args[i]].fixed_reg) {
+            return false;
+        }
+        known[args[i]] = false;
+    }
+    if (opc == INDEX_op_movi_i32 || opc == INDEX_op_movi_i64) {
+        known[args[0]] = true;
+        val[args[0]] = opc == INDEX_op_movi_i32 ? (int32_t)args[1]
+                                                : (tcg_target_long)args[1];
+    }
+    return true;
+}
+
+bool tcg_export_ops(TCGContext *s, TranslationBlock *tb, GByteArray *buf)
+{
+    TCGOpsHeader hdr = { 0 };
+    guint start = buf->len;
+    int oi, i;
+
+    if (s->gen_host_ptr) {
+        return false;
+    }
+
+    hdr.nb_globals = s->nb_globals;
+    hdr.nb_temps = s->nb_temps - s->nb_globals;
+    hdr.nb_labels = s->nb_labels;
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+        hdr.nb_ops++;
+        hdr.nb_params += tcg_op_nb_args(&s->gen_op_buf[oi]);
+    }
+    g_byte_array_append(buf, (guint8 *)&hdr, sizeof(hdr));
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        TCGOpsTemp t = {
+            .base_type = ts->base_type,
+            .type = ts->type,
+            .temp_local = ts->temp_local,
+        };
+        g_byte_array_append(buf, (guint8 *)&t, sizeof(t));
+    }
+
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+        TCGOp *op = &s->gen_op_buf[oi];
+        TCGOpsOp o = {
+            .opc = op->opc,
+            .callo = op->callo,
+            .calli = op->calli,
+            .nb_args = tcg_op_nb_args(op),
+        };
+        g_byte_array_append(buf, (guint8 *)&o, sizeof(o));
+    }
+
+    /* Replace the host addresses in the arguments with values that
+       stay valid across processes.  */
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+        TCGOp *op = &s->gen_op_buf[oi];
+        TCGArg *args = &s->gen_opparam_buf[op->args];
+        int nb_args = tcg_op_nb_args(op);
+        int label = tcg_op_label_arg(op->opc);
+
+        for (i = 0; i < nb_args; i++) {
+            uint64_t v = args[i];
+
+            if (i == label) {
+                v = arg_label(args[i])->id;
+            } else if (op->opc == INDEX_op_call &&
+                       i == op->callo + op->calli) {
+                TCGHelperInfo *info = g_hash_table_lookup(s->helpers,
+                                                          (gpointer)args[i]);
+                if (!info) {
+                    goto fail;
+                }
+                v = info - all_helpers;
+            } else if (op->opc == INDEX_op_exit_tb) {
+                if (args[i] == 0) {
+                    v = TCG_OPS_EXIT_NO_TB;
+                } else if ((args[i] & ~TB_EXIT_MASK) == (uintptr_t)tb) {
+                    v = args[i] & TB_EXIT_MASK;
+                } else {
+                    goto fail;
+                }
+            }
+            g_byte_array_append(buf, (guint8 *)&v, sizeof(v));
+        }
+    }
+    return true;
+
+ fail:
+    g_byte_array_set_size(buf, start);
+    return false;
+}
+
+bool tcg_import_ops(TCGContext *s, TranslationBlock *tb,
+                    const void *buf, size_t size)
+{
+    const TCGOpsHeader *hdr = buf;
+    const TCGOpsTemp *temps;
+    const TCGOpsOp *ops;
+    const uint8_t *params;
+    TCGLabel **labels;
+    TCGArg env = TCG_CALL_DUMMY_ARG;
+    int64_t *val;
+    bool *known;
+    int i, j, pi;
+
+    if (size < sizeof(*hdr) ||
+        hdr->nb_globals != s->nb_globals ||
+        hdr->nb_temps > TCG_MAX_TEMPS - s->nb_globals ||
+        hdr->nb_ops == 0 || hdr->nb_ops > OPC_BUF_SIZE ||
+        hdr->nb_params > OPPARAM_BUF_SIZE ||
+        size != sizeof(*hdr) + hdr->nb_temps * sizeof(TCGOpsTemp) +
+                hdr->nb_ops * sizeof(TCGOpsOp) +
+                hdr->nb_params * sizeof(uint64_t)) {
+        return false;
+    }
+    temps = (const TCGOpsTemp *)(hdr + 1);
+    ops = (const TCGOpsOp *)(temps + hdr->nb_temps);
+    params = (const uint8_t *)(ops + hdr->nb_ops);
+
+    for (i = 0; i < hdr->nb_temps; i++) {
+        if (temps[i].base_type >= TCG_TYPE_COUNT ||
+            temps[i].type >= TCG_TYPE_COUNT || temps[i].temp_local > 1) {
+            return false;
+        }
+    }
+    for (i = 0; i < s->nb_globals; i++) {
+        if (s->temps[i].fixed_reg && s->temps[i].reg == TCG_AREG0) {
+            env = i;
+        }
+    }
+
+    for (i = 0; i < hdr->nb_temps; i++) {
+        TCGTemp *ts = tcg_temp_alloc(s);
+
+        ts->base_type = temps[i].base_type;
+        ts->type = temps[i].type;
+        ts->temp_local = temps[i].temp_local;
+        ts->temp_allocated = 1;
+    }
+
+    known = tcg_malloc(s->nb_temps * sizeof(bool));
+    val = tcg_malloc(s->nb_temps * sizeof(int64_t));
+    memset(known, 0, s->nb_temps * sizeof(bool));
+
+    labels = tcg_malloc(hdr->nb_labels * sizeof(TCGLabel *));
+    for (i = 0; i < hdr->nb_labels; i++) {
+        labels[i] = gen_new_label();
+    }
+
+    pi = 0;
+    for (i = 0; i < hdr->nb_ops; i++) {
+        const TCGOpsOp *o = &ops[i];
+        const TCGOpDef *def;
+        TCGArg *args = &s->gen_opparam_buf[pi];
+        int label, nb_temp_args;
+
+        if (o->opc >= NB_OPS) {
+            return false;
+        }
+        def = &tcg_op_defs[o->opc];
+        if (o->opc == INDEX_op_call) {
+            nb_temp_args = o->callo + o->calli;
+            if (o->nb_args != nb_temp_args + def->nb_cargs) {
+                return false;
+            }
+        } else {
+            nb_temp_args = def->nb_oargs + def->nb_iargs;
+            if (o->nb_args != def->nb_args) {
+                return false;
+            }
+        }
+        if (pi + o->nb_args > hdr->nb_params) {
+            return false;
+        }
+
+        label = tcg_op_label_arg(o->opc);
+        for (j = 0; j < o->nb_args; j++) {
+            uint64_t v = ldq_he_p(params + (pi + j) * sizeof(uint64_t));
+
+            if (j < nb_temp_args) {
+                if (v >= s->nb_temps &&
+                    !(o->opc == INDEX_op_call && v == TCG_CALL_DUMMY_ARG)) {
+                    return false;
+                }
+            } else if (j == label) {
+                if (v >= hdr->nb_labels) {
+                    return false;
+                }
+                v = label_arg(labels[v]);
+            } else if (o->opc == INDEX_op_call && j == nb_temp_args) {
+                if (v >= ARRAY_SIZE(all_helpers)) {
+                    return false;
+                }
+                v = (uintptr_t)all_helpers[v].func;
+            } else if (o->opc == INDEX_op_exit_tb) {
+                if (v == TCG_OPS_EXIT_NO_TB) {
+                    v = 0;
+                } else if (v <= TB_EXIT_MASK) {
+                    v += (uintptr_t)tb;
+                } else {
+                    return false;
+                }
+            }
+            args[j] = v;
+        }
+        if (!tcg_import_check_op(s, o, args, env, known, val)) {
+            return false;
+        }
+
+        s->gen_op_buf[i] = (TCGOp){
+            .opc = o->opc,
+            .callo = o->callo,
+            .calli = o->calli,
+            .args = o->nb_args ? pi : -1,
+            .prev = i - 1,
+            .next = i + 1,
+        };
+        pi += o->nb_args;
+    }
+    if (pi != hdr->nb_params) {
+        return false;
+    }
+
+    s->gen_op_buf[hdr->nb_ops - 1].next = -1;
+    s->gen_first_op_idx = 0;
+    s->gen_last_op_idx = hdr->nb_ops - 1;
+    s->gen_next_op_idx = hdr->nb_ops;
+    s->gen_next_parm_idx = pi;
+    s->gen_ops_imported = true;
+    return true;
+}
+
 /* we give more priority to constraints with less registers */
 static int get_constraint_priority(const TCGOpDef *def, int k)
 {
@@ -1329,6 +1763,25 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: conditional branch: globals and local temps should
+   be in memory for the branch target, but they stay live on the
+   fall-through path; normal temps are dead. */
+static inline void tcg_la_cbranch_end(TCGContext *s, uint8_t *dead_temps,
+                                      uint8_t *mem_temps)
+{
+    int i;
+
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            mem_temps[i] = 1;
+        } else {
+            dead_temps[i] = 1;
+            mem_temps[i] = 0;
+        }
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1396,14 +1849,31 @@ static void tcg_liveness_analysis(TCGContext *s)
                         mem_temps[arg] = 0;
                     }
 
-                    if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
-                        /* globals should be synced to memory */
-                        memset(mem_temps, 1, s->nb_globals);
-                    }
-                    if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
-                                        TCG_CALL_NO_READ_GLOBALS))) {
-                        /* globals should go back to memory */
-                        memset(dead_temps, 1, s->nb_globals);
+                    if (call_flags & TCG_CALL_GLOBALS_LISTED) {
+                        const TCGCallGlobals *g;
+
+                        g = tcg_call_globals(s, args[nb_oargs + nb_iargs]);
+                        for (i = 0; i < s->nb_globals; i++) {
+                            /* a global may be written only conditionally,
+                               so it must be in memory before the call */
+                            if (test_bit(i, g->writes.l)) {
+                                mem_temps[i] = 1;
+                                dead_temps[i] = 1;
+                            } else if (g->reads_all ||
+                                       test_bit(i, g->reads.l)) {
+                                mem_temps[i] = 1;
+                            }
+                        }
+                    } else {
+                        if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
+                            /* globals should be synced to memory */
+                            memset(mem_temps, 1, s->nb_globals);
+                        }
+                        if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
+                                            TCG_CALL_NO_READ_GLOBALS))) {
+                            /* globals should go back to memory */
+                            memset(dead_temps, 1, s->nb_globals);
+                        }
                     }
 
                     /* record arguments that die in this helper */
@@ -1547,7 +2017,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_cbranch_end(s, dead_temps, mem_temps);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1892,6 +2364,33 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, globals and local temps must be stored at
+   their canonical location for the branch target, but the fall-through
+   path can keep using the registers that hold them. */
+static void tcg_reg_alloc_cbranch_end(TCGContext *s,
+                                      TCGRegSet allocated_regs)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        if (ts->temp_local) {
+            temp_sync(s, ts, allocated_regs);
+        } else {
+#ifdef USE_LIVENESS_ANALYSIS
+            /* ??? Liveness does not yet incorporate indirect bases.  */
+            if (!ts->indirect_base) {
+                assert(ts->val_type == TEMP_VAL_DEAD);
+                continue;
+            }
+#endif
+            temp_dead(s, ts);
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -2098,7 +2597,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cbranch_end(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2268,7 +2769,17 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
 
     /* Save globals if they might be written by the helper, sync them if
        they might be read. */
-    if (flags & TCG_CALL_NO_READ_GLOBALS) {
+    if (flags & TCG_CALL_GLOBALS_LISTED) {
+        const TCGCallGlobals *g = tcg_call_globals(s, (uintptr_t)func_addr);
+
+        for (i = 0; i < s->nb_globals; i++) {
+            if (test_bit(i, g->writes.l)) {
+                temp_save(s, &s->temps[i], allocated_regs);
+            } else if (g->reads_all || test_bit(i, g->reads.l)) {
+                temp_sync(s, &s->temps[i], allocated_regs);
+            }
+        }
+    } else if (flags & TCG_CALL_NO_READ_GLOBALS) {
         /* Nothing to do */
     } else if (flags & TCG_CALL_NO_WRITE_GLOBALS) {
         sync_globals(s, allocated_regs);
@@ -2364,8 +2875,13 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
-    tcg_optimize(s);
+    if (!s->gen_ops_imported) {
+        tcg_optimize(s);
+    }
 #endif
+    if (s->gen_ops_export) {
+        tcg_export_ops(s, tb, s->gen_ops_export);
+    }
 
 #ifdef CONFIG_PROFILER
     s->opt_time += profile_getclock();
@@ -196,6 +196,10 @@ typedef struct TCGPool {
 #define TCG_MAX_TEMPS 512
 #define TCG_MAX_INSNS 512
 
+/* Room left at the end of the translation buffer (or region) for the
+   code generation of a single opcode; see code_gen_highwater.  */
+#define TCG_HIGHWATER 1024
+
 /* when the size of the arguments of a called function is smaller than
    this value, they are statically allocated in the TB stack frame */
 #define TCG_STATIC_CALL_ARGS_SIZE 128
@@ -373,6 +377,9 @@ static inline intptr_t QEMU_ARTIFICIAL GET_TCGV_PTR(TCGv_ptr t)
 #define TCG_CALL_NO_WRITE_GLOBALS   0x0020
 /* Helper can be safely suppressed if the return value is not used. */
 #define TCG_CALL_NO_SIDE_EFFECTS    0x0040
+/* The globals accessed by the helper are listed with
+   tcg_set_helper_globals(); takes precedence over the flags above. */
+#define TCG_CALL_GLOBALS_LISTED     0x0080
 
 /* convenience version of most used call flags */
 #define TCG_CALL_NO_RWG         TCG_CALL_NO_READ_GLOBALS
@@ -560,6 +567,9 @@ struct TCGContext {
     int gen_last_op_idx;
     int gen_next_op_idx;
     int gen_next_parm_idx;
+    /* First op of the TB being translated; only non-zero while the
+       members of a superblock are translated.  */
+    int gen_op_base;
 
     /* Code generation.  Note that we specifically do not use tcg_insn_unit
        here, because there's too much arithmetic throughout that relies
@@ -571,7 +581,8 @@ struct TCGContext {
     size_t code_gen_buffer_size;
     void *code_gen_ptr;
 
-    /* Threshold to flush the translated code buffer.  */
+    /* Threshold to flush the translated code buffer, or to move on to
+       the next region of it.  */
     void *code_gen_highwater;
 
     TBContext tb_ctx;
@@ -589,16 +600,29 @@ struct TCGContext {
     TCGOp gen_op_buf[OPC_BUF_SIZE];
     TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
 
+    /* The opcode stream embeds host addresses (see tcg_const_ptr), so it
+       cannot be exported for use by another process.  */
+    bool gen_host_ptr;
+    /* The opcode stream came from tcg_import_ops() and is already
+       optimized.  */
+    bool gen_ops_imported;
+    /* If non-NULL, tcg_gen_code() exports the optimized opcode stream
+       here; an empty array means that it could not be exported.  */
+    GByteArray *gen_ops_export;
+
     uint16_t gen_insn_end_off[TCG_MAX_INSNS];
     target_ulong gen_insn_data[TCG_MAX_INSNS][TARGET_INSN_START_WORDS];
 };
 
 extern TCGContext tcg_ctx;
 
-/* The number of opcodes emitted so far.  */
+/* The CPU state pointer, created on TCG_AREG0 by the front end.  */
+extern TCGv_env cpu_env;
+
+/* The number of opcodes emitted so far for the current TB.  */
 static inline int tcg_op_buf_count(void)
 {
-    return tcg_ctx.gen_next_op_idx;
+    return tcg_ctx.gen_next_op_idx - tcg_ctx.gen_op_base;
 }
 
 /* Test for whether to terminate the TB for using too many opcodes.  */
@@ -638,6 +662,35 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
 
+/**
+ * tcg_export_ops:
+ * @s: TCG context
+ * @tb: translation block the opcode stream was generated for
+ * @buf: array to append the serialized stream to
+ *
+ * Serialize the opcode stream of @s in a form that does not depend on
+ * host addresses, so that another process running the same QEMU binary
+ * can feed it back to tcg_import_ops() instead of translating @tb again.
+ *
+ * Returns false, leaving @buf unchanged, if the stream cannot be
+ * exported, e.g. because it embeds a host pointer.
+ */
+bool tcg_export_ops(TCGContext *s, TranslationBlock *tb, GByteArray *buf);
+
+/**
+ * tcg_import_ops:
+ * @s: TCG context, just reset with tcg_func_start()
+ * @tb: translation block to import the opcode stream for
+ * @buf: stream produced by tcg_export_ops()
+ * @size: size of @buf in bytes
+ *
+ * Returns false if @buf is not a valid opcode stream for this binary, or
+ * if it accesses host memory outside of the CPU object other than through
+ * helpers; @s must then be reset again before being used.
+ */
+bool tcg_import_ops(TCGContext *s, TranslationBlock *tb,
+                    const void *buf, size_t size);
+
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
 int tcg_global_mem_new_internal(TCGType, TCGv_ptr, intptr_t, const char *);
@@ -730,6 +783,9 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: it ends a basic block, but the
+       fall-through path stays in the same extended basic block.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -772,7 +828,9 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.gen_host_ptr = true, \
+     TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -783,7 +841,9 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.gen_host_ptr = true, \
+     TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -795,6 +855,35 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 void tcg_gen_callN(TCGContext *s, void *func,
                    TCGArg ret, int nargs, TCGArg *args);
 
+/* Globals accessed by a helper, see tcg_set_helper_globals().  */
+typedef struct TCGCallGlobals {
+    bool reads_all;
+    TCGTempSet reads;
+    TCGTempSet writes;
+} TCGCallGlobals;
+
+/**
+ * tcg_set_helper_globals:
+ * @func: the helper
+ * @reads: the globals the helper may read, or NULL for any global
+ * @nb_reads: number of elements of @reads
+ * @writes: the globals the helper may write
+ * @nb_writes: number of elements of @writes
+ *
+ * Declare which TCG globals (as returned by GET_TCGV_I32/GET_TCGV_I64)
+ * @func accesses through env.  Only those are synced to memory before a
+ * call to @func, and only those in @writes are reloaded after it; the
+ * other ones can stay in host registers across the call.  A helper that
+ * can raise an exception must be declared to read any global.  Called by
+ * the targets once their globals are allocated.
+ */
+void tcg_set_helper_globals(void *func, const int *reads, int nb_reads,
+                            const int *writes, int nb_writes);
+
+/* The globals accessed by the helper called by a call op with
+   TCG_CALL_GLOBALS_LISTED; 'func' is the function argument of the op. */
+const TCGCallGlobals *tcg_call_globals(TCGContext *s, TCGArg func);
+
 void tcg_op_remove(TCGContext *s, TCGOp *op);
 void tcg_optimize(TCGContext *s);
 
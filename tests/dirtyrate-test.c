@@ -0,0 +1,126 @@
+/*
+ * QTest testcases for calc-dirty-rate and query-dirty-rate
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+#define TEST_MEM_START  (2 * 1024 * 1024)
+#define TEST_MEM_SIZE   (8 * 1024 * 1024)
+
+static QDict *query_dirty_rate(void)
+{
+    QDict *rsp = qmp("{ 'execute': 'query-dirty-rate' }");
+    QDict *ret;
+
+    g_assert(qdict_haskey(rsp, "return"));
+    ret = qdict_get_qdict(rsp, "return");
+    QINCREF(ret);
+    QDECREF(rsp);
+    return ret;
+}
+
+static bool calc_dirty_rate(int calc_time)
+{
+    QDict *rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+                     "'arguments': { 'calc-time': %d } }", calc_time);
+    bool ok = qdict_haskey(rsp, "return");
+
+    g_assert(ok || qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    return ok;
+}
+
+static void test_calc_time(void)
+{
+    QDict *info;
+
+    qtest_start("-m 64M");
+
+    g_assert(!calc_dirty_rate(0));
+    g_assert(!calc_dirty_rate(-1));
+    g_assert(!calc_dirty_rate(61));
+
+    /* the failed commands did not start anything */
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "unstarted");
+    g_assert(!qdict_haskey(info, "calc-time"));
+    QDECREF(info);
+
+    qtest_end();
+}
+
+static void test_measure(void)
+{
+    const QListEntry *entry;
+    QDict *info, *block;
+    QList *blocks;
+    bool ram_dirtied = false;
+    int round = 0;
+
+    qtest_start("-m 64M");
+
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "unstarted");
+    QDECREF(info);
+
+    g_assert(calc_dirty_rate(1));
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measuring");
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    g_assert(!qdict_haskey(info, "dirty-rate"));
+    QDECREF(info);
+
+    /* only one measurement at a time */
+    g_assert(!calc_dirty_rate(1));
+
+    /* Dirty memory until the measurement ends; the thread starts it
+     * asynchronously, so writing once at the start is not enough
+     */
+    for (;;) {
+        info = query_dirty_rate();
+        if (strcmp(qdict_get_str(info, "status"), "measuring")) {
+            break;
+        }
+        QDECREF(info);
+        qmemset(TEST_MEM_START, round++, TEST_MEM_SIZE);
+        g_usleep(50 * 1000);
+    }
+
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measured");
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(info, "dirty-rate"), >, 0);
+
+    blocks = qdict_get_qlist(info, "block-dirty-rate");
+    QLIST_FOREACH_ENTRY(blocks, entry) {
+        block = qobject_to_qdict(qlist_entry_obj(entry));
+        if (!strcmp(qdict_get_str(block, "id"), "pc.ram")) {
+            ram_dirtied = qdict_get_int(block, "dirty-rate") > 0;
+        }
+    }
+    g_assert(ram_dirtied);
+    QDECREF(info);
+
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("/dirtyrate/calc-time", test_calc_time);
+        qtest_add_func("/dirtyrate/measure", test_measure);
+    }
+    return g_test_run();
+}
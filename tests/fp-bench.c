@@ -0,0 +1,386 @@
+/*
+ * Benchmark of the softfloat host FPU fast path
+ *
+ * The same sequence of operations is run with and without the fast path,
+ * and the results and exception flags of both runs are compared.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/timer.h"
+#include "fpu/softfloat.h"
+
+enum op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_COUNT,
+};
+
+static const char * const op_names[] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_SQRT] = "sqrt",
+};
+
+/*
+ * The float_status setups used by the targets.  The NaN specialization
+ * is fixed when softfloat is built; these cover the run-time knobs.
+ */
+enum profile {
+    PROFILE_TININESS_AFTER,   /* e.g. arm, ppc, mips */
+    PROFILE_TININESS_BEFORE,  /* e.g. x86, sparc, m68k */
+    PROFILE_FLUSH_TO_ZERO,    /* e.g. arm with FPSCR.FZ, sh4 */
+    PROFILE_DEFAULT_NAN,      /* e.g. arm with FPSCR.DN, aarch64 */
+    PROFILE_CLEAR_FLAGS,      /* flags cleared before each op, e.g. ppc */
+    PROFILE_COUNT,
+};
+
+static const char * const profile_names[] = {
+    [PROFILE_TININESS_AFTER] = "after",
+    [PROFILE_TININESS_BEFORE] = "before",
+    [PROFILE_FLUSH_TO_ZERO] = "ftz",
+    [PROFILE_DEFAULT_NAN] = "dnan",
+    [PROFILE_CLEAR_FLAGS] = "clear",
+};
+
+#define N_INPUTS 1024
+
+/* command line parameters, see commands_string */
+static unsigned long n_iters = 20000;
+static int op_mask = (1 << OP_COUNT) - 1;
+static int profile_mask = (1 << PROFILE_COUNT) - 1;
+static bool do_single = true;
+static bool do_double = true;
+static bool quiet;
+
+static float32 f32_in[2][N_INPUTS];
+static float64 f64_in[2][N_INPUTS];
+static float32 f32_out[2][N_INPUTS];
+static float64 f64_out[2][N_INPUTS];
+static int flags_out[2][N_INPUTS];
+
+static const char commands_string[] =
+    " -n = number of iterations over the input set (default: 20000)\n"
+    " -o = operation: add, sub, mul, div, sqrt (default: all)\n"
+    " -p = precision: single, double (default: both)\n"
+    " -t = float_status profile: after, before, ftz, dnan, clear\n"
+    "      (default: all)\n"
+    " -q = only report mismatches between the two paths\n"
+    " -h = show this help message";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static inline uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Inputs are mostly normal numbers with a moderate exponent, which is what
+ * the fast path is for.  A few zeroes, denormals and huge values exercise
+ * the fallbacks.
+ */
+static void init_inputs(void)
+{
+    uint64_t r = 1;
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < N_INPUTS; j++) {
+            uint64_t sign, exp, frac;
+
+            r = xorshift64star(r);
+            sign = r >> 63;
+            frac = r;
+            switch (r % 64) {
+            case 0:
+                exp = 0;
+                frac &= 1;   /* zero or denormal */
+                break;
+            case 1:
+                exp = 0xfe;
+                break;
+            default:
+                exp = 0x7f - 32 + (r >> 8) % 64;
+                break;
+            }
+            f32_in[i][j] = make_float32(sign << 31 | exp << 23 |
+                                        (frac & 0x7fffff));
+            if (exp == 0xfe) {
+                exp = 0x7fe;
+            } else if (exp) {
+                exp += 0x3ff - 0x7f;
+            }
+            f64_in[i][j] = make_float64(sign << 63 | exp << 52 |
+                                        (frac & 0xfffffffffffffULL));
+        }
+    }
+}
+
+static void init_status(float_status *s, enum profile p)
+{
+    memset(s, 0, sizeof(*s));
+    set_float_rounding_mode(float_round_nearest_even, s);
+    set_float_detect_tininess(p == PROFILE_TININESS_BEFORE ?
+                              float_tininess_before_rounding :
+                              float_tininess_after_rounding, s);
+    if (p == PROFILE_FLUSH_TO_ZERO) {
+        set_flush_to_zero(1, s);
+        set_flush_inputs_to_zero(1, s);
+    }
+    if (p == PROFILE_DEFAULT_NAN) {
+        set_default_nan_mode(1, s);
+    }
+}
+
+static void run_f32(enum op op, enum profile p, int k)
+{
+    float_status s;
+    unsigned long n;
+    int i;
+
+    init_status(&s, p);
+    for (n = 0; n < n_iters; n++) {
+        for (i = 0; i < N_INPUTS; i++) {
+            float32 a = f32_in[0][i];
+            float32 b = f32_in[1][i];
+            float32 r;
+
+            if (p == PROFILE_CLEAR_FLAGS) {
+                set_float_exception_flags(0, &s);
+            }
+            switch (op) {
+            case OP_ADD:
+                r = float32_add(a, b, &s);
+                break;
+            case OP_SUB:
+                r = float32_sub(a, b, &s);
+                break;
+            case OP_MUL:
+                r = float32_mul(a, b, &s);
+                break;
+            case OP_DIV:
+                r = float32_div(a, b, &s);
+                break;
+            case OP_SQRT:
+                r = float32_sqrt(a, &s);
+                break;
+            default:
+                g_assert_not_reached();
+            }
+            if (n == 0) {
+                f32_out[k][i] = r;
+                flags_out[k][i] = get_float_exception_flags(&s);
+            }
+        }
+    }
+}
+
+static void run_f64(enum op op, enum profile p, int k)
+{
+    float_status s;
+    unsigned long n;
+    int i;
+
+    init_status(&s, p);
+    for (n = 0; n < n_iters; n++) {
+        for (i = 0; i < N_INPUTS; i++) {
+            float64 a = f64_in[0][i];
+            float64 b = f64_in[1][i];
+            float64 r;
+
+            if (p == PROFILE_CLEAR_FLAGS) {
+                set_float_exception_flags(0, &s);
+            }
+            switch (op) {
+            case OP_ADD:
+                r = float64_add(a, b, &s);
+                break;
+            case OP_SUB:
+                r = float64_sub(a, b, &s);
+                break;
+            case OP_MUL:
+                r = float64_mul(a, b, &s);
+                break;
+            case OP_DIV:
+                r = float64_div(a, b, &s);
+                break;
+            case OP_SQRT:
+                r = float64_sqrt(a, &s);
+                break;
+            default:
+                g_assert_not_reached();
+            }
+            if (n == 0) {
+                f64_out[k][i] = r;
+                flags_out[k][i] = get_float_exception_flags(&s);
+            }
+        }
+    }
+}
+
+static int64_t run(bool dbl, enum op op, enum profile p, int k)
+{
+    int64_t t0 = get_clock();
+
+    float_host_fpu_enabled = k;
+    if (dbl) {
+        run_f64(op, p, k);
+    } else {
+        run_f32(op, p, k);
+    }
+    return get_clock() - t0;
+}
+
+static int check(bool dbl, enum op op, enum profile p)
+{
+    int bad = 0;
+    int i;
+
+    for (i = 0; i < N_INPUTS; i++) {
+        uint64_t soft, hard;
+
+        if (dbl) {
+            soft = float64_val(f64_out[0][i]);
+            hard = float64_val(f64_out[1][i]);
+        } else {
+            soft = float32_val(f32_out[0][i]);
+            hard = float32_val(f32_out[1][i]);
+        }
+        if (soft != hard || flags_out[0][i] != flags_out[1][i]) {
+            if (!bad) {
+                fprintf(stderr, "%s%s/%s: input %d: soft %#" PRIx64
+                        " flags %#x, hard %#" PRIx64 " flags %#x\n",
+                        op_names[op], dbl ? "64" : "32", profile_names[p], i,
+                        soft, flags_out[0][i], hard, flags_out[1][i]);
+            }
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static int bench(bool dbl, enum op op, enum profile p)
+{
+    double n_ops = (double)n_iters * N_INPUTS;
+    int64_t t_soft, t_hard;
+    int bad;
+
+    t_soft = run(dbl, op, p, 0);
+    t_hard = run(dbl, op, p, 1);
+    bad = check(dbl, op, p);
+    if (!quiet) {
+        printf("%-4s %-6s %-6s %8.2f %8.2f %6.2fx %s\n",
+               op_names[op], dbl ? "double" : "single", profile_names[p],
+               n_ops * 1e3 / t_soft, n_ops * 1e3 / t_hard,
+               (double)t_soft / t_hard, bad ? "MISMATCH" : "");
+    }
+    return bad;
+}
+
+static int find_name(const char * const *names, int n, const char *s)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(names[i], s)) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Unknown name '%s'\n", s);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:o:p:qt:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argc, argv);
+            break;
+        case 'n':
+            n_iters = atol(optarg);
+            break;
+        case 'o':
+            op_mask = 1 << find_name(op_names, OP_COUNT, optarg);
+            break;
+        case 'p':
+            do_single = !strcmp(optarg, "single");
+            do_double = !strcmp(optarg, "double");
+            if (!do_single && !do_double) {
+                usage_complete(argc, argv);
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 't':
+            profile_mask = 1 << find_name(profile_names, PROFILE_COUNT,
+                                          optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+    if (n_iters == 0) {
+        n_iters = 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int op, p;
+    int bad = 0;
+
+    parse_args(argc, argv);
+    init_inputs();
+
+    if (!quiet) {
+        printf("%-4s %-6s %-6s %8s %8s %7s\n", "op", "prec", "status",
+               "soft", "hard", "speedup");
+        printf("(Mops/s)\n");
+    }
+    for (op = 0; op < OP_COUNT; op++) {
+        if (!(op_mask & (1 << op))) {
+            continue;
+        }
+        for (p = 0; p < PROFILE_COUNT; p++) {
+            if (!(profile_mask & (1 << p))) {
+                continue;
+            }
+            if (do_single) {
+                bad += bench(false, op, p);
+            }
+            if (do_double) {
+                bad += bench(true, op, p);
+            }
+        }
+    }
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * QTest testcases for RAM migration
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define TEST_PAGE_SIZE  4096
+#define TEST_MEM_START  (2 * 1024 * 1024)
+#define TEST_MEM_PAGES  1024
+
+/* Every eighth page is zero, as those go on the main stream even with
+ * multifd; the others get a value that depends on the page and on the
+ * round in which it was written.
+ */
+static uint8_t page_value(int page, int round)
+{
+    return page % 8 ? (page + round * 16) % 255 + 1 : 0;
+}
+
+static void fill_pages(QTestState *s, int round, int first, int step)
+{
+    int i;
+
+    for (i = first; i < TEST_MEM_PAGES; i += step) {
+        qtest_memset(s, TEST_MEM_START + i * TEST_PAGE_SIZE,
+                     page_value(i, round), TEST_PAGE_SIZE);
+    }
+}
+
+static void check_pages(QTestState *s)
+{
+    uint8_t *buf = g_malloc(TEST_PAGE_SIZE);
+    int i, j;
+
+    for (i = 0; i < TEST_MEM_PAGES; i++) {
+        /* odd pages were written again while the migration ran */
+        uint8_t expected = page_value(i, i % 2);
+
+        qtest_memread(s, TEST_MEM_START + i * TEST_PAGE_SIZE, buf,
+                      TEST_PAGE_SIZE);
+        for (j = 0; j < TEST_PAGE_SIZE; j++) {
+            g_assert_cmphex(buf[j], ==, expected);
+        }
+    }
+    g_free(buf);
+}
+
+static void qmp_check(QTestState *s, const char *cmd)
+{
+    QDict *rsp = qtest_qmp(s, cmd);
+
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+static void set_multifd(QTestState *s, int channels)
+{
+    char *cmd;
+
+    qmp_check(s, "{ 'execute': 'migrate-set-capabilities',"
+                 "'arguments': { 'capabilities': ["
+                 "{ 'capability': 'x-multifd', 'state': true } ] } }");
+    cmd = g_strdup_printf("{ 'execute': 'migrate-set-parameters',"
+                          "'arguments': { 'x-multifd-channels': %d } }",
+                          channels);
+    qmp_check(s, cmd);
+    g_free(cmd);
+}
+
+static char *migrate_status(QTestState *s)
+{
+    QDict *rsp = qtest_qmp(s, "{ 'execute': 'query-migrate' }");
+    QDict *ret = qdict_get_qdict(rsp, "return");
+    char *status = g_strdup(qdict_get_str(ret, "status"));
+
+    QDECREF(rsp);
+    return status;
+}
+
+static void wait_for_status(QTestState *s, const char *wanted)
+{
+    for (;;) {
+        char *status = migrate_status(s);
+        bool done = !strcmp(status, wanted);
+
+        g_assert_cmpstr(status, !=, "failed");
+        g_free(status);
+        if (done) {
+            break;
+        }
+        g_usleep(10 * 1000);
+    }
+}
+
+/* Find a port that is free right now; the destination listens on it
+ * shortly after.
+ */
+static int find_free_port(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    g_assert(fd >= 0);
+    g_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static void test_migrate(const void *opaque)
+{
+    int channels = GPOINTER_TO_INT(opaque);
+    QTestState *global = global_qtest, *from, *to;
+    char *uri, *cmd;
+
+    uri = g_strdup_printf("tcp:127.0.0.1:%d", find_free_port());
+    from = qtest_init("-m 64M");
+    to = qtest_init("-m 64M -incoming defer");
+    if (channels) {
+        set_multifd(from, channels);
+        set_multifd(to, channels);
+    }
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate-incoming',"
+                          "'arguments': { 'uri': '%s' } }", uri);
+    qmp_check(to, cmd);
+    g_free(cmd);
+
+    fill_pages(from, 0, 0, 1);
+
+    /* Go slowly at first, so that the pages written below are sent again
+     * in a later round */
+    qmp_check(from, "{ 'execute': 'migrate_set_speed',"
+                    "'arguments': { 'value': 10 } }");
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }", uri);
+    qmp_check(from, cmd);
+    g_free(cmd);
+
+    wait_for_status(from, "active");
+    fill_pages(from, 1, 1, 2);
+    qmp_check(from, "{ 'execute': 'migrate_set_speed',"
+                    "'arguments': { 'value': 0 } }");
+
+    wait_for_status(from, "completed");
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    global_qtest = global;
+
+    check_pages(to);
+
+    qtest_quit(to);
+    qtest_quit(from);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_data_func("/migration/precopy", GINT_TO_POINTER(0),
+                            test_migrate);
+        qtest_add_data_func("/migration/multifd", GINT_TO_POINTER(2),
+                            test_migrate);
+    }
+    return g_test_run();
+}
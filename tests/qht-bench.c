@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2016, Emilio G. Cota <cota@braap.org>
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/processor.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "exec/tb-hash-xx.h"
+
+struct thread_stats {
+    size_t lookups;
+    size_t lookups_hit;
+    size_t updates;
+    size_t updates_ok;
+};
+
+struct thread_info {
+    void (*func)(struct thread_info *);
+    struct thread_stats stats;
+    uint64_t r;
+    bool write_op; /* writes alternate between insertions and removals */
+    bool resize_down;
+} __attribute__((aligned(64)));
+
+/* command line parameters, see commands_string */
+static unsigned long duration = 1;
+static unsigned int n_rw_threads = 1;
+static unsigned int n_rz_threads = 1;
+static double update_rate;
+static double resize_rate;
+static size_t init_size = 64;
+static unsigned long init_range = 128;
+static unsigned long lookup_range;
+static unsigned long update_range;
+static unsigned long resize_delay = 1000;
+static size_t qht_n_elems = 64;
+static long populate_offset;
+static unsigned int qht_mode;
+
+static size_t resize_min;
+static size_t resize_max;
+static bool test_stop;
+
+static QemuThread *rw_threads;
+static QemuThread *rz_threads;
+static struct thread_info *rw_info;
+static struct thread_info *rz_info;
+
+static struct qht ht;
+static long *keys;
+
+static uint64_t update_threshold;
+static uint64_t resize_threshold;
+
+static const char commands_string[] =
+    " -d = duration, in seconds (1)\n"
+    " -n = number of lookup/update threads (1)\n"
+    "\n"
+    " -k = initial number of keys (64)\n"
+    " -o = offset at which keys start (0)\n"
+    " -K = initial range of keys, rounded up to pow2 (128)\n"
+    " -l = lookup range of keys, rounded up to pow2 (initial range)\n"
+    " -r = update range of keys, rounded up to pow2 (lookup range)\n"
+    "\n"
+    " -u = update rate (0.0 to 100.0), 50/50 split of insertions/removals\n"
+    "\n"
+    " -s = initial size hint (64)\n"
+    " -A = enable auto-resize\n"
+    " -R = enable periodic manual resizes, 1% of the resize thread's loops\n"
+    " -D = delay (in us) between potential resizes (1000)\n"
+    " -N = number of resize threads (1)";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static inline uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * UINT64_C(2685821657736338717);
+}
+
+static inline uint32_t h(unsigned long v)
+{
+    return tb_hash_func8(v, 0, 0, 0);
+}
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const long *a = obj;
+    const long *b = userp;
+
+    return *a == *b;
+}
+
+static void do_rz(struct thread_info *info)
+{
+    struct thread_stats *stats = &info->stats;
+
+    if (info->r < resize_threshold) {
+        size_t size = info->resize_down ? resize_min : resize_max;
+        bool resized;
+
+        resized = qht_resize(&ht, size);
+        info->resize_down = !info->resize_down;
+
+        if (resized) {
+            stats->updates_ok++;
+        }
+        stats->updates++;
+    }
+    g_usleep(resize_delay);
+}
+
+static void do_rw(struct thread_info *info)
+{
+    struct thread_stats *stats = &info->stats;
+    uint32_t hash;
+    long *p;
+
+    if (info->r >= update_threshold) {
+        bool read;
+
+        p = &keys[info->r & (lookup_range - 1)];
+        hash = h(*p);
+        read = qht_lookup(&ht, is_equal, p, hash);
+        if (read) {
+            stats->lookups_hit++;
+        }
+        stats->lookups++;
+    } else {
+        p = &keys[info->r & (update_range - 1)];
+        hash = h(*p);
+        if (info->write_op) {
+            bool written = false;
+
+            if (qht_lookup(&ht, is_equal, p, hash) == NULL) {
+                written = qht_insert(&ht, p, hash);
+            }
+            if (written) {
+                stats->updates_ok++;
+            }
+        } else {
+            bool removed = false;
+
+            if (qht_lookup(&ht, is_equal, p, hash)) {
+                removed = qht_remove(&ht, p, hash);
+            }
+            if (removed) {
+                stats->updates_ok++;
+            }
+        }
+        info->write_op = !info->write_op;
+        stats->updates++;
+    }
+}
+
+static void *thread_func(void *p)
+{
+    struct thread_info *info = p;
+
+    rcu_register_thread();
+
+    rcu_read_lock();
+    while (!atomic_read(&test_stop)) {
+        info->r = xorshift64star(info->r);
+        info->func(info);
+    }
+    rcu_read_unlock();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* sets everything except info->func */
+static void prepare_thread_info(struct thread_info *info, int i)
+{
+    /* seed for the RNG; each thread should have a different one */
+    info->r = (i + 1) ^ time(NULL);
+    /* the first update will be a write */
+    info->write_op = true;
+    /* the first resize will be down */
+    info->resize_down = true;
+
+    memset(&info->stats, 0, sizeof(info->stats));
+}
+
+static void
+th_create_n(QemuThread **threads, struct thread_info **infos, const char *name,
+            void (*func)(struct thread_info *), int offset, int n)
+{
+    struct thread_info *info;
+    QemuThread *th;
+    int i;
+
+    th = g_malloc(sizeof(*th) * n);
+    *threads = th;
+
+    info = qemu_memalign(64, sizeof(*info) * n);
+    *infos = info;
+
+    for (i = 0; i < n; i++) {
+        prepare_thread_info(&info[i], offset + i);
+        info[i].func = func;
+        qemu_thread_create(&th[i], name, thread_func, &info[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void create_threads(void)
+{
+    th_create_n(&rw_threads, &rw_info, "rw", do_rw, 0, n_rw_threads);
+    th_create_n(&rz_threads, &rz_info, "rz", do_rz, n_rw_threads, n_rz_threads);
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" duration:          %lu s\n", duration);
+    printf(" # of threads:      %u\n", n_rw_threads);
+    printf(" initial # of keys: %zu\n", init_size);
+    printf(" initial size hint: %zu\n", qht_n_elems);
+    printf(" auto-resize:       %s\n",
+           qht_mode & QHT_MODE_AUTO_RESIZE ? "on" : "off");
+    if (resize_rate) {
+        printf(" resize_rate:       %f%%\n", resize_rate * 100.0);
+        printf(" resize range:      %zu-%zu\n", resize_min, resize_max);
+        printf(" # resize threads   %u\n", n_rz_threads);
+    }
+    printf(" update rate:       %f%%\n", update_rate * 100.0);
+    printf(" offset:            %ld\n", populate_offset);
+    printf(" initial key range: %lu\n", init_range);
+    printf(" lookup range:      %lu\n", lookup_range);
+    printf(" update range:      %lu\n", update_range);
+}
+
+static void do_threshold(double rate, uint64_t *threshold)
+{
+    if (rate == 1.0) {
+        *threshold = UINT64_MAX;
+    } else {
+        *threshold = rate * UINT64_MAX;
+    }
+}
+
+static void htable_init(void)
+{
+    unsigned long n;
+    uint64_t r = time(NULL);
+    size_t retries = 0;
+    size_t i;
+
+    if (!lookup_range) {
+        lookup_range = init_range;
+    }
+    if (!update_range) {
+        update_range = lookup_range;
+    }
+    n = MAX(init_range, MAX(lookup_range, update_range));
+
+    /* avoid allocating memory later by allocating all the keys now */
+    keys = g_malloc(sizeof(*keys) * n);
+    for (i = 0; i < n; i++) {
+        keys[i] = populate_offset + i;
+    }
+
+    /* some sanity checks */
+    g_assert_cmpuint(lookup_range, <=, n);
+
+    /* compute thresholds */
+    do_threshold(update_rate, &update_threshold);
+    do_threshold(resize_rate, &resize_threshold);
+
+    if (resize_rate) {
+        resize_min = n / 2;
+        resize_max = n;
+        assert(resize_min < resize_max);
+    } else {
+        n_rz_threads = 0;
+    }
+
+    /* initialize the hash table */
+    qht_init(&ht, qht_n_elems, qht_mode);
+    assert(init_size <= init_range);
+
+    pr_params();
+
+    fprintf(stderr, "Initialization: populating %zu items...", init_size);
+    for (i = 0; i < init_size; i++) {
+        for (;;) {
+            uint32_t hash;
+            long *p;
+
+            r = xorshift64star(r);
+            p = &keys[r & (init_range - 1)];
+            hash = h(*p);
+            if (qht_insert(&ht, p, hash)) {
+                break;
+            }
+            retries++;
+        }
+    }
+    fprintf(stderr, " populated after %zu retries\n", retries);
+}
+
+static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct thread_stats *stats = &info[i].stats;
+
+        s->lookups += stats->lookups;
+        s->lookups_hit += stats->lookups_hit;
+        s->updates += stats->updates;
+        s->updates_ok += stats->updates_ok;
+    }
+}
+
+static void pr_hist(const char *name, const size_t *hist, size_t n_total)
+{
+    int i;
+
+    printf(" %s:\n", name);
+    for (i = 0; i <= QHT_STATS_MAX_CHAIN; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+        printf("  %s%2d: %10zu (%6.2f%%)\n",
+               i == QHT_STATS_MAX_CHAIN ? ">=" : "  ", i, hist[i],
+               n_total ? 100.0 * hist[i] / n_total : 0.0);
+    }
+}
+
+static void pr_ht_stats(void)
+{
+    struct qht_stats hs;
+
+    qht_statistics(&ht, &hs);
+
+    printf("Hash table:\n");
+    printf(" head buckets:      %zu\n", hs.head_buckets);
+    printf(" used head buckets: %zu (%.2f%%)\n", hs.used_head_buckets,
+           hs.head_buckets ?
+           100.0 * hs.used_head_buckets / hs.head_buckets : 0.0);
+    printf(" entries:           %zu\n", hs.entries);
+    printf(" longest chain:     %zu buckets\n", hs.chain_max);
+    pr_hist("chain length (buckets)", hs.chain_hist, hs.used_head_buckets);
+    pr_hist("occupancy (1/16ths)", hs.occupancy_hist, hs.head_buckets);
+}
+
+static void pr_stats(void)
+{
+    struct thread_stats s = {};
+    double tx;
+    double ns_per_lookup;
+
+    add_stats(&s, rw_info, n_rw_threads);
+    add_stats(&s, rz_info, n_rz_threads);
+
+    printf("Results:\n");
+
+    if (resize_rate) {
+        printf(" Resizes:           %zu (%.2f%% of %zu)\n",
+               s.updates_ok, (double)s.updates_ok / s.updates * 100.0,
+               s.updates);
+    }
+
+    tx = (double)(s.lookups + s.updates) / duration / 1e6;
+    printf(" Throughput:        %.2f MT/s\n", tx);
+    printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    /* every rw thread spends the whole test doing operations */
+    ns_per_lookup = s.lookups + s.updates ?
+        duration * 1e9 * n_rw_threads / (s.lookups + s.updates) : 0.0;
+    printf(" Lookups:           %zu (%.2f%% hit)\n", s.lookups,
+           s.lookups ? 100.0 * s.lookups_hit / s.lookups : 0.0);
+    printf(" Avg op latency:    %.1f ns\n", ns_per_lookup);
+    printf(" Updates:           %zu (%.2f%% successful)\n", s.updates,
+           s.updates ? 100.0 * s.updates_ok / s.updates : 0.0);
+
+    pr_ht_stats();
+}
+
+static void run_test(void)
+{
+    int i;
+
+    g_usleep(duration * G_USEC_PER_SEC);
+    atomic_mb_set(&test_stop, true);
+
+    for (i = 0; i < n_rw_threads; i++) {
+        qemu_thread_join(&rw_threads[i]);
+    }
+    for (i = 0; i < n_rz_threads; i++) {
+        qemu_thread_join(&rz_threads[i]);
+    }
+    pr_stats();
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:D:k:K:l:hAn:N:o:r:Rs:u:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'A':
+            qht_mode |= QHT_MODE_AUTO_RESIZE;
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'D':
+            resize_delay = atol(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            break;
+        case 'k':
+            init_size = atol(optarg);
+            break;
+        case 'K':
+            init_range = pow2ceil(atol(optarg));
+            break;
+        case 'l':
+            lookup_range = pow2ceil(atol(optarg));
+            break;
+        case 'n':
+            n_rw_threads = atoi(optarg);
+            break;
+        case 'N':
+            n_rz_threads = atoi(optarg);
+            break;
+        case 'o':
+            populate_offset = atol(optarg);
+            break;
+        case 'r':
+            update_range = pow2ceil(atol(optarg));
+            break;
+        case 'R':
+            resize_rate = 1.0 / 100.0;
+            break;
+        case 's':
+            qht_n_elems = atol(optarg);
+            break;
+        case 'u':
+            update_rate = atof(optarg) / 100.0;
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    htable_init();
+    create_threads();
+    run_test();
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * TLB flush benchmark
+ *
+ * Maps, touches and unmaps (or write-protects) memory regions of
+ * increasing size while other threads keep running on the same address
+ * space.  Run inside a system emulation guest, every iteration makes
+ * the guest kernel invalidate each page of the region on all the vCPUs
+ * running the process (INVLPG on x86, TLBI on ARM), which is the case
+ * that range and batched TLB flushes are meant to speed up.
+ *
+ * Under user mode emulation the numbers only measure mmap/munmap.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define MAX_THREADS 64
+
+static const char usage_string[] =
+    "Usage: tlb-bench [-t threads] [-n iterations] [-m munmap|mprotect]\n"
+    " -t = threads that keep running during the flushes (default: 3)\n"
+    " -n = iterations for each region size (default: 200)\n"
+    " -m = how the pages of the region are invalidated (default: munmap)\n";
+
+static int n_threads = 3;
+static int n_iters = 200;
+static int use_mprotect;
+static volatile int stop;
+static long page_size;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Keep a few pages of this address space in the TLB of another vCPU.  */
+static void *busy_thread(void *arg)
+{
+    size_t size = 16 * page_size;
+    volatile char *buf = malloc(size);
+    size_t i = 0;
+
+    if (!buf) {
+        return NULL;
+    }
+    while (!stop) {
+        buf[i]++;
+        i = (i + page_size) % size;
+    }
+    free((void *)buf);
+    return NULL;
+}
+
+static void touch(char *p, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i += page_size) {
+        p[i] = 1;
+    }
+}
+
+/* Return the average time in ns spent invalidating a region of size.  */
+static uint64_t bench(size_t size)
+{
+    uint64_t total = 0;
+    char *p = NULL;
+    int i;
+
+    if (use_mprotect) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < n_iters; i++) {
+        uint64_t t0;
+
+        if (use_mprotect) {
+            mprotect(p, size, PROT_READ | PROT_WRITE);
+            touch(p, size);
+            t0 = now_ns();
+            mprotect(p, size, PROT_READ);
+        } else {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
+            }
+            touch(p, size);
+            t0 = now_ns();
+            munmap(p, size);
+        }
+        total += now_ns() - t0;
+    }
+    if (use_mprotect) {
+        munmap(p, size);
+    }
+    return total / n_iters;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[MAX_THREADS];
+    size_t pages;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "ht:n:m:")) != -1) {
+        switch (c) {
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads < 0 || n_threads > MAX_THREADS) {
+                fprintf(stderr, "threads must be between 0 and %d\n",
+                        MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            n_iters = atoi(optarg);
+            if (n_iters <= 0) {
+                n_iters = 1;
+            }
+            break;
+        case 'm':
+            if (!strcmp(optarg, "mprotect")) {
+                use_mprotect = 1;
+            } else if (strcmp(optarg, "munmap")) {
+                fputs(usage_string, stderr);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fputs(usage_string, stderr);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    for (i = 0; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, busy_thread, NULL)) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%8s %12s %10s\n", "pages", "ns/flush", "ns/page");
+    for (pages = 1; pages <= 4096; pages *= 4) {
+        uint64_t t = bench(pages * page_size);
+
+        printf("%8zu %12llu %10llu\n", pages, (unsigned long long)t,
+               (unsigned long long)(t / pages));
+    }
+
+    stop = 1;
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,293 @@
+/*
+ * AioContext multithreading tests
+ *
+ * Copyright Red Hat, Inc. 2016
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+
+/* AioContext management */
+
+#define NUM_CONTEXTS 5
+
+typedef struct TestThread {
+    QemuThread thread;
+    AioContext *ctx;
+    int id;
+    bool stopping;
+} TestThread;
+
+static TestThread threads[NUM_CONTEXTS];
+static __thread int id = -1;
+
+static void *test_thread_run(void *opaque)
+{
+    TestThread *t = opaque;
+
+    id = t->id;
+    qemu_set_current_aio_context(t->ctx);
+    while (!atomic_read(&t->stopping)) {
+        aio_poll(t->ctx, true);
+    }
+    qemu_set_current_aio_context(NULL);
+    return NULL;
+}
+
+static void create_aio_contexts(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_CONTEXTS; i++) {
+        threads[i].ctx = aio_context_new(&error_abort);
+        threads[i].id = i;
+        threads[i].stopping = false;
+        qemu_thread_create(&threads[i].thread, "test-aio", test_thread_run,
+                           &threads[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void join_aio_contexts(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_CONTEXTS; i++) {
+        atomic_mb_set(&threads[i].stopping, true);
+        aio_notify(threads[i].ctx);
+        qemu_thread_join(&threads[i].thread);
+        aio_context_unref(threads[i].ctx);
+        threads[i].ctx = NULL;
+    }
+}
+
+static bool now_stopping;
+static int running;
+
+static void start_coroutines(CoroutineEntry *entry, int n)
+{
+    int i;
+
+    running = n;
+    for (i = 0; i < n; i++) {
+        Coroutine *co = qemu_coroutine_create(entry);
+        aio_co_schedule(threads[i].ctx, co);
+    }
+}
+
+/* aio_co_schedule test: every AioContext runs a coroutine, which is woken up
+ * by the coroutines of the other AioContexts.
+ */
+
+static Coroutine *to_schedule[NUM_CONTEXTS];
+static int count_retry;
+static int count_here;
+static int count_other;
+
+static bool schedule_next(int n)
+{
+    Coroutine *co;
+
+    co = atomic_xchg(&to_schedule[n], NULL);
+    if (!co) {
+        atomic_inc(&count_retry);
+        return false;
+    }
+
+    if (n == id) {
+        atomic_inc(&count_here);
+    } else {
+        atomic_inc(&count_other);
+    }
+
+    aio_co_schedule(threads[n].ctx, co);
+    return true;
+}
+
+static void coroutine_fn test_multi_co_schedule_entry(void *opaque)
+{
+    while (!atomic_mb_read(&now_stopping)) {
+        int n;
+
+        g_assert(to_schedule[id] == NULL);
+        atomic_mb_set(&to_schedule[id], qemu_coroutine_self());
+
+        n = g_test_rand_int_range(0, NUM_CONTEXTS);
+        schedule_next(n);
+        qemu_coroutine_yield();
+    }
+    atomic_dec(&running);
+}
+
+static void test_multi_co_schedule(int seconds)
+{
+    int i;
+
+    count_here = count_other = count_retry = 0;
+    now_stopping = false;
+
+    create_aio_contexts();
+    start_coroutines(test_multi_co_schedule_entry, NUM_CONTEXTS);
+
+    g_usleep(seconds * 1000000);
+
+    /* Wake up the coroutines that are waiting, so that they can exit */
+    atomic_mb_set(&now_stopping, true);
+    while (atomic_mb_read(&running) > 0) {
+        for (i = 0; i < NUM_CONTEXTS; i++) {
+            Coroutine *co = atomic_xchg(&to_schedule[i], NULL);
+            if (co) {
+                aio_co_schedule(threads[i].ctx, co);
+            }
+        }
+        g_usleep(1000);
+    }
+
+    join_aio_contexts();
+    g_test_message("scheduled %d, queued %d, retry %d, total %d",
+                   count_other, count_here, count_retry,
+                   count_here + count_other + count_retry);
+}
+
+static void test_multi_co_schedule_1(void)
+{
+    test_multi_co_schedule(1);
+}
+
+static void test_multi_co_schedule_10(void)
+{
+    test_multi_co_schedule(10);
+}
+
+/* CoMutex test: coroutines on different AioContexts, sometimes hopping to
+ * another context while they hold the mutex, increment an unprotected
+ * counter.
+ */
+
+static CoMutex comutex;
+static int counter;
+static int atomic_counter;
+
+typedef struct HopData {
+    Coroutine *co;
+    AioContext *new_ctx;
+    QEMUBH *bh;
+} HopData;
+
+/* Runs after the coroutine has yielded, so that it cannot be entered by the
+ * new AioContext while it is still running in the old one.
+ */
+static void hop_bh(void *opaque)
+{
+    HopData *data = opaque;
+
+    qemu_bh_delete(data->bh);
+    aio_co_schedule(data->new_ctx, data->co);
+}
+
+static void coroutine_fn hop_to(AioContext *new_ctx)
+{
+    HopData data = {
+        .co = qemu_coroutine_self(),
+        .new_ctx = new_ctx,
+    };
+
+    data.bh = aio_bh_new(qemu_get_current_aio_context(), hop_bh, &data);
+    qemu_bh_schedule(data.bh);
+    qemu_coroutine_yield();
+}
+
+static void coroutine_fn test_multi_co_mutex_entry(void *opaque)
+{
+    while (!atomic_mb_read(&now_stopping)) {
+        qemu_co_mutex_lock(&comutex);
+        counter++;
+        if (g_test_rand_int_range(0, 4) == 0) {
+            int n = g_test_rand_int_range(0, NUM_CONTEXTS);
+
+            /* Move to another thread while holding the mutex */
+            hop_to(threads[n].ctx);
+        }
+        qemu_co_mutex_unlock(&comutex);
+
+        /* Increase atomic_counter *after* releasing the mutex, so that the
+         * two counters only match if no increment of counter was lost.
+         */
+        atomic_inc(&atomic_counter);
+    }
+    atomic_dec(&running);
+}
+
+static void test_multi_co_mutex(int n, int seconds)
+{
+    qemu_co_mutex_init(&comutex);
+    counter = 0;
+    atomic_counter = 0;
+    now_stopping = false;
+
+    create_aio_contexts();
+    assert(n <= NUM_CONTEXTS);
+    start_coroutines(test_multi_co_mutex_entry, n);
+
+    g_usleep(seconds * 1000000);
+
+    atomic_mb_set(&now_stopping, true);
+    while (atomic_mb_read(&running) > 0) {
+        g_usleep(1000);
+    }
+
+    join_aio_contexts();
+    g_test_message("%d iterations/second", counter / seconds);
+    g_assert_cmpint(counter, ==, atomic_counter);
+}
+
+/* Testing with NUM_CONTEXTS threads keeps the wait queue busy */
+static void test_multi_co_mutex_1(void)
+{
+    test_multi_co_mutex(NUM_CONTEXTS, 1);
+}
+
+static void test_multi_co_mutex_10(void)
+{
+    test_multi_co_mutex(NUM_CONTEXTS, 10);
+}
+
+/* With two threads, the mutex is often released while the other thread is
+ * about to queue itself, which stresses the handoff between threads.
+ */
+static void test_multi_co_mutex_2_3(void)
+{
+    test_multi_co_mutex(2, 3);
+}
+
+static void test_multi_co_mutex_2_30(void)
+{
+    test_multi_co_mutex(2, 30);
+}
+
+/* End of tests.  */
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    if (g_test_quick()) {
+        g_test_add_func("/aio/multi/schedule", test_multi_co_schedule_1);
+        g_test_add_func("/aio/multi/mutex/contended", test_multi_co_mutex_1);
+        g_test_add_func("/aio/multi/mutex/handoff", test_multi_co_mutex_2_3);
+    } else {
+        g_test_add_func("/aio/multi/schedule", test_multi_co_schedule_10);
+        g_test_add_func("/aio/multi/mutex/contended", test_multi_co_mutex_10);
+        g_test_add_func("/aio/multi/mutex/handoff", test_multi_co_mutex_2_30);
+    }
+    return g_test_run();
+}
@@ -123,7 +123,7 @@ static void *test_acquire_thread(void *opaque)
 static void set_event_notifier(AioContext *ctx, EventNotifier *notifier,
                                EventNotifierHandler *handler)
 {
-    aio_set_event_notifier(ctx, notifier, false, handler);
+    aio_set_event_notifier(ctx, notifier, false, handler, NULL);
 }
 
 static void dummy_notifier_read(EventNotifier *unused)
@@ -383,7 +383,7 @@ static void test_aio_external_client(void)
     for (i = 1; i < 3; i++) {
         EventNotifierTestData data = { .n = 0, .active = 10, .auto_set = true };
         event_notifier_init(&data.e, false);
-        aio_set_event_notifier(ctx, &data.e, true, event_ready_cb);
+        aio_set_event_notifier(ctx, &data.e, true, event_ready_cb, NULL);
         event_notifier_set(&data.e);
         for (j = 0; j < i; j++) {
             aio_disable_external(ctx);
@@ -400,6 +400,81 @@ static void test_aio_external_client(void)
     }
 }
 
+#ifndef _WIN32
+typedef struct {
+    EventNotifier e;
+    int reads;
+    int polls;
+    bool ready;
+} PollTestData;
+
+static void poll_test_read(EventNotifier *e)
+{
+    PollTestData *data = container_of(e, PollTestData, e);
+
+    g_assert(event_notifier_test_and_clear(e));
+    data->reads++;
+}
+
+static bool poll_test_poll(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+
+    data->polls++;
+    if (data->ready) {
+        data->ready = false;
+        return true;
+    }
+    return false;
+}
+
+static void test_poll_event_notifier(void)
+{
+    PollTestData data = { .reads = 0 };
+    EventNotifierTestData dummy = { .n = 0 };
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, false, poll_test_read,
+                           poll_test_poll);
+    aio_context_set_poll_params(ctx, SCALE_MS * 100, 0, 0, &error_abort);
+
+    /* The polling time starts at zero, so this goes through ppoll... */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 1);
+    g_assert_cmpint(data.polls, ==, 0);
+
+    /* ... and the quick wakeup makes the next iteration poll.  */
+    data.ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 1);
+    g_assert_cmpint(data.polls, ==, 1);
+    g_assert(!data.ready);
+
+    /* A handler without io_poll disables polling */
+    event_notifier_init(&dummy.e, false);
+    set_event_notifier(ctx, &dummy.e, event_ready_cb);
+    data.ready = true;
+    event_notifier_set(&dummy.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(dummy.n, ==, 1);
+    g_assert_cmpint(data.polls, ==, 1);
+    set_event_notifier(ctx, &dummy.e, NULL);
+    event_notifier_cleanup(&dummy.e);
+
+    /* So does a zero poll-max-ns */
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 2);
+    g_assert_cmpint(data.polls, ==, 1);
+
+    aio_set_event_notifier(ctx, &data.e, false, NULL, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -857,6 +932,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+#ifndef _WIN32
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -66,10 +66,55 @@ static void test_sextract64(void)
     }
 }
 
+/* Large enough for find_next_bit to use the vector zero scan */
+#define SPARSE_WORDS 4096
+
+static void test_find_first_nonzero_word(void)
+{
+    unsigned long *map = g_new0(unsigned long, SPARSE_WORDS);
+    unsigned long i, start;
+
+    g_assert_cmpint(find_first_nonzero_word(map, SPARSE_WORDS), ==,
+                    SPARSE_WORDS);
+
+    for (start = 0; start < 8; start++) {
+        for (i = start; i < SPARSE_WORDS; i += 61) {
+            map[i] = 1UL << (BITS_PER_LONG - 1);
+            g_assert_cmpint(find_first_nonzero_word(map + start,
+                                                    SPARSE_WORDS - start),
+                            ==, i - start);
+            map[i] = 0;
+        }
+    }
+    g_free(map);
+}
+
+static void test_find_next_bit_sparse(void)
+{
+    unsigned long *map = g_new0(unsigned long, SPARSE_WORDS);
+    unsigned long size = SPARSE_WORDS * BITS_PER_LONG;
+    unsigned long bit, offset;
+
+    g_assert_cmpint(find_next_bit(map, size, 0), ==, size);
+
+    for (bit = 3; bit < size; bit += 4099) {
+        set_bit(bit, map);
+        for (offset = 0; offset <= bit; offset += 997) {
+            g_assert_cmpint(find_next_bit(map, size, offset), ==, bit);
+        }
+        g_assert_cmpint(find_next_bit(map, size, bit + 1), ==, size);
+        clear_bit(bit, map);
+    }
+    g_free(map);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/bitops/sextract32", test_sextract32);
     g_test_add_func("/bitops/sextract64", test_sextract64);
+    g_test_add_func("/bitops/find_first_nonzero_word",
+                    test_find_first_nonzero_word);
+    g_test_add_func("/bitops/find_next_bit/sparse", test_find_next_bit_sparse);
     return g_test_run();
 }
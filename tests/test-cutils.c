@@ -1430,6 +1430,43 @@ static void test_qemu_strtosz_suffix_unit(void)
     g_assert_cmpint(res, ==, 12345000);
 }
 
+/* Runs once for each vector implementation that the host supports */
+static void test_buffer_find_nonzero_offset(void)
+{
+    static uint8_t buf[64 * 1024] __attribute__((aligned(64)));
+    size_t len = sizeof(buf);
+    size_t i, ofs;
+
+    do {
+        const char *accel = buffer_find_nonzero_offset_accel();
+
+        memset(buf, 0, len);
+        g_assert(buffer_is_zero(buf, len));
+        g_assert(can_use_buffer_find_nonzero_offset(buf, len));
+        g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+
+        for (i = 0; i < len; i += 4093) {
+            buf[i] = 0x80;
+            g_assert(!buffer_is_zero(buf, len));
+
+            /* The result is rounded down to the unrolled vector block */
+            ofs = buffer_find_nonzero_offset(buf, len);
+            g_assert_cmpint(ofs, <=, i);
+            g_assert_cmpint(i - ofs, <, 256);
+            g_assert(buffer_is_zero(buf, ofs));
+            buf[i] = 0;
+        }
+
+        /* Odd lengths fall back to the loop over longs */
+        buf[len - 64] = 1;
+        g_assert(!buffer_is_zero(buf + 32, len - 64));
+        g_assert(buffer_is_zero(buf + 32, len - 96));
+        buf[len - 64] = 0;
+
+        g_test_message("%s ok", accel);
+    } while (buffer_find_nonzero_offset_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1591,5 +1628,8 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/strtosz/suffix-unit",
                     test_qemu_strtosz_suffix_unit);
 
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+
     return g_test_run();
 }
@@ -0,0 +1,191 @@
+/*
+ * Test the out-of-line generic vector helpers
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/bitops.h"
+#include "tcg-gvec-desc.h"
+#include "exec/helper-head.h"
+
+#define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
+#define DEF_HELPER_FLAGS_3(name, flags, ret, t1, t2, t3) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3));
+#define DEF_HELPER_FLAGS_4(name, flags, ret, t1, t2, t3, t4) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2), dh_ctype(t3), \
+                              dh_ctype(t4));
+
+#include "tcg-runtime.h"
+
+#define MAX_SIZE 256
+
+typedef void GVecHelper3(void *, void *, void *, uint32_t);
+
+typedef struct {
+    const char *name;
+    GVecHelper3 *fn;
+    int esize;
+    uint64_t (*op)(uint64_t, uint64_t);
+} GVecTest3;
+
+static uint64_t ref_add(uint64_t a, uint64_t b)
+{
+    return a + b;
+}
+
+static uint64_t ref_sub(uint64_t a, uint64_t b)
+{
+    return a - b;
+}
+
+static uint64_t ref_and(uint64_t a, uint64_t b)
+{
+    return a & b;
+}
+
+static uint64_t ref_or(uint64_t a, uint64_t b)
+{
+    return a | b;
+}
+
+static uint64_t ref_xor(uint64_t a, uint64_t b)
+{
+    return a ^ b;
+}
+
+static uint64_t ref_andc(uint64_t a, uint64_t b)
+{
+    return a & ~b;
+}
+
+static uint64_t ref_orc(uint64_t a, uint64_t b)
+{
+    return a | ~b;
+}
+
+static const GVecTest3 tests3[] = {
+    { "add8", helper_gvec_add8, 1, ref_add },
+    { "add16", helper_gvec_add16, 2, ref_add },
+    { "add32", helper_gvec_add32, 4, ref_add },
+    { "add64", helper_gvec_add64, 8, ref_add },
+    { "sub8", helper_gvec_sub8, 1, ref_sub },
+    { "sub16", helper_gvec_sub16, 2, ref_sub },
+    { "sub32", helper_gvec_sub32, 4, ref_sub },
+    { "sub64", helper_gvec_sub64, 8, ref_sub },
+    { "and", helper_gvec_and, 8, ref_and },
+    { "or", helper_gvec_or, 8, ref_or },
+    { "xor", helper_gvec_xor, 8, ref_xor },
+    { "andc", helper_gvec_andc, 8, ref_andc },
+    { "orc", helper_gvec_orc, 8, ref_orc },
+};
+
+static uint32_t make_desc(uint32_t oprsz, uint32_t maxsz)
+{
+    uint32_t desc = 0;
+
+    desc = deposit32(desc, SIMD_OPRSZ_SHIFT, SIMD_OPRSZ_BITS, oprsz / 8 - 1);
+    desc = deposit32(desc, SIMD_MAXSZ_SHIFT, SIMD_MAXSZ_BITS, maxsz / 8 - 1);
+    return desc;
+}
+
+static uint64_t get_elem(const uint8_t *p, int esize)
+{
+    uint64_t v = 0;
+
+    memcpy(&v, p, esize);
+    return v;
+}
+
+/* The operands are only 8-byte aligned, like the vector registers in
+   env, and the size may be an odd multiple of 8.  The bytes above the
+   operation size and up to the maximum size must be cleared, the ones
+   above the maximum size must be left alone.  */
+static void test_gvec_3(const void *opaque)
+{
+    const GVecTest3 *t = opaque;
+    uint64_t abuf[MAX_SIZE / 8 + 1], bbuf[MAX_SIZE / 8 + 1];
+    uint64_t dbuf[MAX_SIZE / 8 + 2];
+    uint8_t *a = (uint8_t *)(abuf + 1);
+    uint8_t *b = (uint8_t *)(bbuf + 1);
+    uint8_t *d = (uint8_t *)(dbuf + 1);
+    uint32_t oprsz, maxsz;
+    int i;
+
+    for (i = 0; i < MAX_SIZE; i++) {
+        a[i] = i * 37 + 0x80;
+        b[i] = i * 91 + 0x7f;
+    }
+
+    for (maxsz = 8; maxsz <= MAX_SIZE; maxsz += 8) {
+        for (oprsz = 8; oprsz <= maxsz; oprsz += 8) {
+            uint64_t mask = -1ull >> (64 - t->esize * 8);
+
+            memset(dbuf, 0xa5, sizeof(dbuf));
+            t->fn(d, a, b, make_desc(oprsz, maxsz));
+
+            for (i = 0; i < oprsz; i += t->esize) {
+                uint64_t expected = t->op(get_elem(a + i, t->esize),
+                                          get_elem(b + i, t->esize)) & mask;
+                g_assert_cmphex(get_elem(d + i, t->esize), ==, expected);
+            }
+            for (; i < maxsz; i++) {
+                g_assert_cmpint(d[i], ==, 0);
+            }
+            for (; i < sizeof(dbuf) - 8; i++) {
+                g_assert_cmpint(d[i], ==, 0xa5);
+            }
+            g_assert_cmphex(dbuf[0], ==, 0xa5a5a5a5a5a5a5a5ull);
+        }
+    }
+}
+
+static void test_gvec_mov_not(void)
+{
+    uint64_t abuf[MAX_SIZE / 8], dbuf[MAX_SIZE / 8];
+    uint8_t *a = (uint8_t *)abuf, *d = (uint8_t *)dbuf;
+    uint32_t oprsz, maxsz;
+    int i;
+
+    for (i = 0; i < MAX_SIZE; i++) {
+        a[i] = i ^ 0x5a;
+    }
+
+    for (maxsz = 8; maxsz <= MAX_SIZE; maxsz += 8) {
+        for (oprsz = 8; oprsz <= maxsz; oprsz += 8) {
+            memset(dbuf, 0xa5, sizeof(dbuf));
+            helper_gvec_mov(d, a, make_desc(oprsz, maxsz));
+            g_assert(!memcmp(d, a, oprsz));
+            for (i = oprsz; i < maxsz; i++) {
+                g_assert_cmpint(d[i], ==, 0);
+            }
+
+            memset(dbuf, 0xa5, sizeof(dbuf));
+            helper_gvec_not(d, a, make_desc(oprsz, maxsz));
+            for (i = 0; i < oprsz; i++) {
+                g_assert_cmpint(d[i], ==, (uint8_t)~a[i]);
+            }
+            for (; i < maxsz; i++) {
+                g_assert_cmpint(d[i], ==, 0);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(tests3); i++) {
+        char *path = g_strdup_printf("/gvec/%s", tests3[i].name);
+
+        g_test_add_data_func(path, &tests3[i], test_gvec_3);
+        g_free(path);
+    }
+    g_test_add_func("/gvec/mov-not", test_gvec_mov_not);
+    return g_test_run();
+}
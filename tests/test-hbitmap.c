@@ -635,6 +635,100 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    int r;
+
+    hbitmap_test_init(data, L3 * 2, 3);
+    r = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(r, ==, 64 << 3);
+}
+
+/* Serialize the bitmap in chunks of @chunk items (the last one possibly
+ * shorter), deserialize it into a new bitmap and compare the two.
+ */
+static void hbitmap_test_serialize_roundtrip(TestHBitmapData *data,
+                                             uint64_t chunk)
+{
+    HBitmap *copy;
+    uint8_t *buf;
+    uint64_t pos, count, len;
+    uint64_t size = data->size;
+    uint64_t i;
+
+    copy = hbitmap_alloc(size, data->granularity);
+    buf = g_malloc0(hbitmap_serialization_size(data->hb, 0, size));
+
+    for (pos = 0; pos < size; pos += chunk) {
+        count = MIN(chunk, size - pos);
+        len = hbitmap_serialization_size(data->hb, pos, count);
+        memset(buf, 0, len);
+        hbitmap_serialize_part(data->hb, buf, pos, count);
+        hbitmap_deserialize_part(copy, buf, pos, count, false);
+    }
+    hbitmap_deserialize_finish(copy);
+
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(data->hb));
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(hbitmap_get(copy, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    g_free(buf);
+    hbitmap_free(copy);
+}
+
+static void test_hbitmap_serialize_basic(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t gran;
+
+    hbitmap_test_init(data, L2 * 3 + 17, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+
+    hbitmap_test_serialize_roundtrip(data, gran);
+
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 70, 300);
+    hbitmap_test_set(data, L2 - 1, 2);
+    hbitmap_test_set(data, L2 * 3 + 16, 1);
+    hbitmap_test_serialize_roundtrip(data, gran);
+    hbitmap_test_serialize_roundtrip(data, gran * 5);
+    hbitmap_test_serialize_roundtrip(data, data->size);
+}
+
+static void test_hbitmap_serialize_granularity_data(TestHBitmapData *data,
+                                                    const void *unused)
+{
+    hbitmap_test_init(data, L3, 4);
+
+    hbitmap_test_set(data, 17, 1);
+    hbitmap_test_set(data, L2 + 5, L1 * 3);
+    hbitmap_test_set(data, L3 - 1, 1);
+    hbitmap_test_serialize_roundtrip(data,
+        hbitmap_serialization_granularity(data->hb) * 3);
+}
+
+static void test_hbitmap_deserialize_fill(TestHBitmapData *data,
+                                          const void *unused)
+{
+    uint64_t gran;
+
+    hbitmap_test_init(data, L2 + 7, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+
+    /* Filling the last, partial chunk must not set bits past the end */
+    hbitmap_deserialize_fill(data->hb, 0, data->size, true, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size);
+
+    hbitmap_deserialize_fill(data->hb, gran, gran, false, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size - gran);
+    g_assert(hbitmap_get(data->hb, gran - 1));
+    g_assert(!hbitmap_get(data->hb, gran));
+    g_assert(!hbitmap_get(data->hb, gran * 2 - 1));
+    g_assert(hbitmap_get(data->hb, gran * 2));
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -684,6 +778,15 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
+    hbitmap_test_add("/hbitmap/serialize/basic",
+                     test_hbitmap_serialize_basic);
+    hbitmap_test_add("/hbitmap/serialize/granularity-data",
+                     test_hbitmap_serialize_granularity_data);
+    hbitmap_test_add("/hbitmap/deserialize/fill",
+                     test_hbitmap_deserialize_fill);
     g_test_run();
 
     return 0;
@@ -0,0 +1,121 @@
+/*
+ * Test the record format of the persistent translation cache
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/tbcache-record.h"
+
+#define N_RECORDS 16
+
+static void fill_record(TBCacheRecord *rec, uint8_t *code, uint8_t *ops, int i)
+{
+    int j;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->key = 0x1000 + i;
+    rec->pc = 0x400000 + i * 0x40;
+    rec->cs_base = i;
+    /* the flags of some targets use the upper half */
+    rec->flags = (0x80000001ull << 32) | i;
+    rec->size = 1 + i * 3;
+    rec->icount = i;
+    rec->ops_len = 5 + i * 7;
+    for (j = 0; j < rec->size; j++) {
+        code[j] = i + j;
+    }
+    for (j = 0; j < rec->ops_len; j++) {
+        ops[j] = i * j;
+    }
+}
+
+static GByteArray *build_file(void)
+{
+    GByteArray *buf = g_byte_array_new();
+    uint8_t code[64], ops[128];
+    TBCacheRecord rec;
+    int i;
+
+    for (i = 0; i < N_RECORDS; i++) {
+        fill_record(&rec, code, ops, i);
+        tbcache_record_append(buf, &rec, code, ops);
+        g_assert_cmpint(buf->len % 8, ==, 0);
+    }
+    return buf;
+}
+
+static void test_round_trip(void)
+{
+    GByteArray *buf = build_file();
+    const TBCacheRecord *rec;
+    uint8_t code[64], ops[128];
+    TBCacheRecord expected;
+    size_t off = 0;
+    int i = 0;
+
+    while ((rec = tbcache_record_next(buf->data, buf->len, &off))) {
+        const uint8_t *data = (const uint8_t *)(rec + 1);
+
+        fill_record(&expected, code, ops, i);
+        g_assert_cmphex(rec->key, ==, expected.key);
+        g_assert_cmphex(rec->pc, ==, expected.pc);
+        g_assert_cmphex(rec->cs_base, ==, expected.cs_base);
+        g_assert_cmphex(rec->flags, ==, expected.flags);
+        g_assert_cmpint(rec->icount, ==, expected.icount);
+        g_assert_cmpint(rec->size, ==, expected.size);
+        g_assert_cmpint(rec->ops_len, ==, expected.ops_len);
+        g_assert(!memcmp(data, code, rec->size));
+        g_assert(!memcmp(data + rec->size, ops, rec->ops_len));
+        i++;
+    }
+    g_assert_cmpint(i, ==, N_RECORDS);
+    g_assert_cmpint(off, ==, buf->len);
+    g_byte_array_free(buf, true);
+}
+
+/* A record that was only partly appended ends the file */
+static void test_torn_tail(void)
+{
+    GByteArray *buf = build_file();
+    size_t off = 0, len = buf->len - 3;
+    int i = 0;
+
+    while (tbcache_record_next(buf->data, len, &off)) {
+        i++;
+    }
+    g_assert_cmpint(i, ==, N_RECORDS - 1);
+    g_byte_array_free(buf, true);
+}
+
+/* A damaged record ends the file, even if the following ones are fine */
+static void test_corrupted(void)
+{
+    GByteArray *buf = build_file();
+    const TBCacheRecord *rec;
+    size_t off = 0;
+    int i;
+
+    for (i = 0; i < N_RECORDS / 2; i++) {
+        rec = tbcache_record_next(buf->data, buf->len, &off);
+        g_assert(rec);
+    }
+    buf->data[off + sizeof(TBCacheRecord)] ^= 1;
+
+    off = 0;
+    for (i = 0; tbcache_record_next(buf->data, buf->len, &off); i++) {
+        continue;
+    }
+    g_assert_cmpint(i, ==, N_RECORDS / 2);
+    g_byte_array_free(buf, true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/tbcache-record/round-trip", test_round_trip);
+    g_test_add_func("/tbcache-record/torn-tail", test_torn_tail);
+    g_test_add_func("/tbcache-record/corrupted", test_corrupted);
+    return g_test_run();
+}
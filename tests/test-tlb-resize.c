@@ -0,0 +1,88 @@
+/*
+ * Test the sizing policy of the softmmu TLB
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "exec/tlb-resize.h"
+
+#define MIN_SIZE 64
+#define MAX_SIZE (1 << 22)
+
+static size_t resize(size_t old_size, size_t max_used, bool expired)
+{
+    return tlb_resize_policy(old_size, max_used, expired, MIN_SIZE, MAX_SIZE);
+}
+
+static void test_grow(void)
+{
+    /* above 70% the table doubles, whether the window expired or not */
+    g_assert_cmpuint(resize(256, 200, false), ==, 512);
+    g_assert_cmpuint(resize(256, 200, true), ==, 512);
+    g_assert_cmpuint(resize(256, 256, false), ==, 512);
+    /* 70% is not enough */
+    g_assert_cmpuint(resize(128, 90, false), ==, 128);
+    /* but never beyond the maximum */
+    g_assert_cmpuint(resize(MAX_SIZE, MAX_SIZE, true), ==, MAX_SIZE);
+    g_assert_cmpuint(resize(MAX_SIZE / 2, MAX_SIZE / 2, true), ==, MAX_SIZE);
+}
+
+static void test_shrink(void)
+{
+    /* below 30% the table only shrinks after a whole window */
+    g_assert_cmpuint(resize(1024, 100, false), ==, 1024);
+    g_assert_cmpuint(resize(1024, 100, true), ==, 256);
+    /* the peak use fills a quarter to a half of the new table */
+    g_assert_cmpuint(resize(4096, 128, true), ==, 256);
+    g_assert_cmpuint(resize(4096, 129, true), ==, 512);
+    /* but never below the minimum, even when nothing was used */
+    g_assert_cmpuint(resize(256, 0, true), ==, MIN_SIZE);
+    g_assert_cmpuint(resize(MIN_SIZE, 1, true), ==, MIN_SIZE);
+}
+
+static void test_keep(void)
+{
+    /* between 30% and 70% the size is right */
+    g_assert_cmpuint(resize(256, 77, true), ==, 256);
+    g_assert_cmpuint(resize(256, 128, true), ==, 256);
+    g_assert_cmpuint(resize(256, 179, true), ==, 256);
+}
+
+/* A steady working set must not make the size oscillate, whether the
+ * table grows or shrinks to fit it.
+ */
+static void test_steady(void)
+{
+    size_t used, size, next;
+
+    for (used = 1; used <= MAX_SIZE; used = used * 3 / 2 + 1) {
+        size = resize(MAX_SIZE, used, true);
+        g_assert_cmpuint(resize(size, used, true), ==, size);
+
+        size = MIN_SIZE;
+        for (;;) {
+            next = resize(size, MIN(used, size), true);
+            if (next == size) {
+                break;
+            }
+            g_assert_cmpuint(next, >, size);
+            size = next;
+        }
+        if (used < size) {
+            g_assert_cmpuint(resize(size, used, true), ==, size);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/tlb-resize/grow", test_grow);
+    g_test_add_func("/tlb-resize/shrink", test_shrink);
+    g_test_add_func("/tlb-resize/keep", test_keep);
+    g_test_add_func("/tlb-resize/steady", test_steady);
+    return g_test_run();
+}
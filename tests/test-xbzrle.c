@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +175,158 @@ static void test_encode_decode(void)
     }
 }
 
+/* Byte at a time version of the encoder, the vector ones must match it */
+static int encode_bytewise(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                           uint8_t *dst)
+{
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        for (start = i; i < slen && old_buf[i] == new_buf[i]; i++) {
+            /* zrun */
+        }
+        if (i == slen) {
+            break;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        for (start = i; i < slen && old_buf[i] != new_buf[i]; i++) {
+            /* nzrun */
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+    return d;
+}
+
+static void test_encode_decode_sparse(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(2 * PAGE_SIZE);
+    uint8_t *expected = g_malloc(2 * PAGE_SIZE);
+    int i, j, n, dlen, rc;
+
+    for (i = 0; i < 10000; i++) {
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old_buf[j] = g_test_rand_int();
+        }
+        memcpy(new_buf, old_buf, PAGE_SIZE);
+
+        /* runs of every length, crossing the 16 and 32 byte boundaries */
+        for (n = g_test_rand_int_range(1, 32); n > 0; n--) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 80);
+
+            for (j = start; j < MIN(start + len, PAGE_SIZE); j++) {
+                new_buf[j] = ~old_buf[j];
+            }
+        }
+
+        dlen = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                    2 * PAGE_SIZE);
+        g_assert_cmpint(dlen, ==, encode_bytewise(old_buf, new_buf,
+                                                  PAGE_SIZE, expected));
+        g_assert(memcmp(compressed, expected, dlen) == 0);
+
+        rc = xbzrle_decode_buffer(compressed, dlen, old_buf, PAGE_SIZE);
+        g_assert(rc <= PAGE_SIZE);
+        g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(expected);
+}
+
+/* The tests above use the encoder picked for the host; run them again for
+ * each slower one that the host supports.
+ */
+static void test_encode_decode_accels(void)
+{
+    while (xbzrle_encode_buffer_next_accel()) {
+        test_encode_decode_zero();
+        test_encode_decode_unchanged();
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode();
+        test_encode_decode_sparse();
+        g_test_message("%s ok", xbzrle_encode_buffer_accel());
+    }
+}
+
+static void test_cache_assoc(void)
+{
+    /* two buckets of two pages each */
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t a = 0, b = 2 * PAGE_SIZE, c = 4 * PAGE_SIZE;
+    int i;
+
+    /* a, b and c share a bucket */
+    page[0] = 'a';
+    g_assert_cmpint(cache_insert(cache, a, page, 1), ==, 0);
+    page[0] = 'b';
+    g_assert_cmpint(cache_insert(cache, b, page, 1), ==, 0);
+    g_assert(cache_is_cached(cache, a, 1));
+    g_assert(cache_is_cached(cache, b, 1));
+    g_assert_cmpint(get_cached_data(cache, a)[0], ==, 'a');
+    g_assert_cmpint(get_cached_data(cache, b)[0], ==, 'b');
+    for (i = 0; i < 16; i++) {
+        g_assert(cache_is_cached(cache, a, 1));
+    }
+
+    /* both pages are fresh */
+    page[0] = 'c';
+    g_assert_cmpint(cache_insert(cache, c, page, 2), ==, -1);
+    g_assert(!cache_is_cached(cache, c, 2));
+    g_assert(get_cached_data(cache, c) == NULL);
+
+    /* b was used more recently, but a was hit more often */
+    g_assert(cache_is_cached(cache, b, 2));
+    g_assert_cmpint(cache_insert(cache, c, page, 4), ==, 0);
+    g_assert(cache_is_cached(cache, a, 4));
+    g_assert(!cache_is_cached(cache, b, 4));
+    g_assert_cmpint(get_cached_data(cache, c)[0], ==, 'c');
+
+    /* unused pages lose their hits, then the least recently used goes */
+    g_assert(cache_is_cached(cache, c, 20));
+    page[0] = 'b';
+    g_assert_cmpint(cache_insert(cache, b, page, 40), ==, 0);
+    g_assert(!cache_is_cached(cache, a, 40));
+    g_assert(cache_is_cached(cache, c, 40));
+    g_assert(cache_is_cached(cache, b, 40));
+
+    g_free(page);
+    cache_fini(cache);
+}
+
+static void test_cache_resize(void)
+{
+    PageCache *cache = cache_init(8, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < 8; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * PAGE_SIZE, page, i), ==, 0);
+    }
+
+    /* one bucket is left, it keeps the two most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 2), ==, 2);
+    for (i = 0; i < 6; i++) {
+        g_assert(!cache_is_cached(cache, i * PAGE_SIZE, 8));
+    }
+    for (i = 6; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 8));
+        g_assert_cmpint(get_cached_data(cache, i * PAGE_SIZE)[0], ==, i);
+    }
+
+    g_free(page);
+    cache_fini(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +339,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_sparse",
+                    test_encode_decode_sparse);
+    g_test_add_func("/xbzrle/encode_decode_accels", test_encode_decode_accels);
+    g_test_add_func("/xbzrle/cache/assoc", test_cache_assoc);
+    g_test_add_func("/xbzrle/cache/resize", test_cache_resize);
 
     return g_test_run();
 }
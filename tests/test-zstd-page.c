@@ -0,0 +1,160 @@
+/*
+ * Test the zstd page streams of RAM migration
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qapi/error.h"
+#include "migration/zstd-page.h"
+
+#define PAGE_SIZE 4096
+#define N_PAGES   64
+
+/* Pages that hardly compress alone but look alike, so that later pages
+ * compress well after the earlier ones
+ */
+static void fill_page(uint8_t *page, int i)
+{
+    uint32_t x = 1;
+    int j;
+
+    for (j = 0; j < PAGE_SIZE; j++) {
+        x = x * 1103515245 + 12345;
+        page[j] = x >> 24;
+    }
+    for (j = i % 64; j < PAGE_SIZE; j += 64) {
+        page[j] = i;
+    }
+}
+
+typedef struct Stream {
+    ZSTD_CCtx *zcs;
+    ZSTD_DCtx *zds;
+    int frame_level;
+    uint8_t *buf;
+    size_t buf_size;
+} Stream;
+
+static void stream_init(Stream *s, int level)
+{
+    s->zcs = ZSTD_createCCtx();
+    s->zds = ZSTD_createDCtx();
+    s->frame_level = level;
+    ZSTD_CCtx_setParameter(s->zcs, ZSTD_c_compressionLevel, level);
+    s->buf_size = ZSTD_compressBound(PAGE_SIZE);
+    s->buf = g_malloc(s->buf_size);
+}
+
+static void stream_fini(Stream *s)
+{
+    ZSTD_freeCCtx(s->zcs);
+    ZSTD_freeDCtx(s->zds);
+    g_free(s->buf);
+}
+
+/* Compress page @i at @level and check that it decompresses to itself */
+static ssize_t round_trip(Stream *s, int i, int level)
+{
+    uint8_t page[PAGE_SIZE], out[PAGE_SIZE];
+    ssize_t len;
+
+    fill_page(page, i);
+    len = zstd_compress_page(s->zcs, &s->frame_level, level, page, PAGE_SIZE,
+                             s->buf, s->buf_size, &error_abort);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(len, <=, s->buf_size);
+
+    memset(out, 0xa5, sizeof(out));
+    g_assert_cmpint(zstd_decompress_page(s->zds, s->buf, len, out, PAGE_SIZE,
+                                         &error_abort), ==, 0);
+    g_assert(!memcmp(page, out, PAGE_SIZE));
+    return len;
+}
+
+static void test_round_trip(void)
+{
+    Stream s;
+    ssize_t first, len;
+    int i;
+
+    stream_init(&s, 3);
+    first = round_trip(&s, 0, 3);
+    for (i = 1; i < N_PAGES; i++) {
+        len = round_trip(&s, i, 3);
+        /* the previous pages work as the dictionary */
+        g_assert_cmpint(len, <, first / 4);
+    }
+    g_assert_cmpint(s.frame_level, ==, 3);
+    stream_fini(&s);
+}
+
+/* A new level ends the frame; the stream goes on in the next one */
+static void test_level_change(void)
+{
+    static const int levels[] = { 1, 1, 5, 5, 5, 19, 2, 2, 1 };
+    Stream s;
+    int i;
+
+    stream_init(&s, 1);
+    for (i = 0; i < ARRAY_SIZE(levels); i++) {
+        round_trip(&s, i, levels[i]);
+        g_assert_cmpint(s.frame_level, ==, levels[i]);
+    }
+    stream_fini(&s);
+}
+
+/* A page that was not compressed by this stream fails it */
+static void test_corrupted(void)
+{
+    uint8_t page[PAGE_SIZE];
+    Error *err = NULL;
+    Stream s;
+    ssize_t len;
+
+    stream_init(&s, 3);
+    round_trip(&s, 0, 3);
+
+    fill_page(page, 1);
+    len = zstd_compress_page(s.zcs, &s.frame_level, 3, page, PAGE_SIZE,
+                             s.buf, s.buf_size, &error_abort);
+    memset(s.buf, 0xff, len);
+    g_assert_cmpint(zstd_decompress_page(s.zds, s.buf, len, page, PAGE_SIZE,
+                                         &err), ==, -1);
+    g_assert(err);
+    error_free(err);
+    stream_fini(&s);
+}
+
+/* The data of a page must not be cut short */
+static void test_truncated(void)
+{
+    uint8_t page[PAGE_SIZE];
+    Error *err = NULL;
+    Stream s;
+    ssize_t len;
+
+    stream_init(&s, 3);
+    fill_page(page, 0);
+    len = zstd_compress_page(s.zcs, &s.frame_level, 3, page, PAGE_SIZE,
+                             s.buf, s.buf_size, &error_abort);
+    g_assert_cmpint(zstd_decompress_page(s.zds, s.buf, len / 2, page,
+                                         PAGE_SIZE, &err), ==, -1);
+    g_assert(err);
+    error_free(err);
+    stream_fini(&s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/zstd-page/round-trip", test_round_trip);
+    g_test_add_func("/zstd-page/level-change", test_level_change);
+    g_test_add_func("/zstd-page/corrupted", test_corrupted);
+    g_test_add_func("/zstd-page/truncated", test_truncated);
+    return g_test_run();
+}
@@ -0,0 +1,208 @@
+/*
+ * Benchmark of the zero page and dirty bitmap scans used by RAM migration
+ *
+ * Every vector implementation of buffer_find_nonzero_offset that the host
+ * supports is timed on guest-page sized buffers, and on sparse bitmaps with
+ * find_next_bit and find_first_nonzero_word.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/timer.h"
+#include "qemu/cutils.h"
+#include "qemu/bitmap.h"
+
+/* command line parameters, see commands_string */
+static size_t page_size = 4096;
+static size_t ram_mb = 256;
+static unsigned long n_iters = 20;
+static unsigned int dirty_pct = 1;
+
+static const char commands_string[] =
+    " -p = page size in bytes (default: 4096)\n"
+    " -m = guest RAM to scan in MiB (default: 256)\n"
+    " -n = number of passes over the guest RAM (default: 20)\n"
+    " -d = percentage of nonzero pages and dirty bits (default: 1)\n"
+    " -h = show this help message";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static inline uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * UINT64_C(2685821657736338717);
+}
+
+/* Returns the number of zero pages, like the migration zero page check */
+static size_t scan_pages(const uint8_t *ram, size_t npages)
+{
+    size_t i, zero = 0;
+
+    for (i = 0; i < npages; i++) {
+        const uint8_t *p = ram + i * page_size;
+
+        zero += buffer_find_nonzero_offset(p, page_size) == page_size;
+    }
+    return zero;
+}
+
+/* Returns the number of set bits, like migration_bitmap_find_dirty */
+static size_t scan_bitmap(const unsigned long *map, unsigned long nbits)
+{
+    unsigned long bit = find_next_bit(map, nbits, 0);
+    size_t n = 0;
+
+    while (bit < nbits) {
+        n++;
+        bit = find_next_bit(map, nbits, bit + 1);
+    }
+    return n;
+}
+
+/* Returns the number of nonzero words, like the dirty log sync */
+static size_t scan_words(const unsigned long *map, unsigned long nwords)
+{
+    unsigned long i = 0;
+    size_t n = 0;
+
+    for (;;) {
+        i += find_first_nonzero_word(map + i, nwords - i);
+        if (i == nwords) {
+            return n;
+        }
+        n++;
+        i++;
+    }
+}
+
+static double mb_per_sec(size_t bytes, int64_t ns)
+{
+    return ns ? (double)bytes * n_iters * 1000 / ns : 0;
+}
+
+static void bench(const uint8_t *ram, size_t npages,
+                  const unsigned long *map, unsigned long nbits)
+{
+    size_t map_bytes = BITS_TO_LONGS(nbits) * sizeof(unsigned long);
+    size_t zero = 0, dirty = 0, words = 0;
+    int64_t t_pages, t_bits, t_words;
+    unsigned long i;
+
+    t_pages = get_clock();
+    for (i = 0; i < n_iters; i++) {
+        zero = scan_pages(ram, npages);
+    }
+    t_pages = get_clock() - t_pages;
+
+    t_bits = get_clock();
+    for (i = 0; i < n_iters; i++) {
+        dirty = scan_bitmap(map, nbits);
+    }
+    t_bits = get_clock() - t_bits;
+
+    t_words = get_clock();
+    for (i = 0; i < n_iters; i++) {
+        words = scan_words(map, BITS_TO_LONGS(nbits));
+    }
+    t_words = get_clock() - t_words;
+
+    printf("%-8s %10.1f %10.1f %10.1f   %zu zero pages, %zu dirty bits, "
+           "%zu dirty words\n", buffer_find_nonzero_offset_accel(),
+           mb_per_sec(npages * page_size, t_pages),
+           mb_per_sec(map_bytes, t_bits),
+           mb_per_sec(map_bytes, t_words),
+           zero, dirty, words);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:hm:n:p:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            dirty_pct = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            break;
+        case 'm':
+            ram_mb = atol(optarg);
+            break;
+        case 'n':
+            n_iters = atol(optarg);
+            break;
+        case 'p':
+            page_size = atol(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+    if (!is_power_of_2(page_size) || page_size < 256 || dirty_pct > 100) {
+        usage_complete(argc, argv);
+    }
+    if (n_iters == 0) {
+        n_iters = 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t npages, i;
+    unsigned long nbits;
+    unsigned long *map;
+    uint8_t *ram;
+    uint64_t r = 1;
+
+    parse_args(argc, argv);
+
+    /* The bitmap is as large as the scanned RAM, so that throughputs compare */
+    npages = ram_mb * 1024 * 1024 / page_size;
+    nbits = ram_mb * 1024 * 1024 * 8;
+    ram = qemu_memalign(64, npages * page_size);
+    map = bitmap_new(nbits);
+    memset(ram, 0, npages * page_size);
+
+    for (i = 0; i < npages; i++) {
+        r = xorshift64star(r);
+        if (r % 100 < dirty_pct) {
+            ram[i * page_size + r % page_size] = 1;
+        }
+    }
+    for (i = 0; i < nbits / 64; i++) {
+        r = xorshift64star(r);
+        if (r % 100 < dirty_pct) {
+            set_bit(i * 64 + r % 64, map);
+        }
+    }
+
+    printf("%-8s %10s %10s %10s\n", "accel", "zero-page",
+           "next-bit", "next-word");
+    printf("(MB/s)\n");
+    do {
+        bench(ram, npages, map, nbits);
+    } while (buffer_find_nonzero_offset_next_accel());
+
+    g_free(map);
+    qemu_vfree(ram);
+    return 0;
+}
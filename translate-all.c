@@ -119,38 +119,31 @@ static void *l1_map[V_L1_SIZE];
 
 /* code generation context */
 TCGContext tcg_ctx;
+TCGv_env cpu_env;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -300,7 +293,19 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool r = false;
 
+    /* Only a return address inside generated code can be looked up.
+       Anything else comes from a helper called outside of translated
+       code (possibly during translation itself, with tb_lock held),
+       so there is nothing to restore.  */
+    if (retaddr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        retaddr >= (uintptr_t)tcg_ctx.code_gen_buffer +
+                   tcg_ctx.code_gen_buffer_size) {
+        return false;
+    }
+
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
@@ -310,9 +315,10 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        r = true;
     }
-    return false;
+    tb_unlock();
+    return r;
 }
 
 void page_size_init(void)
@@ -735,6 +741,13 @@ static inline void code_gen_alloc(size_t tb_size)
     qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
 }
 
+static void tb_htable_init(void)
+{
+    unsigned int mode = QHT_MODE_AUTO_RESIZE;
+
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE, mode);
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -742,6 +755,7 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     page_init();
+    tb_htable_init();
     code_gen_alloc(tb_size);
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
@@ -755,30 +769,98 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Regions smaller than this would be evicted too often to be useful;
+   a small translation buffer gets fewer regions.  */
+#define TB_REGION_MIN_SIZE (256u * 1024)
+
+static void tb_region_set_current(int i)
+{
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+    tcg_ctx.tb_ctx.cur_region = i;
+    tcg_ctx.code_gen_ptr = r->start;
+    tcg_ctx.code_gen_highwater = r->end - TCG_HIGHWATER;
+}
+
+/* Split code_gen_buffer and the tbs array into regions, all of them
+   empty.  The layout depends on where the prologue ended up, so this
+   is (re)done whenever code_gen_buffer has moved.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = tcg_ctx.code_gen_buffer_size;
+    int i, n;
+
+    n = MIN(TB_NB_REGIONS, size / TB_REGION_MIN_SIZE);
+    n = MAX(n, 1);
+    ctx->nb_regions = n;
+    ctx->region_size = QEMU_ALIGN_DOWN(size / n, CODE_GEN_ALIGN);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / n;
+
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        /* the last region also gets the rounding leftovers */
+        r->end = i == n - 1 ? tcg_ctx.code_gen_buffer + size
+                            : r->start + ctx->region_size;
+        r->code_end = r->start;
+        r->tbs = &ctx->tbs[i * ctx->region_max_tbs];
+        r->nb_tbs = 0;
+    }
+    ctx->nb_tbs = 0;
+    tb_region_set_current(0);
+}
+
+/* Return the end of the code generated so far into region 'r'.  */
+static inline void *tb_region_code_end(TBRegion *r)
+{
+    if (r == &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region]) {
+        return tcg_ctx.code_gen_ptr;
+    }
+    return r->code_end;
+}
+
+/* Allocate a new translation block. Return NULL if the current region
+   has no room left for it, in which case the next region must be
+   evicted.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (unlikely(ctx->regions[0].start != tcg_ctx.code_gen_buffer)) {
+        tb_regions_init();
+    }
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs >= ctx->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->edge_count[0] = 0;
+    tb->edge_count[1] = 0;
+    /* not reachable until tb_link_page() */
+    tb->invalid = true;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
+        ctx->nb_tbs--;
     }
 }
 
@@ -823,8 +905,7 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void do_tb_flush(CPUState *cpu)
 {
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -837,77 +918,164 @@ void tb_flush(CPUState *cpu)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_init();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
+                  tcg_ctx.tb_ctx.tb_flush_count + 1);
 }
 
-#ifdef DEBUG_TB_CHECK
-
-static void tb_invalidate_check(target_ulong address)
+/* Invalidate the TBs of the region following the current one, which is
+   the oldest, and move code generation there.  Unlike a full flush, the
+   TBs in all other regions stay linked and hashed.  */
+static void do_tb_region_evict(CPUState *cpu)
 {
-    TranslationBlock *tb;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int next = (ctx->cur_region + 1) % ctx->nb_regions;
+    TBRegion *r = &ctx->regions[next];
     int i;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-             tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    ctx->regions[ctx->cur_region].code_end = tcg_ctx.code_gen_ptr;
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        /* skip TBs already invalidated, or whose translation never
+           completed */
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
         }
     }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_end = r->start;
+    tb_region_set_current(next);
+
+    atomic_mb_set(&ctx->tb_region_evict_count, ctx->tb_region_evict_count + 1);
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
-{
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+#ifndef CONFIG_USER_ONLY
+typedef struct TBFlushRequest {
+    CPUState *cpu;
+    bool evict_region;
+    int tb_flush_count;
+    int tb_region_evict_count;
+} TBFlushRequest;
+
+/* Runs with every vCPU out of generated code.  */
+static void tb_flush_safe_work(void *data)
+{
+    TBFlushRequest *req = data;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    tb_lock();
+    /* If somebody else flushed the buffer since the request was queued,
+       there is nothing left to do; the same goes for an eviction once
+       another one has already made room.  */
+    if (ctx->tb_flush_count == req->tb_flush_count) {
+        if (!req->evict_region) {
+            do_tb_flush(req->cpu);
+        } else if (ctx->tb_region_evict_count == req->tb_region_evict_count) {
+            do_tb_region_evict(req->cpu);
         }
     }
+    tb_unlock();
+    g_free(req);
 }
 
+static void tb_queue_flush(CPUState *cpu, bool evict_region)
+{
+    TBFlushRequest *req = g_new(TBFlushRequest, 1);
+
+    /* Other vCPUs may be executing code from the buffer, so defer
+       the work until all of them have left the execution loop.  */
+    req->cpu = cpu;
+    req->evict_region = evict_region;
+    req->tb_flush_count = atomic_mb_read(&tcg_ctx.tb_ctx.tb_flush_count);
+    req->tb_region_evict_count =
+        atomic_mb_read(&tcg_ctx.tb_ctx.tb_region_evict_count);
+    async_safe_run_on_cpu(cpu, tb_flush_safe_work, req);
+}
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+/* XXX: tb_flush is not thread safe for user-mode emulation */
+void tb_flush(CPUState *cpu)
 {
-    TranslationBlock *tb1;
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        tb_queue_flush(cpu, false);
+        return;
+    }
+#endif
+    do_tb_flush(cpu);
+}
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+/* Make room in the translation buffer by evicting its oldest region.
+   With a single region this amounts to a tb_flush().  */
+static void tb_evict_region(CPUState *cpu)
+{
+    if (tcg_ctx.tb_ctx.nb_regions <= 1) {
+        tb_flush(cpu);
+        return;
+    }
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        tb_queue_flush(cpu, true);
+        return;
     }
+#endif
+    do_tb_region_evict(cpu);
+}
+
+#ifdef DEBUG_TB_CHECK
+
+static void
+do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
+
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
+    }
+}
+
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void
+do_tb_page_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
+    }
+}
+
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
 }
 
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -966,14 +1134,17 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUState *cpu;
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int n1;
+    uint32_t h;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -1059,6 +1230,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    bool cached = false;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -1071,8 +1243,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the oldest region must be evicted */
+        tb_evict_region(cpu);
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The eviction only happens once every vCPU has left the
+               execution loop; make this one get there immediately.  */
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
@@ -1094,7 +1272,12 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     tcg_func_start(&tcg_ctx);
 
-    gen_intermediate_code(env, tb);
+#ifdef CONFIG_LINUX_USER
+    cached = tbcache_lookup(cpu, tb);
+#endif
+    if (!cached) {
+        gen_intermediate_code(env, tb);
+    }
 
     trace_translate_block(tb, tb->pc, tb->tc_ptr);
 
@@ -1157,10 +1340,294 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+#ifdef CONFIG_LINUX_USER
+    tbcache_insert(tb);
+#endif
     tb_link_page(tb, phys_pc, phys_page2);
     return tb;
 }
 
+/* Append ops [first, last] to the list of ops whose tail is *prev.  */
+static void tb_sb_link_ops(int *prev, int first, int last)
+{
+    TCGOp *ops = tcg_ctx.gen_op_buf;
+    int i;
+
+    if (first > last) {
+        return;
+    }
+    for (i = first; i <= last; i++) {
+        ops[i].prev = i - 1;
+        ops[i].next = i + 1;
+    }
+    ops[first].prev = *prev;
+    if (*prev >= 0) {
+        ops[*prev].next = first;
+    } else {
+        tcg_ctx.gen_first_op_idx = first;
+    }
+    *prev = last;
+}
+
+/* Append a copy of the last insn_start op among ops [first, last] to
+   the opcode buffer.  Return the index of the copy, or -1 if there is
+   no insn_start op.  */
+static int tb_sb_dup_insn_start(int first, int last)
+{
+    TCGOp *ops = tcg_ctx.gen_op_buf;
+    int nb_args = tcg_op_defs[INDEX_op_insn_start].nb_args;
+    int i, oi = tcg_ctx.gen_next_op_idx;
+    int pi = tcg_ctx.gen_next_parm_idx;
+
+    for (i = last; i >= first; i--) {
+        if (ops[i].opc == INDEX_op_insn_start) {
+            break;
+        }
+    }
+    if (i < first) {
+        return -1;
+    }
+    memcpy(&tcg_ctx.gen_opparam_buf[pi], &tcg_ctx.gen_opparam_buf[ops[i].args],
+           nb_args * sizeof(TCGArg));
+    ops[oi] = ops[i];
+    ops[oi].args = pi;
+    tcg_ctx.gen_next_op_idx = oi + 1;
+    tcg_ctx.gen_next_parm_idx = pi + nb_args;
+    return oi;
+}
+
+/* Find the goto_tb/exit_tb pair through which ops [first, last],
+   translated for 'sub', leave by exit 'n'.  Return the index of the
+   exit_tb op, or -1 if there is no such pair or if the code between
+   them may leave the TB in another way.  */
+static int tb_sb_find_exit(TranslationBlock *sub, int n, int first, int last,
+                           int *goto_tb)
+{
+    TCGOp *ops = tcg_ctx.gen_op_buf;
+    int i, g = -1;
+
+    for (i = first; i <= last; i++) {
+        TCGArg *args = &tcg_ctx.gen_opparam_buf[ops[i].args];
+
+        if (ops[i].opc == INDEX_op_goto_tb && args[0] == n) {
+            if (g >= 0) {
+                return -1;
+            }
+            g = i;
+        } else if (g >= 0 && ops[i].opc == INDEX_op_exit_tb) {
+            if (args[0] != (uintptr_t)sub + n) {
+                return -1;
+            }
+            *goto_tb = g;
+            return i;
+        } else if (g >= 0 &&
+                   (tcg_op_defs[ops[i].opc].flags & TCG_OPF_BB_END)) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/* Retranslate the NB_TBS TBs of TRACE, which is expected to run
+ * straight through from TRACE[i] to TRACE[i + 1] by exit SLOTS[i], as a
+ * single superblock.  The members must lie in the page of the first one
+ * and have been translated without any cflags.
+ *
+ * The members are translated one after the other into the same opcode
+ * stream.  The goto_tb/exit_tb pair by which each member jumps to the
+ * next one is removed, and the rest of the member (its side exits) is
+ * moved to the end of the stream, so that the optimizer and the register
+ * allocator see the hot path as one extended basic block.  Only the last
+ * member keeps direct jumps; side exits go back to the main loop.
+ *
+ * A side exit moved to the end of the stream is preceded by a copy of the
+ * insn_start op of the instruction it belongs to.  Otherwise a fault in
+ * its code would be attributed to the last instruction of the superblock
+ * by cpu_restore_state().  These copies have their own entries in the
+ * search data, so tb->icount counts them too.
+ *
+ * Returns NULL if the superblock could not be generated.  Otherwise,
+ * the superblock replaces the first member in the hash table.
+ *
+ * Called with mmap_lock held for user-mode emulation, and tb_lock held.
+ */
+TranslationBlock *tb_gen_superblock(CPUState *cpu, TranslationBlock **trace,
+                                    const int *slots, int nb_tbs)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TranslationBlock *head = trace[0];
+    TranslationBlock sub[TB_SB_MAX_TBS];
+    int first[TB_SB_MAX_TBS], last[TB_SB_MAX_TBS];
+    int exit_op[TB_SB_MAX_TBS], goto_op[TB_SB_MAX_TBS];
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+    tcg_insn_unit *gen_code_buf;
+    int gen_code_size, search_size;
+    int i, oi, prev, icount, dup;
+    target_ulong end;
+
+    assert(nb_tbs <= TB_SB_MAX_TBS);
+    tb = tb_alloc(head->pc);
+    if (unlikely(!tb)) {
+        /* leave the eviction to the next tb_gen_code() */
+        return NULL;
+    }
+    gen_code_buf = tcg_ctx.code_gen_ptr;
+    tb->tc_ptr = gen_code_buf;
+    tb->cs_base = head->cs_base;
+    tb->flags = head->flags;
+    tb->cflags = CF_SUPERBLOCK;
+
+    tcg_func_start(&tcg_ctx);
+
+    icount = 0;
+    end = head->pc;
+    for (i = 0; i < nb_tbs; i++) {
+        int op_idx = tcg_ctx.gen_next_op_idx;
+        int parm_idx = tcg_ctx.gen_next_parm_idx;
+
+        /* Leave room for one copy of insn_start per side exit.  */
+        if (op_idx + OPC_TB_SIZE + TB_SB_MAX_TBS > OPC_BUF_SIZE ||
+            parm_idx + (OPC_TB_SIZE + TB_SB_MAX_TBS) * MAX_OPC_PARAM >
+            OPPARAM_BUF_SIZE ||
+            icount + trace[i]->icount + i > TCG_MAX_INSNS) {
+            break;
+        }
+        memset(&sub[i], 0, sizeof(sub[i]));
+        sub[i].pc = trace[i]->pc;
+        sub[i].cs_base = trace[i]->cs_base;
+        sub[i].flags = trace[i]->flags;
+        sub[i].cflags = i ? CF_SB_MEMBER : 0;
+
+        tcg_ctx.gen_op_base = op_idx;
+#ifdef CONFIG_DEBUG_TCG
+        tcg_ctx.goto_tb_issue_mask = 0;
+#endif
+        gen_intermediate_code(env, &sub[i]);
+        if (sub[i].size != trace[i]->size ||
+            sub[i].icount != trace[i]->icount) {
+            /* The guest code changed, or the opcode buffer filled up:
+               end the superblock with the previous member.  */
+            tcg_ctx.gen_next_op_idx = op_idx;
+            tcg_ctx.gen_last_op_idx = op_idx - 1;
+            tcg_ctx.gen_next_parm_idx = parm_idx;
+            break;
+        }
+        first[i] = op_idx;
+        last[i] = tcg_ctx.gen_last_op_idx;
+        icount += sub[i].icount;
+        end = MAX(end, sub[i].pc + sub[i].size);
+
+        if (i < nb_tbs - 1) {
+            exit_op[i] = tb_sb_find_exit(&sub[i], slots[i], first[i],
+                                         last[i], &goto_op[i]);
+            if (exit_op[i] < 0) {
+                i++;
+                break;
+            }
+        }
+    }
+    tcg_ctx.gen_op_base = 0;
+    nb_tbs = i;
+    if (nb_tbs < 2) {
+        goto fail;
+    }
+
+    /* Lay out the hot path first, then the side exits.  */
+    prev = -1;
+    for (i = 0; i < nb_tbs - 1; i++) {
+        tb_sb_link_ops(&prev, first[i], exit_op[i] - 1);
+    }
+    tb_sb_link_ops(&prev, first[i], last[i]);
+    for (i = 0; i < nb_tbs - 1; i++) {
+        if (exit_op[i] == last[i]) {
+            continue;
+        }
+        dup = tb_sb_dup_insn_start(first[i], goto_op[i]);
+        if (dup >= 0) {
+            tb_sb_link_ops(&prev, dup, dup);
+            icount++;
+        }
+        tb_sb_link_ops(&prev, exit_op[i] + 1, last[i]);
+    }
+    tcg_ctx.gen_op_buf[prev].next = -1;
+    tcg_ctx.gen_last_op_idx = prev;
+
+    /* Only the last member keeps its direct jumps.  exit_tb ops still
+       point to the TB the member was translated for.  */
+    for (i = 0; i < nb_tbs; i++) {
+        for (oi = first[i]; oi <= last[i]; oi++) {
+            TCGOp *op = &tcg_ctx.gen_op_buf[oi];
+            TCGArg *args = &tcg_ctx.gen_opparam_buf[op->args];
+            int n = args[0] & TB_EXIT_MASK;
+
+            if (i < nb_tbs - 1 && oi == exit_op[i]) {
+                continue;
+            }
+            if (op->opc == INDEX_op_goto_tb && i < nb_tbs - 1) {
+                tcg_op_remove(&tcg_ctx, op);
+            } else if (op->opc == INDEX_op_exit_tb &&
+                       (args[0] & ~TB_EXIT_MASK) == (uintptr_t)&sub[i]) {
+                if (n == TB_EXIT_REQUESTED || i == nb_tbs - 1) {
+                    args[0] = (uintptr_t)tb + n;
+                } else {
+                    args[0] = 0;
+                }
+            }
+        }
+    }
+
+    tb->size = end - head->pc;
+    tb->icount = icount;
+    trace_translate_block(tb, tb->pc, tb->tc_ptr);
+
+    tb->tb_next_offset[0] = 0xffff;
+    tb->tb_next_offset[1] = 0xffff;
+    tcg_ctx.tb_next_offset = tb->tb_next_offset;
+#ifdef USE_DIRECT_JUMP
+    tcg_ctx.tb_jmp_offset = tb->tb_jmp_offset;
+    tcg_ctx.tb_next = NULL;
+#else
+    tcg_ctx.tb_jmp_offset = NULL;
+    tcg_ctx.tb_next = tb->tb_next;
+#endif
+
+    gen_code_size = tcg_gen_code(&tcg_ctx, tb);
+    if (unlikely(gen_code_size < 0 || gen_code_size > UINT16_MAX)) {
+        goto fail;
+    }
+    search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
+    if (unlikely(search_size < 0)) {
+        goto fail;
+    }
+
+#ifdef DEBUG_DISAS
+    if (qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM) &&
+        qemu_log_in_addr_range(tb->pc)) {
+        qemu_log("OUT: [superblock of %d TBs, size=%d]\n", nb_tbs,
+                 gen_code_size);
+        log_disas(tb->tc_ptr, gen_code_size);
+        qemu_log("\n");
+        qemu_log_flush();
+    }
+#endif
+
+    tcg_ctx.code_gen_ptr = (void *)
+        ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
+                 CODE_GEN_ALIGN);
+
+    phys_pc = head->page_addr[0] | (head->pc & ~TARGET_PAGE_MASK);
+    tb_link_page(tb, phys_pc, -1);
+    /* From now on, lookups of the first member find the superblock */
+    tb_phys_invalidate(head, -1);
+    tcg_ctx.tb_ctx.tb_superblock_count++;
+    return tb;
+
+ fail:
+    tb_free(tb);
+    return NULL;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1471,14 +1938,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    uint32_t h;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1499,6 +1959,15 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     if (tb->tb_next_offset[1] != 0xffff) {
         tb_reset_jump(tb, 1);
     }
+    atomic_set(&tb->invalid, false);
+
+    /* add in the hash table last, since lookups do not take tb_lock and
+       must see a fully initialized TB.  Single-use TBs are never looked up,
+       so they are kept out of it.  */
+    if (!(tb->cflags & CF_NOCACHE)) {
+        h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+        qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
+    }
 
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
@@ -1509,23 +1978,30 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (ctx->nb_tbs <= 0) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    /* TBs are only sorted by tc_ptr within a region */
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size;
+    r = &ctx->regions[MIN(i, ctx->nb_regions - 1)];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_code_end(r)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1535,7 +2011,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1554,11 +2030,14 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
 
+/* Called with tb_lock held.  */
 void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
@@ -1595,6 +2074,8 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    /* tb_lock is released by the longjmp back into the execution loop */
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1669,38 +2150,74 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf)
+{
+    struct qht_stats hst;
+    size_t i;
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash entries     %zu\n", hst.entries);
+    cpu_fprintf(f, "TB hash max chain   %zu buckets\n", hst.chain_max);
+    cpu_fprintf(f, "TB hash chains     ");
+    for (i = 1; i <= QHT_STATS_MAX_CHAIN; i++) {
+        if (hst.chain_hist[i]) {
+            cpu_fprintf(f, " %s%zu:%zu", i == QHT_STATS_MAX_CHAIN ? ">=" : "",
+                        i, hst.chain_hist[i]);
+        }
+    }
+    cpu_fprintf(f, "\n");
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t code_size;
     TranslationBlock *tb;
+    TBRegion *r;
+
+    tb_lock();
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (j = 0; j < tcg_ctx.tb_ctx.nb_regions; j++) {
+        r = &tcg_ctx.tb_ctx.regions[j];
+        code_size += tb_region_code_end(r) - r->start;
+    }
+    for (j = 0; j < tcg_ctx.tb_ctx.nb_regions; j++) {
+        r = &tcg_ctx.tb_ctx.regions[j];
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+                code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "TB regions          %d (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1708,12 +2225,8 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1724,12 +2237,21 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    print_qht_statistics(f, cpu_fprintf);
+
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+            tcg_ctx.tb_ctx.tb_region_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB superblocks      %d\n",
+            tcg_ctx.tb_ctx.tb_superblock_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
+
+    tb_unlock();
 }
 
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
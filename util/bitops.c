@@ -13,9 +13,49 @@
 
 #include "qemu/osdep.h"
 #include "qemu/bitops.h"
+#include "qemu/cutils.h"
 
 #define BITOP_WORD(nr)		((nr) / BITS_PER_LONG)
 
+/* Below this many words, a vector scan is not worth its setup */
+#define FIND_NONZERO_WORD_MIN_VEC   (256 / sizeof(unsigned long))
+
+/*
+ * Find the first nonzero word in an array of words.  Long runs of zero
+ * words are handed to buffer_find_nonzero_offset, which uses the widest
+ * vector instructions available on the host.
+ */
+unsigned long find_first_nonzero_word(const unsigned long *addr,
+                                      unsigned long nr)
+{
+    unsigned long i = 0;
+
+    if (nr >= 2 * FIND_NONZERO_WORD_MIN_VEC) {
+        size_t len;
+
+        /* Reach an alignment good enough for any vector length */
+        for (; ((uintptr_t)&addr[i]) % 32; i++) {
+            if (addr[i]) {
+                return i;
+            }
+        }
+
+        len = QEMU_ALIGN_DOWN(nr - i, FIND_NONZERO_WORD_MIN_VEC)
+              * sizeof(unsigned long);
+        if (can_use_buffer_find_nonzero_offset(&addr[i], len)) {
+            i += buffer_find_nonzero_offset(&addr[i], len)
+                 / sizeof(unsigned long);
+        }
+    }
+
+    for (; i < nr; i++) {
+        if (addr[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
 /*
  * Find the next set bit in a memory region.
  */
@@ -43,6 +83,13 @@ unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
         size -= BITS_PER_LONG;
         result += BITS_PER_LONG;
     }
+    if (size >= 2 * FIND_NONZERO_WORD_MIN_VEC * BITS_PER_LONG && !*p) {
+        unsigned long skip = find_first_nonzero_word(p, size / BITS_PER_LONG);
+
+        p += skip;
+        result += skip * BITS_PER_LONG;
+        size -= skip * BITS_PER_LONG;
+    }
     while (size >= 4*BITS_PER_LONG) {
         unsigned long d1, d2, d3;
         tmp = *p;
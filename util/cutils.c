@@ -172,6 +172,7 @@ int qemu_fdatasync(int fd)
 #undef pixel
 #undef bool
 #define VECTYPE        __vector unsigned char
+#define VECNAME        "altivec"
 #define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
 #define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
 #define VEC_OR(v1, v2) ((v1) | (v2))
@@ -181,11 +182,13 @@ int qemu_fdatasync(int fd)
 #elif defined __SSE2__
 #include <emmintrin.h>
 #define VECTYPE        __m128i
+#define VECNAME        "sse2"
 #define SPLAT(p)       _mm_set1_epi8(*(p))
 #define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
 #define VEC_OR(v1, v2) (_mm_or_si128(v1, v2))
 #else
 #define VECTYPE        unsigned long
+#define VECNAME        "long"
 #define SPLAT(p)       (*(p) * (~0UL / 255))
 #define ALL_EQ(v1, v2) ((v1) == (v2))
 #define VEC_OR(v1, v2) ((v1) | (v2))
@@ -262,16 +265,90 @@ static size_t buffer_find_nonzero_offset_inner(const void *buf, size_t len)
  * restrict the gcc version to 4.9+ to prevent the failure.
  */
 
+/* The SSE4.1 version only needs the target pragma on an x86 host, while
+ * the AVX2 one also needs the assembler support that configure checks for.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && QEMU_GNUC_PREREQ(4, 9)
+#define BUFFER_ZERO_SSE4_1
+#endif
+
+#ifdef BUFFER_ZERO_SSE4_1
+#include <cpuid.h>
+
+/* The SSE4.1 and AVX2 versions differ from the SSE2 one in that they test
+ * vectors with PTEST, which does not need a compare and a mask extraction.
+ */
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#include <smmintrin.h>
+
+#define SSE4_VECTYPE        __m128i
+#define SSE4_ALL_ZERO(v)    _mm_testz_si128(v, v)
+#define SSE4_VEC_OR(v1, v2) (_mm_or_si128(v1, v2))
+
+static bool
+can_use_buffer_find_nonzero_offset_sse4(const void *buf, size_t len)
+{
+    return (len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                   * sizeof(SSE4_VECTYPE)) == 0
+            && ((uintptr_t) buf) % sizeof(SSE4_VECTYPE) == 0);
+}
+
+static size_t buffer_find_nonzero_offset_sse4(const void *buf, size_t len)
+{
+    const SSE4_VECTYPE *p = buf;
+    size_t i;
+
+    assert(can_use_buffer_find_nonzero_offset_sse4(buf, len));
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!SSE4_ALL_ZERO(p[i])) {
+            return i * sizeof(SSE4_VECTYPE);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(SSE4_VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        SSE4_VECTYPE tmp0 = SSE4_VEC_OR(p[i + 0], p[i + 1]);
+        SSE4_VECTYPE tmp1 = SSE4_VEC_OR(p[i + 2], p[i + 3]);
+        SSE4_VECTYPE tmp2 = SSE4_VEC_OR(p[i + 4], p[i + 5]);
+        SSE4_VECTYPE tmp3 = SSE4_VEC_OR(p[i + 6], p[i + 7]);
+        SSE4_VECTYPE tmp01 = SSE4_VEC_OR(tmp0, tmp1);
+        SSE4_VECTYPE tmp23 = SSE4_VEC_OR(tmp2, tmp3);
+        if (!SSE4_ALL_ZERO(SSE4_VEC_OR(tmp01, tmp23))) {
+            break;
+        }
+    }
+
+    return i * sizeof(SSE4_VECTYPE);
+}
+#pragma GCC pop_options
+
+bool host_cpu_has_sse4_1(void)
+{
+    unsigned int a, b, c, d;
+
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1);
+}
+#else
+bool host_cpu_has_sse4_1(void)
+{
+    return false;
+}
+#endif
+
 #if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
 #pragma GCC push_options
 #pragma GCC target("avx2")
-#include <cpuid.h>
 #include <immintrin.h>
 
 #define AVX2_VECTYPE        __m256i
-#define AVX2_SPLAT(p)       _mm256_set1_epi8(*(p))
-#define AVX2_ALL_EQ(v1, v2) \
-    (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2)) == 0xFFFFFFFF)
+#define AVX2_ALL_ZERO(v)    _mm256_testz_si256(v, v)
 #define AVX2_VEC_OR(v1, v2) (_mm256_or_si256(v1, v2))
 
 static bool
@@ -285,7 +362,6 @@ can_use_buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
 static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
 {
     const AVX2_VECTYPE *p = buf;
-    const AVX2_VECTYPE zero = (AVX2_VECTYPE){0};
     size_t i;
 
     assert(can_use_buffer_find_nonzero_offset_avx2(buf, len));
@@ -295,7 +371,7 @@ static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
     }
 
     for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
-        if (!AVX2_ALL_EQ(p[i], zero)) {
+        if (!AVX2_ALL_ZERO(p[i])) {
             return i * sizeof(AVX2_VECTYPE);
         }
     }
@@ -309,17 +385,29 @@ static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
         AVX2_VECTYPE tmp3 = AVX2_VEC_OR(p[i + 6], p[i + 7]);
         AVX2_VECTYPE tmp01 = AVX2_VEC_OR(tmp0, tmp1);
         AVX2_VECTYPE tmp23 = AVX2_VEC_OR(tmp2, tmp3);
-        if (!AVX2_ALL_EQ(AVX2_VEC_OR(tmp01, tmp23), zero)) {
+        if (!AVX2_ALL_ZERO(AVX2_VEC_OR(tmp01, tmp23))) {
             break;
         }
     }
 
     return i * sizeof(AVX2_VECTYPE);
 }
+#pragma GCC pop_options
 
-static bool avx2_support(void)
+bool host_cpu_has_avx2(void)
 {
-    int a, b, c, d;
+    unsigned int a, b, c, d, xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) ||
+        !(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+
+    /* The OS must also preserve the YMM registers across context switches */
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
 
     if (__get_cpuid_max(0, NULL) < 7) {
         return false;
@@ -329,40 +417,77 @@ static bool avx2_support(void)
 
     return b & bit_AVX2;
 }
+#else
+bool host_cpu_has_avx2(void)
+{
+    return false;
+}
+#endif
 
-bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len) \
-         __attribute__ ((ifunc("can_use_buffer_find_nonzero_offset_ifunc")));
-size_t buffer_find_nonzero_offset(const void *buf, size_t len) \
-         __attribute__ ((ifunc("buffer_find_nonzero_offset_ifunc")));
+typedef struct BufferZeroAccel {
+    const char *name;
+    bool (*supported)(void);
+    bool (*can_use)(const void *buf, size_t len);
+    size_t (*find)(const void *buf, size_t len);
+} BufferZeroAccel;
 
-static void *buffer_find_nonzero_offset_ifunc(void)
-{
-    typeof(buffer_find_nonzero_offset) *func = (avx2_support()) ?
-        buffer_find_nonzero_offset_avx2 : buffer_find_nonzero_offset_inner;
+/* Fastest first; the last entry works everywhere */
+static const BufferZeroAccel buffer_zero_accels[] = {
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+    { "avx2", host_cpu_has_avx2, can_use_buffer_find_nonzero_offset_avx2,
+      buffer_find_nonzero_offset_avx2 },
+#endif
+#ifdef BUFFER_ZERO_SSE4_1
+    { "sse4.1", host_cpu_has_sse4_1, can_use_buffer_find_nonzero_offset_sse4,
+      buffer_find_nonzero_offset_sse4 },
+#endif
+    { VECNAME, NULL, can_use_buffer_find_nonzero_offset_inner,
+      buffer_find_nonzero_offset_inner },
+};
 
-    return func;
-}
+static const BufferZeroAccel *buffer_zero_accel =
+    &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
 
-static void *can_use_buffer_find_nonzero_offset_ifunc(void)
+static void __attribute__((constructor)) buffer_zero_accel_init(void)
 {
-    typeof(can_use_buffer_find_nonzero_offset) *func = (avx2_support()) ?
-        can_use_buffer_find_nonzero_offset_avx2 :
-        can_use_buffer_find_nonzero_offset_inner;
+    const BufferZeroAccel *accel;
 
-    return func;
+    for (accel = buffer_zero_accels; accel->supported; accel++) {
+        if (accel->supported()) {
+            break;
+        }
+    }
+    buffer_zero_accel = accel;
 }
-#pragma GCC pop_options
-#else
+
 bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 {
-    return can_use_buffer_find_nonzero_offset_inner(buf, len);
+    return buffer_zero_accel->can_use(buf, len);
 }
 
 size_t buffer_find_nonzero_offset(const void *buf, size_t len)
 {
-    return buffer_find_nonzero_offset_inner(buf, len);
+    return buffer_zero_accel->find(buf, len);
+}
+
+const char *buffer_find_nonzero_offset_accel(void)
+{
+    return buffer_zero_accel->name;
+}
+
+bool buffer_find_nonzero_offset_next_accel(void)
+{
+    const BufferZeroAccel *last =
+        &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
+
+    while (buffer_zero_accel < last) {
+        buffer_zero_accel++;
+        if (!buffer_zero_accel->supported || buffer_zero_accel->supported()) {
+            return true;
+        }
+    }
+    return false;
 }
-#endif
 
 /*
  * Checks if a buffer is all zeroes
@@ -491,3 +491,150 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 
     return true;
 }
+
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Serialize in whole longs; use 64 bits so that the serialized data is
+     * the same on 32-bit and 64-bit hosts. */
+    assert(hb->granularity < 64 - 6);
+    return UINT64_C(64) << hb->granularity;
+}
+
+/* Start should be aligned to serialization granularity, chunk size should be
+ * aligned to serialization granularity too, except for the last chunk.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last & (gran - 1)) != gran - 1) {
+        assert((last >> hb->granularity) + 1 == hb->size);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        unsigned long el =
+            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        memcpy(cur, buf, sizeof(*cur));
+
+        if (BITS_PER_LONG == 32) {
+            le32_to_cpus((uint32_t *)cur);
+        } else {
+            le64_to_cpus((uint64_t *)cur);
+        }
+
+        buf += sizeof(unsigned long);
+        cur++;
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_fill(HBitmap *hb, uint64_t start, uint64_t count,
+                              bool value, bool finish)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, value ? 0xff : 0, el_count * sizeof(unsigned long));
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    int64_t i, size, prev_size;
+    int lev;
+    unsigned long *last = hb->levels[HBITMAP_LEVELS - 1];
+
+    /* Bits past the end of the bitmap must stay clear */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        last[hb->size >> BITS_PER_LEVEL] &=
+            (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    /* Restore the upper levels from the last one */
+    size = hb->sizes[HBITMAP_LEVELS - 1];
+    for (lev = HBITMAP_LEVELS - 1; lev >= 1; lev--) {
+        prev_size = hb->sizes[lev - 1];
+        memset(hb->levels[lev - 1], 0, prev_size * sizeof(unsigned long));
+
+        for (i = 0; i < size; i++) {
+            if (hb->levels[lev][i]) {
+                hb->levels[lev - 1][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+
+        size = prev_size;
+    }
+
+    /* Restore the sentinel */
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = hb->size ? hb_count_between(hb, 0, hb->size - 1) : 0;
+}
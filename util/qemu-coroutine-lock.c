@@ -27,6 +27,7 @@
 #include "qemu/coroutine.h"
 #include "qemu/coroutine_int.h"
 #include "qemu/queue.h"
+#include "block/aio.h"
 #include "trace.h"
 
 void qemu_co_queue_init(CoQueue *queue)
@@ -42,6 +43,20 @@ void coroutine_fn qemu_co_queue_wait(CoQueue *queue)
     assert(qemu_in_coroutine());
 }
 
+void coroutine_fn qemu_co_queue_wait_lock(CoQueue *queue, QemuMutex *lock)
+{
+    Coroutine *self = qemu_coroutine_self();
+
+    /* Queue ourselves before dropping the lock, so that a concurrent
+     * restart cannot be missed.  Wakeups from other threads go through
+     * aio_co_wake(), which defers them until we have yielded.
+     */
+    QTAILQ_INSERT_TAIL(&queue->entries, self, co_queue_next);
+    qemu_mutex_unlock(lock);
+    qemu_coroutine_yield();
+    qemu_mutex_lock(lock);
+}
+
 /**
  * qemu_co_queue_run_restart:
  *
@@ -63,7 +78,6 @@ void qemu_co_queue_run_restart(Coroutine *co)
 
 static bool qemu_co_queue_do_restart(CoQueue *queue, bool single)
 {
-    Coroutine *self = qemu_coroutine_self();
     Coroutine *next;
 
     if (QTAILQ_EMPTY(&queue->entries)) {
@@ -72,8 +86,8 @@ static bool qemu_co_queue_do_restart(CoQueue *queue, bool single)
 
     while ((next = QTAILQ_FIRST(&queue->entries)) != NULL) {
         QTAILQ_REMOVE(&queue->entries, next, co_queue_next);
-        QTAILQ_INSERT_TAIL(&self->co_queue_wakeup, next, co_queue_next);
         trace_qemu_co_queue_next(next);
+        aio_co_wake(next);
         if (single) {
             break;
         }
@@ -103,7 +117,7 @@ bool qemu_co_enter_next(CoQueue *queue)
     }
 
     QTAILQ_REMOVE(&queue->entries, next, co_queue_next);
-    qemu_coroutine_enter(next, NULL);
+    aio_co_wake(next);
     return true;
 }
 
@@ -115,6 +129,7 @@ bool qemu_co_queue_empty(CoQueue *queue)
 void qemu_co_mutex_init(CoMutex *mutex)
 {
     memset(mutex, 0, sizeof(*mutex));
+    qemu_spin_init(&mutex->spin);
     qemu_co_queue_init(&mutex->queue);
 }
 
@@ -124,11 +139,18 @@ void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
 
     trace_qemu_co_mutex_lock_entry(mutex, self);
 
-    while (mutex->locked) {
-        qemu_co_queue_wait(&mutex->queue);
-    }
+    qemu_spin_lock(&mutex->spin);
+    if (!mutex->locked) {
+        mutex->locked = true;
+        qemu_spin_unlock(&mutex->spin);
+    } else {
+        QTAILQ_INSERT_TAIL(&mutex->queue.entries, self, co_queue_next);
+        qemu_spin_unlock(&mutex->spin);
+        qemu_coroutine_yield();
 
-    mutex->locked = true;
+        /* qemu_co_mutex_unlock() handed the mutex over to us */
+        assert(mutex->locked);
+    }
 
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
@@ -136,18 +158,41 @@ void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
+    Coroutine *next;
 
     trace_qemu_co_mutex_unlock_entry(mutex, self);
 
     assert(mutex->locked == true);
     assert(qemu_in_coroutine());
 
-    mutex->locked = false;
-    qemu_co_queue_next(&mutex->queue);
+    qemu_spin_lock(&mutex->spin);
+    next = QTAILQ_FIRST(&mutex->queue.entries);
+    if (next) {
+        QTAILQ_REMOVE(&mutex->queue.entries, next, co_queue_next);
+    } else {
+        mutex->locked = false;
+    }
+    qemu_spin_unlock(&mutex->spin);
+
+    if (next) {
+        trace_qemu_co_queue_next(next);
+        aio_co_wake(next);
+    }
 
     trace_qemu_co_mutex_unlock_return(mutex, self);
 }
 
+void coroutine_fn qemu_co_queue_wait_mutex(CoQueue *queue, CoMutex *mutex)
+{
+    Coroutine *self = qemu_coroutine_self();
+
+    /* Same as qemu_co_queue_wait_lock(); the queue is protected by @mutex */
+    QTAILQ_INSERT_TAIL(&queue->entries, self, co_queue_next);
+    qemu_co_mutex_unlock(mutex);
+    qemu_coroutine_yield();
+    qemu_co_mutex_lock(mutex);
+}
+
 void qemu_co_rwlock_init(CoRwlock *lock)
 {
     memset(lock, 0, sizeof(*lock));